@@ -0,0 +1,239 @@
+/*
+ * Access log benchmark: --threads threads, standing in for workers, each log
+ * --records requests at --rate requests per second (0 = as fast as they can), in a
+ * burst every millisecond. "iostream" formats the line the server prints per request
+ * to std::cout (redirected to a file), "binary" appends records to an AccessLog.
+ *
+ *   --mode iostream,binary  --threads 1,4  --records 1000000  --rate 0,250000  --ring 8192
+ *
+ * Each row of the CSV has the ns a thread spends logging one record (bursts only,
+ * not the pauses), the records per second reached over all threads, the records
+ * dropped because the writer fell behind, and the bytes that reached the file.
+*/
+
+#include "../includes/access_log.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    std::vector<std::string> modes{"iostream", "binary"};
+    std::vector<int> threads{1, 4};
+    size_t records = 1000000;
+    std::vector<uint64_t> rates{0, 250000};
+    size_t ring = 8192;
+};
+
+using Clock = std::chrono::steady_clock;
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+// What a request carries into the log
+struct Request {
+    std::string filename;
+    std::string mode = "octet";
+    struct sockaddr_in client{};
+};
+
+std::vector<Request> make_requests(int thread) {
+    std::vector<Request> reqs(64);
+    for (size_t i = 0; i < reqs.size(); i++) {
+        reqs[i].filename = "pxelinux.cfg/01-52-54-00-" + std::to_string(thread) + "-" + std::to_string(i);
+        reqs[i].client.sin_addr.s_addr = htonl(0x0a000000u | (uint32_t)(thread << 8) | (uint32_t)i);
+        reqs[i].client.sin_port = htons((uint16_t)(40000 + i));
+    }
+    return reqs;
+}
+
+// Calls log(i) for every record, rate per second in bursts a millisecond apart, and
+// returns the ns spent inside the bursts
+template <class Log>
+double paced(size_t records, uint64_t rate, Log log) {
+    size_t burst = rate ? std::max<size_t>(1, (size_t)(rate / 1000)) : records;
+    double ns = 0;
+    Clock::time_point next = Clock::now();
+    for (size_t i = 0; i < records;) {
+        while (rate && Clock::now() < next)
+            ;  // spin, a sleep would wake up late
+        Clock::time_point start = Clock::now();
+        size_t end = std::min(records, i + burst);
+        for (; i < end; i++)
+            log(i);
+        ns += std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        next += std::chrono::milliseconds(1);
+    }
+    return ns;
+}
+
+struct Result {
+    double ns_per_record = 0;
+    double records_per_s = 0;
+    uint64_t dropped = 0;
+    uint64_t bytes = 0;
+};
+
+Result run_iostream(const Params &p, int threads, uint64_t rate, const std::string &path) {
+    // the server's std::cout goes to stdout; point that at the file for the run
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    FILE *f = fopen(path.c_str(), "w");
+    dup2(fileno(f), STDOUT_FILENO);
+    fclose(f);
+
+    std::vector<double> thread_ns((size_t)threads);
+    Clock::time_point begin = Clock::now();
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++) {
+        pool.emplace_back([&, t] {
+            std::vector<Request> reqs = make_requests(t);
+            thread_ns[(size_t)t] = paced(p.records, rate, [&](size_t i) {
+                const Request &req = reqs[i & 63];
+                std::cout << "RRQ " << req.filename << " (" << req.mode << ") from "
+                          << inet_ntoa(req.client.sin_addr) << ":" << ntohs(req.client.sin_port) << "\n";
+            });
+        });
+    }
+    for (std::thread &t : pool)
+        t.join();
+    std::cout.flush();
+    fflush(stdout);
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    Result r;
+    for (double ns : thread_ns)
+        r.ns_per_record += ns / (double)p.records / threads;
+    r.records_per_s = (double)p.records * threads / seconds;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+        r.bytes = (uint64_t)st.st_size;
+    return r;
+}
+
+Result run_binary(const Params &p, int threads, uint64_t rate, const std::string &path) {
+    Result r;
+    std::vector<double> thread_ns((size_t)threads);
+    std::vector<uint64_t> dropped((size_t)threads);
+    double seconds;
+    {
+        AccessLog log(path);
+        std::vector<AccessLog::Ring *> rings;
+        for (int t = 0; t < threads; t++)
+            rings.push_back(&log.ring(p.ring));
+        Clock::time_point begin = Clock::now();
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++) {
+            pool.emplace_back([&, t] {
+                std::vector<Request> reqs = make_requests(t);
+                AccessLog::Ring &ring = *rings[(size_t)t];
+                uint64_t lost = 0;
+                thread_ns[(size_t)t] = paced(p.records, rate, [&](size_t i) {
+                    const Request &req = reqs[i & 63];
+                    bool logged = ring.log([&](AccessRecord &rec) {
+                        rec.type = AR_REQUEST;
+                        rec.worker = (uint8_t)t;
+                        rec.addr = req.client.sin_addr.s_addr;
+                        rec.port = ntohs(req.client.sin_port);
+                        rec.op = 1;
+                        if (req.mode == "netascii")
+                            rec.flags = AF_NETASCII;
+                        AccessLog::set_name(rec, req.filename);
+                    });
+                    lost += !logged;
+                });
+                dropped[(size_t)t] = lost;
+            });
+        }
+        for (std::thread &t : pool)
+            t.join();
+        log.flush();
+        seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+        r.bytes = log.stats().bytes;
+    }
+    for (int t = 0; t < threads; t++) {
+        r.ns_per_record += thread_ns[(size_t)t] / (double)p.records / threads;
+        r.dropped += dropped[(size_t)t];
+    }
+    r.records_per_s = (double)p.records * threads / seconds;
+    return r;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--mode iostream,binary] [--threads 1,4] [--records N] [--rate 0,250000] [--ring N]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--mode") {
+            p.modes = split(value);
+        } else if (arg == "--threads") {
+            p.threads.clear();
+            for (const std::string &v : split(value))
+                p.threads.push_back(atoi(v.c_str()));
+        } else if (arg == "--records") {
+            p.records = (size_t)atol(value.c_str());
+        } else if (arg == "--rate") {
+            p.rates.clear();
+            for (const std::string &v : split(value))
+                p.rates.push_back(strtoull(v.c_str(), nullptr, 10));
+        } else if (arg == "--ring") {
+            p.ring = (size_t)atol(value.c_str());
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-accesslog-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string path = std::string(tmpl) + "/log";
+    printf("mode,threads,rate_per_thread,ns_per_record,records_per_s,dropped,file_bytes\n");
+    for (const std::string &mode : p.modes) {
+        for (int threads : p.threads) {
+            for (uint64_t rate : p.rates) {
+                unlink(path.c_str());
+                Result r = mode == "binary" ? run_binary(p, threads, rate, path) : run_iostream(p, threads, rate, path);
+                printf("%s,%d,%llu,%.1f,%.0f,%llu,%llu\n", mode.c_str(), threads, (unsigned long long)rate,
+                       r.ns_per_record, r.records_per_s, (unsigned long long)r.dropped, (unsigned long long)r.bytes);
+                fflush(stdout);
+            }
+        }
+    }
+    unlink(path.c_str());
+    rmdir(tmpl);
+    return 0;
+}
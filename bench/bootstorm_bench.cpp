@@ -0,0 +1,289 @@
+/*
+ * Boot storm benchmark: an in-process server on 127.0.0.1 gets --clients RRQs at
+ * the same instant, the way a rack of machines powering up at once asks for its
+ * boot files. Most fetch a small config, one in --large-every a kernel image:
+ *
+ *   --clients 1000         fetches started together
+ *   --large-every 10       every Nth fetch is the large file
+ *   --small-size 4K --large-size 4M
+ *   --max-sessions 0,64    ServerConfig::max_sessions per worker, 0 = no admission control
+ *   --max-pending 256      ServerConfig::max_pending
+ *   --silent 0,1           shed with a "Server busy" ERROR, or silently
+ *   --rate-mbps 0,200      ServerConfig::rate_limit, a bottleneck link; 0 = none
+ *   --workers 1
+ *   --blksize 1428 --windowsize 8
+ *   --retries 5            a client told "Server busy" tries again after 250 ms x attempt
+ *
+ * Each combination prints a CSV row: the time until the last fetch finished, fetches
+ * that succeeded and failed, busy retries, requests the server queued, shed and expired,
+ * the deepest its queue got, client side time to first block (from the first attempt)
+ * for small and large fetches, and server retransmits and timeouts.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    int clients = 1000;
+    int large_every = 10;
+    size_t small_size = 4 << 10;
+    size_t large_size = 4 << 20;
+    std::vector<int> max_sessions{0, 64};
+    size_t max_pending = 256;
+    std::vector<int> silent{0, 1};
+    std::vector<double> rates{0, 200};
+    std::vector<int> workers{1};
+    uint16_t blksize = 1428;
+    uint16_t windowsize = 8;
+    int retries = 5;
+};
+
+struct Row {
+    int max_sessions, silent, workers;
+    double rate_mbps;
+    double makespan_s = 0;
+    uint64_t ok = 0, failed = 0, busy_retries = 0;
+    uint64_t queued = 0, shed = 0, expired = 0, peak_pending = 0;
+    double small_p50_ms = 0, small_p99_ms = 0, large_p50_ms = 0, large_p99_ms = 0;
+    uint64_t retransmits = 0, timeouts = 0;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Keeps nothing, notes when the first block arrived
+class FirstBlockSink : public ImageSink {
+public:
+    explicit FirstBlockSink(Clock::time_point &first) : first(first) {}
+    bool write(const char *, size_t) override {
+        if (first == Clock::time_point())
+            first = Clock::now();
+        return true;
+    }
+    bool commit() override { return true; }
+    void abort() override {}
+
+private:
+    Clock::time_point &first;
+};
+
+struct Fetch {
+    bool large = false;
+    int attempts = 0;
+    Clock::time_point started, first_block;
+};
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+size_t parse_size(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'K': case 'k': v *= 1 << 10; break;
+    case 'M': case 'm': v *= 1 << 20; break;
+    case 'G': case 'g': v *= 1 << 30; break;
+    }
+    return (size_t)v;
+}
+
+bool write_file(const std::string &path, size_t size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char)(i * 131 + (i >> 9));
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+double quantile(std::vector<double> &v, double q) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t)((double)(v.size() - 1) * q)];
+}
+
+Row run_one(const std::string &root, const Params &p, int max_sessions, int silent, double rate_mbps, int workers) {
+    Row row{max_sessions, silent, workers, rate_mbps};
+    ServerConfig config;
+    config.root = root;
+    config.port = 0;
+    config.workers = workers;
+    config.allow_write = false;
+    config.max_sessions = (size_t)max_sessions;
+    config.max_pending = p.max_pending;
+    config.shed_silently = silent != 0;
+    config.rate_limit = (uint64_t)(rate_mbps * 1e6 / 8);
+    TFTPServer server(config);
+    std::thread server_thread([&] { server.start(); });
+
+    EventLoop loop;
+    ClientOptions options;
+    options.port = server.port();
+    options.blksize = p.blksize;
+    options.windowsize = p.windowsize;
+    AsyncTFTPClient client(loop, "127.0.0.1", options);
+
+    std::vector<Fetch> fetches((size_t)p.clients);
+    size_t finished = 0;
+    std::function<void(size_t)> start = [&](size_t i) {
+        Fetch &f = fetches[i];
+        f.attempts++;
+        client.get(f.large ? "vmlinuz" : "boot.cfg", std::unique_ptr<ImageSink>(new FirstBlockSink(f.first_block)),
+                   [&, i](const TransferResult &r) {
+                       Fetch &f = fetches[i];
+                       if (!r.ok && r.error == "Server busy" && f.attempts <= p.retries) {
+                           row.busy_retries++;
+                           f.first_block = Clock::time_point();
+                           loop.add_timer((uint32_t)(250 * f.attempts + rand() % 100), [&, i] { start(i); });
+                           return;
+                       }
+                       (r.ok ? row.ok : row.failed)++;
+                       finished++;
+                   });
+    };
+    // the server's queue depth, sampled while the storm lasts
+    std::function<void()> sample = [&] {
+        row.peak_pending = std::max(row.peak_pending, server.metrics().pending);
+        if (finished < fetches.size())
+            loop.add_timer(5, sample);
+    };
+
+    Clock::time_point begin = Clock::now();
+    for (size_t i = 0; i < fetches.size(); i++) {
+        fetches[i].large = p.large_every > 0 && (int)(i % (size_t)p.large_every) == p.large_every - 1;
+        fetches[i].started = begin;
+        start(i);
+    }
+    sample();
+    while (finished < fetches.size())
+        loop.run_once(100);
+    row.makespan_s = std::chrono::duration<double>(Clock::now() - begin).count();
+    server.stop();
+    server_thread.join();
+
+    std::vector<double> small, large;
+    for (const Fetch &f : fetches) {
+        if (f.first_block == Clock::time_point())
+            continue;
+        double ms = std::chrono::duration<double, std::milli>(f.first_block - f.started).count();
+        (f.large ? large : small).push_back(ms);
+    }
+    row.small_p50_ms = quantile(small, 0.5);
+    row.small_p99_ms = quantile(small, 0.99);
+    row.large_p50_ms = quantile(large, 0.5);
+    row.large_p99_ms = quantile(large, 0.99);
+    MetricsSnapshot m = server.metrics();
+    row.queued = m.requests_queued;
+    row.shed = m.requests_shed;
+    row.expired = m.requests_expired;
+    row.retransmits = m.retransmits;
+    row.timeouts = m.timeouts;
+    return row;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--clients N] [--large-every N] [--small-size 4K] [--large-size 4M]\n"
+            "          [--max-sessions 0,64] [--max-pending N] [--silent 0,1] [--rate-mbps 0,200]\n"
+            "          [--workers 1,2]"
+            " [--blksize N] [--windowsize N] [--retries N]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--clients")
+            p.clients = atoi(value.c_str());
+        else if (arg == "--large-every")
+            p.large_every = atoi(value.c_str());
+        else if (arg == "--small-size")
+            p.small_size = parse_size(value);
+        else if (arg == "--large-size")
+            p.large_size = parse_size(value);
+        else if (arg == "--max-pending")
+            p.max_pending = (size_t)atoi(value.c_str());
+        else if (arg == "--blksize")
+            p.blksize = (uint16_t)atoi(value.c_str());
+        else if (arg == "--windowsize")
+            p.windowsize = (uint16_t)atoi(value.c_str());
+        else if (arg == "--retries")
+            p.retries = atoi(value.c_str());
+        else if (arg == "--max-sessions" || arg == "--silent" || arg == "--workers") {
+            std::vector<int> &list = arg == "--max-sessions" ? p.max_sessions : arg == "--silent" ? p.silent : p.workers;
+            list.clear();
+            for (const std::string &v : split(value))
+                list.push_back(atoi(v.c_str()));
+        } else if (arg == "--rate-mbps") {
+            p.rates.clear();
+            for (const std::string &v : split(value))
+                p.rates.push_back(atof(v.c_str()));
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-storm-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    if (!write_file(root + "/boot.cfg", p.small_size) || !write_file(root + "/vmlinuz", p.large_size)) {
+        perror(root.c_str());
+        return 1;
+    }
+
+    printf("max_sessions,silent,rate_mbps,workers,makespan_s,ok,failed,busy_retries,queued,shed,expired,peak_pending,"
+           "small_ttfb_p50_ms,small_ttfb_p99_ms,large_ttfb_p50_ms,large_ttfb_p99_ms,retransmits,timeouts\n");
+    for (double rate : p.rates)
+        for (int workers : p.workers)
+            for (int max_sessions : p.max_sessions)
+                for (int silent : p.silent) {
+                    // shedding mode means nothing without admission control
+                    if (max_sessions == 0 && silent != p.silent.front())
+                        continue;
+                    Row r = run_one(root, p, max_sessions, silent, rate, workers);
+                    printf("%d,%d,%.0f,%d,%.3f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%llu,%llu\n",
+                           r.max_sessions, r.silent, r.rate_mbps, r.workers, r.makespan_s, (unsigned long long)r.ok,
+                           (unsigned long long)r.failed, (unsigned long long)r.busy_retries,
+                           (unsigned long long)r.queued, (unsigned long long)r.shed, (unsigned long long)r.expired,
+                           (unsigned long long)r.peak_pending, r.small_p50_ms, r.small_p99_ms, r.large_p50_ms,
+                           r.large_p99_ms, (unsigned long long)r.retransmits, (unsigned long long)r.timeouts);
+                    fflush(stdout);
+                }
+    unlink((root + "/boot.cfg").c_str());
+    unlink((root + "/vmlinuz").c_str());
+    rmdir(root.c_str());
+    return 0;
+}
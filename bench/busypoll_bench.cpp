@@ -0,0 +1,197 @@
+/*
+ * Busy polling benchmark: a one-worker in-process server on 127.0.0.1 and a client
+ * that fetches a small --size file (a config fetch) --fetches times, one at a time,
+ * waiting --gap-ms between fetches so the worker has gone idle by the next request.
+ * Compares sleeping in epoll_wait with ServerConfig::busy_poll_us.
+ *
+ *   --mode epoll,busy  --busy-us 50,200  --fetches 2000  --gap-ms 1  --size 1K
+ *   --idle-seconds 2
+ *
+ * Each mode (and spin window) prints a CSV row: fetch latency p50/p99/max, the
+ * worker's CPU time per fetch, and the share of a CPU the worker burns while the
+ * server sits idle for --idle-seconds afterwards.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    std::vector<std::string> modes{"epoll", "busy"};
+    std::vector<uint32_t> busy_us{50, 200};
+    int fetches = 2000;
+    uint32_t gap_ms = 1;
+    size_t size = 1 << 10;
+    double idle_seconds = 2;
+};
+
+using Clock = std::chrono::steady_clock;
+
+class NullSink : public ImageSink {
+public:
+    bool write(const char *, size_t) override { return true; }
+    bool commit() override { return true; }
+    void abort() override {}
+};
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+size_t parse_size(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'K': case 'k': v *= 1 << 10; break;
+    case 'M': case 'm': v *= 1 << 20; break;
+    }
+    return (size_t)v;
+}
+
+double cpu_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void run_one(const std::string &root, const Params &p, const std::string &mode, uint32_t busy_us) {
+    ServerConfig config;
+    config.root = root;
+    config.port = 0;
+    config.workers = 1;
+    config.allow_write = false;
+    config.busy_poll_us = busy_us;
+    TFTPServer server(config);
+    std::thread server_thread([&] { server.start(); });
+    clockid_t worker_clock;
+    pthread_getcpuclockid(server_thread.native_handle(), &worker_clock);
+
+    std::vector<double> latencies;
+    int failures = 0;
+    double worker0 = cpu_seconds(worker_clock);
+    {
+        EventLoop loop;
+        ClientOptions options;
+        options.port = server.port();
+        AsyncTFTPClient client(loop, "127.0.0.1", options);
+        int started = 0;
+        bool done = false;
+        std::function<void()> fetch = [&] {
+            Clock::time_point begin = Clock::now();
+            started++;
+            client.get("config.txt", std::unique_ptr<ImageSink>(new NullSink), [&, begin](const TransferResult &r) {
+                if (r.ok)
+                    latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+                else
+                    failures++;
+                if (started < p.fetches)
+                    loop.add_timer(p.gap_ms, fetch);
+                else
+                    done = true;
+            });
+        };
+        fetch();
+        while (!done)
+            loop.run_once(100);
+    }
+    double busy_cpu = cpu_seconds(worker_clock) - worker0;
+
+    double idle0 = cpu_seconds(worker_clock);
+    std::this_thread::sleep_for(std::chrono::duration<double>(p.idle_seconds));
+    double idle_cpu = cpu_seconds(worker_clock) - idle0;
+    server.stop();
+    server_thread.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto at = [&](double q) { return latencies.empty() ? 0 : latencies[(size_t)((double)(latencies.size() - 1) * q)]; };
+    printf("%s,%u,%zu,%d,%.1f,%.1f,%.1f,%.1f,%.1f\n", mode.c_str(), busy_us, latencies.size(), failures, at(0.5),
+           at(0.99), latencies.empty() ? 0 : latencies.back(),
+           latencies.empty() ? 0 : busy_cpu / (double)latencies.size() * 1e6, idle_cpu / p.idle_seconds * 100);
+    fflush(stdout);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--mode epoll,busy] [--busy-us 50,200] [--fetches N] [--gap-ms N] [--size 1K]\n"
+            "          [--idle-seconds S]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--mode") {
+            p.modes = split(value);
+        } else if (arg == "--busy-us") {
+            p.busy_us.clear();
+            for (const std::string &v : split(value))
+                p.busy_us.push_back((uint32_t)atoi(v.c_str()));
+        } else if (arg == "--fetches") {
+            p.fetches = atoi(value.c_str());
+        } else if (arg == "--gap-ms") {
+            p.gap_ms = (uint32_t)atoi(value.c_str());
+        } else if (arg == "--size") {
+            p.size = parse_size(value);
+        } else if (arg == "--idle-seconds") {
+            p.idle_seconds = atof(value.c_str());
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-busypoll-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    std::string path = root + "/config.txt";
+    FILE *f = fopen(path.c_str(), "wb");
+    std::string data(p.size, 'c');
+    if (!f || fwrite(data.data(), 1, data.size(), f) != data.size() || fclose(f) != 0) {
+        perror(path.c_str());
+        return 1;
+    }
+
+    printf("mode,busy_us,fetches,failures,p50_us,p99_us,max_us,worker_cpu_us_per_fetch,idle_cpu_percent\n");
+    for (const std::string &mode : p.modes) {
+        if (mode == "busy") {
+            for (uint32_t us : p.busy_us)
+                run_one(root, p, mode, us);
+        } else {
+            run_one(root, p, mode, 0);
+        }
+    }
+    unlink(path.c_str());
+    rmdir(root.c_str());
+    return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * Microbenchmarks for the packet codec in protocal.hpp and tftp_common.hpp, plus
+ * the hash behind chunk names and resume prefix checks. Everything here runs once
+ * per packet or per block, so ns/op is the number to watch between commits:
+ *
+ *   ./codec_bench --benchmark_format=json --benchmark_out=codec.json
+ *   ./codec_bench --benchmark_filter=Netascii
+*/
+
+#include "../includes/hash.hpp"
+#include "../includes/protocal.hpp"
+#include "../includes/tftp_common.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+namespace {
+
+using OptionList = std::vector<std::pair<std::string, std::string>>;
+
+// A request the way our own client sends it
+std::vector<char> sample_request(const OptionList &opts) {
+    std::vector<char> buf(512);
+    buf.resize(build_request(buf.data(), buf.size(), RREQ, "images/switch-fw-9.4.2.bin", "octet", opts));
+    return buf;
+}
+
+const OptionList &full_options() {
+    static const OptionList opts{{"blksize", "1428"}, {"windowsize", "16"}, {"tsize", "0"},
+                                 {"timeout", "2"},    {"offset", "1048576"}, {"length", "4194304"}};
+    return opts;
+}
+
+// Config-file-like text: a line break every 40 bytes on average
+std::string sample_text(size_t size) {
+    std::string text(size, 'a');
+    uint32_t x = 12345;
+    for (size_t i = 0; i < size; i++) {
+        x = x * 1103515245u + 12345u;
+        uint32_t r = (x >> 16) % 80;
+        text[i] = r == 0 ? '\n' : r == 1 ? '\r' : (char)('a' + r % 26);
+    }
+    return text;
+}
+
+void BM_ParseRequestPlain(benchmark::State &state) {
+    std::vector<char> buf = sample_request({});
+    Request req;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parse_request(buf.data(), buf.size(), req));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_ParseRequestPlain);
+
+void BM_ParseRequestOptions(benchmark::State &state) {
+    std::vector<char> buf = sample_request(full_options());
+    Request req;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parse_request(buf.data(), buf.size(), req));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_ParseRequestOptions);
+
+void BM_ParseOptions(benchmark::State &state) {
+    std::vector<char> buf = sample_request(full_options());
+    Request req;
+    parse_request(buf.data(), buf.size(), req);
+    for (auto _ : state) {
+        TransferOptions opts;
+        parse_options(req, opts);
+        benchmark::DoNotOptimize(opts);
+    }
+}
+BENCHMARK(BM_ParseOptions);
+
+void BM_ParseOack(benchmark::State &state) {
+    std::vector<char> req_buf = sample_request(full_options());
+    Request req;
+    parse_request(req_buf.data(), req_buf.size(), req);
+    TransferOptions granted;
+    parse_options(req, granted);
+    char buf[512];
+    size_t len = build_oack(buf, sizeof(buf), req, granted);
+    for (auto _ : state) {
+        TransferOptions opts;
+        benchmark::DoNotOptimize(parse_oack(buf, len, opts));
+        benchmark::DoNotOptimize(opts);
+    }
+}
+BENCHMARK(BM_ParseOack);
+
+void BM_BuildRequest(benchmark::State &state) {
+    char buf[512];
+    const OptionList &opts = full_options();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(build_request(buf, sizeof(buf), RREQ, "images/switch-fw-9.4.2.bin", "octet", opts));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_BuildRequest);
+
+void BM_BuildOack(benchmark::State &state) {
+    std::vector<char> req_buf = sample_request(full_options());
+    Request req;
+    parse_request(req_buf.data(), req_buf.size(), req);
+    TransferOptions granted;
+    parse_options(req, granted);
+    char buf[512];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(build_oack(buf, sizeof(buf), req, granted));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_BuildOack);
+
+void BM_BuildDataHeader(benchmark::State &state) {
+    char buf[4];
+    uint16_t block = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(build_data_header(buf, ++block));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_BuildDataHeader);
+
+void BM_BuildAck(benchmark::State &state) {
+    char buf[4];
+    uint16_t block = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(build_ack(buf, ++block));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_BuildAck);
+
+void BM_BuildError(benchmark::State &state) {
+    char buf[128];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(build_error(buf, sizeof(buf), ERR_NOT_FOUND, "File not found"));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_BuildError);
+
+void BM_GetU16(benchmark::State &state) {
+    char buf[4];
+    build_ack(buf, 4242);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(buf);
+        benchmark::DoNotOptimize(get_u16(buf + 2));
+    }
+}
+BENCHMARK(BM_GetU16);
+
+void BM_ByteOrderRoundTrip(benchmark::State &state) {
+    uint16_t v = 1;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(v);
+        v = to_host_order(to_network_order(v) + 1);
+    }
+    benchmark::DoNotOptimize(v);
+}
+BENCHMARK(BM_ByteOrderRoundTrip);
+
+void BM_ValidMode(benchmark::State &state) {
+    const std::string modes[] = {"octet", "netascii", "mail"};
+    size_t i = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(valid_mode(modes[i++ % 3]));
+}
+BENCHMARK(BM_ValidMode);
+
+// One block per iteration, arg is blksize
+void BM_NetasciiEncode(benchmark::State &state) {
+    size_t blksize = (size_t)state.range(0);
+    std::string text = sample_text(1 << 20);
+    std::vector<char> out(blksize);
+    size_t pos = 0;
+    int carry = -1;
+    for (auto _ : state) {
+        size_t consumed;
+        if (pos + blksize > text.size())
+            pos = 0;
+        benchmark::DoNotOptimize(netascii_encode(text.data() + pos, blksize, consumed, out.data(), blksize, carry));
+        pos += consumed;
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)blksize);
+}
+BENCHMARK(BM_NetasciiEncode)->Arg(512)->Arg(1428)->Arg(8192);
+
+void BM_NetasciiDecode(benchmark::State &state) {
+    size_t blksize = (size_t)state.range(0);
+    std::string text = sample_text(1 << 20);
+    std::vector<char> wire(text.size() * 2);
+    size_t consumed;
+    int carry = -1;
+    wire.resize(netascii_encode(text.data(), text.size(), consumed, wire.data(), wire.size(), carry));
+    std::vector<char> out(blksize + 1);
+    size_t pos = 0;
+    bool cr_pending = false;
+    for (auto _ : state) {
+        if (pos + blksize > wire.size())
+            pos = 0;
+        benchmark::DoNotOptimize(netascii_decode(wire.data() + pos, blksize, out.data(), cr_pending));
+        pos += blksize;
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)blksize);
+}
+BENCHMARK(BM_NetasciiDecode)->Arg(512)->Arg(1428)->Arg(8192);
+
+// 64 KiB is a dedup chunk, 1 MiB a piece of a resume prefixsum
+void BM_Hash128(benchmark::State &state) {
+    std::string data = sample_text((size_t)state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(hash128(data.data(), data.size()));
+    state.SetBytesProcessed((int64_t)state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Hash128)->Arg(1428)->Arg(64 << 10)->Arg(RESUME_PIECE_BYTES);
+
+void BM_Hash128Scalar(benchmark::State &state) {
+    std::string data = sample_text((size_t)state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(hash128_scalar(data.data(), data.size()));
+    state.SetBytesProcessed((int64_t)state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Hash128Scalar)->Arg(1428)->Arg(64 << 10)->Arg(RESUME_PIECE_BYTES);
+
+}  // namespace
+
+BENCHMARK_MAIN();
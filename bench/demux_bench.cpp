@@ -0,0 +1,240 @@
+/*
+ * Shared socket benchmark: a TID socket per transfer against DemuxNet
+ * (ServerConfig::shared_sockets).
+ *
+ * setup      opens, binds, connects and watches --sockets session sockets the way the
+ *            server does for each request, then closes them: microseconds per session
+ *            each way, and bytes per session while they are open, from the growth of
+ *            kernel slab memory (system wide, so keep the machine quiet) and of this
+ *            process's RSS.
+ * transfers  an in-process server on 127.0.0.1 with --concurrency clients fetching a
+ *            4 KiB file back to back for --seconds: transfers/s and p50/p99 latency.
+ *
+ *   --shared 0,4       shared sockets per worker, 0 = a socket per transfer
+ *   --sockets 10000 --concurrency 64 --seconds 3 --workers 1
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/demux_net.hpp"
+#include "../includes/server.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    std::vector<int> shared{0, 4};
+    int sockets = 10000;
+    int concurrency = 64;
+    double seconds = 3;
+    int workers = 1;
+};
+
+using Clock = std::chrono::steady_clock;
+
+class NullSink : public ImageSink {
+public:
+    bool write(const char *, size_t) override { return true; }
+    bool commit() override { return true; }
+    void abort() override {}
+};
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+// A "Name:   123 kB" line from a /proc file, in bytes
+uint64_t proc_kb(const char *path, const char *name) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    char line[256];
+    uint64_t kb = 0;
+    size_t len = strlen(name);
+    while (fgets(line, sizeof(line), f))
+        if (strncmp(line, name, len) == 0 && line[len] == ':') {
+            kb = strtoull(line + len + 1, nullptr, 10);
+            break;
+        }
+    fclose(f);
+    return kb * 1024;
+}
+
+uint64_t slab_bytes() { return proc_kb("/proc/meminfo", "Slab"); }
+uint64_t rss_bytes() { return proc_kb("/proc/self/status", "VmRSS"); }
+
+double us_since(Clock::time_point t) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - t).count();
+}
+
+void run_setup(const Params &p, int shared) {
+    EventLoop loop;
+    std::unique_ptr<DemuxNet> demux;
+    if (shared)
+        demux = std::make_unique<DemuxNet>(loop, DatagramNet::kernel(), shared);
+    DatagramNet &net = demux ? *demux : DatagramNet::kernel();
+    struct sockaddr_in any{};
+    any.sin_family = AF_INET;
+    any.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    std::vector<int> socks;
+    socks.reserve((size_t)p.sockets);
+    uint64_t slab0 = slab_bytes(), rss0 = rss_bytes();
+    Clock::time_point t = Clock::now();
+    for (int i = 0; i < p.sockets; i++) {
+        // a distinct client TID each, spread over a few addresses like real clients
+        struct sockaddr_in peer{};
+        peer.sin_family = AF_INET;
+        peer.sin_addr.s_addr = htonl(0x7f000001 + (uint32_t)(i / 50000));
+        peer.sin_port = htons((uint16_t)(10000 + i % 50000));
+        int fd = net.open();
+        if (fd < 0 || net.bind(fd, any) < 0 || net.connect(fd, peer) < 0) {
+            perror("session socket");
+            if (fd >= 0)
+                net.close(fd);
+            break;
+        }
+        net.watch(loop, fd, [] {});
+        socks.push_back(fd);
+    }
+    double open_us = us_since(t) / (double)std::max<size_t>(socks.size(), 1);
+    double slab = (double)((int64_t)slab_bytes() - (int64_t)slab0) / (double)std::max<size_t>(socks.size(), 1);
+    double rss = (double)((int64_t)rss_bytes() - (int64_t)rss0) / (double)std::max<size_t>(socks.size(), 1);
+    t = Clock::now();
+    for (int fd : socks) {
+        net.unwatch(loop, fd);
+        net.close(fd);
+    }
+    double close_us = us_since(t) / (double)std::max<size_t>(socks.size(), 1);
+    printf("%d,%zu,%.3f,%.3f,%.0f,%.0f\n", shared, socks.size(), open_us, close_us, std::max(slab, 0.0),
+           std::max(rss, 0.0));
+    fflush(stdout);
+}
+
+void run_transfers(const std::string &root, const Params &p, int shared) {
+    ServerConfig config;
+    config.root = root;
+    config.port = 0;
+    config.workers = p.workers;
+    config.allow_write = false;
+    config.shared_sockets = shared;
+    TFTPServer server(config);
+    std::thread server_thread([&] { server.start(); });
+
+    EventLoop loop;
+    ClientOptions options;
+    options.port = server.port();
+    AsyncTFTPClient client(loop, "127.0.0.1", options);
+    Clock::time_point begin = Clock::now();
+    Clock::time_point deadline = begin + std::chrono::duration_cast<Clock::duration>(
+                                             std::chrono::duration<double>(p.seconds));
+    std::vector<double> latencies;
+    uint64_t failures = 0;
+    std::function<void()> fetch = [&] {
+        Clock::time_point started = Clock::now();
+        client.get("small.bin", std::unique_ptr<ImageSink>(new NullSink), [&, started](const TransferResult &r) {
+            if (r.ok)
+                latencies.push_back(us_since(started) / 1000);
+            else
+                failures++;
+            if (Clock::now() < deadline)
+                fetch();
+        });
+    };
+    for (int i = 0; i < p.concurrency; i++)
+        fetch();
+    while (client.active() > 0)
+        loop.run_once(100);
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    server.stop();
+    server_thread.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    double p50 = latencies.empty() ? 0 : latencies[(latencies.size() - 1) / 2];
+    double p99 = latencies.empty() ? 0 : latencies[(size_t)((double)(latencies.size() - 1) * 0.99)];
+    printf("%d,%d,%.0f,%.3f,%.3f,%llu\n", shared, p.concurrency, (double)latencies.size() / seconds, p50, p99,
+           (unsigned long long)failures);
+    fflush(stdout);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--shared 0,4] [--sockets N] [--concurrency N] [--seconds S] [--workers N]\n", prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--shared") {
+            p.shared.clear();
+            for (const std::string &v : split(value))
+                p.shared.push_back(atoi(v.c_str()));
+        } else if (arg == "--sockets") {
+            p.sockets = atoi(value.c_str());
+        } else if (arg == "--concurrency") {
+            p.concurrency = atoi(value.c_str());
+        } else if (arg == "--seconds") {
+            p.seconds = atof(value.c_str());
+        } else if (arg == "--workers") {
+            p.workers = atoi(value.c_str());
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // a socket per session needs as many descriptors as the run has sessions
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    char tmpl[] = "/tmp/turbotftp-demux-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    std::string path = root + "/small.bin";
+    FILE *f = fopen(path.c_str(), "wb");
+    std::string data(4 << 10, 'x');
+    if (!f || fwrite(data.data(), 1, data.size(), f) != data.size() || fclose(f) != 0) {
+        perror(path.c_str());
+        return 1;
+    }
+
+    printf("shared,sockets,open_us,close_us,slab_bytes_per_session,rss_bytes_per_session\n");
+    for (int shared : p.shared)
+        run_setup(p, shared);
+    printf("\nshared,concurrency,transfers_per_s,p50_ms,p99_ms,failures\n");
+    for (int shared : p.shared)
+        run_transfers(root, p, shared);
+    unlink(path.c_str());
+    rmdir(root.c_str());
+    return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * Fairness benchmark: an in-process server on 127.0.0.1 under mixed load, with
+ * and without its deficit round robin scheduler (ServerConfig::fair_queueing):
+ *
+ *   --greedy 4             image pulls asking for blksize 1428 x windowsize 64
+ *   --polite 4             image pulls with blksize 1428 x windowsize 4
+ *   --small 4              lock-step 4 KiB config fetches, back to back
+ *   --fair 0,1             scheduler off / on
+ *   --rate-mbps 0,200      ServerConfig::rate_limit, a bottleneck link; 0 = none
+ *   --workers 1            server event loop threads
+ *
+ * Each combination runs for --seconds (default 3) and prints a CSV row: Jain's
+ * fairness index over the bytes each pull got, (sum x)^2 / (n * sum x^2), 1.0 when
+ * all are equal; the greedy and polite pulls' MB/s; and config fetch p50/p99
+ * latency.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    int greedy = 4;
+    int polite = 4;
+    int small = 4;
+    std::vector<int> fair{0, 1};
+    std::vector<double> rates{0, 200};
+    std::vector<int> workers{1};
+    double seconds = 3;
+};
+
+struct Row {
+    int fair, workers;
+    double rate_mbps;
+    double jain = 0, greedy_mbps = 0, polite_mbps = 0, small_p50_ms = 0, small_p99_ms = 0;
+    uint64_t small_fetches = 0, failures = 0;
+};
+
+// Adds what it is given to a counter and keeps nothing
+class CountingSink : public ImageSink {
+public:
+    explicit CountingSink(uint64_t &count) : count(count) {}
+    bool write(const char *, size_t len) override {
+        count += len;
+        return true;
+    }
+    bool commit() override { return true; }
+    void abort() override {}
+
+private:
+    uint64_t &count;
+};
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+bool write_file(const std::string &path, size_t size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char)(i * 131 + (i >> 9));
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+double jain_index(const std::vector<uint64_t> &x) {
+    double sum = 0, squares = 0;
+    for (uint64_t v : x) {
+        sum += (double)v;
+        squares += (double)v * (double)v;
+    }
+    return squares > 0 ? sum * sum / ((double)x.size() * squares) : 0;
+}
+
+Row run_one(const std::string &root, const Params &p, int fair, double rate_mbps, int workers) {
+    Row row{fair, workers, rate_mbps};
+    ServerConfig config;
+    config.root = root;
+    config.port = 0;
+    config.workers = workers;
+    config.allow_write = false;
+    config.fair_queueing = fair != 0;
+    config.rate_limit = (uint64_t)(rate_mbps * 1e6 / 8);
+    TFTPServer server(config);
+    std::thread server_thread([&] { server.start(); });
+
+    using clock = std::chrono::steady_clock;
+    clock::time_point begin = clock::now();
+    clock::time_point deadline = begin + std::chrono::duration_cast<clock::duration>(
+                                             std::chrono::duration<double>(p.seconds));
+    EventLoop loop;
+    ClientOptions greedy_options, polite_options, small_options;
+    greedy_options.port = polite_options.port = small_options.port = server.port();
+    greedy_options.blksize = 1428;
+    greedy_options.windowsize = 64;
+    polite_options.blksize = 1428;
+    polite_options.windowsize = 4;
+    AsyncTFTPClient greedy(loop, "127.0.0.1", greedy_options);
+    AsyncTFTPClient polite(loop, "127.0.0.1", polite_options);
+    AsyncTFTPClient small(loop, "127.0.0.1", small_options);
+
+    // one byte counter per pull, kept across the pull's back to back transfers
+    std::vector<uint64_t> pulled((size_t)(p.greedy + p.polite), 0);
+    std::vector<std::pair<AsyncTFTPClient *, uint64_t>> running(pulled.size());
+    std::vector<double> latencies;
+    std::function<void(AsyncTFTPClient *, size_t)> pull = [&](AsyncTFTPClient *client, size_t slot) {
+        running[slot] = {client, 0};
+        running[slot].second = client->get("image.bin", std::unique_ptr<ImageSink>(new CountingSink(pulled[slot])),
+                                           [&, client, slot](const TransferResult &r) {
+                                               if (clock::now() >= deadline)
+                                                   return;
+                                               if (!r.ok)
+                                                   row.failures++;
+                                               pull(client, slot);
+                                           });
+    };
+    std::function<void()> fetch = [&] {
+        clock::time_point started = clock::now();
+        small.get("switch.cfg", std::unique_ptr<ImageSink>(new CountingSink(row.small_fetches)),
+                  [&, started](const TransferResult &r) {
+                      if (r.ok)
+                          latencies.push_back(std::chrono::duration<double, std::milli>(clock::now() - started).count());
+                      else
+                          row.failures++;
+                      if (clock::now() < deadline)
+                          fetch();
+                  });
+    };
+    for (int i = 0; i < p.greedy; i++)
+        pull(&greedy, (size_t)i);
+    for (int i = 0; i < p.polite; i++)
+        pull(&polite, (size_t)(p.greedy + i));
+    for (int i = 0; i < p.small; i++)
+        fetch();
+
+    // measure up to the deadline, then stop the pulls where they are
+    while (clock::now() < deadline)
+        loop.run_once(10);
+    std::vector<uint64_t> at_deadline = pulled;
+    double seconds = std::chrono::duration<double>(clock::now() - begin).count();
+    for (auto &r : running)
+        r.first->cancel(r.second);
+    while (greedy.active() + polite.active() + small.active() > 0)
+        loop.run_once(100);
+    server.stop();
+    server_thread.join();
+
+    row.jain = jain_index(at_deadline);
+    for (size_t i = 0; i < at_deadline.size(); i++)
+        ((int)i < p.greedy ? row.greedy_mbps : row.polite_mbps) += (double)at_deadline[i] / seconds / 1e6;
+    row.small_fetches = latencies.size();
+    std::sort(latencies.begin(), latencies.end());
+    if (!latencies.empty()) {
+        row.small_p50_ms = latencies[(latencies.size() - 1) / 2];
+        row.small_p99_ms = latencies[(size_t)((double)(latencies.size() - 1) * 0.99)];
+    }
+    return row;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--greedy N] [--polite N] [--small N] [--fair 0,1] [--rate-mbps 0,200]\n"
+            "          [--workers 1,2] [--seconds S]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--greedy")
+            p.greedy = atoi(value.c_str());
+        else if (arg == "--polite")
+            p.polite = atoi(value.c_str());
+        else if (arg == "--small")
+            p.small = atoi(value.c_str());
+        else if (arg == "--seconds")
+            p.seconds = atof(value.c_str());
+        else if (arg == "--fair" || arg == "--workers") {
+            std::vector<int> &list = arg == "--fair" ? p.fair : p.workers;
+            list.clear();
+            for (const std::string &v : split(value))
+                list.push_back(atoi(v.c_str()));
+        } else if (arg == "--rate-mbps") {
+            p.rates.clear();
+            for (const std::string &v : split(value))
+                p.rates.push_back(atof(v.c_str()));
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-fair-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    if (!write_file(root + "/image.bin", 256 << 20) || !write_file(root + "/switch.cfg", 4 << 10)) {
+        perror(root.c_str());
+        return 1;
+    }
+
+    printf("fair,rate_mbps,workers,jain,greedy_mbps,polite_mbps,small_fetches,small_p50_ms,small_p99_ms,failures\n");
+    for (double rate : p.rates)
+        for (int workers : p.workers)
+            for (int fair : p.fair) {
+                Row r = run_one(root, p, fair, rate, workers);
+                printf("%d,%.0f,%d,%.3f,%.1f,%.1f,%llu,%.3f,%.3f,%llu\n", r.fair, r.rate_mbps, r.workers, r.jain,
+                       r.greedy_mbps, r.polite_mbps, (unsigned long long)r.small_fetches, r.small_p50_ms,
+                       r.small_p99_ms, (unsigned long long)r.failures);
+                fflush(stdout);
+            }
+    unlink((root + "/image.bin").c_str());
+    unlink((root + "/switch.cfg").c_str());
+    rmdir(root.c_str());
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Upgrade handoff benchmark: an in-process server on 127.0.0.1 with an upgrade socket
+ * serves --gets octet RRQs and --netascii netascii RRQs of a --size file and takes
+ * --puts WRQs of the same size, its sending capped at --rate bytes/s so they are
+ * still running when, --after-ms into the run, a second server is constructed on the
+ * same upgrade socket and takes over. Transfers that can move carry on in the new
+ * server; the rest finish in the old one.
+ *
+ *   --gets 300  --puts 50  --netascii 5  --size 1M  --rate 50000000  --after-ms 200
+ *   --blksize 1428  --windowsize 8  --workers 2  --rounds 1
+ *
+ * Each round prints a CSV row: transfers, transfers handed over, how long the new
+ * server's constructor took to take them (ms), failed and corrupted transfers, and
+ * retransmits and timeouts on the old and the new server.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    int gets = 300;
+    int puts = 50;
+    int netascii = 5;
+    size_t size = 1 << 20;
+    uint64_t rate = 50000000;
+    int after_ms = 200;
+    uint16_t blksize = 1428;
+    uint16_t windowsize = 8;
+    int workers = 2;
+    int rounds = 1;
+};
+
+using Clock = std::chrono::steady_clock;
+
+size_t parse_size(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'K': case 'k': v *= 1 << 10; break;
+    case 'M': case 'm': v *= 1 << 20; break;
+    }
+    return (size_t)v;
+}
+
+// Text lines, so the netascii transfers convert every one of them
+std::string make_data(size_t size) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 \n";
+    std::string data(size, '\0');
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = alphabet[x & 63];
+    }
+    return data;
+}
+
+bool write_file(const std::string &path, const std::string &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+bool read_file(const std::string &path, std::string &data) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    data.clear();
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.append(buf, n);
+    fclose(f);
+    return true;
+}
+
+std::string put_name(int i) {
+    return "put" + std::to_string(i) + ".bin";
+}
+
+// Servers run start() on a thread of their own
+struct Running {
+    TFTPServer server;
+    std::thread thread;
+    explicit Running(const ServerConfig &config) : server(config), thread([this] { server.start(); }) {}
+    ~Running() {
+        server.stop();
+        thread.join();
+    }
+};
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--gets N] [--puts N] [--netascii N] [--size 1M] [--rate bytes/s] [--after-ms N]"
+            " [--blksize N] [--windowsize N] [--workers N] [--rounds N]\n",
+            prog);
+}
+
+void run_round(const Params &p, const std::string &root, const std::string &content) {
+    ServerConfig config;
+    config.root = root;
+    config.port = 0;
+    config.workers = p.workers;
+    config.rate_limit = p.rate;
+    config.upgrade_socket = root + "/.upgrade";
+    auto old_server = std::make_unique<Running>(config);
+
+    EventLoop loop;
+    ClientOptions options;
+    options.port = old_server->server.port();
+    options.blksize = p.blksize;
+    options.windowsize = p.windowsize;
+    AsyncTFTPClient client(loop, "127.0.0.1", options);
+    ClientOptions text_options = options;
+    text_options.mode = "netascii";
+    AsyncTFTPClient text_client(loop, "127.0.0.1", text_options);
+
+    int transfers = p.gets + p.puts + p.netascii;
+    std::vector<std::string> got((size_t)(p.gets + p.netascii));
+    int running = 0, failures = 0, corrupt = 0;
+    auto check_get = [&](std::string &out) {
+        return [&](const TransferResult &r) {
+            running--;
+            if (!r.ok)
+                failures++;
+            else if (out != content)
+                corrupt++;
+            out.clear();
+        };
+    };
+    for (int i = 0; i < p.gets; i++) {
+        running++;
+        std::string &out = got[(size_t)i];
+        client.get("handoff.bin", std::make_unique<MemorySink>(out), check_get(out));
+    }
+    for (int i = 0; i < p.netascii; i++) {
+        running++;
+        std::string &out = got[(size_t)(p.gets + i)];
+        text_client.get("handoff.bin", std::make_unique<MemorySink>(out), check_get(out));
+    }
+    for (int i = 0; i < p.puts; i++) {
+        running++;
+        client.put(put_name(i), std::make_unique<MemorySource>(content), [&](const TransferResult &r) {
+            running--;
+            if (!r.ok)
+                failures++;
+        });
+    }
+
+    // the successor takes over on a thread of its own while the clients keep going
+    std::unique_ptr<Running> new_server;
+    double handoff_ms = 0;
+    std::thread upgrade([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(p.after_ms));
+        Clock::time_point begin = Clock::now();
+        new_server = std::make_unique<Running>(config);
+        handoff_ms = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+    });
+    while (running > 0)
+        loop.run_once(100);
+    upgrade.join();
+
+    std::string stored;
+    for (int i = 0; i < p.puts; i++) {
+        std::string path = root + "/" + put_name(i);
+        if (!read_file(path, stored) || stored != content)
+            corrupt++;
+        unlink(path.c_str());
+    }
+    MetricsSnapshot before = old_server->server.metrics();
+    MetricsSnapshot after = new_server->server.metrics();
+    printf("%d,%zu,%.3f,%d,%d,%llu,%llu,%llu,%llu\n", transfers, new_server->server.adopted(), handoff_ms, failures,
+           corrupt, (unsigned long long)before.retransmits, (unsigned long long)before.timeouts,
+           (unsigned long long)after.retransmits, (unsigned long long)after.timeouts);
+    fflush(stdout);
+    old_server.reset();
+    new_server.reset();
+    unlink(config.upgrade_socket.c_str());
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--gets") {
+            p.gets = atoi(value.c_str());
+        } else if (arg == "--puts") {
+            p.puts = atoi(value.c_str());
+        } else if (arg == "--netascii") {
+            p.netascii = atoi(value.c_str());
+        } else if (arg == "--size") {
+            p.size = parse_size(value);
+        } else if (arg == "--rate") {
+            p.rate = strtoull(value.c_str(), nullptr, 10);
+        } else if (arg == "--after-ms") {
+            p.after_ms = atoi(value.c_str());
+        } else if (arg == "--blksize") {
+            p.blksize = (uint16_t)atoi(value.c_str());
+        } else if (arg == "--windowsize") {
+            p.windowsize = (uint16_t)atoi(value.c_str());
+        } else if (arg == "--workers") {
+            p.workers = atoi(value.c_str());
+        } else if (arg == "--rounds") {
+            p.rounds = atoi(value.c_str());
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-handoff-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    std::string content = make_data(p.size);
+    std::string path = root + "/handoff.bin";
+    if (!write_file(path, content)) {
+        perror(path.c_str());
+        return 1;
+    }
+
+    // the old server reports each handoff on std::cout; keep that out of the CSV
+    std::streambuf *saved = std::cout.rdbuf(nullptr);
+    printf("transfers,handed,handoff_ms,failures,corrupt,old_retransmits,old_timeouts,new_retransmits,"
+           "new_timeouts\n");
+    for (int round = 0; round < p.rounds; round++)
+        run_round(p, root, content);
+    std::cout.rdbuf(saved);
+
+    unlink(path.c_str());
+    rmdir(root.c_str());
+    return 0;
+}
@@ -0,0 +1,367 @@
+/*
+ * Loopback benchmark: starts TFTPServer in-process on an ephemeral port and drives
+ * it with concurrent client sessions over 127.0.0.1, for every combination of
+ *
+ *   --kind raw,gz          plain file or 1 MiB-member gzip image served decompressed
+ *   --sizes 4K,1M,16M      file size
+ *   --blksize 512,1428     negotiated blksize (RFC 2348)
+ *   --windowsize 1,16      negotiated windowsize (RFC 7440)
+ *   --sessions 1,32        transfers kept in flight
+ *   --workers 1,4          server event loop threads
+ *   --api callback,coro    client transfers reported through callbacks, or each session
+ *                          a coroutine awaiting get_async in a loop
+ *
+ * --sessions 3000 --client-threads 1 --api coro keeps 3000 gets in flight from one
+ * thread.
+ *
+ * Each combination runs for --seconds (default 2) and prints one result row as
+ * CSV (default) or JSON lines (--format json), to stdout or --out <file>.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+
+struct Params {
+    std::vector<std::string> kinds{"raw"};
+    std::vector<uint64_t> sizes{1 << 20};
+    std::vector<uint64_t> blksizes{1428};
+    std::vector<uint64_t> windowsizes{16};
+    std::vector<uint64_t> sessions{16};
+    std::vector<uint64_t> workers{2};
+    std::vector<std::string> apis{"callback"};
+    int client_threads = 2;
+    double seconds = 2;
+    bool json = false;
+    std::string out;
+};
+
+struct Row {
+    std::string kind;
+    uint64_t size, blksize, windowsize, sessions, workers;
+    std::string api;
+    uint64_t transfers = 0, failures = 0, bytes = 0, retransmits = 0;
+    double seconds = 0, mbps = 0, tps = 0, p50_ms = 0, p99_ms = 0;
+};
+
+// Counts what it is given and keeps nothing
+class DiscardSink : public ImageSink {
+public:
+    bool write(const char *, size_t) override { return true; }
+    bool commit() override { return true; }
+    void abort() override {}
+};
+
+uint64_t parse_size(const std::string &s) {
+    char *end;
+    uint64_t v = strtoull(s.c_str(), &end, 10);
+    switch (*end) {
+    case 'k': case 'K': return v << 10;
+    case 'm': case 'M': return v << 20;
+    case 'g': case 'G': return v << 30;
+    default: return v;
+    }
+}
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+std::vector<uint64_t> split_sizes(const std::string &s) {
+    std::vector<uint64_t> v;
+    for (const std::string &p : split(s))
+        v.push_back(parse_size(p));
+    return v;
+}
+
+// Text-like bytes, so the gz variant compresses to roughly what firmware images do
+std::string make_data(uint64_t size) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 \n";
+    std::string data(size, '\0');
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (uint64_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = alphabet[x & 63];
+    }
+    return data;
+}
+
+bool write_file(const std::string &path, const std::string &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+// Independent gzip members of 1 MiB each, like `split -b 1M --filter=gzip`
+std::string gzip_members(const std::string &data) {
+    std::string out;
+    for (size_t off = 0; off < data.size() || off == 0; off += 1 << 20) {
+        size_t len = std::min<size_t>(1 << 20, data.size() - off);
+        z_stream z{};
+        deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        std::string member(deflateBound(&z, len), '\0');
+        z.next_in = (Bytef *)data.data() + off;
+        z.avail_in = (uInt)len;
+        z.next_out = (Bytef *)&member[0];
+        z.avail_out = (uInt)member.size();
+        deflate(&z, Z_FINISH);
+        member.resize(z.total_out);
+        deflateEnd(&z);
+        out += member;
+        if (data.empty())
+            break;
+    }
+    return out;
+}
+
+std::string file_name(const std::string &kind, uint64_t size) {
+    return kind + "-" + std::to_string(size) + ".bin";
+}
+
+using Record = std::function<void(const TransferResult &, double ms)>;
+
+// One session of the coro api: fetches until the deadline, then drops running
+DetachedTask fetch_until(AsyncTFTPClient &client, const std::string &name,
+                         std::chrono::steady_clock::time_point deadline, const Record &record, uint64_t &running) {
+    using clock = std::chrono::steady_clock;
+    do {
+        clock::time_point started = clock::now();
+        TransferResult r = co_await client.get_async(name, std::unique_ptr<ImageSink>(new DiscardSink));
+        record(r, std::chrono::duration<double, std::milli>(clock::now() - started).count());
+    } while (clock::now() < deadline);
+    running--;
+}
+
+Row run_one(const std::string &root, const Params &p, const std::string &kind, uint64_t size,
+            uint64_t blksize, uint64_t windowsize, uint64_t sessions, uint64_t workers, const std::string &api) {
+    Row row{kind, size, blksize, windowsize, sessions, workers, api};
+    ServerConfig config;
+    config.root = root;
+    config.port = 0;
+    config.workers = (int)workers;
+    config.allow_write = false;
+    config.max_windowsize = (uint16_t)std::max<uint64_t>(windowsize, 64);
+    TFTPServer server(config);
+    std::thread server_thread([&] { server.start(); });
+
+    ClientOptions options;
+    options.port = server.port();
+    options.blksize = (uint16_t)blksize;
+    options.windowsize = (uint16_t)windowsize;
+    std::string name = file_name(kind, size);
+
+    using clock = std::chrono::steady_clock;
+    clock::time_point begin = clock::now();
+    clock::time_point deadline = begin + std::chrono::duration_cast<clock::duration>(
+                                             std::chrono::duration<double>(p.seconds));
+    std::mutex mutex;
+    std::vector<double> latencies;
+    std::atomic<uint64_t> transfers{0}, failures{0}, bytes{0};
+
+    int threads = (int)std::min<uint64_t>((uint64_t)p.client_threads, sessions);
+    std::vector<std::thread> clients;
+    for (int t = 0; t < threads; t++) {
+        uint64_t share = sessions / threads + ((uint64_t)t < sessions % threads ? 1 : 0);
+        clients.emplace_back([&, share] {
+            EventLoop loop;
+            AsyncTFTPClient client(loop, "127.0.0.1", options);
+            std::vector<double> local;
+            Record record = [&](const TransferResult &r, double ms) {
+                local.push_back(ms);
+                transfers++;
+                bytes += r.bytes;
+                if (!r.ok)
+                    failures++;
+            };
+            std::function<void()> launch = [&] {
+                clock::time_point started = clock::now();
+                client.get(name, std::unique_ptr<ImageSink>(new DiscardSink), [&, started](const TransferResult &r) {
+                    record(r, std::chrono::duration<double, std::milli>(clock::now() - started).count());
+                    if (clock::now() < deadline)
+                        launch();
+                });
+            };
+            uint64_t running = 0;
+            for (uint64_t i = 0; i < share; i++) {
+                if (api == "coro") {
+                    running++;
+                    fetch_until(client, name, deadline, record, running);
+                } else {
+                    launch();
+                }
+            }
+            while (client.active() > 0 || running > 0)
+                loop.run_once(100);
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies.insert(latencies.end(), local.begin(), local.end());
+        });
+    }
+    for (auto &c : clients)
+        c.join();
+    row.seconds = std::chrono::duration<double>(clock::now() - begin).count();
+    row.retransmits = server.metrics().retransmits;
+    server.stop();
+    server_thread.join();
+
+    row.transfers = transfers;
+    row.failures = failures;
+    row.bytes = bytes;
+    row.mbps = (double)row.bytes / row.seconds / 1e6;
+    row.tps = (double)row.transfers / row.seconds;
+    std::sort(latencies.begin(), latencies.end());
+    if (!latencies.empty()) {
+        row.p50_ms = latencies[(latencies.size() - 1) / 2];
+        row.p99_ms = latencies[(size_t)((double)(latencies.size() - 1) * 0.99)];
+    }
+    return row;
+}
+
+void print_row(FILE *out, const Row &r, bool json) {
+    if (json) {
+        fprintf(out,
+                "{\"kind\":\"%s\",\"size\":%llu,\"blksize\":%llu,\"windowsize\":%llu,\"sessions\":%llu,"
+                "\"workers\":%llu,\"api\":\"%s\",\"transfers\":%llu,\"failures\":%llu,\"bytes\":%llu,\"retransmits\":%llu,"
+                "\"seconds\":%.3f,\"mbps\":%.1f,\"tps\":%.1f,\"p50_ms\":%.3f,\"p99_ms\":%.3f}\n",
+                r.kind.c_str(), (unsigned long long)r.size, (unsigned long long)r.blksize,
+                (unsigned long long)r.windowsize, (unsigned long long)r.sessions, (unsigned long long)r.workers,
+                r.api.c_str(), (unsigned long long)r.transfers, (unsigned long long)r.failures, (unsigned long long)r.bytes,
+                (unsigned long long)r.retransmits, r.seconds, r.mbps, r.tps, r.p50_ms, r.p99_ms);
+    } else {
+        fprintf(out, "%s,%llu,%llu,%llu,%llu,%llu,%s,%llu,%llu,%llu,%llu,%.3f,%.1f,%.1f,%.3f,%.3f\n", r.kind.c_str(),
+                (unsigned long long)r.size, (unsigned long long)r.blksize, (unsigned long long)r.windowsize,
+                (unsigned long long)r.sessions, (unsigned long long)r.workers, r.api.c_str(),
+                (unsigned long long)r.transfers,
+                (unsigned long long)r.failures, (unsigned long long)r.bytes, (unsigned long long)r.retransmits,
+                r.seconds, r.mbps, r.tps, r.p50_ms, r.p99_ms);
+    }
+    fflush(out);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--kind raw,gz] [--sizes 4K,1M] [--blksize 512,1428] [--windowsize 1,16]\n"
+            "          [--sessions 1,32] [--workers 1,4] [--api callback,coro] [--client-threads N] [--seconds S]\n"
+            "          [--format csv|json] [--out file]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--kind")
+            p.kinds = split(value);
+        else if (arg == "--sizes")
+            p.sizes = split_sizes(value);
+        else if (arg == "--blksize")
+            p.blksizes = split_sizes(value);
+        else if (arg == "--windowsize")
+            p.windowsizes = split_sizes(value);
+        else if (arg == "--sessions")
+            p.sessions = split_sizes(value);
+        else if (arg == "--workers")
+            p.workers = split_sizes(value);
+        else if (arg == "--api")
+            p.apis = split(value);
+        else if (arg == "--client-threads")
+            p.client_threads = std::max(1, atoi(value.c_str()));
+        else if (arg == "--seconds")
+            p.seconds = atof(value.c_str());
+        else if (arg == "--format")
+            p.json = value == "json";
+        else if (arg == "--out")
+            p.out = value;
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    for (const std::string &api : p.apis) {
+        if (api != "callback" && api != "coro") {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-bench-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    std::vector<std::string> created;
+    for (uint64_t size : p.sizes) {
+        std::string data = make_data(size);
+        for (const std::string &kind : p.kinds) {
+            std::string path = root + "/" + file_name(kind, size);
+            if (kind == "gz")
+                path += ".gz";
+            if (!write_file(path, kind == "gz" ? gzip_members(data) : data)) {
+                perror(path.c_str());
+                return 1;
+            }
+            created.push_back(path);
+            if (kind == "gz")
+                created.push_back(path + ".idx");
+        }
+    }
+
+    FILE *out = p.out.empty() ? stdout : fopen(p.out.c_str(), "w");
+    if (!out) {
+        perror(p.out.c_str());
+        return 1;
+    }
+    if (!p.json)
+        fprintf(out, "kind,size,blksize,windowsize,sessions,workers,api,transfers,failures,bytes,retransmits,"
+                     "seconds,mbps,tps,p50_ms,p99_ms\n");
+    for (const std::string &kind : p.kinds)
+        for (uint64_t size : p.sizes)
+            for (uint64_t blksize : p.blksizes)
+                for (uint64_t windowsize : p.windowsizes)
+                    for (uint64_t sessions : p.sessions)
+                        for (uint64_t workers : p.workers)
+                            for (const std::string &api : p.apis)
+                                print_row(out,
+                                          run_one(root, p, kind, size, blksize, windowsize, sessions, workers, api),
+                                          p.json);
+    if (out != stdout)
+        fclose(out);
+    for (const std::string &path : created)
+        unlink(path.c_str());
+    rmdir(root.c_str());
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * WAN benchmark over SimNet: the server and client run in one thread over a
+ * simulated link, so a 200 ms RTT sweep costs CPU time rather than wall time and
+ * every row is reproducible from --seed. For every combination of
+ *
+ *   --latency-ms 1,50,200   one way delay (RTT is twice this)
+ *   --loss 0,0.01           datagram loss probability, both directions
+ *   --windowsize 1,16       negotiated windowsize (RFC 7440)
+ *   --stripes 1,4           concurrent byte ranges (TFTPClient::striped_rrq)
+ *
+ * it fetches one --size file (default 4M) with --blksize (default 1428) over a link
+ * with --jitter-ms, --bandwidth-mbps (0 = unlimited) and --queue-kb, and prints the
+ * simulated goodput next to the wall time the run took, as CSV or --format json.
+*/
+
+#include "../includes/client.hpp"
+#include "../includes/server.hpp"
+#include "../includes/sim_net.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    std::vector<double> latencies_ms{1, 50, 200};
+    std::vector<double> losses{0, 0.01};
+    std::vector<uint64_t> windowsizes{1, 16};
+    std::vector<uint64_t> stripes{1, 4};
+    uint64_t size = 4 << 20;
+    uint16_t blksize = 1428;
+    double jitter_ms = 0;
+    double bandwidth_mbps = 0;
+    uint64_t queue_kb = 0;
+    uint64_t seed = 1;
+    bool json = false;
+    std::string out;
+};
+
+struct Row {
+    double latency_ms, loss;
+    uint64_t windowsize, stripes;
+    bool ok = false;
+    uint64_t bytes = 0, retransmits = 0;
+    double sim_seconds = 0, wall_seconds = 0, mbps = 0;
+    SimNet::Stats net;
+};
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+std::vector<double> split_doubles(const std::string &s) {
+    std::vector<double> v;
+    for (const std::string &p : split(s))
+        v.push_back(atof(p.c_str()));
+    return v;
+}
+
+std::vector<uint64_t> split_counts(const std::string &s) {
+    std::vector<uint64_t> v;
+    for (const std::string &p : split(s))
+        v.push_back(strtoull(p.c_str(), nullptr, 10));
+    return v;
+}
+
+uint64_t parse_size(const std::string &s) {
+    char *end;
+    uint64_t v = strtoull(s.c_str(), &end, 10);
+    switch (*end) {
+    case 'k': case 'K': return v << 10;
+    case 'm': case 'M': return v << 20;
+    case 'g': case 'G': return v << 30;
+    default: return v;
+    }
+}
+
+Row run_one(const std::string &root, const Params &p, double latency_ms, double loss,
+            uint64_t windowsize, uint64_t stripes) {
+    Row row;
+    row.latency_ms = latency_ms;
+    row.loss = loss;
+    row.windowsize = windowsize;
+    row.stripes = stripes;
+    LinkParams link;
+    link.latency_us = (uint32_t)(latency_ms * 1000);
+    link.jitter_us = (uint32_t)(p.jitter_ms * 1000);
+    link.loss = loss;
+    link.bandwidth_bps = (uint64_t)(p.bandwidth_mbps * 1e6);
+    link.queue_bytes = p.queue_kb << 10;
+    SimNet net(link, p.seed);
+
+    ServerConfig config;
+    config.root = root;
+    config.allow_write = false;
+    config.max_windowsize = (uint16_t)std::max<uint64_t>(windowsize, 64);
+    config.net = &net.host("10.0.0.1");
+    TFTPServer server(config);
+
+    ClientOptions options;
+    options.blksize = p.blksize;
+    options.windowsize = (uint16_t)windowsize;
+    options.net = &net.host("10.0.0.2");
+    TFTPClient client("10.0.0.1", options);
+
+    std::string local = root + "/fetched.bin";
+    auto begin = std::chrono::steady_clock::now();
+    row.ok = stripes > 1 ? client.striped_rrq("image.bin", local, (int)stripes) : client.send_rrq("image.bin", local);
+    row.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    row.sim_seconds = (double)net.now_us() / 1e6;
+    row.bytes = client.bytes_transferred();
+    row.retransmits = server.metrics().retransmits;
+    row.mbps = row.sim_seconds > 0 ? (double)row.bytes / row.sim_seconds / 1e6 : 0;
+    row.net = net.stats();
+    unlink(local.c_str());
+    return row;
+}
+
+void print_row(FILE *out, const Row &r, bool json) {
+    const SimNet::Stats &n = r.net;
+    if (json) {
+        fprintf(out,
+                "{\"latency_ms\":%g,\"loss\":%g,\"windowsize\":%llu,\"stripes\":%llu,\"ok\":%s,\"bytes\":%llu,"
+                "\"sim_seconds\":%.3f,\"mbps\":%.3f,\"retransmits\":%llu,\"sent\":%llu,\"lost\":%llu,"
+                "\"queue_drops\":%llu,\"wall_seconds\":%.3f}\n",
+                r.latency_ms, r.loss, (unsigned long long)r.windowsize, (unsigned long long)r.stripes,
+                r.ok ? "true" : "false", (unsigned long long)r.bytes, r.sim_seconds, r.mbps,
+                (unsigned long long)r.retransmits, (unsigned long long)n.sent, (unsigned long long)n.lost,
+                (unsigned long long)n.queue_drops, r.wall_seconds);
+    } else {
+        fprintf(out, "%g,%g,%llu,%llu,%d,%llu,%.3f,%.3f,%llu,%llu,%llu,%llu,%.3f\n", r.latency_ms, r.loss,
+                (unsigned long long)r.windowsize, (unsigned long long)r.stripes, r.ok ? 1 : 0,
+                (unsigned long long)r.bytes, r.sim_seconds, r.mbps, (unsigned long long)r.retransmits,
+                (unsigned long long)n.sent, (unsigned long long)n.lost, (unsigned long long)n.queue_drops,
+                r.wall_seconds);
+    }
+    fflush(out);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--latency-ms 1,50,200] [--loss 0,0.01] [--windowsize 1,16] [--stripes 1,4]\n"
+            "          [--size 4M] [--blksize 1428] [--jitter-ms J] [--bandwidth-mbps B] [--queue-kb Q]\n"
+            "          [--seed N] [--format csv|json] [--out file]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--latency-ms")
+            p.latencies_ms = split_doubles(value);
+        else if (arg == "--loss")
+            p.losses = split_doubles(value);
+        else if (arg == "--windowsize")
+            p.windowsizes = split_counts(value);
+        else if (arg == "--stripes")
+            p.stripes = split_counts(value);
+        else if (arg == "--size")
+            p.size = parse_size(value);
+        else if (arg == "--blksize")
+            p.blksize = (uint16_t)atoi(value.c_str());
+        else if (arg == "--jitter-ms")
+            p.jitter_ms = atof(value.c_str());
+        else if (arg == "--bandwidth-mbps")
+            p.bandwidth_mbps = atof(value.c_str());
+        else if (arg == "--queue-kb")
+            p.queue_kb = strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--seed")
+            p.seed = strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--format")
+            p.json = value == "json";
+        else if (arg == "--out")
+            p.out = value;
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-netsim-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    std::string image = root + "/image.bin";
+    FILE *f = fopen(image.c_str(), "wb");
+    std::string chunk(1 << 16, '\0');
+    for (size_t i = 0; i < chunk.size(); i++)
+        chunk[i] = (char)(i * 131 + 7);
+    for (uint64_t left = p.size; f && left > 0;) {
+        size_t n = (size_t)std::min<uint64_t>(left, chunk.size());
+        fwrite(chunk.data(), 1, n, f);
+        left -= n;
+    }
+    if (!f || fclose(f) != 0) {
+        perror(image.c_str());
+        return 1;
+    }
+
+    FILE *out = p.out.empty() ? stdout : fopen(p.out.c_str(), "w");
+    if (!out) {
+        perror(p.out.c_str());
+        return 1;
+    }
+    if (!p.json)
+        fprintf(out, "latency_ms,loss,windowsize,stripes,ok,bytes,sim_seconds,mbps,retransmits,sent,lost,"
+                     "queue_drops,wall_seconds\n");
+    for (double latency : p.latencies_ms)
+        for (double loss : p.losses)
+            for (uint64_t windowsize : p.windowsizes)
+                for (uint64_t stripes : p.stripes)
+                    print_row(out, run_one(root, p, latency, loss, windowsize, stripes), p.json);
+    if (out != stdout)
+        fclose(out);
+    unlink(image.c_str());
+    rmdir(root.c_str());
+    return 0;
+}
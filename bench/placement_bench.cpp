@@ -0,0 +1,249 @@
+/*
+ * Worker placement benchmark: an in-process server on 127.0.0.1 with --workers
+ * workers, unpinned and pinned (ServerConfig::pin_workers), while --threads client
+ * threads of --concurrency fetches each pull files back to back for --seconds. One
+ * fetch in --packed-every is of a gzip packed image, which is decoded through the
+ * worker's image cache slice; the rest are of a plain file of --size.
+ *
+ *   --layout unpinned,pinned  --workers <CPUs>  --threads 2  --concurrency 16
+ *   --seconds 3  --size 64K  --packed-every 4  --cpus 0-7   (CPUs for the pinned layout)
+ *
+ * Each layout prints a CSV row: transfers/s, MB/s, fetch p50/p99, requests the kernel
+ * handled on another CPU or node than the worker that took them (pinned only), and
+ * where the workers ran as cpu/node pairs. The difference shows on multi-socket
+ * machines; on one node pinning only saves the scheduler's migrations.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+
+struct Params {
+    std::vector<std::string> layouts{"unpinned", "pinned"};
+    int workers = 0;
+    int threads = 2;
+    int concurrency = 16;
+    double seconds = 3;
+    size_t size = 64 << 10;
+    int packed_every = 4;
+    std::vector<int> cpus;
+};
+
+using Clock = std::chrono::steady_clock;
+
+class NullSink : public ImageSink {
+public:
+    bool write(const char *, size_t) override { return true; }
+    bool commit() override { return true; }
+    void abort() override {}
+};
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+size_t parse_size(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'K': case 'k': v *= 1 << 10; break;
+    case 'M': case 'm': v *= 1 << 20; break;
+    case 'G': case 'g': v *= 1 << 30; break;
+    }
+    return (size_t)v;
+}
+
+std::string pattern(size_t size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char)(i * 131 + (i >> 9));
+    return data;
+}
+
+bool write_plain(const std::string &path, size_t size) {
+    std::string data = pattern(size);
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+// 1 MiB members, like split --filter=gzip
+bool write_packed(const std::string &path, size_t size) {
+    std::string data = pattern(size);
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = true;
+    for (size_t off = 0; off < size && ok; off += 1 << 20) {
+        size_t len = std::min<size_t>(1 << 20, size - off);
+        std::vector<unsigned char> out(compressBound((uLong)len) + 64);
+        z_stream z{};
+        ok = deflateInit2(&z, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        if (!ok)
+            break;
+        z.next_in = (Bytef *)data.data() + off;
+        z.avail_in = (uInt)len;
+        z.next_out = out.data();
+        z.avail_out = (uInt)out.size();
+        ok = deflate(&z, Z_FINISH) == Z_STREAM_END;
+        size_t n = out.size() - z.avail_out;
+        deflateEnd(&z);
+        ok = ok && fwrite(out.data(), 1, n, f) == n;
+    }
+    return fclose(f) == 0 && ok;
+}
+
+void run_one(const std::string &root, const Params &p, const std::string &layout) {
+    ServerConfig config;
+    config.root = root;
+    config.port = 0;
+    config.workers = p.workers;
+    config.allow_write = false;
+    config.pin_workers = layout == "pinned";
+    config.worker_cpus = p.cpus;
+    TFTPServer server(config);
+    std::thread server_thread([&] { server.start(); });
+
+    std::mutex mutex;
+    std::vector<double> latencies;
+    std::atomic<uint64_t> failures{0}, bytes{0};
+    Clock::time_point begin = Clock::now();
+    Clock::time_point deadline = begin + std::chrono::duration_cast<Clock::duration>(
+                                             std::chrono::duration<double>(p.seconds));
+    std::vector<std::thread> clients;
+    for (int t = 0; t < p.threads; t++)
+        clients.emplace_back([&] {
+            EventLoop loop;
+            ClientOptions options;
+            options.port = server.port();
+            options.blksize = 1428;
+            options.windowsize = 16;
+            AsyncTFTPClient client(loop, "127.0.0.1", options);
+            std::vector<double> mine;
+            uint64_t n = 0;
+            std::function<void()> fetch = [&] {
+                bool packed = p.packed_every > 0 && ++n % (uint64_t)p.packed_every == 0;
+                Clock::time_point started = Clock::now();
+                client.get(packed ? "image.bin" : "plain.bin", std::unique_ptr<ImageSink>(new NullSink),
+                           [&, started](const TransferResult &r) {
+                               if (r.ok) {
+                                   mine.push_back(std::chrono::duration<double, std::milli>(Clock::now() - started).count());
+                                   bytes += p.size;
+                               } else {
+                                   failures++;
+                               }
+                               if (Clock::now() < deadline)
+                                   fetch();
+                           });
+            };
+            for (int i = 0; i < p.concurrency; i++)
+                fetch();
+            while (client.active() > 0)
+                loop.run_once(100);
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies.insert(latencies.end(), mine.begin(), mine.end());
+        });
+    for (std::thread &t : clients)
+        t.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    MetricsSnapshot m = server.metrics();
+    server.stop();
+    server_thread.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    double p50 = latencies.empty() ? 0 : latencies[(latencies.size() - 1) / 2];
+    double p99 = latencies.empty() ? 0 : latencies[(size_t)((double)(latencies.size() - 1) * 0.99)];
+    std::string where;
+    for (size_t i = 0; i < m.worker_cpu.size(); i++)
+        where += (i ? " " : "") + std::to_string(m.worker_cpu[i]) + "/" + std::to_string(m.worker_node[i]);
+    printf("%s,%zu,%.0f,%.1f,%.3f,%.3f,%llu,%llu,%llu,%s\n", layout.c_str(), m.worker_cpu.size(),
+           (double)latencies.size() / seconds, (double)bytes.load() / seconds / 1e6, p50, p99,
+           (unsigned long long)failures.load(), (unsigned long long)m.requests_other_cpu,
+           (unsigned long long)m.requests_other_node, where.c_str());
+    fflush(stdout);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--layout unpinned,pinned] [--workers N] [--threads N] [--concurrency N]\n"
+            "          [--seconds S] [--size 64K] [--packed-every N] [--cpus 0-7]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    p.workers = (int)std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--layout")
+            p.layouts = split(value);
+        else if (arg == "--workers")
+            p.workers = atoi(value.c_str());
+        else if (arg == "--threads")
+            p.threads = atoi(value.c_str());
+        else if (arg == "--concurrency")
+            p.concurrency = atoi(value.c_str());
+        else if (arg == "--seconds")
+            p.seconds = atof(value.c_str());
+        else if (arg == "--size")
+            p.size = parse_size(value);
+        else if (arg == "--packed-every")
+            p.packed_every = atoi(value.c_str());
+        else if (arg == "--cpus" && parse_cpu_list(value, p.cpus))
+            continue;
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-placement-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    if (!write_plain(root + "/plain.bin", p.size) || !write_packed(root + "/image.bin.gz", p.size)) {
+        perror(root.c_str());
+        return 1;
+    }
+
+    printf("layout,workers,transfers_per_s,mb_per_s,p50_ms,p99_ms,failures,requests_other_cpu,requests_other_node,"
+           "cpu_node\n");
+    for (const std::string &layout : p.layouts)
+        run_one(root, p, layout);
+    for (const char *name : {"/plain.bin", "/image.bin.gz", "/image.bin.gz.idx"})
+        unlink((root + name).c_str());
+    rmdir(root.c_str());
+    return 0;
+}
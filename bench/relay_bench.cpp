@@ -0,0 +1,216 @@
+/*
+ * Caching relay benchmark: two in-process servers on 127.0.0.1. The origin serves
+ * --files files of --size (half of them under a subdirectory), its sending capped at
+ * --uplink bytes/s to stand in for a remote site's slow link; the relay starts with an
+ * empty root and ServerConfig::upstream pointing at the origin. Each of --rounds
+ * rounds has --clients clients per file fetch every file from the relay at once, so
+ * the first round's clients share one upstream fetch per file and later rounds are
+ * served from the relay's root.
+ *
+ *   --files 8  --size 4M  --clients 4  --rounds 3  --uplink 50000000  --blksize 1428  --windowsize 8
+ *
+ * Each round prints a CSV row: fetches started and joined, bytes from the upstream,
+ * bytes delivered to clients, upstream bytes saved (delivered minus fetched), the
+ * round's wall time, and failed or corrupted transfers.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    int files = 8;
+    size_t size = 4 << 20;
+    int clients = 4;
+    int rounds = 3;
+    uint64_t uplink = 50000000;
+    uint16_t blksize = 1428;
+    uint16_t windowsize = 8;
+    int workers = 2;
+};
+
+using Clock = std::chrono::steady_clock;
+
+size_t parse_size(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'K': case 'k': v *= 1 << 10; break;
+    case 'M': case 'm': v *= 1 << 20; break;
+    }
+    return (size_t)v;
+}
+
+std::string make_data(size_t size, int seed) {
+    std::string data(size, '\0');
+    uint64_t x = 0x9e3779b97f4a7c15ull ^ (uint64_t)seed;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (char)x;
+    }
+    return data;
+}
+
+bool write_file(const std::string &path, const std::string &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+std::string file_name(int i) {
+    return (i % 2 ? "pxelinux/image" : "image") + std::to_string(i) + ".bin";
+}
+
+// Servers run start() on a thread of their own
+struct Running {
+    TFTPServer server;
+    std::thread thread;
+    explicit Running(const ServerConfig &config) : server(config), thread([this] { server.start(); }) {}
+    ~Running() {
+        server.stop();
+        thread.join();
+    }
+};
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--files N] [--size 4M] [--clients N] [--rounds N] [--uplink bytes/s] [--blksize N]"
+            " [--windowsize N] [--workers N]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--files") {
+            p.files = atoi(value.c_str());
+        } else if (arg == "--size") {
+            p.size = parse_size(value);
+        } else if (arg == "--clients") {
+            p.clients = atoi(value.c_str());
+        } else if (arg == "--rounds") {
+            p.rounds = atoi(value.c_str());
+        } else if (arg == "--uplink") {
+            p.uplink = strtoull(value.c_str(), nullptr, 10);
+        } else if (arg == "--blksize") {
+            p.blksize = (uint16_t)atoi(value.c_str());
+        } else if (arg == "--windowsize") {
+            p.windowsize = (uint16_t)atoi(value.c_str());
+        } else if (arg == "--workers") {
+            p.workers = atoi(value.c_str());
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char origin_tmpl[] = "/tmp/turbotftp-origin-XXXXXX";
+    char relay_tmpl[] = "/tmp/turbotftp-relay-XXXXXX";
+    if (!mkdtemp(origin_tmpl) || !mkdtemp(relay_tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string origin_root = origin_tmpl, relay_root = relay_tmpl;
+    mkdir((origin_root + "/pxelinux").c_str(), 0755);
+    std::vector<std::string> contents;
+    for (int i = 0; i < p.files; i++) {
+        contents.push_back(make_data(p.size, i));
+        if (!write_file(origin_root + "/" + file_name(i), contents.back())) {
+            perror(origin_root.c_str());
+            return 1;
+        }
+    }
+
+    {
+        ServerConfig origin_config;
+        origin_config.root = origin_root;
+        origin_config.port = 0;
+        origin_config.workers = p.workers;
+        origin_config.allow_write = false;
+        origin_config.rate_limit = p.uplink;
+        Running origin(origin_config);
+
+        ServerConfig relay_config;
+        relay_config.root = relay_root;
+        relay_config.port = 0;
+        relay_config.workers = p.workers;
+        relay_config.allow_write = false;
+        relay_config.upstream = "127.0.0.1:" + std::to_string(origin.server.port());
+        relay_config.upstream_blksize = p.blksize;
+        relay_config.upstream_windowsize = p.windowsize;
+        Running relay(relay_config);
+
+        printf("round,fetches,joined,upstream_bytes,delivered_bytes,saved_bytes,seconds,failures,corrupt\n");
+        MetricsSnapshot before = relay.server.metrics();
+        for (int round = 1; round <= p.rounds; round++) {
+            EventLoop loop;
+            ClientOptions options;
+            options.port = relay.server.port();
+            options.blksize = p.blksize;
+            options.windowsize = p.windowsize;
+            AsyncTFTPClient client(loop, "127.0.0.1", options);
+            std::vector<std::string> got((size_t)(p.files * p.clients));
+            int failures = 0, corrupt = 0, running = 0;
+            Clock::time_point begin = Clock::now();
+            for (int f = 0; f < p.files; f++) {
+                for (int c = 0; c < p.clients; c++) {
+                    std::string &out = got[(size_t)(f * p.clients + c)];
+                    running++;
+                    client.get(file_name(f), std::make_unique<MemorySink>(out), [&, f](const TransferResult &r) {
+                        running--;
+                        if (!r.ok)
+                            failures++;
+                        else if (out != contents[(size_t)f])
+                            corrupt++;
+                        out.clear();
+                    });
+                }
+            }
+            while (running > 0)
+                loop.run_once(100);
+            double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+            MetricsSnapshot after = relay.server.metrics();
+            uint64_t upstream = after.relay_upstream_bytes - before.relay_upstream_bytes;
+            uint64_t delivered = after.bytes_sent - before.bytes_sent;
+            printf("%d,%llu,%llu,%llu,%llu,%lld,%.3f,%d,%d\n", round,
+                   (unsigned long long)(after.relay_fetches - before.relay_fetches),
+                   (unsigned long long)(after.relay_joined - before.relay_joined), (unsigned long long)upstream,
+                   (unsigned long long)delivered, (long long)delivered - (long long)upstream, seconds, failures,
+                   corrupt);
+            fflush(stdout);
+            before = after;
+        }
+    }
+
+    for (int i = 0; i < p.files; i++) {
+        unlink((origin_root + "/" + file_name(i)).c_str());
+        unlink((relay_root + "/" + file_name(i)).c_str());
+    }
+    rmdir((origin_root + "/pxelinux").c_str());
+    rmdir((relay_root + "/pxelinux").c_str());
+    rmdir(origin_root.c_str());
+    rmdir(relay_root.c_str());
+    return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Hot reload benchmark: an in-process server on 127.0.0.1 serves a --size file to
+ * --clients clients, each fetching it again as soon as its last fetch is done, for
+ * --seconds per mode.
+ *
+ *   --clients 32  --size 64K  --seconds 5  --interval-ms 10  --mode none,reload
+ *   --blksize 1428  --windowsize 8  --workers 2
+ *
+ * Modes:
+ *   none    the configuration stays as started
+ *   reload  a thread calls TFTPServer::reload() every --interval-ms, switching between
+ *           two configurations that differ in everything reload() applies live:
+ *           max_blksize, max_windowsize, cache_bytes, rate limits, max_sessions
+ *           and the queueing settings. Neither caps the clients below what they ask for
+ *
+ * Each mode prints a CSV row: fetches done, fetches/s, fetch latency p50, p99 and max
+ * in microseconds, reloads applied, and failed or corrupted fetches.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    int clients = 32;
+    size_t size = 64 << 10;
+    double seconds = 5;
+    int interval_ms = 10;
+    std::vector<std::string> modes = {"none", "reload"};
+    uint16_t blksize = 1428;
+    uint16_t windowsize = 8;
+    int workers = 2;
+};
+
+using Clock = std::chrono::steady_clock;
+
+size_t parse_size(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'K': case 'k': v *= 1 << 10; break;
+    case 'M': case 'm': v *= 1 << 20; break;
+    }
+    return (size_t)v;
+}
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> out;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ','))
+        out.push_back(item);
+    return out;
+}
+
+std::string make_data(size_t size) {
+    std::string data(size, '\0');
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (char)x;
+    }
+    return data;
+}
+
+bool write_file(const std::string &path, const std::string &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+// Servers run start() on a thread of their own
+struct Running {
+    TFTPServer server;
+    std::thread thread;
+    explicit Running(const ServerConfig &config) : server(config), thread([this] { server.start(); }) {}
+    ~Running() {
+        server.stop();
+        thread.join();
+    }
+};
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--clients N] [--size 64K] [--seconds S] [--interval-ms N] [--mode none,reload]"
+            " [--blksize N] [--windowsize N] [--workers N]\n",
+            prog);
+}
+
+uint64_t percentile(std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * (double)sorted.size()))];
+}
+
+void run_mode(const Params &p, const std::string &mode, const std::string &root, const std::string &content) {
+    ServerConfig base;
+    base.root = root;
+    base.port = 0;
+    base.workers = p.workers;
+    base.allow_write = false;
+    // the other configuration: every live setting changed, none of them below what the
+    // clients ask for or low enough to queue them
+    ServerConfig other = base;
+    other.max_blksize = MAX_BLKSIZE - 1;
+    other.max_windowsize = 32;
+    other.cache_bytes = 32 << 20;
+    other.rate_limit = 8ull << 30;
+    other.client_rate_limit = 4ull << 30;
+    other.client_prefix = 24;
+    other.max_sessions = (size_t)p.clients;
+    other.max_pending = 512;
+    other.small_file = 4 << 20;
+    other.max_queue_ms = 5000;
+    other.limits.timeout_ms = base.limits.timeout_ms * 2;
+
+    Running running(base);
+    std::atomic<bool> done{false};
+    std::thread reloader;
+    if (mode == "reload")
+        reloader = std::thread([&] {
+            for (bool flip = true; !done.load(); flip = !flip) {
+                running.server.reload(flip ? other : base);
+                std::this_thread::sleep_for(std::chrono::milliseconds(p.interval_ms));
+            }
+        });
+
+    EventLoop loop;
+    ClientOptions options;
+    options.port = running.server.port();
+    options.blksize = p.blksize;
+    options.windowsize = p.windowsize;
+    AsyncTFTPClient client(loop, "127.0.0.1", options);
+    std::vector<std::string> got((size_t)p.clients);
+    std::vector<uint64_t> latencies;
+    int failures = 0, corrupt = 0, busy = 0;
+    Clock::time_point begin = Clock::now();
+    Clock::time_point end = begin + std::chrono::microseconds((int64_t)(p.seconds * 1e6));
+    std::function<void(int)> fetch = [&](int c) {
+        Clock::time_point started = Clock::now();
+        std::string &out = got[(size_t)c];
+        busy++;
+        client.get("reload.bin", std::make_unique<MemorySink>(out), [&, c, started](const TransferResult &t) {
+            busy--;
+            latencies.push_back(
+                (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count());
+            if (!t.ok)
+                failures++;
+            else if (out != content)
+                corrupt++;
+            out.clear();
+            if (Clock::now() < end)
+                fetch(c);
+        });
+    };
+    for (int c = 0; c < p.clients; c++)
+        fetch(c);
+    while (busy > 0)
+        loop.run_once(100);
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    done = true;
+    if (reloader.joinable())
+        reloader.join();
+    uint64_t reloads = running.server.metrics().config_reloads;
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("%s,%zu,%.0f,%llu,%llu,%llu,%llu,%d,%d\n", mode.c_str(), latencies.size(),
+           (double)latencies.size() / seconds, (unsigned long long)percentile(latencies, 0.5),
+           (unsigned long long)percentile(latencies, 0.99),
+           (unsigned long long)(latencies.empty() ? 0 : latencies.back()), (unsigned long long)reloads, failures,
+           corrupt);
+    fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--clients") {
+            p.clients = atoi(value.c_str());
+        } else if (arg == "--size") {
+            p.size = parse_size(value);
+        } else if (arg == "--seconds") {
+            p.seconds = atof(value.c_str());
+        } else if (arg == "--interval-ms") {
+            p.interval_ms = atoi(value.c_str());
+        } else if (arg == "--mode") {
+            p.modes = split(value);
+        } else if (arg == "--blksize") {
+            p.blksize = (uint16_t)atoi(value.c_str());
+        } else if (arg == "--windowsize") {
+            p.windowsize = (uint16_t)atoi(value.c_str());
+        } else if (arg == "--workers") {
+            p.workers = atoi(value.c_str());
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    for (const std::string &mode : p.modes) {
+        if (mode != "none" && mode != "reload") {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-reload-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    std::string content = make_data(p.size);
+    std::string path = root + "/reload.bin";
+    if (!write_file(path, content)) {
+        perror(path.c_str());
+        return 1;
+    }
+
+    printf("mode,fetches,fetches_per_s,p50_us,p99_us,max_us,reloads,failures,corrupt\n");
+    for (const std::string &mode : p.modes)
+        run_mode(p, mode, root, content);
+
+    unlink(path.c_str());
+    rmdir(root.c_str());
+    return 0;
+}
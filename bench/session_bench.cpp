@@ -0,0 +1,279 @@
+/*
+ * Session benchmark: what a parked transfer costs and what waking one costs. Starts
+ * --sessions sessions over an in-memory transport with a loop-wide FramePool, the way
+ * a worker does, then hands them ACKs (send) or DATA (receive) round robin, so each
+ * packet resumes a different session's coroutine.
+ *
+ *   --kind send,receive,send+flight,receive+flight  --sessions 1000,10000,100000  --packets 2000000  --blksize 512
+ *
+ * Each kind and count prints a CSV row: heap bytes per session (the session, its
+ * buffers, its timer and its coroutine frame), the frame's share of that, ns per
+ * packet handled, and ns per bare resume of an empty coroutine parked in the same
+ * way, which is the cost of the switch itself.
+ *
+ * A kind ending in +flight gives every session the loop's FlightRecorder, as a worker
+ * does with ServerConfig::flight_events, so comparing ns per packet with the plain
+ * kind shows what recording costs a packet. The last column times the recorder alone:
+ * ns per record() in a tight loop.
+*/
+
+#include "../includes/coroutine.hpp"
+#include "../includes/flight_recorder.hpp"
+#include "../includes/session.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Params {
+    std::vector<std::string> kinds{"send", "receive", "send+flight", "receive+flight"};
+    std::vector<size_t> sessions{1000, 10000, 100000};
+    size_t packets = 2000000;
+    uint16_t blksize = 512;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Sockets are slots holding at most one datagram; inject() queues one and calls the
+// socket's reader like a readable event would. Sends are only counted
+class LoopNet : public DatagramNet {
+public:
+    int open() override {
+        slots.emplace_back();
+        return (int)slots.size() - 1;
+    }
+    int bind(int, const struct sockaddr_in &, bool) override { return 0; }
+    int local_address(int, struct sockaddr_in &addr) override {
+        addr = sockaddr_in{};
+        return 0;
+    }
+    int connect(int, const struct sockaddr_in &) override { return 0; }
+    ssize_t send_to(int, const char *, size_t len, const struct sockaddr_in *) override {
+        sends++;
+        return (ssize_t)len;
+    }
+    ssize_t receive(int sock, char *buf, size_t cap, struct sockaddr_in *from) override {
+        Slot &s = slots[(size_t)sock];
+        if (!s.len) {
+            errno = EAGAIN;
+            return -1;
+        }
+        size_t n = std::min(cap, s.len);
+        memcpy(buf, s.data, n);
+        s.len = 0;
+        if (from)
+            *from = sockaddr_in{};
+        return (ssize_t)n;
+    }
+    void close(int) override {}
+    void watch(EventLoop &, int sock, std::function<void()> readable) override {
+        slots[(size_t)sock].readable = std::move(readable);
+    }
+    void unwatch(EventLoop &, int sock) override { slots[(size_t)sock].readable = nullptr; }
+
+    void inject(int sock, const char *buf, size_t len) {
+        Slot &s = slots[(size_t)sock];
+        s.data = buf;
+        s.len = len;
+        if (s.readable)
+            s.readable();
+    }
+
+    uint64_t sends = 0;
+
+private:
+    struct Slot {
+        const char *data = nullptr;
+        size_t len = 0;
+        std::function<void()> readable;
+    };
+    std::vector<Slot> slots;
+};
+
+class ZeroSource : public ImageSource {
+public:
+    uint64_t size() const override { return 1ull << 40; }
+    ssize_t read_at(uint64_t, char *buf, size_t len) override {
+        memset(buf, 0, len);
+        return (ssize_t)len;
+    }
+};
+
+class NullSink : public ImageSink {
+public:
+    bool write(const char *, size_t) override { return true; }
+    bool commit() override { return true; }
+    void abort() override {}
+};
+
+// The smallest flow a session could be: wake, count, wait again
+struct Parked {
+    FramePool *pool;
+    Mailbox<int> box;
+    uint64_t count = 0;
+    Flow flow;
+    FramePool *frame_pool() const { return pool; }
+    Flow run() {
+        for (;;)
+            count += (uint64_t)co_await box.next();
+    }
+};
+
+size_t heap_in_use() {
+    struct mallinfo2 m = mallinfo2();
+    return m.uordblks + m.hblkhd;
+}
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+double bare_resume_ns(size_t count, size_t rounds) {
+    FramePool pool;
+    std::vector<std::unique_ptr<Parked>> parked;
+    parked.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        parked.push_back(std::unique_ptr<Parked>(new Parked{&pool, {}, 0, {}}));
+        parked.back()->flow = parked.back()->run();
+    }
+    Clock::time_point begin = Clock::now();
+    for (size_t r = 0; r < rounds; r++)
+        for (auto &p : parked)
+            p->box.deliver(1);
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+    return ns / (double)(count * rounds);
+}
+
+double record_ns(size_t events) {
+    FlightRecorder recorder(1 << 16);
+    Clock::time_point begin = Clock::now();
+    for (size_t i = 0; i < events; i++)
+        recorder.record(FE_TX, (uint32_t)i, i, 3);
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+    return ns / (double)events;
+}
+
+void run_one(const Params &p, const std::string &kind, size_t count) {
+    // every packet moves the transfer one block on; stay clear of the 16 bit wrap
+    size_t rounds = std::max<size_t>(1, std::min<size_t>(p.packets / count, 60000));
+    EventLoop loop;
+    LoopNet net;
+    FramePool frames;
+    TransferOptions opts;
+    opts.blksize = p.blksize;
+    struct sockaddr_in peer{};
+    peer.sin_family = AF_INET;
+    bool send = kind.compare(0, 4, "send") == 0;
+    bool flight = kind.size() > 7 && kind.compare(kind.size() - 7, 7, "+flight") == 0;
+    FlightRecorder recorder(1 << 16);
+
+    size_t heap0 = heap_in_use();
+    std::vector<std::unique_ptr<Session>> sessions;
+    sessions.reserve(count);
+    std::vector<int> socks;
+    socks.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        int sock = net.open();
+        std::unique_ptr<Session> s;
+        if (send) {
+            auto rrq = std::make_unique<SendSession>(loop, sock, peer, opts, SessionLimits{},
+                                                     std::unique_ptr<ImageSource>(new ZeroSource), false);
+            rrq->use_net(net);
+            rrq->use_frames(frames);
+            if (flight)
+                rrq->set_recorder(recorder, (uint32_t)i);
+            rrq->begin({});  // DATA 1 goes out, then it waits for ACK 1
+            s = std::move(rrq);
+        } else {
+            auto wrq = std::make_unique<ReceiveSession>(loop, sock, peer, opts, SessionLimits{},
+                                                        std::unique_ptr<ImageSink>(new NullSink), false);
+            wrq->use_net(net);
+            wrq->use_frames(frames);
+            if (flight)
+                wrq->set_recorder(recorder, (uint32_t)i);
+            wrq->begin({});  // ACK 0 goes out, then it waits for DATA 1
+            s = std::move(wrq);
+        }
+        sessions.push_back(std::move(s));
+        socks.push_back(sock);
+    }
+    size_t heap1 = heap_in_use();
+
+    std::vector<char> packet(4 + (size_t)p.blksize, 'x');
+    Clock::time_point begin = Clock::now();
+    for (size_t r = 1; r <= rounds; r++) {
+        if (send)
+            build_ack(packet.data(), (uint16_t)r);
+        else
+            build_data_header(packet.data(), (uint16_t)r);
+        size_t len = send ? 4 : packet.size();
+        for (int sock : socks)
+            net.inject(sock, packet.data(), len);
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+    size_t handled = count * rounds;
+    bool all_running = true;
+    for (auto &s : sessions)
+        all_running = all_running && !s->finished() && s->bytes() == (uint64_t)rounds * p.blksize;
+
+    printf("%s,%zu,%.0f,%.0f,%.1f,%.1f,%.1f,%s\n", kind.c_str(), count, (double)(heap1 - heap0) / (double)count,
+           (double)frames.bytes() / (double)count, ns / (double)handled, bare_resume_ns(count, rounds),
+           record_ns(handled), all_running ? "ok" : "STALLED");
+    fflush(stdout);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--kind send,receive,send+flight,receive+flight] [--sessions 1000,10000] [--packets N]"
+            " [--blksize N]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--kind") {
+            p.kinds = split(value);
+        } else if (arg == "--sessions") {
+            p.sessions.clear();
+            for (const std::string &v : split(value))
+                p.sessions.push_back((size_t)atol(v.c_str()));
+        } else if (arg == "--packets") {
+            p.packets = (size_t)atol(value.c_str());
+        } else if (arg == "--blksize") {
+            p.blksize = (uint16_t)atoi(value.c_str());
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    printf("kind,sessions,heap_bytes_per_session,frame_bytes_per_session,ns_per_packet,ns_per_bare_resume,"
+           "ns_per_flight_event,check\n");
+    for (const std::string &kind : p.kinds)
+        for (size_t count : p.sessions)
+            run_one(p, kind, count);
+    return 0;
+}
@@ -0,0 +1,302 @@
+/*
+ * Sharding benchmark: in-process servers on 127.0.0.1. An origin holds --files files
+ * of --size; --backends caching relays (relay.hpp) start with empty roots and fetch
+ * from it. Each of --rounds rounds sends --requests RRQs at once, for files picked
+ * uniformly at random (the same sequence for every mode), and then waits for them.
+ *
+ *   --backends 4  --files 32  --size 1M  --requests 128  --rounds 3  --mode spread,hash
+ *   --blksize 1428  --windowsize 8  --workers 1
+ *
+ * Modes:
+ *   spread  clients go straight to the backends in turn, as behind a plain load
+ *           balancer, so every backend ends up caching most files
+ *   hash    clients go to a front end with ServerConfig::shards set, which relays each
+ *           RRQ to the backend its filename hashes to (shard.hpp)
+ *
+ * Each mode prints a CSV row per backend and an "all" row: RRQs it served, how many it
+ * had cached (hits) or had to fetch or join a fetch for (misses), the hit rate, bytes
+ * it fetched from the origin, files in its root at the end, and the mode's wall time
+ * and failed or corrupted transfers.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ftw.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Params {
+    int backends = 4;
+    int files = 32;
+    size_t size = 1 << 20;
+    int requests = 128;
+    int rounds = 3;
+    std::vector<std::string> modes = {"spread", "hash"};
+    uint16_t blksize = 1428;
+    uint16_t windowsize = 8;
+    int workers = 1;
+};
+
+using Clock = std::chrono::steady_clock;
+
+size_t parse_size(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'K': case 'k': v *= 1 << 10; break;
+    case 'M': case 'm': v *= 1 << 20; break;
+    }
+    return (size_t)v;
+}
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> out;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ','))
+        out.push_back(item);
+    return out;
+}
+
+std::string make_data(size_t size, int seed) {
+    std::string data(size, '\0');
+    uint64_t x = 0x9e3779b97f4a7c15ull ^ (uint64_t)seed;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (char)x;
+    }
+    return data;
+}
+
+bool write_file(const std::string &path, const std::string &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+std::string file_name(int i) {
+    return "image" + std::to_string(i) + ".bin";
+}
+
+std::string make_root(const char *what) {
+    std::string tmpl = std::string("/tmp/turbotftp-") + what + "-XXXXXX";
+    if (!mkdtemp(tmpl.data())) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    return tmpl;
+}
+
+int remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+    return remove(path);
+}
+
+void remove_tree(const std::string &root) {
+    nftw(root.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int counted;
+
+int count_entry(const char *, const struct stat *, int type, struct FTW *) {
+    if (type == FTW_F)
+        counted++;
+    return 0;
+}
+
+// Regular files under root
+int files_in(const std::string &root) {
+    counted = 0;
+    nftw(root.c_str(), count_entry, 16, FTW_PHYS);
+    return counted;
+}
+
+// Servers run start() on a thread of their own
+struct Running {
+    TFTPServer server;
+    std::thread thread;
+    explicit Running(const ServerConfig &config) : server(config), thread([this] { server.start(); }) {}
+    ~Running() {
+        server.stop();
+        thread.join();
+    }
+};
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--backends N] [--files N] [--size 1M] [--requests N] [--rounds N] [--mode spread,hash]"
+            " [--blksize N] [--windowsize N] [--workers N]\n",
+            prog);
+}
+
+void run_mode(const Params &p, const std::string &mode, uint16_t origin_port, const std::vector<std::string> &contents) {
+    std::vector<std::string> roots;
+    std::vector<std::unique_ptr<Running>> backends;
+    std::vector<std::string> addresses;
+    for (int b = 0; b < p.backends; b++) {
+        roots.push_back(make_root("shard"));
+        ServerConfig config;
+        config.root = roots.back();
+        config.port = 0;
+        config.workers = p.workers;
+        config.allow_write = false;
+        config.upstream = "127.0.0.1:" + std::to_string(origin_port);
+        config.upstream_blksize = p.blksize;
+        config.upstream_windowsize = p.windowsize;
+        backends.push_back(std::make_unique<Running>(config));
+        addresses.push_back("127.0.0.1:" + std::to_string(backends.back()->server.port()));
+    }
+    std::unique_ptr<Running> front;
+    if (mode == "hash") {
+        ServerConfig config;
+        config.port = 0;
+        config.workers = p.workers;
+        config.shards = addresses;
+        front = std::make_unique<Running>(config);
+    }
+
+    EventLoop loop;
+    std::vector<std::unique_ptr<AsyncTFTPClient>> clients;
+    for (int b = 0; b < (front ? 1 : p.backends); b++) {
+        ClientOptions options;
+        options.port = front ? front->server.port() : backends[(size_t)b]->server.port();
+        options.blksize = p.blksize;
+        options.windowsize = p.windowsize;
+        clients.push_back(std::make_unique<AsyncTFTPClient>(loop, "127.0.0.1", options));
+    }
+    uint64_t pick = 0x853c49e6748fea9bull;
+    int failures = 0, corrupt = 0;
+    std::vector<std::string> got((size_t)p.requests);
+    Clock::time_point begin = Clock::now();
+    for (int round = 0; round < p.rounds; round++) {
+        int running = 0;
+        for (int r = 0; r < p.requests; r++) {
+            pick = pick * 6364136223846793005ull + 1442695040888963407ull;
+            int f = (int)((pick >> 33) % (uint64_t)p.files);
+            std::string &out = got[(size_t)r];
+            running++;
+            clients[(size_t)r % clients.size()]->get(file_name(f), std::make_unique<MemorySink>(out),
+                                                    [&, f](const TransferResult &t) {
+                                                        running--;
+                                                        if (!t.ok)
+                                                            failures++;
+                                                        else if (out != contents[(size_t)f])
+                                                            corrupt++;
+                                                        out.clear();
+                                                    });
+        }
+        while (running > 0)
+            loop.run_once(100);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    uint64_t all_hits = 0, all_misses = 0, all_upstream = 0;
+    int all_files = 0;
+    for (int b = 0; b <= p.backends; b++) {
+        uint64_t hits = all_hits, misses = all_misses, upstream = all_upstream;
+        int files = all_files;
+        std::string name = "all";
+        if (b < p.backends) {
+            MetricsSnapshot m = backends[(size_t)b]->server.metrics();
+            hits = m.relay_hits;
+            misses = m.relay_fetches + m.relay_joined;
+            upstream = m.relay_upstream_bytes;
+            files = files_in(roots[(size_t)b]);
+            name = std::to_string(b);
+            all_hits += hits;
+            all_misses += misses;
+            all_upstream += upstream;
+            all_files += files;
+        }
+        printf("%s,%s,%llu,%llu,%llu,%.3f,%llu,%d,%.3f,%d,%d\n", mode.c_str(), name.c_str(),
+               (unsigned long long)(hits + misses), (unsigned long long)hits, (unsigned long long)misses,
+               hits + misses ? (double)hits / (double)(hits + misses) : 0.0, (unsigned long long)upstream, files,
+               seconds, failures, corrupt);
+    }
+    fflush(stdout);
+    clients.clear();
+    front.reset();
+    backends.clear();
+    for (const std::string &root : roots)
+        remove_tree(root);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--backends") {
+            p.backends = atoi(value.c_str());
+        } else if (arg == "--files") {
+            p.files = atoi(value.c_str());
+        } else if (arg == "--size") {
+            p.size = parse_size(value);
+        } else if (arg == "--requests") {
+            p.requests = atoi(value.c_str());
+        } else if (arg == "--rounds") {
+            p.rounds = atoi(value.c_str());
+        } else if (arg == "--mode") {
+            p.modes = split(value);
+        } else if (arg == "--blksize") {
+            p.blksize = (uint16_t)atoi(value.c_str());
+        } else if (arg == "--windowsize") {
+            p.windowsize = (uint16_t)atoi(value.c_str());
+        } else if (arg == "--workers") {
+            p.workers = atoi(value.c_str());
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    for (const std::string &mode : p.modes) {
+        if (mode != "spread" && mode != "hash") {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    std::string origin_root = make_root("origin");
+    std::vector<std::string> contents;
+    for (int i = 0; i < p.files; i++) {
+        contents.push_back(make_data(p.size, i));
+        if (!write_file(origin_root + "/" + file_name(i), contents.back())) {
+            perror(origin_root.c_str());
+            return 1;
+        }
+    }
+
+    {
+        ServerConfig origin_config;
+        origin_config.root = origin_root;
+        origin_config.port = 0;
+        origin_config.workers = p.workers;
+        origin_config.allow_write = false;
+        Running origin(origin_config);
+
+        printf("mode,backend,rrq,hits,misses,hit_rate,upstream_bytes,files_cached,seconds,failures,corrupt\n");
+        for (const std::string &mode : p.modes)
+            run_mode(p, mode, origin.server.port(), contents);
+    }
+
+    remove_tree(origin_root);
+    return 0;
+}
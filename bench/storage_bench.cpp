@@ -0,0 +1,253 @@
+/*
+ * Storage offload benchmark: a one-worker in-process server on 127.0.0.1 whose root
+ * holds --images packed images of --image-size without their .idx sidecars, so the
+ * first open of each one inflates all of it to find its members, and serving it
+ * inflates each member again on its cache miss. A heavy client reads them whole,
+ * --heavy at a time; a victim client fetches a small config.txt back to back on the
+ * same worker meanwhile. Compares opening and inflating on the worker with
+ * ServerConfig::storage_threads.
+ *
+ *   --mode inline,offload  --threads 2  --images 8  --image-size 8M  --heavy 2
+ *
+ * Each mode prints a CSV row: victim fetch latency p50/p99/max, the worker loop's
+ * longest rounds (tftp_loop_stall_seconds) as p99/max, and the members inflated.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+
+struct Params {
+    std::vector<std::string> modes{"inline", "offload"};
+    size_t threads = 2;
+    int images = 8;
+    size_t image_size = 8 << 20;
+    int heavy = 2;
+};
+
+using Clock = std::chrono::steady_clock;
+
+class NullSink : public ImageSink {
+public:
+    bool write(const char *, size_t) override { return true; }
+    bool commit() override { return true; }
+    void abort() override {}
+};
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+size_t parse_size(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'K': case 'k': v *= 1 << 10; break;
+    case 'M': case 'm': v *= 1 << 20; break;
+    }
+    return (size_t)v;
+}
+
+// Text-like bytes, which inflate at about the speed firmware images do
+std::string make_data(size_t size) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 \n";
+    std::string data(size, '\0');
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = alphabet[x & 63];
+    }
+    return data;
+}
+
+// Independent gzip members of 1 MiB each, like `split -b 1M --filter=gzip`
+std::string gzip_members(const std::string &data) {
+    std::string out;
+    for (size_t off = 0; off < data.size(); off += 1 << 20) {
+        size_t len = std::min<size_t>(1 << 20, data.size() - off);
+        z_stream z{};
+        deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        std::string member(deflateBound(&z, len), '\0');
+        z.next_in = (Bytef *)data.data() + off;
+        z.avail_in = (uInt)len;
+        z.next_out = (Bytef *)&member[0];
+        z.avail_out = (uInt)member.size();
+        deflate(&z, Z_FINISH);
+        member.resize(z.total_out);
+        deflateEnd(&z);
+        out += member;
+    }
+    return out;
+}
+
+bool write_file(const std::string &path, const std::string &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+std::string image_name(int i) {
+    return "image" + std::to_string(i) + ".bin";
+}
+
+void run_one(const std::string &root, const Params &p, const std::string &mode) {
+    // every mode starts without sidecars, so every first open does the index pass
+    for (int i = 0; i < p.images; i++)
+        unlink((root + "/" + image_name(i) + ".gz.idx").c_str());
+    ServerConfig config;
+    config.root = root;
+    config.port = 0;
+    config.workers = 1;
+    config.allow_write = false;
+    config.storage_threads = mode == "offload" ? p.threads : 0;
+    TFTPServer server(config);
+    std::thread server_thread([&] { server.start(); });
+
+    std::vector<double> latencies;
+    int failures = 0, heavy_failures = 0;
+    {
+        EventLoop loop;
+        ClientOptions options;
+        options.port = server.port();
+        AsyncTFTPClient victim(loop, "127.0.0.1", options);
+        // large blocks, so the images are read in about the time they take to inflate
+        ClientOptions bulk = options;
+        bulk.blksize = 8192;
+        bulk.windowsize = 16;
+        AsyncTFTPClient heavy(loop, "127.0.0.1", bulk);
+        int next_image = 0;
+        int heavy_running = 0;
+        std::function<void()> open_next = [&] {
+            if (next_image >= p.images)
+                return;
+            heavy_running++;
+            heavy.get(image_name(next_image++), std::unique_ptr<ImageSink>(new NullSink),
+                      [&](const TransferResult &r) {
+                          heavy_running--;
+                          if (!r.ok)
+                              heavy_failures++;
+                          open_next();
+                      });
+        };
+        std::function<void()> fetch = [&] {
+            Clock::time_point begin = Clock::now();
+            victim.get("config.txt", std::unique_ptr<ImageSink>(new NullSink), [&, begin](const TransferResult &r) {
+                if (r.ok)
+                    latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+                else
+                    failures++;
+                if (heavy_running > 0)
+                    fetch();
+            });
+        };
+        for (int i = 0; i < p.heavy; i++)
+            open_next();
+        fetch();
+        while (heavy_running > 0)
+            loop.run_once(100);
+        // let the last fetch finish
+        while (victim.active() > 0)
+            loop.run_once(100);
+    }
+    MetricsSnapshot m = server.metrics();
+    server.stop();
+    server_thread.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto at = [&](double q) { return latencies.empty() ? 0 : latencies[(size_t)((double)(latencies.size() - 1) * q)]; };
+    printf("%s,%zu,%zu,%d,%d,%.1f,%.1f,%.1f,%llu,%llu,%llu,%llu\n", mode.c_str(), config.storage_threads,
+           latencies.size(), failures, heavy_failures, at(0.5), at(0.99), latencies.empty() ? 0 : latencies.back(),
+           (unsigned long long)m.loop_stall.quantile(0.99), (unsigned long long)m.loop_stall.quantile(1.0),
+           (unsigned long long)m.storage_jobs, (unsigned long long)m.image_cache_misses);
+    fflush(stdout);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--mode inline,offload] [--threads N] [--images N] [--image-size 8M] [--heavy N]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--mode") {
+            p.modes = split(value);
+        } else if (arg == "--threads") {
+            p.threads = (size_t)atol(value.c_str());
+        } else if (arg == "--images") {
+            p.images = atoi(value.c_str());
+        } else if (arg == "--image-size") {
+            p.image_size = parse_size(value);
+        } else if (arg == "--heavy") {
+            p.heavy = atoi(value.c_str());
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    char tmpl[] = "/tmp/turbotftp-storage-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = tmpl;
+    // one packed image under many names: each name is its own image to the server
+    std::string first = root + "/" + image_name(0) + ".gz";
+    if (!write_file(root + "/config.txt", std::string(1 << 10, 'c')) ||
+        !write_file(first, gzip_members(make_data(p.image_size)))) {
+        perror(root.c_str());
+        return 1;
+    }
+    for (int i = 1; i < p.images; i++) {
+        if (link(first.c_str(), (root + "/" + image_name(i) + ".gz").c_str()) < 0) {
+            perror("link");
+            return 1;
+        }
+    }
+
+    printf("mode,storage_threads,fetches,failures,image_failures,p50_us,p99_us,max_us,loop_stall_p99_us,"
+           "loop_stall_max_us,storage_jobs,image_cache_misses\n");
+    for (const std::string &mode : p.modes)
+        run_one(root, p, mode);
+
+    unlink((root + "/config.txt").c_str());
+    for (int i = 0; i < p.images; i++) {
+        unlink((root + "/" + image_name(i) + ".gz").c_str());
+        unlink((root + "/" + image_name(i) + ".gz.idx").c_str());
+    }
+    rmdir(root.c_str());
+    return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * AF_XDP benchmark: the server on one end of a veth pair, --concurrency clients in
+ * a network namespace on the other, fetching a --size file back to back for
+ * --seconds. Compares the regular socket path (shared sockets, so only the datapath
+ * differs) with ServerConfig::xdp_interface in generic mode.
+ *
+ * Needs root. Creates the namespace tftpx and veth pair tftpx0 (10.201.0.1, the
+ * server's) / tftpx1 (10.201.0.2), and removes them when done.
+ *
+ *   --mode socket,xdp  --concurrency 8 --seconds 3 --size 1M
+ *   --blksize 1428 --windowsize 16 --shared 4
+ *
+ * Packets are those on tftpx0 both ways. CPU is the server worker's thread time and
+ * the whole process's (server and clients), which also covers most of the softirq
+ * work veth does in whichever thread sends; on a quiet machine the second is the
+ * cost of the packets to the host. Each mode prints a CSV row: transfers, MB/s,
+ * packets/s, worker and process CPU seconds, and packets per second of each.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+const char *NETNS = "tftpx";
+const char *SERVER_IF = "tftpx0";
+const char *CLIENT_IF = "tftpx1";
+const char *SERVER_ADDR = "10.201.0.1";
+const char *CLIENT_ADDR = "10.201.0.2";
+
+struct Params {
+    std::vector<std::string> modes{"socket", "xdp"};
+    int concurrency = 8;
+    double seconds = 3;
+    size_t size = 1 << 20;
+    uint16_t blksize = 1428;
+    uint16_t windowsize = 16;
+    int shared = 4;
+};
+
+using Clock = std::chrono::steady_clock;
+
+class NullSink : public ImageSink {
+public:
+    bool write(const char *, size_t) override { return true; }
+    bool commit() override { return true; }
+    void abort() override {}
+};
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ','))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+size_t parse_size(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'K': case 'k': v *= 1 << 10; break;
+    case 'M': case 'm': v *= 1 << 20; break;
+    case 'G': case 'g': v *= 1 << 30; break;
+    }
+    return (size_t)v;
+}
+
+bool sh(const std::string &command) { return system((command + " >/dev/null 2>&1").c_str()) == 0; }
+
+void teardown() {
+    sh(std::string("ip link del ") + SERVER_IF);
+    sh(std::string("ip netns del ") + NETNS);
+}
+
+bool setup() {
+    teardown();
+    std::string ns = std::string("ip netns exec ") + NETNS + " ";
+    return sh(std::string("ip netns add ") + NETNS) &&
+           sh(std::string("ip link add ") + SERVER_IF + " type veth peer name " + CLIENT_IF) &&
+           sh(std::string("ip link set ") + CLIENT_IF + " netns " + NETNS) &&
+           sh(std::string("ip addr add ") + SERVER_ADDR + "/24 dev " + SERVER_IF) &&
+           sh(std::string("ip link set ") + SERVER_IF + " up") &&
+           sh(ns + "ip addr add " + CLIENT_ADDR + "/24 dev " + CLIENT_IF) &&
+           sh(ns + "ip link set " + CLIENT_IF + " up") && sh(ns + "ip link set lo up");
+}
+
+uint64_t if_counter(const char *name) {
+    std::string path = std::string("/sys/class/net/") + SERVER_IF + "/statistics/" + name;
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return 0;
+    unsigned long long v = 0;
+    if (fscanf(f, "%llu", &v) != 1)
+        v = 0;
+    fclose(f);
+    return v;
+}
+
+uint64_t packets() { return if_counter("rx_packets") + if_counter("tx_packets"); }
+
+double cpu_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void run_one(const std::string &root, const Params &p, const std::string &mode) {
+    ServerConfig config;
+    config.root = root;
+    config.port = 0;
+    config.workers = 1;
+    config.allow_write = false;
+    config.shared_sockets = p.shared;
+    if (mode == "xdp")
+        config.xdp_interface = SERVER_IF;
+    TFTPServer server(config);
+    std::thread server_thread([&] { server.start(); });
+    clockid_t worker_clock;
+    pthread_getcpuclockid(server_thread.native_handle(), &worker_clock);
+
+    uint64_t transfers = 0, failures = 0;
+    uint64_t packets0 = packets();
+    double worker0 = cpu_seconds(worker_clock), process0 = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    Clock::time_point begin = Clock::now();
+    // the clients' sockets belong to the namespace of the thread that opens them
+    std::thread clients([&] {
+        int ns = open((std::string("/var/run/netns/") + NETNS).c_str(), O_RDONLY | O_CLOEXEC);
+        if (ns < 0 || setns(ns, CLONE_NEWNET) < 0) {
+            perror("setns");
+            return;
+        }
+        close(ns);
+        EventLoop loop;
+        ClientOptions options;
+        options.port = server.port();
+        options.blksize = p.blksize;
+        options.windowsize = p.windowsize;
+        AsyncTFTPClient client(loop, SERVER_ADDR, options);
+        Clock::time_point deadline = begin + std::chrono::duration_cast<Clock::duration>(
+                                                 std::chrono::duration<double>(p.seconds));
+        std::function<void()> fetch = [&] {
+            client.get("image.bin", std::unique_ptr<ImageSink>(new NullSink), [&](const TransferResult &r) {
+                (r.ok ? transfers : failures)++;
+                if (Clock::now() < deadline)
+                    fetch();
+            });
+        };
+        for (int i = 0; i < p.concurrency; i++)
+            fetch();
+        while (client.active() > 0)
+            loop.run_once(100);
+    });
+    clients.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    double worker = cpu_seconds(worker_clock) - worker0;
+    double process = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - process0;
+    double pps = (double)(packets() - packets0) / seconds;
+    server.stop();
+    server_thread.join();
+
+    printf("%s,%d,%llu,%llu,%.1f,%.0f,%.2f,%.2f,%.0f,%.0f\n", mode.c_str(), p.concurrency,
+           (unsigned long long)transfers, (unsigned long long)failures,
+           (double)(transfers * p.size) / seconds / 1e6, pps, worker, process,
+           worker > 0 ? pps * seconds / worker : 0, process > 0 ? pps * seconds / process : 0);
+    fflush(stdout);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--mode socket,xdp] [--concurrency N] [--seconds S] [--size 1M]\n"
+            "          [--blksize N] [--windowsize N] [--shared N]\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Params p;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--mode")
+            p.modes = split(value);
+        else if (arg == "--concurrency")
+            p.concurrency = atoi(value.c_str());
+        else if (arg == "--seconds")
+            p.seconds = atof(value.c_str());
+        else if (arg == "--size")
+            p.size = parse_size(value);
+        else if (arg == "--blksize")
+            p.blksize = (uint16_t)atoi(value.c_str());
+        else if (arg == "--windowsize")
+            p.windowsize = (uint16_t)atoi(value.c_str());
+        else if (arg == "--shared")
+            p.shared = atoi(value.c_str());
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (!setup()) {
+        fprintf(stderr, "cannot create the veth pair and namespace (needs root and iproute2)\n");
+        teardown();
+        return 1;
+    }
+    char tmpl[] = "/tmp/turbotftp-xdp-XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        teardown();
+        return 1;
+    }
+    std::string root = tmpl;
+    std::string path = root + "/image.bin";
+    FILE *f = fopen(path.c_str(), "wb");
+    std::string data(p.size, 'x');
+    if (!f || fwrite(data.data(), 1, data.size(), f) != data.size() || fclose(f) != 0) {
+        perror(path.c_str());
+        teardown();
+        return 1;
+    }
+
+    printf("mode,concurrency,transfers,failures,mb_per_s,packets_per_s,worker_cpu_s,process_cpu_s,"
+           "packets_per_worker_cpu_s,packets_per_process_cpu_s\n");
+    for (const std::string &mode : p.modes) {
+        try {
+            run_one(root, p, mode);
+        } catch (const std::exception &e) {
+            fprintf(stderr, "%s: %s\n", mode.c_str(), e.what());
+        }
+    }
+    unlink(path.c_str());
+    rmdir(root.c_str());
+    teardown();
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Binary access log: a record for every request, rejection and finished transfer,
+ * cheap enough to keep on at full request rate. Each worker thread writes into a
+ * ring of its own with a few plain stores and one release store; nothing is
+ * formatted and no lock is taken on the packet path. A writer thread drains the
+ * rings every flush interval and appends the records to the file as they are.
+ * tftp_logdump turns the file back into text.
+ *
+ * File: AccessLogHeader, then 128 byte AccessRecords. Every process appending to
+ * the file starts with an AR_OPEN record and adds an AR_CLOCK record per flush; both
+ * pair a TSC reading with the wall clock, so the decoder converts the timestamps
+ * of the records around them. Records of different workers are in drain order,
+ * not strictly in time order.
+*/
+
+#ifndef TFTP_ACCESS_LOG_HPP
+#define TFTP_ACCESS_LOG_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "flight_recorder.hpp"
+
+enum AccessRecordType : uint8_t {
+    AR_OPEN = 1,        // a process started appending: tsc and wall clock, pid in duration_us
+    AR_CLOCK = 2,       // tsc and wall clock, for converting the records around it
+    AR_REQUEST = 3,     // RRQ/WRQ arrived
+    AR_REJECTED = 4,    // answered with an ERROR instead of a transfer, code = the ERROR code
+    AR_DONE_OK = 5,     // transfer finished: bytes, duration from its request
+    AR_DONE_FAILED = 6,
+};
+
+enum AccessRecordFlags : uint8_t {
+    AF_NETASCII = 1,
+    AF_TRUNCATED = 2,   // the filename did not fit in name
+};
+
+struct AccessRecord {
+    uint64_t tsc;           // flight_tsc() when it happened
+    uint64_t bytes;         // AR_DONE_*: payload moved; AR_OPEN/AR_CLOCK: CLOCK_REALTIME ns at tsc
+    uint32_t duration_us;   // AR_DONE_*: request to end
+    uint32_t addr;          // client IPv4, network order
+    uint16_t port;          // client port
+    uint16_t code;          // AR_REJECTED: TFTP error code
+    uint16_t blksize;       // AR_DONE_*: negotiated
+    uint16_t windowsize;
+    uint8_t type;           // AccessRecordType
+    uint8_t op;             // 1 RRQ, 2 WRQ, 0 unknown
+    uint8_t worker;
+    uint8_t flags;          // AccessRecordFlags
+    uint8_t name_len;
+    char name[91];          // not NUL terminated
+};
+static_assert(sizeof(AccessRecord) == 128, "AccessRecord is written to disk as is");
+
+struct AccessLogHeader {
+    char magic[8];          // "TTACCESS"
+    uint32_t version;       // 1
+    uint32_t record_size;   // sizeof(AccessRecord)
+};
+
+class AccessLog {
+public:
+    // One producer thread's records
+    class Ring {
+    public:
+        explicit Ring(size_t capacity);
+
+        // Producer only: fill(record) on the next free slot, which starts zeroed apart
+        // from tsc; false, and nothing recorded, while the ring is full
+        template <class Fill>
+        bool log(Fill fill) {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            if (h - tail_seen > mask) {
+                tail_seen = tail.load(std::memory_order_acquire);
+                if (h - tail_seen > mask)
+                    return false;
+            }
+            AccessRecord &r = slots[h & mask];
+            memset(static_cast<void *>(&r), 0, offsetof(AccessRecord, name));
+            r.tsc = flight_tsc();
+            fill(r);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        friend class AccessLog;
+        uint64_t mask;
+        std::unique_ptr<AccessRecord[]> slots;
+        alignas(64) std::atomic<uint64_t> head{0};
+        uint64_t tail_seen = 0;     // producer's copy of tail
+        alignas(64) std::atomic<uint64_t> tail{0};
+    };
+
+    struct Stats {
+        uint64_t records = 0;   // appended to the file
+        uint64_t bytes = 0;
+        uint64_t write_errors = 0;
+    };
+
+    // Opens (appends to) path and starts the writer; throws std::runtime_error if
+    // path cannot be opened or holds something else
+    explicit AccessLog(const std::string &path, uint32_t flush_ms = 100);
+    // Drains every ring one last time
+    ~AccessLog();
+    AccessLog(const AccessLog &) = delete;
+    AccessLog &operator=(const AccessLog &) = delete;
+
+    // A ring for one producer thread, records rounded up to a power of two; lives
+    // as long as the log. Any thread
+    Ring &ring(size_t capacity = 8192);
+    // Wakes the writer and waits until everything logged before the call is written
+    void flush();
+    Stats stats() const;
+
+    // Copies name into r, cut to fit
+    static void set_name(AccessRecord &r, const std::string &name) {
+        size_t n = name.size();
+        if (n > sizeof(r.name)) {
+            n = sizeof(r.name);
+            r.flags |= AF_TRUNCATED;
+        }
+        memcpy(r.name, name.data(), n);
+        r.name_len = (uint8_t)n;
+    }
+
+private:
+    int fd = -1;
+    uint32_t flush_ms;
+    std::mutex mutex;               // rings, the writer's wake-ups and flush()
+    std::condition_variable wake;
+    std::condition_variable flushed;
+    std::vector<std::unique_ptr<Ring>> rings;
+    uint64_t flush_requests = 0;
+    uint64_t flushes_done = 0;
+    bool stopping = false;
+    std::atomic<uint64_t> records_written{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> errors{0};
+    std::vector<AccessRecord> batch;
+    std::thread writer;
+
+    void run();
+    // Appends what every ring holds plus a clock record; writer thread. Returns how
+    // full the fullest ring was, 0 to 1
+    double drain();
+    void append_clock(uint8_t type);
+};
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Non-blocking client for embedding: transfers run as sessions on an EventLoop the
+ * caller owns and drives, so one thread can keep thousands of gets and puts in flight.
+ * Data goes to / comes from any ImageSink / ImageSource (MemorySink, FileSink, ...).
+ *
+ *   EventLoop loop;
+ *   AsyncTFTPClient tftp(loop, "10.0.0.1");
+ *   std::string config;
+ *   tftp.get("switch1.cfg", std::make_unique<MemorySink>(config), [&](const TransferResult &r) { ... });
+ *   loop.run();
+ *
+ * Completions are posted to the loop, never called from inside get()/put(). All calls
+ * must be made on the loop's thread (use EventLoop::post from elsewhere).
+ *
+ * With C++20 the same transfers can be awaited from a coroutine:
+ *
+ *   DetachedTask fetch(AsyncTFTPClient &tftp, std::string &out) {
+ *       TransferResult r = co_await tftp.get_async("switch1.cfg", std::make_unique<MemorySink>(out));
+ *   }
+*/
+
+#ifndef TFTP_ASYNC_CLIENT_HPP
+#define TFTP_ASYNC_CLIENT_HPP
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <netinet/in.h>
+#include "client.hpp"
+#include "event_loop.hpp"
+#include "session.hpp"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#define TURBOTFTP_COROUTINES 1
+#endif
+
+struct TransferResult {
+    uint64_t id = 0;
+    bool ok = false;
+    std::string error;      // peer's ERROR message or local reason when !ok
+    int error_code = -1;    // peer's ERROR code, -1 when it sent none
+    uint64_t bytes = 0;     // payload moved
+    TransferOptions options; // what the server granted (tsize on a get when it sent one)
+};
+
+class AsyncTFTPClient {
+public:
+    using Callback = std::function<void(const TransferResult &)>;
+
+    AsyncTFTPClient(EventLoop &loop, const std::string &server_ip);
+    AsyncTFTPClient(EventLoop &loop, const std::string &server_ip, const ClientOptions &options);
+    // Cancels whatever is still running; their callbacks are not called. Coroutines
+    // awaiting get_async/put_async still resume, from the loop, with a failed result
+    // ("Client destroyed") and must not use the client again
+    ~AsyncTFTPClient();
+
+    // Starts a download into sink and returns its id; done runs once it has finished.
+    // on_negotiated sees the server's reply before the first byte reaches sink (the
+    // tsize it granted, say); returning false cancels the transfer
+    uint64_t get(const std::string &filename, std::unique_ptr<ImageSink> sink, Callback done,
+                 std::function<bool(Session &)> on_negotiated = nullptr);
+    // Starts an upload of source and returns its id
+    uint64_t put(const std::string &filename, std::unique_ptr<ImageSource> source, Callback done);
+    // Fails a running transfer with "Transfer cancelled"; false if it is not running
+    bool cancel(uint64_t id);
+    // Transfers started and not yet completed
+    size_t active() const { return sessions.size(); }
+    // Commit downloads on pool, queued by hint, instead of on the loop (see
+    // Session::use_storage). Call before starting transfers; pool must outlive them
+    void use_storage(StoragePool &pool, size_t hint) {
+        storage = &pool;
+        storage_hint = hint;
+    }
+
+#ifdef TURBOTFTP_COROUTINES
+    class Awaiter;
+    // co_await-able forms of get/put, resuming on the loop thread with the result
+    Awaiter get_async(const std::string &filename, std::unique_ptr<ImageSink> sink);
+    Awaiter put_async(const std::string &filename, std::unique_ptr<ImageSource> source);
+#endif
+
+private:
+    struct Transfer {
+        std::unique_ptr<Session> session;
+        Callback done;
+        bool awaited;           // done resumes a coroutine, so it runs even once the client is gone
+    };
+
+    EventLoop &loop;
+    struct sockaddr_in server;
+    ClientOptions options;
+    DatagramNet &net;
+    uint64_t next_id = 1;
+    BufferPool buffers;         // shared by this client's sessions, so declared before them
+    FramePool frames;           // likewise, for their coroutine frames
+    DallyList dally{loop};      // TIDs of finished gets
+    StoragePool *storage = nullptr;
+    size_t storage_hint = 0;
+    std::unordered_map<uint64_t, Transfer> sessions;
+    // posted completions check this so they do nothing once the client is gone
+    std::shared_ptr<bool> alive = std::make_shared<bool>(true);
+
+    std::vector<char> make_request(uint16_t op, const std::string &filename, uint64_t tsize) const;
+    uint64_t start_get(const std::string &filename, std::unique_ptr<ImageSink> sink, Callback done,
+                       std::function<bool(Session &)> on_negotiated, bool awaited);
+    uint64_t start_put(const std::string &filename, std::unique_ptr<ImageSource> source, Callback done,
+                       bool awaited);
+    uint64_t start(uint64_t id, std::unique_ptr<Session> session, Callback done, bool awaited);
+    // Reports a transfer that could not start, from the loop like any other completion
+    uint64_t fail(const std::string &reason, Callback done, bool awaited);
+    static TransferResult result_of(uint64_t id, const Session &session);
+};
+
+#ifdef TURBOTFTP_COROUTINES
+class AsyncTFTPClient::Awaiter {
+public:
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        auto done = [this, handle](const TransferResult &r) {
+            result = r;
+            handle.resume();
+        };
+        if (!upload)
+            client.start_get(filename, std::move(sink), done, nullptr, true);
+        else
+            client.start_put(filename, std::move(source), done, true);
+    }
+    TransferResult await_resume() { return std::move(result); }
+
+private:
+    friend class AsyncTFTPClient;
+    Awaiter(AsyncTFTPClient &client, const std::string &filename, std::unique_ptr<ImageSink> sink,
+            std::unique_ptr<ImageSource> source)
+        : client(client), filename(filename), upload(source != nullptr), sink(std::move(sink)),
+          source(std::move(source)) {}
+
+    AsyncTFTPClient &client;
+    std::string filename;
+    bool upload;
+    std::unique_ptr<ImageSink> sink;
+    std::unique_ptr<ImageSource> source;
+    TransferResult result;
+};
+
+// Fire-and-forget coroutine: runs eagerly and frees itself when it returns
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+#endif
+
+#endif  // TFTP_ASYNC_CLIENT_HPP
@@ -0,0 +1,98 @@
+/*
+ * Content-addressed store for deduplicated uploads. A WRQ is cut into fixed size
+ * chunks; each chunk is hashed (hash128) and written once under
+ * <root>/.chunks/<2 hex>/<30 hex>. hash128 is fast, not collision resistant, so a
+ * chunk is only shared with one already stored under its hash if the bytes are the
+ * same; a chunk whose hash is taken by other bytes fails the upload. The upload
+ * itself becomes a small manifest, <name>.chunks, listing its chunks in order,
+ * which ImageStore::open() serves back. Chunks are written without an fsync each:
+ * the upload's commit syncs the filesystem once, then saves the manifest.
+ *
+ * Aborted uploads and overwritten or deleted manifests leave chunks nothing refers
+ * to; sweep() removes them. Chunks of uploads in progress and of manifests being
+ * served are pinned, so a sweep running meanwhile leaves them alone.
+*/
+
+#ifndef TFTP_CHUNK_STORE_HPP
+#define TFTP_CHUNK_STORE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "hash.hpp"
+#include "image_store.hpp"
+
+struct ChunkManifest {
+    struct Entry {
+        Hash128 hash;
+        uint64_t offset;
+        uint32_t len;
+    };
+    uint64_t size = 0;
+    std::vector<Entry> entries;
+
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+};
+
+class ChunkStore {
+public:
+    struct Stats {
+        uint64_t logical_bytes;   // bytes uploaded
+        uint64_t stored_bytes;    // bytes of chunks that were new
+        uint64_t chunks;
+        uint64_t unique_chunks;
+        uint64_t hash_ns;         // time spent hashing on the WRQ path
+        uint64_t swept_chunks;    // removed by sweep()
+        uint64_t swept_bytes;
+
+        double dedup_ratio() const { return stored_bytes ? (double)logical_bytes / stored_bytes : 1.0; }
+        double hash_mbps() const { return hash_ns ? logical_bytes * 1e3 / hash_ns : 0.0; }
+    };
+
+    explicit ChunkStore(const std::string &root, size_t chunk_size = 64 << 10);
+
+    // Hashes and stores one chunk unless an identical one exists; false with errno
+    // EEXIST if different bytes are stored under its hash. The chunk stays pinned,
+    // even when put() fails, until unpin(). It is only durable after sync()
+    bool put(const char *data, size_t len, Hash128 &hash);
+    // Makes the chunks put() so far durable, with their directories: one syncfs of
+    // the root's filesystem rather than an fsync per chunk. Blocks; run it off the
+    // workers, as an upload's commit runs with a storage pool
+    bool sync();
+    // Counted: a chunk stays until it has been unpinned as often as it was pinned
+    void pin(const Hash128 &hash);
+    void unpin(const Hash128 &hash);
+    // Removes chunks that no manifest under the root refers to and nothing has
+    // pinned, and temporary files crashed writes left behind. Walks the whole root;
+    // run it off the workers. Returns the chunks removed
+    uint64_t sweep();
+    std::string chunk_path(const Hash128 &hash) const;
+    size_t chunk_size() const { return chunk_bytes; }
+    Stats stats() const;
+
+    // Sink that chunks an upload and writes path.chunks on commit
+    std::unique_ptr<ImageSink> create(const std::string &path);
+    // Source over an existing manifest, nullptr with errno set on failure
+    std::unique_ptr<ImageSource> open(const std::string &manifest_path);
+
+private:
+    std::string root;
+    std::string dir;
+    size_t chunk_bytes;
+    std::atomic<uint64_t> logical{0}, stored{0}, total_chunks{0}, unique{0}, hashing_ns{0};
+    std::atomic<uint64_t> swept{0}, swept_bytes{0};
+    std::mutex pin_mutex;           // pins, and a sweep's check and unlink of each chunk
+    std::unordered_map<uint64_t, uint32_t> pins;    // by Hash128::lo; a clash only keeps more
+    bool sweeping = false;
+    // unpinned while a sweep ran: its manifests may have been written after the sweep
+    // read the tree, so they stay pinned until it is done
+    std::vector<uint64_t> deferred;
+    std::mutex sweep_mutex;         // one sweep at a time
+};
+
+#endif
@@ -6,30 +6,78 @@
 #ifndef TFTP_CLIENT_HPP
 #define TFTP_CLIENT_HPP
 
+#include <functional>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 #include <netinet/in.h>
+#include "event_loop.hpp"
+#include "net.hpp"
+#include "session.hpp"
 
 #define SERVER_PORT 69      // Default UDP server port
 #define BUFFER_SIZE 516     // + 4-byte header
 
+struct ClientOptions {
+    uint16_t port = SERVER_PORT;
+    std::string mode = "octet";
+    uint16_t blksize = 0;       // 0 = do not negotiate, RFC 1350 512 byte blocks
+    uint16_t windowsize = 0;    // 0 = do not negotiate, lock-step
+    bool resume = false;        // continue partial octet transfers (offset + prefixsum options)
+    SessionLimits limits;
+    DatagramNet *net = nullptr; // transport, nullptr = kernel sockets; a SimNet host for tests
+};
+
+// Resolves an IPv4 server name; throws std::runtime_error if it cannot
+struct sockaddr_in resolve_server(const std::string &server_ip, uint16_t port);
+
 class TFTPClient {
 public:
     TFTPClient(const std::string &server_ip);
+    TFTPClient(const std::string &server_ip, const ClientOptions &options);
     ~TFTPClient();
 
-    // Send a Read Request (RRQ)
-    void send_rrq(const std::string &filename);
+    // Send a Read Request (RRQ); local defaults to the last component of filename.
+    // With resume, an existing local file is continued if the server's copy starts with it
+    bool send_rrq(const std::string &filename, const std::string &local = "");
+
+    // Send a Write Request (WRQ); local defaults to filename. With resume, the upload
+    // continues after what the server already has if that matches the local file
+    bool send_wrq(const std::string &filename, const std::string &local = "");
 
-    // Send a Write Request (WRQ)
-    void send_wrq(const std::string &filename);
+    // Fetch one file as `stripes` byte ranges over concurrent sessions, each pwrite()n
+    // into place. Needs the server's offset/length options, otherwise falls back to send_rrq
+    bool striped_rrq(const std::string &filename, const std::string &local, int stripes);
+
+    // Why the last transfer failed
+    const std::string &error() const { return last_error; }
+    // Payload bytes of the last transfer
+    uint64_t bytes_transferred() const { return transferred; }
 
 private:
-    int sock;                 // UDP socket
+    using OptionList = std::vector<std::pair<std::string, std::string>>;
+
+    EventLoop loop;            // drives this client's sessions
     struct sockaddr_in server; // Server address
+    ClientOptions options;
+    DatagramNet &net;
+    DallyList dally{loop};     // TIDs of finished gets, answered while the loop runs
+    std::string last_error;
+    uint64_t transferred = 0;
+
+    int open_socket();
+    OptionList base_options() const;
+    std::vector<char> make_request(uint16_t op, const std::string &filename, const OptionList &opts) const;
+    // Runs the loop until every session has finished, true if all succeeded
+    bool run(const std::vector<Session *> &sessions);
     // Handles receiving data from the server
-    void receive_file(const std::string &filename);
+    bool receive_file(const std::string &filename, std::unique_ptr<ImageSink> sink, const OptionList &opts,
+                      TransferOptions *granted = nullptr, bool probe = false,
+                      std::function<bool(Session &)> on_negotiated = nullptr);
     // Handles sending a file to the server
-    void send_file(const std::string &filename);
+    bool send_file(const std::string &filename, std::unique_ptr<ImageSource> source, const OptionList &opts,
+                   std::function<bool(Session &)> on_negotiated = nullptr);
 };
 
 #endif  // TFTP_CLIENT_HPP
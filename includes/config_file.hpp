@@ -0,0 +1,33 @@
+/*
+ * Server configuration file: one "key = value" per line, # starts a comment. Keys are
+ * ServerConfig's field names, with timeout_ms and max_retries for its limits and
+ * shards as a comma separated list; sizes and rates take K, M or G suffixes (powers
+ * of 1024), booleans are true/false, yes/no, on/off or 1/0.
+ *
+ *   root = /srv/tftp
+ *   workers = 8
+ *   max_blksize = 1468
+ *   max_sessions = 256
+ *   cache_bytes = 512M
+ *
+ * tftp_server -f reads it at startup and again on SIGHUP; TFTPServer::reload() says
+ * which keys take effect without a restart.
+*/
+
+#ifndef TFTP_CONFIG_FILE_HPP
+#define TFTP_CONFIG_FILE_HPP
+
+#include <cstdint>
+#include <string>
+#include "server.hpp"
+
+// Decimal with an optional K, M or G suffix (powers of 1024). False if s is not one or
+// the amount does not fit in 64 bits
+bool parse_amount(const std::string &s, uint64_t &out);
+
+// Applies the file at path on top of config. False with error set ("path:line: why")
+// if it cannot be read or holds a key or value it does not understand; config is
+// left as it was then
+bool load_config_file(const std::string &path, ServerConfig &config, std::string &error);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Coroutines on an EventLoop. A transfer is a sequence: send the OACK until ACK 0
+ * comes back, then send windows until the last block is acknowledged. Written as a
+ * Flow, each step is a co_await on the next event, and the loop resumes the flow
+ * when a packet arrives or a timer fires. No thread blocks, and a suspended flow
+ * costs only its frame.
+ *
+ * Frames come from a FramePool, one per loop, so a worker starting and finishing
+ * sessions all day reuses the same few frame sizes instead of going to malloc.
+*/
+
+#ifndef TFTP_COROUTINE_HPP
+#define TFTP_COROUTINE_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+#include <vector>
+
+// Recycles coroutine frames by size. Not thread safe: one pool per loop, and it
+// must outlive the flows allocated from it
+class FramePool {
+public:
+    explicit FramePool(size_t max_spare = 4096) : max_spare(max_spare) {}
+    ~FramePool();
+    FramePool(const FramePool &) = delete;
+    FramePool &operator=(const FramePool &) = delete;
+
+    // Frames handed out and not yet released, and their bytes including the header
+    size_t frames() const { return in_use; }
+    size_t bytes() const { return in_use_bytes; }
+
+    // pool nullptr = plain operator new; release() finds the pool again
+    static void *allocate(size_t size, FramePool *pool);
+    static void release(void *frame, size_t size);
+
+private:
+    static constexpr size_t GRAIN = 64;
+    size_t max_spare;
+    size_t spare_count = 0;
+    std::vector<std::vector<void *>> spare;  // by block size / GRAIN
+    size_t in_use = 0;
+    size_t in_use_bytes = 0;
+};
+
+// A coroutine owned by whoever started it: destroying the Flow destroys the frame,
+// wherever it is suspended. It runs from the call up to its first co_await
+class Flow {
+public:
+    struct promise_type {
+        Flow get_return_object() { return Flow(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        // A member function's frame comes from its object's frame_pool()
+        template <class Owner, class... Args>
+        static void *operator new(size_t size, Owner &owner, Args &...) {
+            return FramePool::allocate(size, owner.frame_pool());
+        }
+        static void *operator new(size_t size) { return FramePool::allocate(size, nullptr); }
+        static void operator delete(void *frame, size_t size) { FramePool::release(frame, size); }
+    };
+
+    Flow() = default;
+    Flow(Flow &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+    Flow &operator=(Flow &&other) noexcept {
+        if (this != &other) {
+            if (handle)
+                handle.destroy();
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+    ~Flow() {
+        if (handle)
+            handle.destroy();
+    }
+
+    // Not started, or ran to the end
+    bool done() const { return !handle || handle.done(); }
+
+private:
+    explicit Flow(std::coroutine_handle<promise_type> h) : handle(h) {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Hands one value at a time to the flow awaiting next()
+template <class T>
+class Mailbox {
+public:
+    struct Next {
+        Mailbox &box;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) noexcept { box.waiter = h; }
+        T await_resume() const noexcept { return box.value; }
+    };
+
+    Next next() { return Next{*this}; }
+    // Resumes the waiting flow with value until it awaits again or ends; false if no
+    // flow was waiting, and the value is dropped
+    bool deliver(const T &v) {
+        if (!waiter)
+            return false;
+        value = v;
+        std::exchange(waiter, {}).resume();
+        return true;
+    }
+    bool waiting() const { return (bool)waiter; }
+
+private:
+    std::coroutine_handle<> waiter;
+    T value{};
+};
+
+#endif
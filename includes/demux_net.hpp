@@ -0,0 +1,124 @@
+/*
+ * Serving all of a worker's transfers from a few shared UDP sockets instead of one
+ * TID socket each. A socket per transfer costs a descriptor, a bind, a connect and an
+ * epoll registration on every request, and a kernel socket with its own receive
+ * buffer for as long as the transfer lasts.
+ *
+ * DemuxNet is a DatagramNet layered over another one (the kernel's, or a SimNet
+ * host). Its sockets are virtual: connect() files one under (shared socket, peer
+ * address) in an open addressing table, and each datagram read from a shared socket
+ * goes to the virtual socket its sender maps to. Datagrams from unknown peers are
+ * dropped, as a connected socket would drop them.
+ *
+ * A DemuxNet belongs to one event loop and is only used from its thread, so the
+ * table needs neither locks nor atomics.
+*/
+
+#ifndef TFTP_DEMUX_NET_HPP
+#define TFTP_DEMUX_NET_HPP
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "net.hpp"
+
+// Linear probing with backward shift deletion, so there are no tombstones and a
+// lookup stops at the first empty slot. Slots are 16 bytes, four to a cache line.
+// Keys must not be 0
+class PeerTable {
+public:
+    PeerTable();
+    // -1 if key is absent
+    int find(uint64_t key) const;
+    // False if key is already there
+    bool insert(uint64_t key, int value);
+    void erase(uint64_t key);
+    size_t size() const { return count; }
+    size_t capacity() const { return slots.size(); }
+
+private:
+    struct Slot {
+        uint64_t key;
+        int32_t value;
+        int32_t unused;
+    };
+
+    std::vector<Slot> slots;
+    size_t mask;
+    int shift;
+    size_t count = 0;
+
+    size_t home(uint64_t key) const { return (size_t)((key * 0x9e3779b97f4a7c15ull) >> shift); }
+    void grow();
+};
+
+class DemuxNet : public DatagramNet {
+public:
+    struct Stats {
+        uint64_t unknown = 0;   // datagrams from a peer no socket is connected to
+        uint64_t overflow = 0;  // datagrams for a socket that had not read the last one
+    };
+
+    // Opens count sockets on base, bound to ephemeral ports and read on loop, each with
+    // receive_buffer bytes of room (0 = the default); they stand in for a buffer per
+    // transfer. Throws std::runtime_error if it cannot
+    DemuxNet(EventLoop &loop, DatagramNet &base, int count, int receive_buffer = 0);
+    ~DemuxNet() override;
+
+    int open() override;
+    // Port 0 only: the shared socket is picked by connect()
+    int bind(int sock, const struct sockaddr_in &addr, bool reuse_port = false) override;
+    int local_address(int sock, struct sockaddr_in &addr) override;
+    // Fails with EADDRINUSE if every shared socket already has a transfer with peer
+    int connect(int sock, const struct sockaddr_in &peer) override;
+    ssize_t send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) override;
+    ssize_t receive(int sock, char *buf, size_t cap, struct sockaddr_in *from) override;
+    void close(int sock) override;
+    void watch(EventLoop &loop, int sock, std::function<void()> readable) override;
+    void unwatch(EventLoop &loop, int sock) override;
+    void run_once(EventLoop &loop) override { base.run_once(loop); }
+
+    // set_busy_poll() on every shared socket; virtual sockets have no queue of their own
+    void busy_poll(int usec);
+
+    // Connected virtual sockets
+    size_t connected() const { return table.size(); }
+    const Stats &stats() const { return counters; }
+
+protected:
+    EventLoop &loop;
+    DatagramNet &base;
+    std::vector<int> shared;
+
+    // Hands a datagram that came in on shared socket i to the socket its sender is
+    // connected to
+    void deliver(size_t i, const struct sockaddr_in &from, const char *buf, size_t len);
+    // The shared socket sock sends from, and to the peer when to is nullptr; -1 with
+    // errno if sock is not open or has nowhere to send
+    int route(int sock, const struct sockaddr_in *&to, size_t &i);
+
+private:
+    // A virtual socket. It holds at most one datagram: the reader hands each one over
+    // and calls readable, which takes it before the next is read
+    struct Endpoint {
+        bool open = false;
+        int shared = -1;            // index into shared once connected
+        struct sockaddr_in peer{};
+        std::function<void()> readable;
+        std::vector<char> inbox;    // keeps its capacity across reuse of the slot
+        bool full = false;
+    };
+
+    std::vector<Endpoint> endpoints;
+    std::vector<int> free_endpoints;
+    PeerTable table;
+    size_t next_shared = 0;
+    std::vector<char> buffer;
+    Stats counters;
+
+    Endpoint *endpoint(int sock);
+    // Reads shared socket i dry, handing each datagram to its endpoint
+    void drain(size_t i);
+};
+
+#endif
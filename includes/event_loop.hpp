@@ -0,0 +1,88 @@
+/*
+ * epoll based loop owned by one thread. Sockets and timers registered here are
+ * only touched from that thread; post() is the one thread-safe entry point.
+*/
+
+#ifndef TFTP_EVENT_LOOP_HPP
+#define TFTP_EVENT_LOOP_HPP
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class EventLoop {
+public:
+    using IoCallback = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+
+    EventLoop();
+    ~EventLoop();
+
+    // Watch fd for the given epoll events
+    void add(int fd, uint32_t events, IoCallback cb);
+    void modify(int fd, uint32_t events);
+    // Safe to call from inside the fd's own callback
+    void remove(int fd);
+
+    // One-shot timer, returns an id for cancel_timer()
+    uint64_t add_timer(uint32_t delay_ms, Task cb);
+    void cancel_timer(uint64_t id);
+
+    // Queue a task from any thread
+    void post(Task task);
+    // Loop thread only: run task after the next poll for I/O, so packets that arrived
+    // meanwhile are handled first. No wakeup write, unlike post()
+    void defer(Task task);
+
+    void run();
+    void stop();
+    // run() spins instead of sleeping: it polls without blocking and only sleeps in
+    // epoll_wait once nothing has happened for the spin window. The window starts at
+    // spin_us. It doubles (up to spin_us) when an event wakes the loop less than spin_us
+    // into a sleep and halves after longer sleeps, so an idle loop backs off to spin_us/16.
+    // The kernel also polls the device queues of the sockets inside epoll_wait, where
+    // it allows (EPIOCSPARAMS). 0 = always sleep
+    void busy_poll(uint32_t spin_us);
+    // Called after every round with the nanoseconds it spent in callbacks, during
+    // which the loop could not see new events; busy_poll()'s empty polls are skipped
+    void observe(std::function<void(uint64_t busy_ns)> observer) { on_round = std::move(observer); }
+    // Waits at most timeout_ms (-1 = until the next timer), dispatches, returns events handled
+    int run_once(int timeout_ms = -1);
+
+    static uint64_t now_ms();
+    // Timers follow this clock instead of the monotonic one (a simulated network's)
+    void use_clock(std::function<uint64_t()> clock_ms);
+    // The clock timers run on, in milliseconds
+    uint64_t now() const { return clock ? clock() : now_ms(); }
+    // Earliest timer deadline on the loop's clock, UINT64_MAX if none is armed
+    uint64_t next_deadline() const;
+    // Posted or deferred tasks are waiting
+    bool has_posted();
+
+private:
+    int epfd;
+    int wakefd;  // eventfd for post()/stop()
+    bool stopped = false;
+    std::function<uint64_t()> clock;
+    uint64_t next_timer_id = 1;
+    std::unordered_map<int, IoCallback> handlers;
+    std::vector<std::unordered_map<int, IoCallback>::node_type> retired;  // handlers removed mid-dispatch
+    std::multimap<uint64_t, uint64_t> deadlines;  // deadline -> timer id
+    std::unordered_map<uint64_t, std::pair<std::multimap<uint64_t, uint64_t>::iterator, Task>> timers;
+    std::mutex post_mutex;
+    std::vector<Task> posted;
+    std::vector<Task> deferred;
+    uint32_t spin_max_us = 0;   // busy_poll()
+    uint32_t spin_us = 0;       // the current window
+    std::function<void(uint64_t)> on_round;
+
+    int next_timeout() const;
+    void run_timers();
+    void run_posted();
+    void run_spinning();
+};
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Per-worker flight recorder: a fixed ring of binary events (packet sent or
+ * received, retransmit, timer, state change) stamped with the TSC. Recording is a
+ * few relaxed stores by the worker thread, so it stays on at full packet rate; the
+ * ring is copied out on demand or when a session fails and turned back into text
+ * with tftp_flightdump. Each slot carries the number of the event it holds, written
+ * last, so a reader copying it while the worker writes it again can tell.
+ *
+ * Dump file: FlightHeader followed by `count` 16 byte FlightEvents, oldest first.
+*/
+
+#ifndef TFTP_FLIGHT_RECORDER_HPP
+#define TFTP_FLIGHT_RECORDER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "metrics.hpp"
+
+enum FlightEventType : uint8_t {
+    FE_RX = 1,          // arg = opcode
+    FE_TX = 2,          // arg = opcode
+    FE_RETRANSMIT = 3,  // block = first block sent again
+    FE_TIMER = 4,       // arg = retries so far
+    FE_STATE = 5,       // arg = FlightState
+};
+
+enum FlightState : uint8_t {
+    FS_START = 1,       // block = request opcode, 1 RRQ or 2 WRQ
+    FS_NEGOTIATED = 2,
+    FS_DONE_OK = 3,
+    FS_DONE_FAILED = 4,
+    FS_HANDED_OFF = 5,  // moved to the next process in an upgrade, see handoff.hpp
+};
+
+struct FlightEvent {
+    uint64_t tsc;
+    uint32_t session;
+    uint16_t block;     // low 16 bits of the block number, as on the wire
+    uint8_t type;
+    uint8_t arg;
+};
+static_assert(sizeof(FlightEvent) == 16, "FlightEvent is written to disk as is");
+
+struct FlightHeader {
+    char magic[8];      // "TTFLIGHT"
+    uint32_t version;   // 1
+    uint32_t count;
+    // two (tsc, CLOCK_MONOTONIC ns) pairs to convert timestamps
+    uint64_t tsc0, ns0, tsc1, ns1;
+};
+
+inline uint64_t flight_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return metrics_now_ns();
+#endif
+}
+
+class FlightRecorder {
+public:
+    // capacity is rounded up to a power of two
+    explicit FlightRecorder(size_t capacity);
+
+    // Worker thread only
+    void record(uint8_t type, uint32_t session, uint64_t block, uint8_t arg = 0) {
+        uint64_t n = head.load(std::memory_order_relaxed);
+        std::atomic<uint64_t> *slot = &words[SLOT_WORDS * (n & mask)];
+        // seqlock per slot: 0 while it is written, then the event's number + 1
+        slot[2].store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot[0].store(flight_tsc(), std::memory_order_relaxed);
+        slot[1].store((uint64_t)session | (uint64_t)(uint16_t)block << 32 | (uint64_t)type << 48 |
+                      (uint64_t)arg << 56, std::memory_order_relaxed);
+        slot[2].store(n + 1, std::memory_order_release);
+        head.store(n + 1, std::memory_order_release);
+    }
+
+    // Copies out what is in the ring, oldest first; any thread. Events the writer
+    // overwrote, or was overwriting, while they were copied are dropped
+    std::vector<FlightEvent> snapshot() const;
+
+    // Writes events to path in the dump format; false with errno set on failure
+    static bool dump(const std::string &path, const std::vector<FlightEvent> &events, uint64_t tsc0, uint64_t ns0);
+    uint64_t created_tsc() const { return tsc0; }
+    uint64_t created_ns() const { return ns0; }
+
+private:
+    static constexpr size_t SLOT_WORDS = 3;  // tsc, packed fields, sequence
+    size_t mask;
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+    alignas(64) std::atomic<uint64_t> head{0};
+    uint64_t tsc0;
+    uint64_t ns0;
+};
+
+#endif
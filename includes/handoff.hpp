@@ -0,0 +1,59 @@
+/*
+ * Zero-downtime upgrade. A server with ServerConfig::upgrade_socket set listens on
+ * that Unix socket for its successor. A new process started with the same path, and
+ * running as the same user (checked with SO_PEERCRED), connects to it and takes over:
+ *
+ *   - the listening UDP sockets, so requests queued in them are not lost and the
+ *     port is never unbound;
+ *   - every transfer that can move: octet RRQs and plain-file WRQs that are past
+ *     option negotiation, each with its TID socket and window position.
+ *
+ * The old process stops reading the listening sockets, finishes whatever could not
+ * move (netascii, dedup uploads, transfers still negotiating) and exits.
+ *
+ * Messages are SOCK_SEQPACKET datagrams; descriptors ride along as SCM_RIGHTS.
+ *
+ * HELLO   -> | "TTHANDOF" (8 bytes) | Version (2 bytes) | Port (2 bytes) |  + listening sockets
+ * SESSION -> | 'S' | encoded HandoffSession |                                + TID socket
+ * END     -> | 'E' | Sessions sent (4 bytes) |
+*/
+
+#ifndef TFTP_HANDOFF_HPP
+#define TFTP_HANDOFF_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include "protocal.hpp"
+
+// One transfer in flight, as much as the successor needs to carry on from the
+// exact window position without resending anything the peer already has
+struct HandoffSession {
+    uint16_t op = 0;                // RREQ: we were sending, WREQ: receiving
+    std::string filename;
+    struct sockaddr_in peer{};
+    TransferOptions opts;
+    int sock = -1;                  // TID socket, connected to peer
+    uint64_t size = 0;              // RRQ: source size, checked before resuming
+    uint64_t acked = 0;             // RRQ: highest block ACKed; WRQ: highest block written
+    uint64_t sent = 0;              // RRQ: highest block sent
+    uint64_t transferred = 0;
+    uint16_t in_window = 0;         // WRQ: blocks since the last ACK
+    bool keep_partial = false;      // WRQ: resumable upload, keep the file if it fails
+    std::vector<char> reply;        // WRQ: last ACK/OACK, resent on timeout
+};
+
+// Binds path for the next successor, replacing a stale socket; -1 with errno set
+int listen_handoff(const std::string &path);
+// Successor: connects to path and receives the predecessor's listening sockets and
+// transfers. False with nothing received if no server is listening there; throws
+// std::runtime_error if one answered but the handoff broke off
+bool receive_handoff(const std::string &path, uint16_t &port, std::vector<int> &listen_socks,
+                     std::vector<HandoffSession> &sessions);
+// Predecessor: sends everything over a connection accepted on listen_handoff()'s
+// socket. The descriptors stay open; the caller closes its copies afterwards
+bool send_handoff(int conn, uint16_t port, const std::vector<int> &listen_socks,
+                  const std::vector<HandoffSession> &sessions);
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * 128-bit non-cryptographic hash used to name deduplicated chunks. Built like XXH3:
+ * 64-byte stripes folded into eight 64-bit lanes with 32x32->64 multiplies, which map
+ * directly onto SSE2/AVX2. The AVX2 path is picked at run time on CPUs that have it,
+ * so a baseline x86-64 build still uses it. The scalar and vector paths produce
+ * identical digests, so a chunk store written by one build is readable by any other.
+*/
+
+#ifndef TFTP_HASH_HPP
+#define TFTP_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct Hash128 {
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+
+    bool operator==(const Hash128 &o) const { return lo == o.lo && hi == o.hi; }
+    bool operator!=(const Hash128 &o) const { return !(*this == o); }
+    // 32 lowercase hex digits, hi first
+    std::string hex() const;
+    static bool from_hex(const std::string &s, Hash128 &out);
+};
+
+Hash128 hash128(const void *data, size_t len);
+// Reference implementation without intrinsics, kept for verification and benchmarks
+Hash128 hash128_scalar(const void *data, size_t len);
+// Kernel hash128() runs on this CPU: "avx2", "sse2" or "scalar"
+const char *hash128_kernel();
+
+#endif
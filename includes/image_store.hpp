@@ -0,0 +1,295 @@
+/*
+ * Read side of the server root. Plain files are served with pread. An image kept
+ * as name.gz (or name.zst when built with zstd) is served decompressed: a sidecar
+ * name.gz.idx records the decompressed size, used for tsize, and where every gzip
+ * member / zstd frame starts. Members are inflated one at a time into a cache shared
+ * by all sessions, so concurrent RRQs for one image only decompress it once. A
+ * server with a storage pool inflates the members a session misses there, not on
+ * the session's loop.
+ *
+ * Pack images as independent ~1 MiB members to keep cache entries small:
+ *   split -b 1M --filter=gzip image > image.gz
+ * Each member is inflated whole into one entry, so an image with a member larger
+ * than MAX_FRAME_BYTES (a plain `gzip image` of anything big) is refused.
+ *
+ * Deduplicated uploads are stored as name.chunks manifests, see chunk_store.hpp.
+ *
+ * Every lookup names the root it serves from, so a server reloading its settings
+ * switches roots per worker, with the snapshot it runs on; the store only keeps the
+ * root its chunk store lives under.
+*/
+
+#ifndef TFTP_IMAGE_STORE_HPP
+#define TFTP_IMAGE_STORE_HPP
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+class EventLoop;
+class StoragePool;
+
+class ImageSource {
+public:
+    virtual ~ImageSource() = default;
+    // Size as seen by the client (decompressed for packed images); UINT64_MAX while
+    // it is not known yet (a relayed file whose upstream did not send tsize)
+    virtual uint64_t size() const = 0;
+    // Copies up to len bytes from offset, returns 0 at end of image and -1 on error
+    virtual ssize_t read_at(uint64_t offset, char *buf, size_t len) = 0;
+    // Sources still being written (relay.hpp) fail read_at with EAGAIN for bytes that
+    // have not arrived yet; this has ready run on loop once more have. Plain sources
+    // never do either
+    virtual void when_readable(EventLoop &, std::function<void()>) {}
+    // Packed images: decode blocks missing from the cache on pool, queued by hint,
+    // rather than in read_at, which fails with EAGAIN until when_readable's ready
+    // runs. Call on the loop's thread before the first read_at there
+    virtual void use_storage(StoragePool &, size_t) {}
+};
+
+// Destination of a WRQ. Chunked uploads only appear under their name on commit(),
+// plain files are written in place
+class ImageSink {
+public:
+    virtual ~ImageSink() = default;
+    virtual bool write(const char *buf, size_t len) = 0;
+    // May run on a storage thread (Session::use_storage)
+    virtual bool commit() = 0;
+    // Runs on the session's loop once commit() has succeeded
+    virtual void committed() {}
+    // Drops a partial upload
+    virtual void abort() = 0;
+};
+
+// Regular file read with pread, takes ownership of fd
+class FileSource : public ImageSource {
+public:
+    FileSource(int fd, uint64_t size) : fd(fd), file_size(size) {}
+    ~FileSource() override;
+    uint64_t size() const override { return file_size; }
+    ssize_t read_at(uint64_t offset, char *buf, size_t len) override;
+
+private:
+    int fd;
+    uint64_t file_size;
+};
+
+// Writes sequentially with pwrite from offset, so several sinks can fill disjoint
+// ranges of one file. Takes ownership of fd; abort() unlinks path unless it is empty
+class FileSink : public ImageSink {
+public:
+    FileSink(int fd, const std::string &path, uint64_t offset = 0) : fd(fd), path(path), pos(offset) {}
+    ~FileSink() override;
+    bool write(const char *buf, size_t len) override;
+    bool commit() override;
+    void abort() override;
+    uint64_t position() const { return pos; }
+    // Truncates the file and starts over at 0, for a resume the peer refused
+    bool restart();
+
+private:
+    int fd;
+    std::string path;
+    uint64_t pos;
+};
+
+// Appends to a caller owned string, which must outlive the transfer
+class MemorySink : public ImageSink {
+public:
+    explicit MemorySink(std::string &out) : out(out) {}
+    bool write(const char *buf, size_t len) override;
+    bool commit() override { return true; }
+    void abort() override { out.clear(); }
+
+private:
+    std::string &out;
+};
+
+class MemorySource : public ImageSource {
+public:
+    explicit MemorySource(std::string data) : data(std::move(data)) {}
+    uint64_t size() const override { return data.size(); }
+    ssize_t read_at(uint64_t offset, char *buf, size_t len) override;
+
+private:
+    std::string data;
+};
+
+// hash128 hex of the hex hash128s of each RESUME_PIECE_BYTES piece of the whole prefix
+// before offset, empty on read error.
+// Both ends of a resumed transfer compare it to make sure the prefix they share matches
+std::string prefix_checksum(ImageSource &source, uint64_t offset);
+
+enum class Codec { GZIP, ZSTD };
+
+// Largest decompressed gzip member / zstd frame a packed image may have
+constexpr uint64_t MAX_FRAME_BYTES = 16 << 20;
+
+// Contents of the .idx sidecar
+struct ImageIndex {
+    struct Frame {
+        uint64_t in_offset;   // compressed
+        uint64_t in_len;
+        uint64_t out_offset;  // decompressed
+        uint64_t out_len;
+    };
+    Codec codec = Codec::GZIP;
+    uint64_t source_size = 0;   // compressed file size and mtime the index was built from
+    int64_t source_mtime = 0;
+    uint64_t size = 0;          // decompressed size
+    std::vector<Frame> frames;
+
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+};
+
+// LRU of decompressed frames; concurrent misses on one frame wait for a single decode
+class BlockCache {
+public:
+    using Block = std::shared_ptr<const std::vector<char>>;
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t bytes;
+    };
+
+    explicit BlockCache(size_t capacity_bytes);
+
+    template <typename Loader>
+    Block get(const std::string &key, Loader &&load);
+    // The block if it is decoded and cached, nullptr otherwise; never waits
+    Block peek(const std::string &key);
+    Stats stats() const;
+    // New capacity, evicting down to it right away when it shrinks
+    void resize(size_t capacity_bytes);
+
+private:
+    struct Entry {
+        std::shared_future<Block> block;
+        size_t bytes = 0;
+        std::list<std::string>::iterator lru;
+        uint64_t generation = 0;    // tells a loader its entry from one that replaced it
+    };
+    mutable std::mutex mutex;
+    size_t capacity;
+    size_t bytes = 0;
+    uint64_t generations = 0;
+    Stats counters{};
+    std::list<std::string> lru;  // front = most recent
+    std::unordered_map<std::string, Entry> entries;
+
+    void evict();
+};
+
+class CompressedImage;
+class ChunkStore;
+
+class ImageStore {
+public:
+    // The chunk store goes under chunk_root
+    explicit ImageStore(const std::string &chunk_root, size_t cache_bytes = 64 << 20);
+    ~ImageStore();
+
+    // Path for a client supplied name under root, empty if it escapes the root
+    static std::string path_for(const std::string &root, const std::string &filename);
+    // Opens filename under root, its packed form or its chunk manifest; nullptr with errno
+    // set if none exists. Packed images decode through cache slice slice
+    std::unique_ptr<ImageSource> open(const std::string &root, const std::string &filename, size_t slice = 0);
+    // Upload target, deduplicated into the chunk store when dedup is set, which only
+    // works under the chunk store's root. With resume_from, an existing partial file is
+    // kept (also on abort) and *resume_from is set to its size
+    std::unique_ptr<ImageSink> create(const std::string &root, const std::string &filename, bool dedup,
+                                      uint64_t *resume_from = nullptr);
+    // Plain-file upload another process started (handoff.hpp), written on from offset.
+    // keep_partial as for create()'s resume_from, otherwise abort() removes the file
+    std::unique_ptr<ImageSink> resume_upload(const std::string &root, const std::string &filename, uint64_t offset,
+                                             bool keep_partial);
+    // Splits the decompressed image cache into slices of equal capacity, one per NUMA
+    // node, so workers only read blocks that were decoded on their node. Call before
+    // the first open()
+    void slice_cache(size_t slices);
+    // All slices together
+    BlockCache::Stats cache_stats() const;
+    // New capacity for the image cache, split over its slices. Any thread
+    void resize_cache(size_t bytes);
+    ChunkStore &chunks() { return *chunk_store; }
+    const ChunkStore &chunks() const { return *chunk_store; }
+
+private:
+    size_t cache_bytes;
+    std::vector<std::unique_ptr<BlockCache>> caches;
+    std::unique_ptr<ChunkStore> chunk_store;
+    std::mutex images_mutex;
+    std::unordered_map<std::string, std::shared_ptr<CompressedImage>> images;
+
+    std::shared_ptr<CompressedImage> load_packed(const std::string &path, Codec codec);
+};
+
+template <typename Loader>
+BlockCache::Block BlockCache::get(const std::string &key, Loader &&load) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        counters.hits++;
+        lru.splice(lru.begin(), lru, it->second.lru);
+        auto pending = it->second.block;
+        lock.unlock();
+        return pending.get();
+    }
+    counters.misses++;
+    std::promise<Block> promise;
+    Entry &entry = entries[key];
+    entry.block = promise.get_future().share();
+    entry.generation = ++generations;
+    uint64_t generation = entry.generation;
+    lru.push_front(key);
+    entry.lru = lru.begin();
+    lock.unlock();
+
+    // the entry may have been evicted while loading, and even loaded again by someone
+    // else: only touch it if it is still ours
+    auto mine = [&] {
+        it = entries.find(key);
+        return it != entries.end() && it->second.generation == generation;
+    };
+    Block block;
+    try {
+        block = load();
+    } catch (...) {
+        // readers waiting on it see the exception too, the next one retries
+        promise.set_exception(std::current_exception());
+        lock.lock();
+        if (mine()) {
+            lru.erase(it->second.lru);
+            entries.erase(it);
+        }
+        throw;
+    }
+    promise.set_value(block);
+
+    lock.lock();
+    if (!block) {
+        // failed decode, let the next reader retry
+        if (mine()) {
+            lru.erase(it->second.lru);
+            entries.erase(it);
+        }
+        return block;
+    }
+    if (mine()) {
+        it->second.bytes = block->size();
+        bytes += block->size();
+        evict();
+    }
+    return block;
+}
+
+#endif
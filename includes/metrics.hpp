@@ -0,0 +1,188 @@
+/*
+ * Server instrumentation. Every worker owns a WorkerMetrics block that only its own
+ * thread writes, so updates are plain relaxed load/store pairs with no locked
+ * instructions; readers merge all blocks into a MetricsSnapshot whenever they like.
+ *
+ * Latencies go into log-linear (HDR style) histograms in microseconds: 16 linear
+ * sub-buckets per power of two, so any recorded value is off by at most ~6%.
+*/
+
+#ifndef TFTP_METRICS_HPP
+#define TFTP_METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#define METRICS_ERROR_CODES 9   // ERR_UNDEFINED .. ERR_OPTION
+
+inline uint64_t metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Single writer counter; any thread may read
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Single writer level (a queue depth, say); any thread may read
+class Gauge {
+public:
+    void set(uint64_t v) { value.store(v, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+struct HistogramSnapshot {
+    std::vector<uint64_t> counts;
+    uint64_t count = 0;
+    uint64_t sum = 0;       // microseconds
+
+    // Value at quantile q (0..1), the lower bound of its bucket
+    uint64_t quantile(double q) const;
+};
+
+// Single writer latency histogram in microseconds
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int BUCKETS = (42 - SUB_BITS) << SUB_BITS;  // up to 2^41 us, ~25 days
+
+    void record(uint64_t us);
+    void record_since(uint64_t start_ns) { record((metrics_now_ns() - start_ns) / 1000); }
+    // Adds this histogram's counts into out
+    void merge_into(HistogramSnapshot &out) const;
+
+    static size_t bucket_of(uint64_t us);
+    static uint64_t bucket_floor(size_t index);
+
+private:
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    Counter total;
+    Counter sum;
+};
+
+// One per worker, padded so neighbouring workers never share a cache line
+struct alignas(64) WorkerMetrics {
+    Counter rrq;
+    Counter wrq;
+    Counter bytes_sent;
+    Counter bytes_received;
+    Counter retransmits;            // DATA/ACK/OACK/request packets sent again
+    Counter timeouts;               // retransmit timer expiries
+    Counter errors_sent[METRICS_ERROR_CODES];
+    Counter errors_received;
+    Counter transfers_ok;
+    Counter transfers_failed;
+    Counter requests_queued;        // admission control: waited for a session slot
+    Counter requests_shed;          // turned away (or dropped): queue full or waited too long
+    Counter requests_expired;       // the part of requests_shed that waited past max_queue_ms
+    Gauge pending;                  // requests queued right now
+    Counter requests_other_cpu;     // pinned workers: request handled by the kernel on another CPU
+    Counter requests_other_node;    // ... on another NUMA node
+    Counter storage_jobs;           // opens and the like handed to the storage pool
+    Counter log_dropped;            // access log records lost to a full ring
+    Counter relay_fetches;          // relay: RRQs that started an upstream fetch
+    Counter relay_joined;           // RRQs that streamed from a fetch already running
+    Counter relay_upstream_bytes;   // fetched from upstream, by the fetches this worker started
+    Counter relay_failed;           // fetches that did not complete
+    Counter relay_hits;             // RRQs a relay served from its root, the cache hits
+    std::vector<Counter> shard_requests;    // front end, see shard.hpp: requests relayed, by shard;
+                                            // sized before the worker runs
+    Counter shard_unanswered;       // requests whose shard never answered
+    int cpu = -1;                   // where the worker is pinned, -1 = it is not; set before it runs
+    int node = -1;
+    Histogram first_data;           // request to first DATA sent (RRQ) or received (WRQ)
+    Histogram block_rtt;            // DATA sent to its ACK, never sampled on a resend
+    Histogram duration;             // whole transfer, successful ones only
+    Histogram queue_wait;           // arrival to admission, queued requests only
+    Histogram loop_stall;           // time each loop round spent in callbacks, blind to new packets
+};
+
+struct MetricsSnapshot {
+    uint64_t rrq = 0;
+    uint64_t wrq = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    uint64_t retransmits = 0;
+    uint64_t timeouts = 0;
+    uint64_t errors_sent[METRICS_ERROR_CODES] = {};
+    uint64_t errors_received = 0;
+    uint64_t transfers_ok = 0;
+    uint64_t transfers_failed = 0;
+    uint64_t requests_queued = 0;
+    uint64_t requests_shed = 0;
+    uint64_t requests_expired = 0;
+    uint64_t pending = 0;
+    uint64_t requests_other_cpu = 0;
+    uint64_t requests_other_node = 0;
+    uint64_t storage_jobs = 0;
+    uint64_t log_dropped = 0;
+    uint64_t relay_fetches = 0;
+    uint64_t relay_joined = 0;
+    uint64_t relay_upstream_bytes = 0;
+    uint64_t relay_failed = 0;
+    uint64_t relay_hits = 0;
+    std::vector<uint64_t> shard_requests;
+    uint64_t shard_unanswered = 0;
+    std::vector<std::string> shards;    // labels shard_requests; set by the server, not by merge()
+    uint64_t image_cache_hits = 0;      // decompressed image cache, likewise
+    uint64_t image_cache_misses = 0;
+    uint64_t config_reloads = 0;        // likewise
+    uint64_t dedup_logical_bytes = 0;   // chunk store (ServerConfig::dedup), likewise
+    uint64_t dedup_stored_bytes = 0;
+    uint64_t dedup_chunks = 0;
+    uint64_t dedup_unique_chunks = 0;
+    uint64_t dedup_hash_ns = 0;
+    uint64_t dedup_swept_chunks = 0;
+    uint64_t dedup_swept_bytes = 0;
+    std::vector<int> worker_cpu;    // by worker, in merge order
+    std::vector<int> worker_node;
+    HistogramSnapshot first_data;
+    HistogramSnapshot block_rtt;
+    HistogramSnapshot duration;
+    HistogramSnapshot queue_wait;
+    HistogramSnapshot loop_stall;
+
+    void merge(const WorkerMetrics &worker);
+};
+
+// Prometheus text exposition format (0.0.4)
+std::string prometheus_text(const MetricsSnapshot &snapshot);
+
+// Answers every HTTP request on a TCP port (bound to 127.0.0.1) or a Unix socket with
+// render(). Runs on its own thread; constructor throws std::runtime_error if it cannot listen
+class MetricsExporter {
+public:
+    MetricsExporter(std::function<std::string()> render, uint16_t port, const std::string &unix_path = "");
+    ~MetricsExporter();
+    // Bound TCP port, useful when 0 was asked for; 0 for a Unix socket
+    uint16_t port() const { return bound_port; }
+
+private:
+    std::function<std::string()> render;
+    int listen_fd = -1;
+    int wake_fd = -1;
+    uint16_t bound_port = 0;
+    std::string unix_path;
+    std::thread thread;
+
+    void serve();
+};
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Datagram transport under the server and client sessions. KernelNet is the real
+ * UDP socket API; SimNet (sim_net.hpp) is an in-process network with a virtual clock
+ * for reproducing WAN and lossy links deterministically.
+ *
+ * Sockets are plain ints either way. Calls follow the socket API they stand for:
+ * -1 with errno set on failure, receive() fails with EAGAIN once the queue is empty.
+*/
+
+#ifndef TFTP_NET_HPP
+#define TFTP_NET_HPP
+
+#include <functional>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include "event_loop.hpp"
+
+class DatagramNet {
+public:
+    virtual ~DatagramNet() = default;
+
+    // New non-blocking datagram socket
+    virtual int open() = 0;
+    // Port 0 picks a free one; reuse_port lets several sockets share it (SO_REUSEPORT)
+    virtual int bind(int sock, const struct sockaddr_in &addr, bool reuse_port = false) = 0;
+    virtual int local_address(int sock, struct sockaddr_in &addr) = 0;
+    // Room for datagrams waiting to be received (SO_RCVBUF); the kernel caps it at
+    // net.core.rmem_max. Transports without such a queue ignore it
+    virtual int set_receive_buffer(int, int) { return 0; }
+    // SO_INCOMING_CPU: among sockets sharing a port, prefer this one for datagrams the
+    // kernel handles on cpu. Reading it back gives the CPU the last datagram was
+    // handled on, -1 where transports do not know
+    virtual int set_incoming_cpu(int, int) { return 0; }
+    virtual int incoming_cpu(int) { return -1; }
+    // SO_BUSY_POLL: a receive or poll that finds sock empty polls the device's queue for
+    // up to usec instead of waiting for its interrupt. Raising it past the
+    // net.core.busy_read sysctl takes CAP_NET_ADMIN
+    virtual int set_busy_poll(int, int) { return 0; }
+    // Only datagrams from peer are received afterwards, send_to(nullptr) goes to it
+    virtual int connect(int sock, const struct sockaddr_in &peer) = 0;
+    virtual ssize_t send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) = 0;
+    virtual ssize_t receive(int sock, char *buf, size_t cap, struct sockaddr_in *from) = 0;
+    virtual void close(int sock) = 0;
+
+    // Calls readable on loop's thread whenever sock may have datagrams queued
+    virtual void watch(EventLoop &loop, int sock, std::function<void()> readable) = 0;
+    // Safe from inside the socket's own callback
+    virtual void unwatch(EventLoop &loop, int sock) = 0;
+
+    // One round of work for a thread that owns loop and is waiting on a transfer
+    virtual void run_once(EventLoop &loop) { loop.run_once(); }
+
+    // Process wide KernelNet
+    static DatagramNet &kernel();
+};
+
+class KernelNet : public DatagramNet {
+public:
+    int open() override;
+    int bind(int sock, const struct sockaddr_in &addr, bool reuse_port = false) override;
+    int local_address(int sock, struct sockaddr_in &addr) override;
+    int set_receive_buffer(int sock, int bytes) override;
+    int set_incoming_cpu(int sock, int cpu) override;
+    int incoming_cpu(int sock) override;
+    int set_busy_poll(int sock, int usec) override;
+    int connect(int sock, const struct sockaddr_in &peer) override;
+    ssize_t send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) override;
+    ssize_t receive(int sock, char *buf, size_t cap, struct sockaddr_in *from) override;
+    void close(int sock) override;
+    void watch(EventLoop &loop, int sock, std::function<void()> readable) override;
+    void unwatch(EventLoop &loop, int sock) override;
+};
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Where the server's workers run. On a multi-socket machine, a worker whose thread,
+ * packets and memory sit on different NUMA nodes pays for every cache line that
+ * crosses the interconnect. With ServerConfig::pin_workers each worker gets a CPU of
+ * its own, the workers spread over the nodes, and a worker's memory comes from its
+ * node: the Worker itself (loop, counters, queues) through alloc_on_node(), and all
+ * it allocates on its thread afterwards (sessions, their packet and window buffers,
+ * the image blocks it decodes into its node's cache slice) through the thread's
+ * memory policy.
+ *
+ * Topology comes from /sys/devices/system/node; without it every CPU is on node 0.
+*/
+
+#ifndef TFTP_PLACEMENT_HPP
+#define TFTP_PLACEMENT_HPP
+
+#include <sched.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct WorkerPlacement {
+    int cpu = -1;       // -1 = not pinned
+    int node = -1;
+    size_t slice = 0;   // the node's image cache slice, see ImageStore::slice_cache()
+};
+
+// Parses a cpulist such as "0-3,8,10-11"; false if it is malformed
+bool parse_cpu_list(const std::string &text, std::vector<int> &cpus);
+
+class CpuTopology {
+public:
+    // The machine's nodes and the CPUs this process may run on
+    static CpuTopology detect();
+
+    // -1 for a CPU the topology does not know
+    int node_of(int cpu) const;
+    // count workers over cpus (empty = every CPU this process may use), one CPU each
+    // while they last. Nodes take turns, so a few workers already cover them all.
+    // Slices number the nodes that got a worker, from 0
+    std::vector<WorkerPlacement> place(size_t count, const std::vector<int> &cpus) const;
+
+private:
+    std::vector<int> nodes;     // by CPU, -1 for CPUs no node lists
+    std::vector<int> allowed;
+};
+
+// Pins the calling thread to p.cpu and has its pages allocated on p.node first.
+// previous, if given, receives the affinity to put back with unpin_thread()
+bool pin_thread(const WorkerPlacement &p, cpu_set_t *previous = nullptr);
+void unpin_thread(const cpu_set_t &previous);
+
+// Page aligned memory whose pages come from node first wherever they are touched;
+// node -1 = the usual policy. nullptr if bytes cannot be mapped
+void *alloc_on_node(size_t bytes, int node);
+void free_on_node(void *p, size_t bytes);
+
+#endif
@@ -1,22 +1,224 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <cerrno>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include "tftp_common.hpp"
 
-#define SIZE = 512 //default size
+#define SIZE 512 //default size
+#define MAX_BLKSIZE 65464 //RFC 2348 upper bound
+#define MAX_WINDOWSIZE 65535 //RFC 7440 upper bound
+#define RESUME_PIECE_BYTES (1 << 20) //prefixsum hashes the bytes before the offset in pieces of this much
 enum op_code{
   RREQ =1, //read req
   WREQ=2,  //write req
   DATA=3, //data
   ACK=4,  //acknowledge
-  ERROR=5 //err
+  ERROR=5, //err
+  OACK=6  //option acknowledge (RFC 2347)
+};
+
+enum error_code{
+  ERR_UNDEFINED=0,
+  ERR_NOT_FOUND=1,
+  ERR_ACCESS=2,
+  ERR_DISK_FULL=3,
+  ERR_ILLEGAL_OP=4,
+  ERR_UNKNOWN_TID=5,
+  ERR_EXISTS=6,
+  ERR_NO_USER=7,
+  ERR_OPTION=8
 };
 
 typedef struct Packet{
   uint32_t op_code;
   uint32_t block;
-  char data[SIZE];  
-}Packet; 
+  char data[SIZE];
+}Packet;
+
+// RRQ/WRQ as it arrives on the wire, options kept in request order
+struct Request{
+  uint16_t op_code;
+  std::string filename;
+  std::string mode;
+  std::vector<std::pair<std::string, std::string>> options;
+};
+
+// values negotiated through OACK, defaults are plain RFC 1350
+struct TransferOptions{
+  uint16_t blksize = SIZE;
+  uint16_t windowsize = 1;
+  uint8_t timeout = 0;   //seconds, 0 = not requested
+  bool has_tsize = false;
+  uint64_t tsize = 0;
+  bool has_offset = false;  //turbotftp extension: serve from this byte (octet only)
+  uint64_t offset = 0;
+  bool has_length = false;  //turbotftp extension: stop after this many bytes
+  uint64_t length = 0;
+  std::string prefixsum;    //turbotftp extension: hash128 hex of the bytes just before offset
+};
+
+inline uint16_t get_u16(const char *p){
+  uint16_t v;
+  memcpy(&v, p, 2);
+  return to_host_order(v);
+}
+inline void put_u16(char *p, uint16_t v){
+  v = to_network_order(v);
+  memcpy(p, &v, 2);
+}
+
+inline std::string lower(std::string s){
+  for(auto &c : s) if(c >= 'A' && c <= 'Z') c = c - 'A' + 'a';
+  return s;
+}
+
+// splits a run of NUL terminated strings
+inline bool parse_fields(const char *buf, size_t len, std::vector<std::string> &fields){
+  fields.clear();
+  size_t pos = 0;
+  while(pos < len){
+    const char *end = (const char *)memchr(buf + pos, '\0', len - pos);
+    if(!end) return false; //unterminated string
+    fields.emplace_back(buf + pos, end - (buf + pos));
+    pos = end - buf + 1;
+  }
+  return true;
+}
+
+// parses | opcode | filename | 0 | mode | 0 | (opt | 0 | value | 0)* |
+inline bool parse_request(const char *buf, size_t len, Request &req){
+  if(len < 4) return false;
+  req.op_code = get_u16(buf);
+  if(req.op_code != RREQ && req.op_code != WREQ) return false;
+  std::vector<std::string> fields;
+  if(!parse_fields(buf + 2, len - 2, fields)) return false;
+  if(fields.size() < 2 || fields[0].empty() || fields.size() % 2 != 0) return false;
+  req.filename = fields[0];
+  req.mode = lower(fields[1]);
+  if(!valid_mode(req.mode)) return false;
+  req.options.clear();
+  for(size_t i = 2; i < fields.size(); i += 2)
+    req.options.emplace_back(lower(fields[i]), fields[i + 1]);
+  return true;
+}
+
+// decimal digits only: strtoull alone skips leading blanks, takes a sign and
+// saturates at ULLONG_MAX
+inline bool parse_number(const std::string &s, uint64_t &out){
+  if(s.empty() || s[0] < '0' || s[0] > '9') return false;
+  char *end = nullptr;
+  errno = 0;
+  unsigned long long v = strtoull(s.c_str(), &end, 10);
+  if(*end != '\0' || errno == ERANGE) return false;
+  out = v;
+  return true;
+}
+
+// applies the options we understand, clamped to the server limits;
+// unknown or malformed options are left out of the OACK as RFC 2347 allows
+inline void parse_options(const Request &req, TransferOptions &opts,
+                          uint16_t max_blksize = MAX_BLKSIZE,
+                          uint16_t max_windowsize = MAX_WINDOWSIZE){
+  for(const auto &opt : req.options){
+    uint64_t v;
+    if(!parse_number(opt.second, v)) continue;
+    if(opt.first == "blksize" && v >= 8){
+      opts.blksize = (uint16_t)(v > max_blksize ? max_blksize : v);
+    } else if(opt.first == "windowsize" && v >= 1){
+      opts.windowsize = (uint16_t)(v > max_windowsize ? max_windowsize : v);
+    } else if(opt.first == "timeout" && v >= 1 && v <= 255){
+      opts.timeout = (uint8_t)v;
+    } else if(opt.first == "tsize"){
+      opts.has_tsize = true;
+      opts.tsize = v;
+    } else if(opt.first == "offset"){
+      opts.has_offset = true;
+      opts.offset = v;
+    } else if(opt.first == "length"){
+      opts.has_length = true;
+      opts.length = v;
+    }
+  }
+  for(const auto &opt : req.options)
+    if(opt.first == "prefixsum" && opt.second.size() == 32) opts.prefixsum = lower(opt.second);
+}
+
+inline size_t append_option(char *buf, size_t pos, size_t cap, const std::string &name, const std::string &value){
+  if(pos + name.size() + value.size() + 2 > cap) return pos;
+  memcpy(buf + pos, name.c_str(), name.size() + 1);
+  pos += name.size() + 1;
+  memcpy(buf + pos, value.c_str(), value.size() + 1);
+  return pos + value.size() + 1;
+}
+
+// client side: what the server agreed to in its OACK, anything absent stays default
+inline bool parse_oack(const char *buf, size_t len, TransferOptions &opts){
+  if(len < 2 || get_u16(buf) != OACK) return false;
+  Request acked;
+  std::vector<std::string> fields;
+  if(!parse_fields(buf + 2, len - 2, fields) || fields.size() % 2 != 0) return false;
+  for(size_t i = 0; i < fields.size(); i += 2)
+    acked.options.emplace_back(lower(fields[i]), fields[i + 1]);
+  opts = TransferOptions{};
+  parse_options(acked, opts);
+  return true;
+}
+
+// | opcode | filename | 0 | mode | 0 | (opt | 0 | value | 0)* |, 0 if it does not fit
+inline size_t build_request(char *buf, size_t cap, uint16_t op, const std::string &filename,
+                            const std::string &mode,
+                            const std::vector<std::pair<std::string, std::string>> &options){
+  size_t need = 2 + filename.size() + 1 + mode.size() + 1;
+  for(const auto &opt : options) need += opt.first.size() + opt.second.size() + 2;
+  if(need > cap) return 0;
+  put_u16(buf, op);
+  size_t pos = append_option(buf, 2, cap, filename, mode);
+  for(const auto &opt : options) pos = append_option(buf, pos, cap, opt.first, opt.second);
+  return pos;
+}
+
+inline size_t build_data_header(char *buf, uint16_t block){
+  put_u16(buf, DATA);
+  put_u16(buf + 2, block);
+  return 4;
+}
+inline size_t build_ack(char *buf, uint16_t block){
+  put_u16(buf, ACK);
+  put_u16(buf + 2, block);
+  return 4;
+}
+// 0 if cap cannot hold even an empty message
+inline size_t build_error(char *buf, size_t cap, uint16_t code, const char *msg){
+  if(cap < 5) return 0;
+  size_t n = strlen(msg);
+  if(n > cap - 5) n = cap - 5;
+  put_u16(buf, ERROR);
+  put_u16(buf + 2, code);
+  memcpy(buf + 4, msg, n);
+  buf[4 + n] = '\0';
+  return 5 + n;
+}
+
+// OACK echoing only the options the peer asked for
+inline size_t build_oack(char *buf, size_t cap, const Request &req, const TransferOptions &opts){
+  put_u16(buf, OACK);
+  size_t pos = 2;
+  for(const auto &opt : req.options){
+    if(opt.first == "blksize") pos = append_option(buf, pos, cap, "blksize", std::to_string(opts.blksize));
+    else if(opt.first == "windowsize") pos = append_option(buf, pos, cap, "windowsize", std::to_string(opts.windowsize));
+    else if(opt.first == "timeout" && opts.timeout) pos = append_option(buf, pos, cap, "timeout", std::to_string(opts.timeout));
+    else if(opt.first == "tsize" && opts.has_tsize) pos = append_option(buf, pos, cap, "tsize", std::to_string(opts.tsize));
+    else if(opt.first == "offset" && opts.has_offset) pos = append_option(buf, pos, cap, "offset", std::to_string(opts.offset));
+    else if(opt.first == "length" && opts.has_length) pos = append_option(buf, pos, cap, "length", std::to_string(opts.length));
+    else if(opt.first == "prefixsum" && !opts.prefixsum.empty()) pos = append_option(buf, pos, cap, "prefixsum", opts.prefixsum);
+  }
+  return pos;
+}
 
-#endif 
+#endif
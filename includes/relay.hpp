@@ -0,0 +1,66 @@
+/*
+ * Caching relay. A server with ServerConfig::upstream fetches the files it does not
+ * have from another TFTP server and keeps them under its own root, for sites whose
+ * link to the central image repository is slow.
+ *
+ * The first RRQ for a missing file starts an upstream get on its worker's loop. The
+ * blocks go into a partial file in the root's .relay directory as they arrive, and
+ * every RRQ for the file meanwhile, on any worker, streams from that partial file:
+ * its session sends what has arrived and waits (ImageSource::when_readable) for the
+ * rest. Once the fetch completes the file is synced, its directories are created and
+ * it is renamed into place, on the storage pool when the server has one; then the
+ * worker's loop marks the fetch complete, and later RRQs are served from the file
+ * like from any other. A failed fetch fails the transfers streaming from it, with the upstream's
+ * ERROR, and leaves nothing behind.
+*/
+
+#ifndef TFTP_RELAY_HPP
+#define TFTP_RELAY_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "async_client.hpp"
+#include "event_loop.hpp"
+#include "image_store.hpp"
+#include "metrics.hpp"
+
+class RelayFetch;
+
+class RelayCache {
+public:
+    // What an RRQ gets: a source streaming the file, or why there is none
+    struct Opened {
+        std::unique_ptr<ImageSource> source;
+        uint16_t code = 0;          // TFTP error code when source is null
+        std::string message;
+    };
+    using Ready = std::function<void(Opened)>;
+
+    // Removes partial files that processes no longer running left in root's .relay
+    RelayCache(ImageStore &store, const std::string &root);
+
+    // For an RRQ whose file store does not have under root: joins the fetch of
+    // filename in progress, or starts one through upstream, whose loop is loop. ready
+    // runs on loop once the upstream has answered; a file that arrived in full
+    // meanwhile is opened from store through cache slice slice. Counts into metrics,
+    // and so does the fetch it starts. loop's thread only
+    void open(const std::string &root, const std::string &filename, EventLoop &loop, AsyncTFTPClient &upstream, size_t slice,
+              WorkerMetrics &metrics, Ready ready);
+    // Fetches in progress; any thread
+    size_t fetching() const;
+
+private:
+    ImageStore &store;
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<RelayFetch>> fetches;   // by root path
+
+    void finished(const std::shared_ptr<RelayFetch> &fetch);
+};
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Sharing a worker's sending between its transfers. Left alone, every ACK refills
+ * that session's whole window on the spot, so a client asking for 64 blocks of
+ * 64 KiB per round trip takes 64 times what a lock-step config fetch gets, and the
+ * fetch's next block waits behind each of those bursts.
+ *
+ * FairScheduler runs deficit round robin over the sessions with blocks ready: each
+ * round, every backlogged session earns a quantum of bytes and sends whole blocks
+ * while its deficit covers them. Bandwidth is shared by bytes, whatever blksize and
+ * windowsize each client negotiated.
+ *
+ * TokenBucket caps a rate. The server keeps one per worker for its total egress
+ * (ServerConfig::rate_limit) and one per client address block, shared by all
+ * workers (ServerConfig::client_rate_limit).
+*/
+
+#ifndef TFTP_SCHEDULER_HPP
+#define TFTP_SCHEDULER_HPP
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <netinet/in.h>
+#include "event_loop.hpp"
+
+class SendSession;
+
+// rate bytes per second with up to burst bytes saved up. Thread safe
+class TokenBucket {
+public:
+    TokenBucket(uint64_t rate, uint64_t burst);
+    // Bytes that may go now
+    uint64_t available(uint64_t now_ms);
+    // Takes n bytes; may run into debt by less than a block, which the next refill pays
+    void take(uint64_t n);
+    // Milliseconds until n bytes are available, at least 1
+    uint64_t wait_ms(uint64_t n, uint64_t now_ms);
+
+private:
+    std::mutex mutex;
+    double rate;
+    double burst;
+    double tokens;
+    uint64_t last_ms = 0;
+
+    void refill(uint64_t now_ms);
+};
+
+// One bucket per client address block (prefix bits of the IPv4 address), created on
+// first use and dropped once no session holds it. Thread safe
+class ClientLimiter {
+public:
+    ClientLimiter(uint64_t rate, uint64_t burst, int prefix);
+    // nullptr while the rate is 0
+    std::shared_ptr<TokenBucket> bucket_for(const struct sockaddr_in &client);
+    // Buckets handed out from now on follow these; the ones sessions already hold do not
+    void set_limits(uint64_t rate, uint64_t burst, int prefix);
+
+private:
+    std::mutex mutex;
+    uint64_t rate;
+    uint64_t burst;
+    uint32_t mask;
+    std::unordered_map<uint32_t, std::weak_ptr<TokenBucket>> buckets;
+    size_t sweep_at = 1024;
+};
+
+// Per worker, loop thread only
+class FairScheduler {
+public:
+    // quantum: bytes a backlogged session earns per round, 0 = no sharing, each turn
+    // sends all the window and the buckets allow (rate limits only). rate: the
+    // worker's total, 0 = unlimited
+    FairScheduler(EventLoop &loop, uint32_t quantum, uint64_t rate = 0);
+    ~FairScheduler();
+
+    // session has blocks ready; it sends them from run() when its turn comes
+    void wake(SendSession &session);
+    // Drops a session that is going away
+    void forget(SendSession &session);
+    // The worker's total from now on, 0 = unlimited
+    void set_rate(uint64_t rate);
+    size_t backlogged() const { return active.size(); }
+
+private:
+    struct Entry {
+        SendSession *session;
+        int64_t deficit;
+        uint64_t throttled_until;   // waiting for its client bucket, loop clock ms
+    };
+
+    EventLoop &loop;
+    uint32_t quantum;
+    std::unique_ptr<TokenBucket> total;
+    std::list<Entry> active;
+    std::unordered_map<SendSession *, std::list<Entry>::iterator> index;
+    bool deferred = false;
+    uint64_t timer = 0;
+
+    void schedule();
+    void run();
+    // One turn for e: earn a quantum, send what it and the buckets allow. Returns the
+    // bytes sent; wait is set if the worker's bucket is dry
+    uint64_t visit(Entry &e, uint64_t now, uint64_t &wait);
+};
+
+#endif
@@ -6,27 +6,310 @@
 #ifndef TFTP_SERVER_HPP
 #define TFTP_SERVER_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <netinet/in.h>
+#include "access_log.hpp"
+#include "demux_net.hpp"
+#include "event_loop.hpp"
+#include "flight_recorder.hpp"
+#include "handoff.hpp"
+#include "image_store.hpp"
+#include "metrics.hpp"
+#include "net.hpp"
+#include "placement.hpp"
+#include "protocal.hpp"
+#include "relay.hpp"
+#include "scheduler.hpp"
+#include "session.hpp"
+#include "shard.hpp"
+#include "storage_pool.hpp"
+#include "xdp_net.hpp"
 
 #define SERVER_PORT 69      // Default UDP port
 #define BUFFER_SIZE 516     //+ 4 bytes for header
 
+struct ServerConfig {
+    std::string root = ".";          // directory files are served from
+    uint16_t port = SERVER_PORT;     // 0 picks a free port, see TFTPServer::port()
+    int workers = 1;                 // event loop threads sharing the port (SO_REUSEPORT)
+    bool allow_write = true;         // accept WRQ
+    bool dedup = false;              // store uploads in the content-addressed chunk store
+    uint32_t chunk_sweep_s = 3600;   // with dedup, remove chunks no upload refers to any more this
+                                     // often, the first time one interval after start; 0 = never
+    uint16_t max_blksize = MAX_BLKSIZE;
+    uint16_t max_windowsize = 64;
+    size_t cache_bytes = 64 << 20;   // decompressed image cache
+    int metrics_port = -1;           // Prometheus endpoint on 127.0.0.1, -1 = off, 0 = any port
+    std::string metrics_socket;      // or on this Unix socket path
+    size_t flight_events = 0;        // per worker flight recorder ring, 0 = off
+    std::string access_log;          // binary log of every request and transfer, see access_log.hpp
+    bool log_requests = false;       // without access_log, print each request to stdout
+    std::string flight_dir;          // dump the ring here when a session fails (at most 1/s per worker)
+    SessionLimits limits;
+    DatagramNet *net = nullptr;      // transport, nullptr = kernel sockets; a SimNet host for tests
+    std::string upgrade_socket;      // take over from / hand over to another process, see handoff.hpp
+    int shared_sockets = 0;          // per worker: serve every transfer from this many sockets,
+                                     // see demux_net.hpp; 0 = a TID socket per transfer
+    std::string xdp_interface;       // move DATA and ACKs over AF_XDP on this interface, worker i
+                                     // on its queue i, see xdp_net.hpp; uses shared sockets
+    // Sending, see scheduler.hpp. Limits are bytes/s of DATA the server sends, 0 = none
+    bool fair_queueing = true;       // deficit round robin between a worker's RRQs
+    uint32_t fair_quantum = 1432;    // bytes a session earns per round
+    uint64_t rate_limit = 0;         // all transfers together, split evenly over the workers
+    uint64_t client_rate_limit = 0;  // per client address block
+    int client_prefix = 32;          // address bits that make a block: 32 per IP, 24 per /24
+    // Admission control. Past max_sessions transfers a worker queues new requests, RRQs
+    // for small files ahead of the rest, and sheds what does not fit in the queue
+    size_t max_sessions = 0;         // per worker, 0 = unlimited
+    size_t max_pending = 256;        // queued requests per worker
+    uint64_t small_file = 1 << 20;   // RRQs for files up to this size go first
+    uint32_t max_queue_ms = 3000;    // requests waiting longer are shed before their clients give up
+    bool shed_silently = false;      // drop instead of answering "Server busy"; clients retry on timeout
+    int request_buffer = 4 << 20;    // SO_RCVBUF of the listening (and shared) sockets, so a burst
+                                     // waits in the kernel instead of being dropped; 0 = system default
+    // Placement, see placement.hpp
+    bool pin_workers = false;        // a CPU per worker, spread over the NUMA nodes, with the
+                                     // worker's memory and a slice of the image cache on its node
+    std::vector<int> worker_cpus;    // the CPUs to pin to; empty = all the process may run on
+    uint32_t busy_poll_us = 0;       // workers spin on their sockets for up to this long before
+                                     // sleeping, see EventLoop::busy_poll(); 0 = sleep in epoll_wait
+    size_t storage_threads = 0;      // run opens, resume checksums, image inflation and upload
+                                     // commits on this many threads instead of the workers, see
+                                     // storage_pool.hpp; 0 = inline
+    // Caching relay, see relay.hpp: RRQs for files the root does not have are fetched
+    // from this server ("host" or "host:port") and kept under the root; empty = off
+    std::string upstream;
+    uint16_t upstream_blksize = 1428;     // asked of the upstream, 0 = RFC 1350 blocks
+    uint16_t upstream_windowsize = 16;
+    // Sharding front end, see shard.hpp: every request is relayed to the one of these
+    // servers ("host" or "host:port") its filename hashes to; root is not used then
+    std::vector<std::string> shards;
+};
+
 class TFTPServer {
 public:
     TFTPServer();
+    explicit TFTPServer(const ServerConfig &config);
     ~TFTPServer();
 
+    // Runs the workers; blocks until stop()
     void start();
+    // Safe to call from any thread
+    void stop();
+    // Port the workers are bound to (the ephemeral one when config.port is 0)
+    uint16_t port() const { return bound_port; }
+    // All workers' counters and histograms merged; safe to call from any thread
+    MetricsSnapshot metrics() const;
+    // Port of the Prometheus endpoint, 0 if it is off or on a Unix socket
+    uint16_t metrics_port() const { return exporter ? exporter->port() : 0; }
+    // Writes every worker's flight recorder to path, merged by time; any thread
+    bool dump_flight(const std::string &path) const;
+    // Transfers taken over from the previous process when this one was constructed
+    size_t adopted() const { return adopted_count; }
+    // Set once a successor has taken the port over; start() then returns by itself
+    // when the transfers that could not move have finished
+    bool handed_off() const { return handed; }
+    // Switches to next's root, allow_write, dedup, max_blksize, max_windowsize,
+    // cache_bytes, limits, rate limits, admission control and log_requests without a
+    // restart. Each worker takes the new snapshot between two events and reads it
+    // without locks from then on; transfers already running keep what they
+    // negotiated. With dedup on, the root stays the one the server started with, where
+    // the chunk store is. Returns the names of the other settings next changes, which
+    // only a restart applies. Any thread
+    std::vector<std::string> reload(const ServerConfig &next);
 
 private:
-    int sock;  
+    // What the successor needs besides the session's own state to reopen a transfer
+    struct Movable {
+        uint16_t op;
+        std::string filename;
+        bool keep_partial;
+    };
+
+    // What an RRQ needs from storage before its session can start
+    struct OpenedFile {
+        std::unique_ptr<ImageSource> source;
+        int error = 0;              // errno when source is null
+        std::string prefixsum;      // resume: hash of our bytes before the requested offset
+        bool relayed = false;       // streams from an upstream fetch in progress
+    };
+    // What a WRQ needs: the upload and, for a resume, what we already have of it
+    struct CreatedFile {
+        std::unique_ptr<ImageSink> sink;
+        int error = 0;
+        uint64_t have = 0;
+        std::string prefixsum;
+        bool dedup = false;         // goes to the chunk store
+    };
+
+    // A request waiting for a session slot
+    struct Pending {
+        struct sockaddr_in client;
+        Request req;
+        OpenedFile file;            // RRQ: opened on arrival, for its size
+        uint64_t arrived_ns;
+    };
+
+    struct Worker {
+        // A pinned worker lives in memory of its node, node -1 for the usual policy
+        static void *operator new(size_t size, int node) {
+            void *p = alloc_on_node(size, node);
+            if (!p)
+                throw std::bad_alloc();
+            return p;
+        }
+        static void operator delete(void *p, size_t size) { free_on_node(p, size); }
+        static void operator delete(void *p, int) { free_on_node(p, sizeof(Worker)); }
+
+        EventLoop loop;
+        // the settings this worker runs with: reload()'s latest once the worker has
+        // seen it. Only the worker's thread touches the pointer; the snapshot is immutable
+        std::shared_ptr<const ServerConfig> settings;
+        std::unique_ptr<FairScheduler> scheduler;  // outlives the sessions that use it
+        std::unique_ptr<DemuxNet> demux;            // with config.shared_sockets or an XdpNet, likewise
+        FramePool frames;                           // the sessions' coroutine frames, likewise
+        DallyList dally{loop};                      // TIDs of finished uploads, after demux
+        int sock = -1;
+        std::thread thread;
+        std::unordered_map<Session *, std::unique_ptr<Session>> sessions;
+        WorkerMetrics metrics;
+        uint64_t request_ns = 0;    // arrival of the request being handled
+        uint16_t request_op = 0;
+        uint32_t index = 0;
+        WorkerPlacement placement;
+        std::unique_ptr<FlightRecorder> recorder;
+        uint32_t flight_ids = 0;
+        AccessLog::Ring *log = nullptr;     // with config.access_log
+        uint64_t last_dump_ns = 0;
+        // sessions an upgrade may hand over, the rest finish here
+        std::unordered_map<Session *, Movable> movable;
+        bool draining = false;      // handed off: stop once the last session is gone
+        // admission control: queued requests and the client TIDs they came from,
+        // so a client resending its request does not queue twice
+        std::deque<Pending> pending_small;
+        std::deque<Pending> pending_large;
+        std::unordered_set<uint64_t> pending_peers;
+        // TIDs of sessions started from the queue: a request the client resent while
+        // it waited may still arrive after its session has started
+        std::unordered_set<uint64_t> admitted_peers;
+        // peers whose request waits on the storage pool or the upstream; they count as sessions
+        std::unordered_set<uint64_t> opening;
+        std::unique_ptr<AsyncTFTPClient> upstream;  // with config.upstream, fetches run on this loop
+        std::unique_ptr<ShardProxy> proxy;          // with config.shards
+    };
+
+    // One worker's share of a handoff: its listening socket and suspended transfers
+    struct HandoffPart {
+        int sock = -1;
+        std::vector<HandoffSession> sessions;
+        size_t staying = 0;         // sessions left to finish on the worker
+    };
+
+    int sock;
+    uint16_t bound_port = 0;
+    ServerConfig config;            // as started; what reload() cannot change comes from here
+    std::mutex reload_mutex;
+    std::shared_ptr<const ServerConfig> settings;   // the latest reload(), under reload_mutex
+    std::atomic<uint64_t> reloads{0};
+    DatagramNet &net;
+    ImageStore store;
+    std::unique_ptr<RelayCache> relay;  // with config.upstream
+    std::unique_ptr<ShardRing> shard_ring;  // with config.shards
+    CpuTopology topology;           // with config.pin_workers
+    std::unique_ptr<AccessLog> access_log;  // outlives the workers writing to it
+    std::unique_ptr<XdpProgram> xdp;    // outlives the workers' sockets
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::unique_ptr<MetricsExporter> exporter;
+    std::unique_ptr<ClientLimiter> client_limits;  // hands out no buckets while client_rate_limit is 0
+    std::unique_ptr<StoragePool> storage;   // with config.storage_threads
+    int upgrade_fd = -1;            // listen_handoff() socket, -1 without config.upgrade_socket
+    int upgrade_wake = -1;
+    std::thread upgrade_thread;
+    std::thread sweeper;            // ChunkStore::sweep() every config.chunk_sweep_s
+    std::mutex sweep_mutex;
+    std::condition_variable sweep_wake;
+    bool sweep_stop = false;
+    size_t adopted_count = 0;
+    std::atomic<bool> handed{false};
+
+    int bind_socket(uint16_t port);
     // Handles incoming TFTP requests
-    void handle_request();
-    // Handles Read Request (RRQ) - Sending files
-    void handle_rrq(struct sockaddr_in &client, socklen_t client_len, const std::string &filename);
-    // Handles Write Request (WRQ) - Receiving files
-    void handle_wrq(struct sockaddr_in &client, socklen_t client_len, const std::string &filename);
+    void handle_request(Worker &worker);
+    // Opens an RRQ's file, then queues or starts it
+    void open_rrq(Worker &worker, const struct sockaddr_in &client, const Request &req);
+    void opened_rrq(Worker &worker, const struct sockaddr_in &client, const Request &req, uint64_t arrived,
+                    OpenedFile file);
+    // An RRQ for a file the root does not have: streams it from the upstream
+    void relay_rrq(Worker &worker, const struct sockaddr_in &client, const Request &req, uint64_t arrived);
+    // Handles Read Request (RRQ) - Sending files, from its opened file
+    void handle_rrq(Worker &worker, struct sockaddr_in &client, socklen_t client_len, const Request &req,
+                    OpenedFile file);
+    // Handles Write Request (WRQ) - Receiving files: creates the upload, then starts it
+    void handle_wrq(Worker &worker, struct sockaddr_in &client, socklen_t client_len, const Request &req);
+    void start_wrq(Worker &worker, struct sockaddr_in &client, const Request &req, CreatedFile file);
+    // The blocking part of each, safe on any thread
+    OpenedFile open_file(const std::string &root, const Request &req, const TransferOptions &opts, size_t slice);
+    CreatedFile create_file(const std::string &root, const Request &req, bool dedup, bool resume, size_t slice);
+    // done(work()) right away, or work() on the storage pool and done on worker's loop
+    // once it returns; client counts as opening meanwhile
+    template <class Work, class Done>
+    void storage_call(Worker &worker, const struct sockaddr_in &client, Work work, Done done);
+    // Sessions running or about to start from the storage pool
+    size_t busy_slots(const Worker &worker) const { return worker.sessions.size() + worker.opening.size(); }
+    // A new request has to queue: no slot free, or others already wait for one
+    bool must_wait(const Worker &worker) const {
+        size_t max = worker.settings->max_sessions;
+        return max && (busy_slots(worker) >= max || !worker.pending_peers.empty());
+    }
+    // Ephemeral socket connected to the client, the session's TID
+    int open_session_socket(Worker &worker, const struct sockaddr_in &client, socklen_t client_len);
+    // What the worker's sessions send and receive through
+    DatagramNet &session_net(Worker &worker) { return worker.demux ? *worker.demux : net; }
+    // Past config.max_sessions: queue req, or shed it (or a larger queued one) if full
+    void enqueue(Worker &worker, const struct sockaddr_in &client, const Request &req, OpenedFile file);
+    // Starts queued requests while worker has session slots free
+    void admit(Worker &worker);
+    void shed(Worker &worker, const struct sockaddr_in &client);
+    // Sheds queued requests older than config.max_queue_ms
+    void expire(Worker &worker);
+    // ERROR for an RRQ whose file cannot be opened, from errno
+    void reject_open(Worker &worker, const struct sockaddr_in &client, socklen_t client_len);
+    void reject(Worker &worker, const struct sockaddr_in &client, socklen_t client_len,
+                uint16_t code, const char *msg);
+    Session &add_session(Worker &worker, std::unique_ptr<Session> session, const std::string &filename,
+                         std::function<void(bool ok)> done = nullptr);
+    // Appends a type record about client to the worker's access log, fill sets the
+    // rest; counted as dropped when the log's writer has fallen behind
+    template <class Fill>
+    void log_access(Worker &worker, uint8_t type, const struct sockaddr_in &client, Fill fill);
+    // Called when a session of worker fails: dump its ring to config.flight_dir
+    void dump_failed(Worker &worker, uint32_t flight_id);
+    // Hands rrq's sending to the worker's scheduler and its client's rate limit
+    void pace(Worker &worker, SendSession &rrq, const struct sockaddr_in &client);
+    // On worker's thread: switch it to next, see reload()
+    void apply_settings(Worker &worker, std::shared_ptr<const ServerConfig> next);
+    void start_metrics();
+    // Starts the sweeper once dedup is on; again under reload_mutex after the constructor
+    void start_sweeper(const ServerConfig &with);
+    // Pins the calling thread where worker belongs, if it is placed at all
+    bool pin(Worker &worker, cpu_set_t *previous);
+    // Upgrade: waits for a successor on upgrade_fd and hands over to it
+    void serve_upgrade();
+    bool hand_off(int conn);
+    // On worker's thread: stop taking requests and suspend what can move
+    HandoffPart suspend_worker(Worker &worker);
+    // Continues a transfer suspended by this or the previous process
+    void adopt(Worker &worker, const HandoffSession &state);
 };
 
-#endif 
+#endif
@@ -0,0 +1,301 @@
+/*
+ * One transfer on its own ephemeral port (TID). Each session's protocol runs as a
+ * coroutine (a Flow, see coroutine.hpp) on an EventLoop: it reads top to bottom,
+ * negotiate then transfer, and co_awaits the next packet or retransmit timeout,
+ * which the loop delivers. on_done fires once the transfer has finished either way.
+ *
+ * The same two machines serve both ends: SendSession answers an RRQ on the server
+ * and runs a put on the client, ReceiveSession answers a WRQ and runs a get. Client
+ * sessions start with request(), which keeps resending the RRQ/WRQ until the server
+ * replies from its new TID and then locks onto that address.
+ *
+ * DATA  -> | Opcode (2 bytes) | Block # (2 bytes) | Data (0..blksize bytes) |
+ * ACK   -> | Opcode (2 bytes) | Block # (2 bytes) |
+ * ERROR -> | Opcode (2 bytes) | ErrorCode (2 bytes) | ErrMsg (N bytes) | NULL (1 byte) |
+*/
+
+#ifndef TFTP_SESSION_HPP
+#define TFTP_SESSION_HPP
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+#include "coroutine.hpp"
+#include "event_loop.hpp"
+#include "flight_recorder.hpp"
+#include "handoff.hpp"
+#include "image_store.hpp"
+#include "metrics.hpp"
+#include "net.hpp"
+#include "protocal.hpp"
+#include "scheduler.hpp"
+
+class StoragePool;
+
+struct SessionLimits {
+    uint32_t timeout_ms = 1000;  // used when the peer did not negotiate "timeout"
+    int max_retries = 5;
+};
+
+// Free list of packet/window buffers so back to back transfers on one loop do not
+// reallocate them. Not thread safe: one pool per loop
+class BufferPool {
+public:
+    explicit BufferPool(size_t max_buffers = 256) : max_buffers(max_buffers) {}
+    // A buffer of exactly n bytes, recycled when one is free
+    std::vector<char> take(size_t n);
+    void give(std::vector<char> &&buf);
+
+private:
+    size_t max_buffers;
+    std::vector<std::vector<char>> spare;
+};
+
+// TIDs of finished receives, held open for a while after the final ACK (RFC 1350
+// section 6). If that ACK is lost the sender sends its last DATA again; with the TID
+// closed it would get an ICMP port unreachable and fail a transfer that completed.
+// Each TID held is an open socket, so past max_tids the oldest is closed early.
+// Not thread safe: one list per loop, destroyed before the transports it closes on
+class DallyList {
+public:
+    explicit DallyList(EventLoop &loop, size_t max_tids = 1024) : loop(loop), max_tids(max_tids) {}
+    ~DallyList();
+    DallyList(const DallyList &) = delete;
+    DallyList &operator=(const DallyList &) = delete;
+
+    // Takes sock over from a finished session: a resend of the last DATA is answered
+    // with final_ack, that block's ACK, until ms have passed, then net closes sock
+    void add(DatagramNet &net, int sock, const std::vector<char> &final_ack, uint32_t ms);
+    size_t size() const { return tids.size(); }
+
+private:
+    struct Tid {
+        DatagramNet *net;
+        std::vector<char> ack;
+        uint64_t timer;
+        uint64_t added;             // tells a socket number in order from its reuse
+    };
+    EventLoop &loop;
+    size_t max_tids;
+    uint64_t adds = 0;
+    std::unordered_map<int, Tid> tids;
+    std::deque<std::pair<int, uint64_t>> order;  // oldest first, with ones already dropped
+
+    void on_readable(int sock);
+    void drop(int sock);
+};
+
+// What a session's flow wakes up to: a packet, which stays valid until the flow
+// awaits again, or the retransmit timer running out
+struct SessionEvent {
+    const char *buf = nullptr;  // nullptr = timeout
+    size_t len = 0;
+    bool timeout() const { return !buf; }
+};
+
+class Session {
+public:
+    Session(EventLoop &loop, int sock, const struct sockaddr_in &peer,
+            const TransferOptions &opts, const SessionLimits &limits);
+    virtual ~Session();
+
+    bool ok() const { return succeeded; }
+    bool finished() const { return done; }
+    // Set when the transfer failed: the peer's ERROR message or a local reason
+    const std::string &error() const { return error_msg; }
+    // The code of the ERROR the peer ended the transfer with, -1 if it sent none
+    int peer_error() const { return peer_code; }
+    // Negotiated values; on the client these are what the OACK granted
+    const TransferOptions &options() const { return opts; }
+    // Payload bytes moved so far
+    uint64_t bytes() const { return transferred; }
+    // The other end's TID
+    const struct sockaddr_in &peer_address() const { return peer; }
+    // Ends the transfer as failed, telling the peer with an ERROR once it has a TID
+    void cancel(const char *reason = "Transfer cancelled");
+    // Draw buffers from pool and hand them back when done; set before request()
+    void use_pool(BufferPool &buffers);
+    // Transport sock belongs to (the kernel's by default); set before request()
+    void use_net(DatagramNet &transport) { net = &transport; }
+    // Hold the TID open in list after a receive's final ACK; set before request()
+    void use_dally(DallyList &list) { dally = &list; }
+    // Run the storage calls that block, committing an upload and decoding a packed
+    // image's blocks, on storage_pool, queued by hint; set before request()
+    virtual void use_storage(StoragePool &storage_pool, size_t hint);
+    // Allocate the session's flow from frames, one pool per loop; set before request()
+    void use_frames(FramePool &frames) { flow_frames = &frames; }
+    FramePool *frame_pool() const { return flow_frames; }
+    // Count into the owning worker's metrics; request_ns is when the RRQ/WRQ arrived,
+    // where the request-to-first-DATA and duration clocks start
+    void set_metrics(WorkerMetrics &worker_metrics, uint64_t request_ns);
+    // Record this session's packets, timers and state changes under id
+    void set_recorder(FlightRecorder &flight, uint32_t id);
+    // Upgrade handoff: fills state and lets go of the transfer without telling the
+    // peer or running on_done. Returns the TID socket, which the caller now owns,
+    // or -1 if the transfer cannot move and has to finish here
+    virtual int suspend(HandoffSession &state);
+
+    std::function<void(Session &)> on_done;
+    // Client: called once the server's reply has set options(); returning false
+    // cancels the transfer (a resume whose prefix does not match)
+    std::function<bool(Session &)> on_negotiated;
+
+protected:
+    EventLoop &loop;
+    int sock;
+    struct sockaddr_in peer;
+    TransferOptions opts;
+    SessionLimits limits;
+    DatagramNet *net;
+    BufferPool *pool = nullptr;
+    FramePool *flow_frames = nullptr;
+    DallyList *dally = nullptr;
+    StoragePool *storage = nullptr;
+    size_t storage_hint = 0;
+    WorkerMetrics *metrics = nullptr;
+    uint64_t started_ns = 0;
+    FlightRecorder *recorder = nullptr;
+    uint32_t flight_id = 0;
+    std::vector<char> packet;   // receive buffer, blksize + header
+    std::vector<char> pending;  // client RRQ/WRQ, resent until the first reply
+    uint64_t timer = 0;
+    uint64_t transferred = 0;
+    int retries = 0;
+    bool connected = true;      // server sockets are connected to the client up front
+    bool done = false;
+    bool succeeded = false;
+    std::string error_msg;
+    int peer_code = -1;
+    Flow flow;                  // the protocol, started by begin(), request() or resume()
+    Mailbox<SessionEvent> events;
+
+    // Starts watching the socket; subclasses call it before their first send
+    void attach();
+    // Client side: send the request to the server's well-known port
+    void send_request(const std::vector<char> &req);
+    void send_packet(const char *buf, size_t len);
+    void send_error(uint16_t code, const char *msg);
+    void arm_timer();
+    // Counts a packet sent again, block 0 for requests/OACKs
+    void note_retransmit(uint64_t block);
+    void finish(bool success, const char *reason = nullptr);
+    // Stops the timer and the watch and gives up the socket, for suspend()
+    int detach();
+    uint32_t timeout_ms() const;
+    // Adopts the options the OACK granted, or the RFC 1350 defaults when the server sent none
+    virtual void negotiated(const TransferOptions &granted);
+    // Runs on_negotiated, false if the transfer was cancelled
+    bool accept_options();
+
+private:
+    void on_readable();
+    void timer_fired();
+};
+
+// Sends an ImageSource: windowed DATA, go-back-N on gaps and timeouts
+class SendSession : public Session {
+public:
+    SendSession(EventLoop &loop, int sock, const struct sockaddr_in &peer, const TransferOptions &opts,
+                const SessionLimits &limits, std::unique_ptr<ImageSource> source, bool netascii);
+    ~SendSession() override;
+    // Server: oack empty = no options were negotiated, DATA 1 goes out straight away
+    void begin(const std::vector<char> &oack);
+    // Client: send the WRQ and start on its ACK 0 / OACK
+    void request(const std::vector<char> &wrq);
+    void use_storage(StoragePool &storage_pool, size_t hint) override;
+    // Server, octet only: past negotiation, the window and where it stands
+    int suspend(HandoffSession &state) override;
+    // Carries on a suspended transfer over its socket: rebuilds the blocks in
+    // flight from the source without resending them, the timer covers any loss
+    void resume(const HandoffSession &state);
+    // Leave sending to the worker's scheduler instead of refilling the window on
+    // every ACK; client_limit is this client's bucket, nullptr for none. Set before begin()
+    void use_scheduler(FairScheduler &scheduler, std::shared_ptr<TokenBucket> client_limit);
+    // Scheduler: wire size of the next block, 0 if the window is full or all is sent
+    size_t next_block_bytes() const;
+    // Scheduler: sends whole blocks while the next one fits in budget, returns bytes sent
+    uint64_t send_burst(uint64_t budget);
+    TokenBucket *client_bucket() const { return client_limit.get(); }
+
+protected:
+    void negotiated(const TransferOptions &granted) override;
+
+private:
+    std::unique_ptr<ImageSource> source;
+    bool netascii;
+    int carry = -1;                 // netascii byte that spilled over a block
+    std::vector<char> staged;       // netascii input not yet encoded
+    size_t staged_pos = 0;
+    uint64_t offset = 0;            // next source byte to read
+    uint64_t end = UINT64_MAX;      // stop reading here (length option)
+    uint64_t acked = 0;             // highest block acknowledged
+    uint64_t sent = 0;              // highest block sent
+    uint64_t generated = 0;         // highest block built in the ring
+    uint64_t last_block = 0;        // final short block once known
+    uint64_t highest_sent = 0;      // anything at or below this is a retransmit
+    std::vector<char> oack;
+    std::vector<std::vector<char>> ring;  // windowsize blocks, indexed by block % windowsize
+    std::vector<size_t> ring_len;
+    std::vector<uint64_t> ring_sent_ns;   // first send time for RTT samples, 0 once resent
+    FairScheduler *scheduler = nullptr;
+    std::shared_ptr<TokenBucket> client_limit;
+    bool starved = false;           // the source has not got the next block yet
+
+    // Negotiates unless resumed, then sends windows until the last block is acknowledged
+    Flow run();
+    void size_ring();
+    // Builds block in the ring; false with errno EAGAIN if the source is still
+    // waiting for its bytes, which leaves the position as it was
+    bool fill(uint64_t block);
+    bool window_open() const;
+    // Waits for the source to have more, then carries on sending
+    void starve();
+    // Sends block sent + 1; false if reading it failed and the session is over
+    bool send_block();
+    void send_window();
+};
+
+// Receives into an ImageSink, ACKing once per window
+class ReceiveSession : public Session {
+public:
+    ReceiveSession(EventLoop &loop, int sock, const struct sockaddr_in &peer, const TransferOptions &opts,
+                   const SessionLimits &limits, std::unique_ptr<ImageSink> sink, bool netascii);
+    // Aborts the sink unless the transfer completed
+    ~ReceiveSession() override;
+    // Server: acknowledge the WRQ
+    void begin(const std::vector<char> &oack);
+    // Client: send the RRQ; with probe set, stop as soon as the OACK arrives (tsize probe)
+    void request(const std::vector<char> &rrq, bool probe = false);
+    // Server, octet only. The sink is released, not aborted: the successor reopens
+    // the file with ImageStore::resume_upload() and writes on from bytes()
+    int suspend(HandoffSession &state) override;
+    void resume(const HandoffSession &state);
+
+private:
+    std::unique_ptr<ImageSink> sink;
+    bool netascii;
+    bool probe = false;
+    bool cr_pending = false;
+    uint64_t received = 0;          // highest in-order block written
+    uint16_t in_window = 0;         // blocks since the last ACK
+    bool gap_acked = false;         // already told the sender about a hole
+    std::vector<char> reply;        // last ACK/OACK, resent on timeout
+    std::vector<char> decoded;
+    Mailbox<bool> committed;        // how a commit on the storage pool went
+    bool committing = false;
+    std::shared_ptr<bool> alive = std::make_shared<bool>(true);
+
+    // Takes the server's reply to an RRQ on the client, then DATA until the short block
+    Flow run();
+    // Commits the sink on the storage pool; committed gets the result on the loop
+    void commit_on_pool();
+    void send_reply(const char *buf, size_t len);
+    void fail_write();
+};
+
+#endif
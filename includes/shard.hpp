@@ -0,0 +1,79 @@
+/*
+ * Sharding front end. A server with ServerConfig::shards serves no files of its own:
+ * it places each request's filename on a consistent hash ring of backend servers and
+ * relays the transfer to the one that owns it. Every backend's caches (its relay root,
+ * see relay.hpp, and its image cache) then only ever hold their share of the images,
+ * so adding backends adds cache capacity instead of copies. Adding or removing a
+ * backend moves only the names on its arcs of the ring, about 1/n of them.
+ *
+ * TFTP has no redirect, so the front end proxies. A transfer gets a socket facing the
+ * client, which is its TID there, and one facing the backend. The request goes to the
+ * backend's port from the latter, the backend's TID is learned from its first reply,
+ * and from then on datagrams pass through untouched: options, windows and resumes are
+ * negotiated between client and backend.
+*/
+
+#ifndef TFTP_SHARD_HPP
+#define TFTP_SHARD_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <netinet/in.h>
+#include "event_loop.hpp"
+#include "metrics.hpp"
+#include "net.hpp"
+#include "session.hpp"
+
+// Consistent hash ring: each shard sits at points places, a name belongs to the
+// first shard clockwise of its hash
+class ShardRing {
+public:
+    explicit ShardRing(const std::vector<std::string> &shards, int points = 160);
+    // Index into shards of the one that owns filename
+    size_t owner(const std::string &filename) const;
+    size_t size() const { return count; }
+
+private:
+    size_t count;
+    std::vector<std::pair<uint64_t, uint32_t>> ring;    // point -> shard, sorted by point
+};
+
+// Relays one worker's transfers to their shards; loop thread only
+class ShardProxy {
+public:
+    ShardProxy(EventLoop &loop, DatagramNet &net, std::vector<struct sockaddr_in> shards,
+               const SessionLimits &limits, WorkerMetrics &metrics);
+    ~ShardProxy();
+
+    // Sends the request in buf from client on to shard. A client whose transfer is
+    // already being relayed is resending its request, which is ignored. False if no
+    // sockets could be had
+    bool forward(const struct sockaddr_in &client, const char *buf, size_t len, size_t shard);
+    // Transfers being relayed
+    size_t active() const { return relays.size(); }
+
+private:
+    struct Relay;
+
+    EventLoop &loop;
+    DatagramNet &net;
+    std::vector<struct sockaddr_in> shards;
+    SessionLimits limits;
+    WorkerMetrics &metrics;
+    std::vector<char> buf;
+    std::unordered_map<uint64_t, std::unique_ptr<Relay>> relays;    // by client TID
+
+    int open_socket(const struct sockaddr_in *peer);
+    void from_client(Relay &r);
+    void from_shard(Relay &r);
+    // What passes through: the short DATA that ends the transfer and its ACK, or an ERROR
+    void watch_for_end(Relay &r, size_t len);
+    void check(Relay &r);
+    void close(Relay &r);
+};
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * Deterministic in-process network. Datagrams cross simulated links with latency,
+ * jitter, loss, reordering, duplication and a bandwidth limit, all drawn from one
+ * seeded generator, and time is a virtual clock that jumps straight to the next
+ * packet arrival or timer. A transfer over a 200 ms RTT link therefore finishes as
+ * fast as the CPU allows, and the same seed always gives the same run.
+ *
+ * Every endpoint is a Host with its own address; pass it wherever a DatagramNet is
+ * taken (ServerConfig::net, ClientOptions::net). Everything runs on one thread:
+ * do not call TFTPServer::start(), the SimNet drives the server's loops itself.
+ *
+ *   LinkParams wan;
+ *   wan.latency_us = 50000;
+ *   wan.loss = 0.01;
+ *   SimNet net(wan);
+ *   SimNet::Host &server_host = net.host("10.0.0.1"), &client_host = net.host("10.0.0.2");
+ *   ServerConfig sc; sc.net = &server_host; TFTPServer server(sc);
+ *   ClientOptions co; co.net = &client_host; TFTPClient client("10.0.0.1", co);
+ *   client.send_rrq("image.bin");   // steps the whole simulation until it is done
+*/
+
+#ifndef TFTP_SIM_NET_HPP
+#define TFTP_SIM_NET_HPP
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "net.hpp"
+
+struct LinkParams {
+    uint32_t latency_us = 0;      // one way
+    uint32_t jitter_us = 0;       // uniform extra delay, up to this much
+    double loss = 0;              // probability a datagram is dropped
+    double reorder = 0;           // probability a datagram is held back by reorder_us
+    uint32_t reorder_us = 1000;
+    double duplicate = 0;         // probability a datagram arrives twice
+    uint64_t bandwidth_bps = 0;   // 0 = unlimited
+    size_t queue_bytes = 0;       // bottleneck queue, tail drop beyond it; 0 = unlimited
+};
+
+class SimNet {
+public:
+    struct Stats {
+        uint64_t sent = 0;
+        uint64_t delivered = 0;
+        uint64_t lost = 0;          // random loss
+        uint64_t queue_drops = 0;   // bottleneck queue or receiver full
+        uint64_t unreachable = 0;   // nobody bound to the destination
+        uint64_t duplicated = 0;
+        uint64_t reordered = 0;
+    };
+
+    class Host : public DatagramNet {
+    public:
+        int open() override;
+        int bind(int sock, const struct sockaddr_in &addr, bool reuse_port = false) override;
+        int local_address(int sock, struct sockaddr_in &addr) override;
+        int connect(int sock, const struct sockaddr_in &peer) override;
+        ssize_t send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) override;
+        ssize_t receive(int sock, char *buf, size_t cap, struct sockaddr_in *from) override;
+        void close(int sock) override;
+        void watch(EventLoop &loop, int sock, std::function<void()> readable) override;
+        void unwatch(EventLoop &loop, int sock) override;
+        void run_once(EventLoop &loop) override;
+
+        uint32_t address() const { return ip; }   // network byte order
+
+    private:
+        friend class SimNet;
+        Host(SimNet &net, uint32_t ip) : net(net), ip(ip) {}
+        SimNet &net;
+        uint32_t ip;
+    };
+
+    explicit SimNet(const LinkParams &link = LinkParams{}, uint64_t seed = 1);
+    ~SimNet();
+
+    // The endpoint with this dotted quad address, created on first use
+    Host &host(const std::string &ip);
+    // Parameters for datagrams from one host to another; others use the default link
+    void set_link(const std::string &from, const std::string &to, const LinkParams &link);
+
+    uint64_t now_us() const { return clock_us; }
+    const Stats &stats() const { return counters; }
+
+    // Runs every known loop once, or advances the clock to the next event when they
+    // are idle. driver is run too even if it watches no socket. False once nothing
+    // is scheduled anywhere
+    bool run_once(EventLoop *driver = nullptr);
+    // Steps until done() returns true or nothing is left to happen. Pass the loop an
+    // AsyncTFTPClient runs on as driver so its completions still run once its
+    // last socket is closed
+    void run_until(const std::function<bool()> &done, EventLoop *driver = nullptr);
+
+private:
+    struct Socket {
+        uint32_t host;
+        uint32_t ip = 0;          // bound address, 0 = any
+        uint16_t port = 0;
+        bool reuse_port = false;
+        bool connected = false;
+        struct sockaddr_in peer{};
+        std::deque<std::pair<struct sockaddr_in, std::string>> queue;
+        EventLoop *loop = nullptr;
+        std::function<void()> readable;
+    };
+    struct Packet {
+        uint64_t at_us;
+        uint64_t seq;             // ties broken by send order, keeps runs deterministic
+        struct sockaddr_in from;
+        struct sockaddr_in to;
+        std::string data;
+        bool operator>(const Packet &o) const { return at_us != o.at_us ? at_us > o.at_us : seq > o.seq; }
+    };
+    struct Link {
+        LinkParams params;
+        uint64_t busy_until_us = 0;
+    };
+
+    LinkParams default_link;
+    std::mt19937_64 rng;
+    uint64_t clock_us = 0;
+    uint64_t next_seq = 0;
+    int next_socket = 1 << 20;    // well clear of real fds, to tell them apart in logs
+    uint16_t next_port = 49152;
+    Stats counters;
+    std::unordered_map<uint32_t, std::unique_ptr<Host>> hosts;
+    std::map<std::pair<uint32_t, uint32_t>, Link> links;
+    std::unordered_map<int, Socket> sockets;
+    std::priority_queue<Packet, std::vector<Packet>, std::greater<Packet>> in_flight;
+    // loop -> sockets it watches, in registration order so runs replay identically
+    std::vector<std::pair<EventLoop *, int>> loops;
+
+    double uniform();
+    Link &link(uint32_t from, uint32_t to);
+    bool port_in_use(uint32_t host, uint16_t port) const;
+    ssize_t send(int sock, const char *buf, size_t len, const struct sockaddr_in *to);
+    void deliver(Packet &packet);
+    void watch(EventLoop &loop, int sock, std::function<void()> readable);
+    void unwatch(EventLoop &loop, int sock);
+    void close(int sock);
+};
+
+#endif
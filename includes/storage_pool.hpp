@@ -0,0 +1,84 @@
+/*
+ * Threads for the storage calls that block and have no cheap async form: open() and
+ * stat on a network filesystem, the index pass over a packed image without its
+ * sidecar, inflating a member of one that is not in the cache, hashing the prefix of
+ * a resumed transfer, creating an upload and committing it. A worker making these
+ * itself stalls every transfer on its loop for as long as the disk or the file
+ * server takes. With ServerConfig::storage_threads the worker hands them to a
+ * StoragePool and carries on; the result comes back to the worker's loop through
+ * EventLoop::post(), whose queue is signalled with an eventfd.
+ *
+ * Each pool thread owns a deque. A job goes on the deque its submitter's hint picks,
+ * so one worker's jobs queue together. Threads run their own jobs oldest first and,
+ * once their deque is empty, steal the newest job from another's: a single slow
+ * open holds up one thread, not the jobs queued behind it.
+*/
+
+#ifndef TFTP_STORAGE_POOL_HPP
+#define TFTP_STORAGE_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "event_loop.hpp"
+
+class StoragePool {
+public:
+    using Job = std::function<void()>;
+
+    struct Stats {
+        uint64_t jobs = 0;      // run to completion
+        uint64_t stolen = 0;    // of those, taken from another thread's deque
+    };
+
+    // threads 0 = one per CPU
+    explicit StoragePool(size_t threads);
+    // Runs whatever is still queued, then joins the threads
+    ~StoragePool();
+    StoragePool(const StoragePool &) = delete;
+    StoragePool &operator=(const StoragePool &) = delete;
+
+    // Queues job on the deque hint picks (hint % threads). Any thread
+    void submit(size_t hint, Job job);
+
+    // Runs work() on the pool, then done(result) on loop's thread. loop must outlive
+    // the pool or stop taking posts first; done is dropped with the loop's queue
+    template <class Work, class Done>
+    void run(EventLoop &loop, size_t hint, Work work, Done done) {
+        submit(hint, [&loop, work = std::move(work), done = std::move(done)]() mutable {
+            // results may be move-only; the loop's tasks are copyable
+            auto result = std::make_shared<decltype(work())>(work());
+            loop.post([done, result]() mutable { done(std::move(*result)); });
+        });
+    }
+
+    size_t threads() const { return workers.size(); }
+    Stats stats() const;
+
+private:
+    struct Deque {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<std::unique_ptr<Deque>> deques;
+    std::vector<std::thread> workers;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    size_t queued = 0;              // under sleep_mutex
+    bool stopping = false;
+    std::atomic<uint64_t> jobs_run{0};
+    std::atomic<uint64_t> jobs_stolen{0};
+
+    void work(size_t self);
+    // Own deque first, oldest job; then the newest job of the others in turn
+    bool take(size_t self, Job &job);
+};
+
+#endif
@@ -4,14 +4,58 @@
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <string>
+#include <arpa/inet.h>
 
-inline uint16_t to_network_order(uint_16t val){
+inline uint16_t to_network_order(uint16_t val){
   return htons(val); //to big-endian
 }
-inline uint16_t to_host_order(uint_16t val){
+inline uint16_t to_host_order(uint16_t val){
   return ntohs(val); //to lil-endian
 }
 inline bool valid_mode(const std::string mode){
-  return(mode=="netascii" || mode="octet");//octet fot .bin files netascii for .txt files
+  return(mode=="netascii" || mode=="octet");//octet fot .bin files netascii for .txt files
 }
-#endif 
+
+// netascii (RFC 764): LF goes out as CR LF and a bare CR as CR NUL.
+// carry holds the second byte of a pair that did not fit in dst (-1 if none)
+inline size_t netascii_encode(const char *src, size_t src_len, size_t &consumed,
+                              char *dst, size_t dst_cap, int &carry){
+  size_t out = 0;
+  consumed = 0;
+  if(carry >= 0 && out < dst_cap){
+    dst[out++] = (char)carry;
+    carry = -1;
+  }
+  while(consumed < src_len && out < dst_cap){
+    char c = src[consumed++];
+    if(c == '\n' || c == '\r'){
+      dst[out++] = '\r';
+      char second = (c == '\n') ? '\n' : '\0';
+      if(out < dst_cap) dst[out++] = second;
+      else carry = (unsigned char)second;
+    } else {
+      dst[out++] = c;
+    }
+  }
+  return out;
+}
+
+// reverse of netascii_encode; dst needs room for len + 1 bytes.
+// cr_pending carries a CR that ended the previous block
+inline size_t netascii_decode(const char *src, size_t len, char *dst, bool &cr_pending){
+  size_t out = 0;
+  for(size_t i = 0; i < len; i++){
+    char c = src[i];
+    if(cr_pending){
+      cr_pending = false;
+      if(c == '\n'){ dst[out++] = '\n'; continue; }
+      dst[out++] = '\r';
+      if(c == '\0') continue;
+    }
+    if(c == '\r') cr_pending = true;
+    else dst[out++] = c;
+  }
+  return out;
+}
+#endif
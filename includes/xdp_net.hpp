@@ -0,0 +1,135 @@
+/*
+ * AF_XDP datapath for dedicated boot servers. Requests still arrive on the listening
+ * socket; the DATA and ACK packets of the transfers they start move between the NIC
+ * and the sessions as raw frames in a UMEM area shared with the kernel, skipping the
+ * UDP socket layer both ways.
+ *
+ * XdpProgram is the kernel side: a few dozen instructions attached to one interface in
+ * generic (skb) mode, so it also runs on veth, loopback and drivers without native
+ * XDP. IPv4 UDP frames for a registered port go to the AF_XDP socket of the queue
+ * they arrived on, everything else up the stack. It is loaded with the bpf() syscall
+ * directly rather than through libbpf.
+ *
+ * XdpNet is a DemuxNet whose shared sockets stay bound in the kernel. That reserves
+ * their ports and carries what the ring cannot: frames larger than a UMEM chunk, IP
+ * fragments, frames that arrive on another queue than the socket's, and sends to a
+ * peer whose MAC address is not known yet. Addresses are learnt from the frames
+ * peers send, so a transfer to a new client sends its first packet through the
+ * kernel, which resolves the neighbour, and the rest through the ring. The UDP
+ * checksum of a received frame is verified unless it is 0 (none sent). On a virtual
+ * interface such as veth, a frame from a peer on the same host may carry only the
+ * pseudo-header sum its sender left for offload (CHECKSUM_PARTIAL), which generic XDP
+ * hands over as it is; there, and only there, that value is accepted too.
+ *
+ * Like DemuxNet, an XdpNet belongs to one event loop. Needs CAP_NET_ADMIN and CAP_BPF.
+*/
+
+#ifndef TFTP_XDP_NET_HPP
+#define TFTP_XDP_NET_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "demux_net.hpp"
+
+struct xdp_ring_offset;
+
+class XdpProgram {
+public:
+    // Loads the program and attaches it to ifname. Throws std::runtime_error if it
+    // cannot: no such interface, missing privileges, another XDP program there
+    explicit XdpProgram(const std::string &ifname);
+    ~XdpProgram();
+
+    int ifindex() const { return index; }
+    // Receive queues of the interface; each can have one AF_XDP socket
+    uint32_t queues() const { return rx_queues; }
+    // No device behind the interface (veth, loopback, bridges): its frames come from
+    // this host and may carry partial checksums
+    bool is_virtual() const { return virtual_device; }
+
+    // Frames arriving on queue go to xsk. -1 with errno on failure
+    int add_socket(uint32_t queue, int xsk);
+    void remove_socket(uint32_t queue);
+    // Frames for UDP port (host order) are redirected when they arrive on queue
+    int add_port(uint16_t port, uint32_t queue);
+    void remove_port(uint16_t port);
+
+private:
+    int index;
+    uint32_t rx_queues = 1;
+    bool virtual_device = false;
+    int ports = -1;         // array map: port in network order -> queue + 1, 0 = not ours
+    int sockets = -1;       // XSKMAP: queue -> AF_XDP socket
+    int prog = -1;
+    int link = -1;          // the attachment; closing it detaches the program
+
+    void release();
+};
+
+class XdpNet : public DemuxNet {
+public:
+    struct XdpStats {
+        uint64_t rx_frames = 0;         // datagrams received through the ring
+        uint64_t rx_dropped = 0;        // frames in the ring that were not for a shared socket
+        uint64_t rx_bad_checksum = 0;   // dropped for a UDP checksum that does not add up
+        uint64_t tx_frames = 0;         // datagrams sent through the ring
+        uint64_t tx_kernel = 0;         // sent through the kernel socket instead
+    };
+
+    // count shared sockets on the kernel's network, as DemuxNet, and an AF_XDP socket
+    // bound to queue of program's interface. Throws std::runtime_error if it cannot
+    XdpNet(EventLoop &loop, XdpProgram &program, uint32_t queue, int count, int receive_buffer = 0);
+    ~XdpNet() override;
+
+    ssize_t send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) override;
+
+    const XdpStats &xdp_stats() const { return xdp_counters; }
+
+private:
+    struct Ring {
+        uint32_t *producer = nullptr;
+        uint32_t *consumer = nullptr;
+        void *desc = nullptr;
+        uint32_t mask = 0;
+        void *map = nullptr;
+        size_t map_len = 0;
+    };
+
+    // Where to send a peer's frames, from the last frame it sent us
+    struct Neighbour {
+        uint8_t peer_mac[6];
+        uint8_t local_mac[6];
+        uint32_t local_addr;    // network order, the address the peer sent to
+    };
+
+    XdpProgram &program;
+    uint32_t queue;
+    int xsk = -1;
+    bool watching = false;
+    uint8_t *umem = nullptr;
+    Ring fill, completion, rx, tx;
+    std::vector<uint64_t> free_frames;          // UMEM frames free for sending
+    std::vector<uint16_t> ports;                // network order, by shared socket
+    std::unordered_map<uint32_t, Neighbour> neighbours;
+    uint16_t ip_id = 0;
+    bool kick_pending = false;
+    XdpStats xdp_counters;
+
+    bool open_socket();
+    bool map_ring(Ring &ring, const struct xdp_ring_offset &offsets, off_t pgoff, size_t desc_size);
+    void release();
+    // Reads the RX ring dry and hands its frames back to the fill ring
+    void receive_frames();
+    void handle_frame(const uint8_t *frame, uint32_t len);
+    // Queues a datagram from shared socket i on the TX ring; false if it has to go
+    // through the kernel
+    bool transmit(size_t i, const struct sockaddr_in &to, const char *buf, size_t len);
+    // Has the kernel send what the TX ring holds, once per loop iteration
+    void kick();
+    // Frames the kernel has sent go back to free_frames
+    void reclaim();
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "../includes/access_log.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+AccessRecord clock_record(uint8_t type) {
+    AccessRecord r{};
+    r.type = type;
+    r.tsc = flight_tsc();
+    r.bytes = realtime_ns();
+    return r;
+}
+
+bool write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+}  // namespace
+
+AccessLog::Ring::Ring(size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+    mask = cap - 1;
+    slots.reset(new AccessRecord[cap]());
+}
+
+AccessLog::AccessLog(const std::string &path, uint32_t flush_ms) : flush_ms(flush_ms ? flush_ms : 1) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("cannot open access log " + path);
+    struct stat st;
+    AccessLogHeader header{};
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size == 0) {
+        memcpy(header.magic, "TTACCESS", 8);
+        header.version = 1;
+        header.record_size = sizeof(AccessRecord);
+        ok = write_all(fd, (const char *)&header, sizeof(header));
+    } else if (ok) {
+        ok = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+             memcmp(header.magic, "TTACCESS", 8) == 0 && header.version == 1 &&
+             header.record_size == sizeof(AccessRecord);
+        // a crash mid-write leaves part of a record; cut it so ours line up
+        off_t whole = (off_t)sizeof(header) +
+                      (st.st_size - (off_t)sizeof(header)) / (off_t)sizeof(AccessRecord) * (off_t)sizeof(AccessRecord);
+        if (ok && whole != st.st_size)
+            ok = ftruncate(fd, whole) == 0;
+    }
+    if (ok) {
+        AccessRecord open = clock_record(AR_OPEN);
+        open.duration_us = (uint32_t)getpid();
+        ok = write_all(fd, (const char *)&open, sizeof(open));
+    }
+    if (!ok) {
+        close(fd);
+        throw std::runtime_error("cannot use " + path + " as an access log");
+    }
+    writer = std::thread([this] { run(); });
+}
+
+AccessLog::~AccessLog() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    writer.join();
+    close(fd);
+}
+
+AccessLog::Ring &AccessLog::ring(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex);
+    rings.push_back(std::make_unique<Ring>(capacity));
+    return *rings.back();
+}
+
+void AccessLog::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64_t ticket = ++flush_requests;
+    wake.notify_all();
+    flushed.wait(lock, [&] { return flushes_done >= ticket; });
+}
+
+AccessLog::Stats AccessLog::stats() const {
+    Stats s;
+    s.records = records_written.load(std::memory_order_relaxed);
+    s.bytes = bytes_written.load(std::memory_order_relaxed);
+    s.write_errors = errors.load(std::memory_order_relaxed);
+    return s;
+}
+
+void AccessLog::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    const auto shortest = std::chrono::microseconds(500);
+    auto wait = shortest;   // until there is a rate to go by
+    auto last_drain = std::chrono::steady_clock::now();
+    for (;;) {
+        wake.wait_for(lock, wait, [this] { return stopping || flush_requests > flushes_done; });
+        uint64_t target = flush_requests;
+        bool last = stopping;
+        lock.unlock();
+        double fill = drain();
+        // come back by the time the busiest ring fills a quarter at the rate it
+        // filled since the last pass, before its producer starts dropping; a full
+        // ring hides how fast it filled, so soon
+        auto now = std::chrono::steady_clock::now();
+        auto since = std::chrono::duration_cast<std::chrono::microseconds>(now - last_drain);
+        last_drain = now;
+        wait = std::chrono::microseconds(flush_ms * 1000ull);
+        if (fill >= 1)
+            wait = shortest;
+        else if (fill > 0)
+            wait = std::clamp(std::chrono::microseconds((int64_t)((double)since.count() * 0.25 / fill)),
+                              shortest, wait);
+        lock.lock();
+        flushes_done = target;
+        flushed.notify_all();
+        if (last)
+            return;
+    }
+}
+
+double AccessLog::drain() {
+    std::vector<Ring *> current;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &r : rings)
+            current.push_back(r.get());
+    }
+    batch.clear();
+    double fill = 0;
+    for (Ring *ring : current) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        fill = std::max(fill, (double)(head - tail) / (double)(ring->mask + 1));
+        for (uint64_t i = tail; i < head; i++)
+            batch.push_back(ring->slots[i & ring->mask]);
+        // the producer may reuse the slots once it sees this
+        ring->tail.store(head, std::memory_order_release);
+    }
+    if (batch.empty())
+        return 0;
+    size_t records = batch.size();
+    batch.push_back(clock_record(AR_CLOCK));
+    size_t len = batch.size() * sizeof(AccessRecord);
+    if (!write_all(fd, (const char *)batch.data(), len)) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        return fill;
+    }
+    records_written.fetch_add(records, std::memory_order_relaxed);
+    bytes_written.fetch_add(len, std::memory_order_relaxed);
+    return fill;
+}
@@ -0,0 +1,154 @@
+#include "../includes/async_client.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+AsyncTFTPClient::AsyncTFTPClient(EventLoop &loop, const std::string &server_ip)
+    : AsyncTFTPClient(loop, server_ip, ClientOptions{}) {}
+
+AsyncTFTPClient::AsyncTFTPClient(EventLoop &loop, const std::string &server_ip, const ClientOptions &options)
+    : loop(loop), options(options), net(options.net ? *options.net : DatagramNet::kernel()) {
+    server = resolve_server(server_ip, options.port);
+}
+
+AsyncTFTPClient::~AsyncTFTPClient() {
+    *alive = false;
+    for (auto &t : sessions) {
+        Session &session = *t.second.session;
+        session.on_done = nullptr;
+        bool finished = session.finished();
+        if (!finished)
+            session.cancel();
+        if (!t.second.awaited)
+            continue;
+        // a finished transfer whose completion was still queued reports how it went
+        TransferResult r = result_of(t.first, session);
+        if (!finished) {
+            r.ok = false;
+            r.error = "Client destroyed";
+            r.error_code = -1;
+        }
+        loop.post([done = std::move(t.second.done), r] { done(r); });
+    }
+}
+
+std::vector<char> AsyncTFTPClient::make_request(uint16_t op, const std::string &filename, uint64_t tsize) const {
+    std::vector<std::pair<std::string, std::string>> opts;
+    if (options.blksize)
+        opts.emplace_back("blksize", std::to_string(options.blksize));
+    if (options.windowsize)
+        opts.emplace_back("windowsize", std::to_string(options.windowsize));
+    if (options.mode == "octet")
+        opts.emplace_back("tsize", std::to_string(tsize));
+    std::vector<char> buf(2048);
+    buf.resize(build_request(buf.data(), buf.size(), op, filename, options.mode, opts));
+    return buf;
+}
+
+uint64_t AsyncTFTPClient::get(const std::string &filename, std::unique_ptr<ImageSink> sink, Callback done,
+                              std::function<bool(Session &)> on_negotiated) {
+    return start_get(filename, std::move(sink), std::move(done), std::move(on_negotiated), false);
+}
+
+uint64_t AsyncTFTPClient::put(const std::string &filename, std::unique_ptr<ImageSource> source, Callback done) {
+    return start_put(filename, std::move(source), std::move(done), false);
+}
+
+uint64_t AsyncTFTPClient::start_get(const std::string &filename, std::unique_ptr<ImageSink> sink, Callback done,
+                                    std::function<bool(Session &)> on_negotiated, bool awaited) {
+    int sock = net.open();
+    if (sock < 0)
+        return fail(strerror(errno), std::move(done), awaited);
+    uint64_t id = next_id++;
+    auto session = std::make_unique<ReceiveSession>(loop, sock, server, TransferOptions{}, options.limits,
+                                                    std::move(sink), options.mode == "netascii");
+    ReceiveSession *rrq = session.get();
+    rrq->on_negotiated = std::move(on_negotiated);
+    start(id, std::move(session), std::move(done), awaited);
+    rrq->request(make_request(RREQ, filename, 0));
+    return id;
+}
+
+uint64_t AsyncTFTPClient::start_put(const std::string &filename, std::unique_ptr<ImageSource> source,
+                                    Callback done, bool awaited) {
+    int sock = net.open();
+    if (sock < 0)
+        return fail(strerror(errno), std::move(done), awaited);
+    uint64_t id = next_id++;
+    uint64_t size = source->size();
+    auto session = std::make_unique<SendSession>(loop, sock, server, TransferOptions{}, options.limits,
+                                                 std::move(source), options.mode == "netascii");
+    SendSession *wrq = session.get();
+    start(id, std::move(session), std::move(done), awaited);
+    wrq->request(make_request(WREQ, filename, size));
+    return id;
+}
+
+uint64_t AsyncTFTPClient::start(uint64_t id, std::unique_ptr<Session> session, Callback done, bool awaited) {
+    session->on_done = [this, id, token = std::weak_ptr<bool>(alive)](Session &) {
+        // the session is still on the stack, report and free it once the loop unwinds
+        loop.post([this, id, token] {
+            if (token.expired())
+                return;
+            auto it = sessions.find(id);
+            if (it == sessions.end())
+                return;
+            Transfer t = std::move(it->second);
+            sessions.erase(it);
+            TransferResult r = result_of(id, *t.session);
+            t.session.reset();
+            if (t.done)
+                t.done(r);
+        });
+    };
+    session->use_net(net);
+    session->use_pool(buffers);
+    session->use_frames(frames);
+    session->use_dally(dally);
+    if (storage)
+        session->use_storage(*storage, storage_hint);
+    sessions.emplace(id, Transfer{std::move(session), std::move(done), awaited});
+    return id;
+}
+
+uint64_t AsyncTFTPClient::fail(const std::string &reason, Callback done, bool awaited) {
+    uint64_t id = next_id++;
+    loop.post([id, reason, awaited, done = std::move(done), token = std::weak_ptr<bool>(alive)] {
+        if ((token.expired() && !awaited) || !done)
+            return;
+        TransferResult r;
+        r.id = id;
+        r.error = reason;
+        done(r);
+    });
+    return id;
+}
+
+TransferResult AsyncTFTPClient::result_of(uint64_t id, const Session &session) {
+    TransferResult r;
+    r.id = id;
+    r.ok = session.ok();
+    r.error = session.error();
+    r.error_code = session.peer_error();
+    r.bytes = session.bytes();
+    r.options = session.options();
+    return r;
+}
+
+bool AsyncTFTPClient::cancel(uint64_t id) {
+    auto it = sessions.find(id);
+    if (it == sessions.end() || it->second.session->finished())
+        return false;
+    it->second.session->cancel();
+    return true;
+}
+
+#ifdef TURBOTFTP_COROUTINES
+AsyncTFTPClient::Awaiter AsyncTFTPClient::get_async(const std::string &filename, std::unique_ptr<ImageSink> sink) {
+    return Awaiter(*this, filename, std::move(sink), nullptr);
+}
+
+AsyncTFTPClient::Awaiter AsyncTFTPClient::put_async(const std::string &filename, std::unique_ptr<ImageSource> source) {
+    return Awaiter(*this, filename, nullptr, std::move(source));
+}
+#endif
@@ -0,0 +1,422 @@
+#include "../includes/chunk_store.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace {
+
+// Makes a rename or create in dir survive a crash
+bool sync_dir(const std::string &dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+std::string parent_of(const std::string &path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+}
+
+
+// Regular files under dir, recursively, except under the directory skip
+void walk(const std::string &dir, const std::string &skip,
+          const std::function<void(const std::string &, const struct stat &)> &visit) {
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return;
+    while (struct dirent *e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode) && path != skip)
+            walk(path, skip, visit);
+        else if (S_ISREG(st.st_mode))
+            visit(path, st);
+    }
+    closedir(d);
+}
+
+// 1 if the chunk file at path holds exactly data, 0 if it holds anything else, -1
+// if it cannot be opened
+int compare_chunk(const std::string &path, const char *data, size_t len) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    bool same = fstat(fd, &st) == 0 && (uint64_t)st.st_size == len;
+    std::vector<char> stored(same ? len : 0);
+    size_t off = 0;
+    while (same && off < len) {
+        ssize_t n = pread(fd, stored.data() + off, len - off, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        same = n > 0;
+        off += same ? (size_t)n : 0;
+    }
+    close(fd);
+    return same && memcmp(stored.data(), data, len) == 0 ? 1 : 0;
+}
+
+bool ends_with(const std::string &s, const char *suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+}  // namespace
+
+// ---- manifest ----
+
+bool ChunkManifest::load(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+    unsigned long long total;
+    bool ok = fscanf(f, "turbotftp-chunks 1 size %llu", &total) == 1;
+    entries.clear();
+    uint64_t offset = 0;
+    char hex[33];
+    unsigned len;
+    while (ok && fscanf(f, " %32s %u", hex, &len) == 2) {
+        Entry e;
+        if (!Hash128::from_hex(hex, e.hash)) {
+            ok = false;
+            break;
+        }
+        e.offset = offset;
+        e.len = len;
+        entries.push_back(e);
+        offset += len;
+    }
+    fclose(f);
+    size = total;
+    return ok && offset == size;
+}
+
+bool ChunkManifest::save(const std::string &path) const {
+    // the counter keeps threads of this process saving the same name apart
+    static std::atomic<unsigned> saves{0};
+    std::string tmp = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(saves++);
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f)
+        return false;
+    fprintf(f, "turbotftp-chunks 1\nsize %llu\n", (unsigned long long)size);
+    for (const auto &e : entries)
+        fprintf(f, "%s %u\n", e.hash.hex().c_str(), e.len);
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return sync_dir(parent_of(path));
+}
+
+// ---- store ----
+
+ChunkStore::ChunkStore(const std::string &root, size_t chunk_size)
+    : root(root), dir(root + "/.chunks"), chunk_bytes(chunk_size ? chunk_size : 64 << 10) {}
+
+std::string ChunkStore::chunk_path(const Hash128 &hash) const {
+    std::string hex = hash.hex();
+    return dir + "/" + hex.substr(0, 2) + "/" + hex.substr(2);
+}
+
+ChunkStore::Stats ChunkStore::stats() const {
+    Stats s;
+    s.logical_bytes = logical.load(std::memory_order_relaxed);
+    s.stored_bytes = stored.load(std::memory_order_relaxed);
+    s.chunks = total_chunks.load(std::memory_order_relaxed);
+    s.unique_chunks = unique.load(std::memory_order_relaxed);
+    s.hash_ns = hashing_ns.load(std::memory_order_relaxed);
+    s.swept_chunks = swept.load(std::memory_order_relaxed);
+    s.swept_bytes = swept_bytes.load(std::memory_order_relaxed);
+    return s;
+}
+
+void ChunkStore::pin(const Hash128 &hash) {
+    std::lock_guard<std::mutex> lock(pin_mutex);
+    pins[hash.lo]++;
+}
+
+void ChunkStore::unpin(const Hash128 &hash) {
+    std::lock_guard<std::mutex> lock(pin_mutex);
+    if (sweeping) {
+        deferred.push_back(hash.lo);
+        return;
+    }
+    auto it = pins.find(hash.lo);
+    if (it != pins.end() && --it->second == 0)
+        pins.erase(it);
+}
+
+uint64_t ChunkStore::sweep() {
+    std::lock_guard<std::mutex> one(sweep_mutex);
+    struct stat st;
+    if (stat(dir.c_str(), &st) < 0)
+        return 0;
+    {
+        std::lock_guard<std::mutex> lock(pin_mutex);
+        sweeping = true;
+    }
+    // mark: every chunk a manifest lists. One that cannot be read might list any of
+    // them, so then nothing is removed
+    std::unordered_set<uint64_t> live;
+    bool complete = true;
+    walk(root, dir, [&](const std::string &path, const struct stat &) {
+        ChunkManifest manifest;
+        if (!ends_with(path, ".chunks"))
+            return;
+        if (!manifest.load(path)) {
+            complete = false;
+            return;
+        }
+        for (const auto &e : manifest.entries)
+            live.insert(e.hash.lo);
+    });
+    // sweep: the rest, unless pinned since
+    uint64_t removed = 0, bytes = 0;
+    time_t now = time(nullptr);
+    if (complete) {
+        walk(dir, "", [&](const std::string &path, const struct stat &st) {
+            size_t slash = path.rfind('/');
+            std::string name = path.substr(slash + 1);
+            if (name.compare(0, 4, ".tmp") == 0) {
+                // a write that crashed; the ones in progress are seconds old
+                if (now - st.st_mtime > 3600)
+                    unlink(path.c_str());
+                return;
+            }
+            std::string sub = path.substr(0, slash);
+            Hash128 hash;
+            if (!Hash128::from_hex(sub.substr(sub.rfind('/') + 1) + name, hash) || live.count(hash.lo))
+                return;
+            std::lock_guard<std::mutex> lock(pin_mutex);
+            if (!pins.count(hash.lo) && unlink(path.c_str()) == 0) {
+                removed++;
+                bytes += (uint64_t)st.st_size;
+            }
+        });
+    }
+    {
+        std::lock_guard<std::mutex> lock(pin_mutex);
+        sweeping = false;
+        for (uint64_t lo : deferred) {
+            auto it = pins.find(lo);
+            if (it != pins.end() && --it->second == 0)
+                pins.erase(it);
+        }
+        deferred.clear();
+    }
+    swept += removed;
+    swept_bytes += bytes;
+    return removed;
+}
+
+bool ChunkStore::put(const char *data, size_t len, Hash128 &hash) {
+    auto t0 = std::chrono::steady_clock::now();
+    hash = hash128(data, len);
+    auto t1 = std::chrono::steady_clock::now();
+    hashing_ns += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+    logical += len;
+    total_chunks++;
+    // before looking, so a sweep cannot remove the chunk between the check and the manifest
+    pin(hash);
+
+    std::string path = chunk_path(hash);
+    // hash128 is not collision resistant and its key is public, so a stored chunk is
+    // only shared once its bytes match. One that differs is never replaced: the
+    // files using it would change. It is a collision, or a crash's leftover that no
+    // manifest refers to and the next sweep removes
+    int same = compare_chunk(path, data, len);
+    if (same == 1)
+        return true;  // already stored
+    if (same == 0) {
+        errno = EEXIST;
+        return false;
+    }
+
+    // the directories, like the chunk, are made durable by sync()
+    mkdir(dir.c_str(), 0755);
+    std::string sub = parent_of(path);
+    mkdir(sub.c_str(), 0755);
+    std::string tmp = sub + "/.tmpXXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+        return false;
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, data + off, len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        off += (size_t)n;
+    }
+    bool ok = off == len;
+    ok = close(fd) == 0 && ok;
+    // link, which unlike rename fails on an existing name; a racing writer may have
+    // stored the chunk since we looked, or something else under its name
+    ok = ok && link(tmp.c_str(), path.c_str()) == 0;
+    int err = errno;
+    unlink(tmp.c_str());
+    if (!ok) {
+        errno = err;
+        return err == EEXIST && compare_chunk(path, data, len) == 1;
+    }
+    stored += len;
+    unique++;
+    return true;
+}
+
+bool ChunkStore::sync() {
+    int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ok = syncfs(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+namespace {
+
+class ChunkSink : public ImageSink {
+public:
+    ChunkSink(ChunkStore &store, const std::string &path) : store(store), path(path) {
+        buffer.reserve(store.chunk_size());
+    }
+    ~ChunkSink() override {
+        for (const Hash128 &hash : pinned)
+            store.unpin(hash);
+    }
+
+    bool write(const char *buf, size_t len) override {
+        while (len > 0) {
+            size_t n = std::min(len, store.chunk_size() - buffer.size());
+            buffer.insert(buffer.end(), buf, buf + n);
+            buf += n;
+            len -= n;
+            if (buffer.size() == store.chunk_size() && !flush())
+                return false;
+        }
+        return true;
+    }
+
+    bool commit() override {
+        if (!buffer.empty() && !flush())
+            return false;
+        // the chunks reach the disk before the manifest that refers to them
+        if (!manifest.entries.empty() && !store.sync())
+            return false;
+        if (!manifest.save(path + ".chunks"))
+            return false;
+        unlink(path.c_str());  // a stale plain copy would shadow the manifest
+        return true;
+    }
+
+    // the chunks written so far are unpinned with the sink, and a sweep removes them
+    void abort() override {}
+
+private:
+    ChunkStore &store;
+    std::string path;
+    std::vector<char> buffer;
+    ChunkManifest manifest;
+    std::vector<Hash128> pinned;    // every chunk put(), until the manifest is on disk
+
+    bool flush() {
+        ChunkManifest::Entry e;
+        bool ok = store.put(buffer.data(), buffer.size(), e.hash);
+        pinned.push_back(e.hash);
+        if (!ok)
+            return false;
+        e.offset = manifest.size;
+        e.len = (uint32_t)buffer.size();
+        manifest.entries.push_back(e);
+        manifest.size += buffer.size();
+        buffer.clear();
+        return true;
+    }
+};
+
+class ChunkSource : public ImageSource {
+public:
+    // pinned while served, in case the manifest is overwritten meanwhile
+    ChunkSource(ChunkStore &store, ChunkManifest manifest) : store(store), manifest(std::move(manifest)) {
+        for (const auto &e : this->manifest.entries)
+            store.pin(e.hash);
+    }
+    ~ChunkSource() override {
+        if (fd >= 0)
+            close(fd);
+        for (const auto &e : manifest.entries)
+            store.unpin(e.hash);
+    }
+    uint64_t size() const override { return manifest.size; }
+
+    ssize_t read_at(uint64_t offset, char *buf, size_t len) override {
+        const auto &entries = manifest.entries;
+        size_t copied = 0;
+        while (copied < len && offset < manifest.size) {
+            auto it = std::upper_bound(entries.begin(), entries.end(), offset,
+                [](uint64_t off, const ChunkManifest::Entry &e) { return off < e.offset; });
+            size_t idx = (size_t)(it - entries.begin()) - 1;
+            if (idx != current) {
+                if (fd >= 0)
+                    close(fd);
+                fd = ::open(store.chunk_path(entries[idx].hash).c_str(), O_RDONLY | O_CLOEXEC);
+                current = idx;
+                if (fd < 0)
+                    return -1;
+            }
+            uint64_t within = offset - entries[idx].offset;
+            ssize_t n = pread(fd, buf + copied, (size_t)std::min<uint64_t>(len - copied, entries[idx].len - within),
+                              (off_t)within);
+            if (n <= 0)
+                return -1;  // chunk shorter than the manifest says
+            copied += (size_t)n;
+            offset += (uint64_t)n;
+        }
+        return (ssize_t)copied;
+    }
+
+private:
+    ChunkStore &store;
+    ChunkManifest manifest;
+    int fd = -1;
+    size_t current = SIZE_MAX;
+};
+
+}  // namespace
+
+std::unique_ptr<ImageSink> ChunkStore::create(const std::string &path) {
+    return std::unique_ptr<ImageSink>(new ChunkSink(*this, path));
+}
+
+std::unique_ptr<ImageSource> ChunkStore::open(const std::string &manifest_path) {
+    if (access(manifest_path.c_str(), F_OK) < 0)
+        return nullptr;
+    ChunkManifest manifest;
+    if (!manifest.load(manifest_path)) {
+        errno = EIO;
+        return nullptr;
+    }
+    return std::unique_ptr<ImageSource>(new ChunkSource(*this, std::move(manifest)));
+}
@@ -0,0 +1,269 @@
+#include "../includes/client.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+TFTPClient::TFTPClient(const std::string &server_ip) : TFTPClient(server_ip, ClientOptions{}) {}
+
+struct sockaddr_in resolve_server(const std::string &server_ip, uint16_t port) {
+    struct addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(server_ip.c_str(), nullptr, &hints, &res) != 0 || !res)
+        throw std::runtime_error("cannot resolve " + server_ip);
+    struct sockaddr_in addr;
+    memcpy(&addr, res->ai_addr, sizeof(addr));
+    addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    return addr;
+}
+
+TFTPClient::TFTPClient(const std::string &server_ip, const ClientOptions &options)
+    : server(resolve_server(server_ip, options.port)), options(options),
+      net(options.net ? *options.net : DatagramNet::kernel()) {}
+
+TFTPClient::~TFTPClient() {}
+
+int TFTPClient::open_socket() {
+    return net.open();
+}
+
+TFTPClient::OptionList TFTPClient::base_options() const {
+    OptionList opts;
+    if (options.blksize)
+        opts.emplace_back("blksize", std::to_string(options.blksize));
+    if (options.windowsize)
+        opts.emplace_back("windowsize", std::to_string(options.windowsize));
+    return opts;
+}
+
+std::vector<char> TFTPClient::make_request(uint16_t op, const std::string &filename, const OptionList &opts) const {
+    std::vector<char> buf(2048);
+    buf.resize(build_request(buf.data(), buf.size(), op, filename, options.mode, opts));
+    return buf;
+}
+
+bool TFTPClient::run(const std::vector<Session *> &sessions) {
+    for (;;) {
+        bool all_done = true;
+        for (Session *s : sessions)
+            all_done = all_done && s->finished();
+        if (all_done)
+            break;
+        net.run_once(loop);
+    }
+    transferred = 0;
+    for (Session *s : sessions) {
+        transferred += s->bytes();
+        if (!s->ok()) {
+            last_error = s->error();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TFTPClient::receive_file(const std::string &filename, std::unique_ptr<ImageSink> sink, const OptionList &opts,
+                              TransferOptions *granted, bool probe,
+                              std::function<bool(Session &)> on_negotiated) {
+    int sock = open_socket();
+    if (sock < 0) {
+        last_error = strerror(errno);
+        return false;
+    }
+    ReceiveSession session(loop, sock, server, TransferOptions{}, options.limits, std::move(sink),
+                           options.mode == "netascii");
+    session.use_net(net);
+    session.use_dally(dally);
+    session.on_negotiated = std::move(on_negotiated);
+    session.request(make_request(RREQ, filename, opts), probe);
+    bool ok = run({&session});
+    if (granted)
+        *granted = session.options();
+    return ok;
+}
+
+bool TFTPClient::send_file(const std::string &filename, std::unique_ptr<ImageSource> source, const OptionList &opts,
+                           std::function<bool(Session &)> on_negotiated) {
+    int sock = open_socket();
+    if (sock < 0) {
+        last_error = strerror(errno);
+        return false;
+    }
+    SendSession session(loop, sock, server, TransferOptions{}, options.limits, std::move(source),
+                        options.mode == "netascii");
+    session.use_net(net);
+    session.on_negotiated = std::move(on_negotiated);
+    session.request(make_request(WREQ, filename, opts));
+    return run({&session});
+}
+
+bool TFTPClient::send_rrq(const std::string &filename, const std::string &local) {
+    std::string path = local;
+    if (path.empty())
+        path = filename.substr(filename.rfind('/') + 1);
+    bool resume = options.resume && options.mode == "octet";
+    int fd = open(path.c_str(), resume ? O_RDWR | O_CREAT | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        last_error = path + ": " + strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    uint64_t have = resume ? (uint64_t)st.st_size : 0;
+    if (have == 0) {
+        if (resume && ftruncate(fd, 0) < 0) {
+            last_error = path + ": " + strerror(errno);
+            close(fd);
+            return false;
+        }
+        return receive_file(filename, std::unique_ptr<ImageSink>(new FileSink(fd, path)), base_options());
+    }
+
+    FileSource local_copy(dup(fd), have);
+    std::string sum = prefix_checksum(local_copy, have);
+    if (sum.empty()) {
+        last_error = path + ": " + strerror(errno);
+        close(fd);
+        return false;
+    }
+    OptionList opts = base_options();
+    opts.emplace_back("tsize", "0");
+    opts.emplace_back("offset", std::to_string(have));
+    opts.emplace_back("prefixsum", sum);
+    // the partial file survives a failed attempt so the next one can continue it
+    FileSink *sink = new FileSink(fd, "", have);
+    return receive_file(filename, std::unique_ptr<ImageSink>(sink), opts, nullptr, false,
+                        [sink, have](Session &s) {
+                            // no offset in the reply: the server refused to continue, start over
+                            const TransferOptions &o = s.options();
+                            return (o.has_offset && o.offset == have) || sink->restart();
+                        });
+}
+
+bool TFTPClient::send_wrq(const std::string &filename, const std::string &local) {
+    std::string path = local.empty() ? filename : local;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        last_error = path + ": " + strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    OptionList opts = base_options();
+    if (options.mode == "octet")
+        opts.emplace_back("tsize", std::to_string(size));
+    if (!options.resume || options.mode != "octet")
+        return send_file(filename, std::unique_ptr<ImageSource>(new FileSource(fd, size)), opts);
+
+    // ask how much the server has; prefixsum is echoed with the server's checksum of it
+    OptionList resume_opts = opts;
+    resume_opts.emplace_back("offset", "0");
+    resume_opts.emplace_back("prefixsum", std::string(32, '0'));
+    FileSource *source = new FileSource(fd, size);
+    bool mismatch = false;
+    bool ok = send_file(filename, std::unique_ptr<ImageSource>(source), resume_opts,
+                        [source, size, &mismatch](Session &s) {
+                            const TransferOptions &o = s.options();
+                            if (!o.has_offset || o.offset == 0)
+                                return true;
+                            mismatch = o.offset > size || o.prefixsum != prefix_checksum(*source, o.offset);
+                            return !mismatch;
+                        });
+    if (ok || !mismatch)
+        return ok;
+    // the server's partial copy is of some other file: upload it whole
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        last_error = path + ": " + strerror(errno);
+        return false;
+    }
+    return send_file(filename, std::unique_ptr<ImageSource>(new FileSource(fd, size)), opts);
+}
+
+bool TFTPClient::striped_rrq(const std::string &filename, const std::string &local, int stripes) {
+    if (stripes <= 1 || options.mode != "octet")
+        return send_rrq(filename, local);
+
+    // tsize probe: learn the size and whether the server honours offset, then cancel
+    OptionList probe_opts = base_options();
+    probe_opts.emplace_back("tsize", "0");
+    probe_opts.emplace_back("offset", "0");
+    TransferOptions granted;
+    if (!receive_file(filename, nullptr, probe_opts, &granted, true))
+        return false;
+    if (!granted.has_tsize || !granted.has_offset)
+        return send_rrq(filename, local);
+
+    std::string path = local.empty() ? filename.substr(filename.rfind('/') + 1) : local;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)granted.tsize) < 0) {
+        last_error = path + ": " + strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    // block aligned ranges, the last one takes the remainder
+    uint64_t size = granted.tsize;
+    uint64_t blk = granted.blksize;
+    uint64_t range = (size + (uint64_t)stripes - 1) / (uint64_t)stripes;
+    range = (range + blk - 1) / blk * blk;
+    if (range == 0)
+        range = blk;
+
+    std::vector<std::unique_ptr<ReceiveSession>> sessions;
+    std::vector<Session *> running;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    bool ok = true;
+    for (uint64_t start = 0; ok && (start < size || sessions.empty()); start += range) {
+        uint64_t len = std::min(range, size - start);
+        int sock = open_socket();
+        int stripe_fd = dup(fd);
+        if (sock < 0 || stripe_fd < 0) {
+            last_error = strerror(errno);
+            if (sock >= 0)
+                net.close(sock);
+            ok = false;
+            break;
+        }
+        OptionList opts = base_options();
+        opts.emplace_back("offset", std::to_string(start));
+        opts.emplace_back("length", std::to_string(len));
+        auto session = std::make_unique<ReceiveSession>(
+            loop, sock, server, TransferOptions{}, options.limits,
+            std::unique_ptr<ImageSink>(new FileSink(stripe_fd, "", start)), false);
+        session->use_net(net);
+        session->use_dally(dally);
+        session->request(make_request(RREQ, filename, opts));
+        running.push_back(session.get());
+        ranges.emplace_back(start, len);
+        sessions.push_back(std::move(session));
+    }
+    close(fd);
+    if (ok)
+        ok = run(running);
+    for (size_t i = 0; ok && i < sessions.size(); i++) {
+        // a server that dropped the range options would have sent the file from byte 0
+        const TransferOptions &o = sessions[i]->options();
+        if (!o.has_offset || o.offset != ranges[i].first || sessions[i]->bytes() != ranges[i].second) {
+            last_error = "server did not honour the requested byte range";
+            ok = false;
+        }
+    }
+    if (!ok) {
+        sessions.clear();
+        unlink(path.c_str());
+    }
+    return ok;
+}
@@ -0,0 +1,199 @@
+#include "../includes/config_file.hpp"
+#include "../includes/protocal.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <utility>
+#include <vector>
+
+bool parse_amount(const std::string &s, uint64_t &out) {
+    if (s.empty() || s[0] < '0' || s[0] > '9')
+        return false;
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s.c_str(), &end, 10);
+    if (errno == ERANGE)
+        return false;  // strtoull saturates at ULLONG_MAX
+    int shift = 0;
+    switch (*end) {
+    case '\0': break;
+    case 'K': case 'k': shift = 10; end++; break;
+    case 'M': case 'm': shift = 20; end++; break;
+    case 'G': case 'g': shift = 30; end++; break;
+    default: return false;
+    }
+    if (*end != '\0' || (shift && v >> (64 - shift)))
+        return false;
+    out = (uint64_t)v << shift;
+    return true;
+}
+
+namespace {
+
+std::string trim(const std::string &s) {
+    size_t begin = s.find_first_not_of(" \t\r");
+    if (begin == std::string::npos)
+        return "";
+    return s.substr(begin, s.find_last_not_of(" \t\r") - begin + 1);
+}
+
+bool parse_bool(const std::string &s, bool &out) {
+    std::string v = lower(s);
+    if (v == "true" || v == "yes" || v == "on" || v == "1")
+        out = true;
+    else if (v == "false" || v == "no" || v == "off" || v == "0")
+        out = false;
+    else
+        return false;
+    return true;
+}
+
+// Integer field within [min, max]
+template <typename T>
+std::function<bool(ServerConfig &, const std::string &)> amount(T ServerConfig::*field, uint64_t min, uint64_t max) {
+    return [=](ServerConfig &c, const std::string &v) {
+        uint64_t n;
+        if (!parse_amount(v, n) || n < min || n > max)
+            return false;
+        c.*field = (T)n;
+        return true;
+    };
+}
+
+std::function<bool(ServerConfig &, const std::string &)> flag(bool ServerConfig::*field) {
+    return [=](ServerConfig &c, const std::string &v) { return parse_bool(v, c.*field); };
+}
+
+std::function<bool(ServerConfig &, const std::string &)> text(std::string ServerConfig::*field) {
+    return [=](ServerConfig &c, const std::string &v) {
+        c.*field = v;
+        return true;
+    };
+}
+
+using Setter = std::function<bool(ServerConfig &, const std::string &)>;
+
+const std::vector<std::pair<std::string, Setter>> &keys() {
+    static const std::vector<std::pair<std::string, Setter>> table = {
+        {"root", text(&ServerConfig::root)},
+        {"port", amount(&ServerConfig::port, 0, 65535)},
+        {"workers", amount(&ServerConfig::workers, 1, 4096)},
+        {"allow_write", flag(&ServerConfig::allow_write)},
+        {"dedup", flag(&ServerConfig::dedup)},
+        {"chunk_sweep_s", amount(&ServerConfig::chunk_sweep_s, 0, UINT32_MAX)},
+        {"max_blksize", amount(&ServerConfig::max_blksize, 8, MAX_BLKSIZE)},
+        {"max_windowsize", amount(&ServerConfig::max_windowsize, 1, MAX_WINDOWSIZE)},
+        {"cache_bytes", amount(&ServerConfig::cache_bytes, 0, UINT64_MAX)},
+        {"timeout_ms",
+         [](ServerConfig &c, const std::string &v) {
+             uint64_t n;
+             if (!parse_amount(v, n) || n < 1 || n > 255000)
+                 return false;
+             c.limits.timeout_ms = (uint32_t)n;
+             return true;
+         }},
+        {"max_retries",
+         [](ServerConfig &c, const std::string &v) {
+             uint64_t n;
+             if (!parse_amount(v, n) || n > 1000)
+                 return false;
+             c.limits.max_retries = (int)n;
+             return true;
+         }},
+        {"metrics_port",
+         [](ServerConfig &c, const std::string &v) {
+             uint64_t n;
+             if (v == "off") {
+                 c.metrics_port = -1;
+                 return true;
+             }
+             if (!parse_amount(v, n) || n > 65535)
+                 return false;
+             c.metrics_port = (int)n;
+             return true;
+         }},
+        {"metrics_socket", text(&ServerConfig::metrics_socket)},
+        {"access_log", text(&ServerConfig::access_log)},
+        {"log_requests", flag(&ServerConfig::log_requests)},
+        {"flight_events", amount(&ServerConfig::flight_events, 0, 1 << 24)},
+        {"flight_dir", text(&ServerConfig::flight_dir)},
+        {"upgrade_socket", text(&ServerConfig::upgrade_socket)},
+        {"shared_sockets", amount(&ServerConfig::shared_sockets, 0, 1024)},
+        {"xdp_interface", text(&ServerConfig::xdp_interface)},
+        {"fair_queueing", flag(&ServerConfig::fair_queueing)},
+        {"fair_quantum", amount(&ServerConfig::fair_quantum, 1, UINT32_MAX)},
+        {"rate_limit", amount(&ServerConfig::rate_limit, 0, UINT64_MAX)},
+        {"client_rate_limit", amount(&ServerConfig::client_rate_limit, 0, UINT64_MAX)},
+        {"client_prefix", amount(&ServerConfig::client_prefix, 0, 32)},
+        {"max_sessions", amount(&ServerConfig::max_sessions, 0, UINT32_MAX)},
+        {"max_pending", amount(&ServerConfig::max_pending, 0, UINT32_MAX)},
+        {"small_file", amount(&ServerConfig::small_file, 0, UINT64_MAX)},
+        {"max_queue_ms", amount(&ServerConfig::max_queue_ms, 0, UINT32_MAX)},
+        {"shed_silently", flag(&ServerConfig::shed_silently)},
+        {"request_buffer", amount(&ServerConfig::request_buffer, 0, INT32_MAX)},
+        {"busy_poll_us", amount(&ServerConfig::busy_poll_us, 0, UINT32_MAX)},
+        {"storage_threads", amount(&ServerConfig::storage_threads, 0, 1024)},
+        {"upstream", text(&ServerConfig::upstream)},
+        {"upstream_blksize", amount(&ServerConfig::upstream_blksize, 0, MAX_BLKSIZE)},
+        {"upstream_windowsize", amount(&ServerConfig::upstream_windowsize, 0, MAX_WINDOWSIZE)},
+        {"shards",
+         [](ServerConfig &c, const std::string &v) {
+             c.shards.clear();
+             for (size_t pos = 0; pos <= v.size();) {
+                 size_t comma = v.find(',', pos);
+                 if (comma == std::string::npos)
+                     comma = v.size();
+                 std::string shard = trim(v.substr(pos, comma - pos));
+                 if (!shard.empty())
+                     c.shards.push_back(shard);
+                 pos = comma + 1;
+             }
+             return true;
+         }},
+    };
+    return table;
+}
+
+}  // namespace
+
+bool load_config_file(const std::string &path, ServerConfig &config, std::string &error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = path + ": cannot read";
+        return false;
+    }
+    ServerConfig next = config;
+    std::string line;
+    for (int number = 1; std::getline(in, line); number++) {
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.resize(hash);
+        line = trim(line);
+        if (line.empty())
+            continue;
+        size_t eq = line.find('=');
+        std::string key = eq == std::string::npos ? line : trim(line.substr(0, eq));
+        std::string value = eq == std::string::npos ? "" : trim(line.substr(eq + 1));
+        std::string where = path + ":" + std::to_string(number) + ": ";
+        if (eq == std::string::npos) {
+            error = where + "expected key = value";
+            return false;
+        }
+        const Setter *set = nullptr;
+        for (const auto &k : keys())
+            if (k.first == key)
+                set = &k.second;
+        if (!set) {
+            error = where + "unknown key " + key;
+            return false;
+        }
+        if (!(*set)(next, value)) {
+            error = where + "bad value for " + key;
+            return false;
+        }
+    }
+    config = next;
+    return true;
+}
@@ -0,0 +1,56 @@
+#include "../includes/coroutine.hpp"
+
+#include <new>
+
+namespace {
+
+// Ahead of every frame: the pool it goes back to. Keeps the frame 16 byte aligned
+struct alignas(16) FrameHeader {
+    FramePool *pool;
+};
+
+}  // namespace
+
+FramePool::~FramePool() {
+    for (auto &blocks : spare)
+        for (void *p : blocks)
+            ::operator delete(p);
+}
+
+void *FramePool::allocate(size_t size, FramePool *pool) {
+    size_t block = (size + sizeof(FrameHeader) + GRAIN - 1) / GRAIN * GRAIN;
+    void *p = nullptr;
+    if (pool) {
+        size_t cls = block / GRAIN;
+        if (cls < pool->spare.size() && !pool->spare[cls].empty()) {
+            p = pool->spare[cls].back();
+            pool->spare[cls].pop_back();
+            pool->spare_count--;
+        }
+        pool->in_use++;
+        pool->in_use_bytes += block;
+    }
+    if (!p)
+        p = ::operator new(block);
+    static_cast<FrameHeader *>(p)->pool = pool;
+    return static_cast<char *>(p) + sizeof(FrameHeader);
+}
+
+void FramePool::release(void *frame, size_t size) {
+    void *p = static_cast<char *>(frame) - sizeof(FrameHeader);
+    FramePool *pool = static_cast<FrameHeader *>(p)->pool;
+    size_t block = (size + sizeof(FrameHeader) + GRAIN - 1) / GRAIN * GRAIN;
+    if (pool) {
+        pool->in_use--;
+        pool->in_use_bytes -= block;
+        if (pool->spare_count < pool->max_spare) {
+            size_t cls = block / GRAIN;
+            if (cls >= pool->spare.size())
+                pool->spare.resize(cls + 1);
+            pool->spare[cls].push_back(p);
+            pool->spare_count++;
+            return;
+        }
+    }
+    ::operator delete(p);
+}
@@ -0,0 +1,263 @@
+#include "../includes/demux_net.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+const size_t MIN_SLOTS = 64;
+const size_t MAX_DATAGRAM = 65536;
+
+// Shared socket index in the top 16 bits, then the peer's address and port. The
+// port is never 0, so neither is the key
+uint64_t peer_key(size_t shared, const struct sockaddr_in &peer) {
+    return (uint64_t)shared << 48 | (uint64_t)ntohl(peer.sin_addr.s_addr) << 16 | ntohs(peer.sin_port);
+}
+
+}  // namespace
+
+PeerTable::PeerTable() : slots(MIN_SLOTS, Slot{0, -1, 0}), mask(MIN_SLOTS - 1), shift(64 - 6) {}
+
+int PeerTable::find(uint64_t key) const {
+    for (size_t i = home(key);; i = (i + 1) & mask) {
+        if (slots[i].key == key)
+            return slots[i].value;
+        if (slots[i].key == 0)
+            return -1;
+    }
+}
+
+bool PeerTable::insert(uint64_t key, int value) {
+    // at most half full keeps probe sequences short
+    if ((count + 1) * 2 > slots.size())
+        grow();
+    size_t i = home(key);
+    for (; slots[i].key != 0; i = (i + 1) & mask)
+        if (slots[i].key == key)
+            return false;
+    slots[i] = Slot{key, value, 0};
+    count++;
+    return true;
+}
+
+void PeerTable::erase(uint64_t key) {
+    size_t i = home(key);
+    for (; slots[i].key != key; i = (i + 1) & mask)
+        if (slots[i].key == 0)
+            return;
+    // pull later entries of the run back over the hole unless that would put one
+    // before its home slot
+    for (size_t j = (i + 1) & mask; slots[j].key != 0; j = (j + 1) & mask) {
+        size_t h = home(slots[j].key);
+        bool stays = i <= j ? (i < h && h <= j) : (i < h || h <= j);
+        if (!stays) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i].key = 0;
+    count--;
+}
+
+void PeerTable::grow() {
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.assign(old.size() * 2, Slot{0, -1, 0});
+    mask = slots.size() - 1;
+    shift--;
+    count = 0;
+    for (const Slot &s : old)
+        if (s.key != 0)
+            insert(s.key, s.value);
+}
+
+DemuxNet::DemuxNet(EventLoop &loop, DatagramNet &base, int count, int receive_buffer)
+    : loop(loop), base(base), buffer(MAX_DATAGRAM) {
+    count = std::max(1, std::min(count, 0xffff));
+    for (int i = 0; i < count; i++) {
+        int fd = base.open();
+        struct sockaddr_in any{};
+        any.sin_family = AF_INET;
+        any.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (fd < 0 || base.bind(fd, any) < 0) {
+            if (fd >= 0)
+                base.close(fd);
+            for (int s : shared) {
+                base.unwatch(loop, s);
+                base.close(s);
+            }
+            throw std::runtime_error("cannot open shared session socket");
+        }
+        if (receive_buffer)
+            base.set_receive_buffer(fd, receive_buffer);
+        size_t index = shared.size();
+        shared.push_back(fd);
+        base.watch(loop, fd, [this, index] { drain(index); });
+    }
+}
+
+DemuxNet::~DemuxNet() {
+    for (int s : shared) {
+        base.unwatch(loop, s);
+        base.close(s);
+    }
+}
+
+void DemuxNet::busy_poll(int usec) {
+    for (int s : shared)
+        base.set_busy_poll(s, usec);
+}
+
+DemuxNet::Endpoint *DemuxNet::endpoint(int sock) {
+    if (sock < 0 || (size_t)sock >= endpoints.size() || !endpoints[(size_t)sock].open) {
+        errno = EBADF;
+        return nullptr;
+    }
+    return &endpoints[(size_t)sock];
+}
+
+int DemuxNet::open() {
+    int sock;
+    if (!free_endpoints.empty()) {
+        sock = free_endpoints.back();
+        free_endpoints.pop_back();
+    } else {
+        sock = (int)endpoints.size();
+        endpoints.emplace_back();
+    }
+    endpoints[(size_t)sock].open = true;
+    return sock;
+}
+
+int DemuxNet::bind(int sock, const struct sockaddr_in &addr, bool) {
+    if (!endpoint(sock))
+        return -1;
+    if (addr.sin_port != 0) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    return 0;
+}
+
+int DemuxNet::local_address(int sock, struct sockaddr_in &addr) {
+    Endpoint *e = endpoint(sock);
+    if (!e)
+        return -1;
+    return base.local_address(shared[e->shared >= 0 ? (size_t)e->shared : 0], addr);
+}
+
+int DemuxNet::connect(int sock, const struct sockaddr_in &peer) {
+    Endpoint *e = endpoint(sock);
+    if (!e)
+        return -1;
+    if (e->shared >= 0) {
+        table.erase(peer_key((size_t)e->shared, e->peer));
+        e->shared = -1;
+    }
+    // round robin over the shared sockets, skipping those that already serve this peer
+    for (size_t k = 0; k < shared.size(); k++) {
+        size_t s = (next_shared + k) % shared.size();
+        if (table.insert(peer_key(s, peer), sock)) {
+            e->shared = (int)s;
+            e->peer = peer;
+            next_shared = s + 1;
+            return 0;
+        }
+    }
+    errno = EADDRINUSE;
+    return -1;
+}
+
+int DemuxNet::route(int sock, const struct sockaddr_in *&to, size_t &i) {
+    Endpoint *e = endpoint(sock);
+    if (!e)
+        return -1;
+    if (!to) {
+        if (e->shared < 0) {
+            errno = EDESTADDRREQ;
+            return -1;
+        }
+        to = &e->peer;
+    }
+    i = e->shared >= 0 ? (size_t)e->shared : 0;
+    return 0;
+}
+
+ssize_t DemuxNet::send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) {
+    size_t i;
+    if (route(sock, to, i) < 0)
+        return -1;
+    return base.send_to(shared[i], buf, len, to);
+}
+
+ssize_t DemuxNet::receive(int sock, char *buf, size_t cap, struct sockaddr_in *from) {
+    Endpoint *e = endpoint(sock);
+    if (!e)
+        return -1;
+    if (!e->full) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t n = std::min(cap, e->inbox.size());
+    memcpy(buf, e->inbox.data(), n);
+    if (from)
+        *from = e->peer;
+    e->full = false;
+    return (ssize_t)n;
+}
+
+void DemuxNet::close(int sock) {
+    Endpoint *e = endpoint(sock);
+    if (!e)
+        return;
+    if (e->shared >= 0)
+        table.erase(peer_key((size_t)e->shared, e->peer));
+    e->open = false;
+    e->shared = -1;
+    e->readable = nullptr;
+    e->full = false;
+    free_endpoints.push_back(sock);
+}
+
+void DemuxNet::watch(EventLoop &, int sock, std::function<void()> readable) {
+    if (Endpoint *e = endpoint(sock))
+        e->readable = std::move(readable);
+}
+
+void DemuxNet::unwatch(EventLoop &, int sock) {
+    if (Endpoint *e = endpoint(sock))
+        e->readable = nullptr;
+}
+
+void DemuxNet::drain(size_t i) {
+    for (;;) {
+        struct sockaddr_in from{};
+        ssize_t n = base.receive(shared[i], buffer.data(), buffer.size(), &from);
+        if (n < 0)
+            return;
+        deliver(i, from, buffer.data(), (size_t)n);
+    }
+}
+
+void DemuxNet::deliver(size_t i, const struct sockaddr_in &from, const char *buf, size_t len) {
+    int sock = table.find(peer_key(i, from));
+    if (sock < 0) {
+        counters.unknown++;
+        return;
+    }
+    Endpoint &e = endpoints[(size_t)sock];
+    if (e.full) {
+        counters.overflow++;
+        return;
+    }
+    e.inbox.assign(buf, buf + len);
+    e.full = true;
+    // the callback may close the socket and with it the function it runs from
+    if (e.readable) {
+        std::function<void()> readable = e.readable;
+        readable();
+    }
+}
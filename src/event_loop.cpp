@@ -0,0 +1,233 @@
+#include "../includes/event_loop.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <linux/types.h>
+#include <sched.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// Per epoll instance busy polling, Linux 6.9; older headers lack it
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    __u32 busy_poll_usecs;
+    __u16 busy_poll_budget;
+    __u8 prefer_busy_poll;
+    __u8 __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+namespace {
+
+uint64_t now_us() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t now_ns() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace
+
+EventLoop::EventLoop() {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd < 0 || wakefd < 0)
+        throw std::runtime_error("event loop setup failed");
+    add(wakefd, EPOLLIN, [this](uint32_t) {
+        uint64_t n;
+        while (read(wakefd, &n, sizeof(n)) > 0) {}
+    });
+}
+
+EventLoop::~EventLoop() {
+    close(wakefd);
+    close(epfd);
+}
+
+uint64_t EventLoop::now_ms() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void EventLoop::use_clock(std::function<uint64_t()> clock_ms) {
+    clock = std::move(clock_ms);
+}
+
+uint64_t EventLoop::next_deadline() const {
+    return deadlines.empty() ? UINT64_MAX : deadlines.begin()->first;
+}
+
+bool EventLoop::has_posted() {
+    if (!deferred.empty())
+        return true;
+    std::lock_guard<std::mutex> lock(post_mutex);
+    return !posted.empty();
+}
+
+void EventLoop::add(int fd, uint32_t events, IoCallback cb) {
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        throw std::runtime_error("epoll_ctl add failed");
+    handlers[fd] = std::move(cb);
+}
+
+void EventLoop::modify(int fd, uint32_t events) {
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void EventLoop::remove(int fd) {
+    auto it = handlers.find(fd);
+    if (it == handlers.end())
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    // the callback may be the one running right now, destroy it after dispatch
+    retired.push_back(handlers.extract(it));
+}
+
+uint64_t EventLoop::add_timer(uint32_t delay_ms, Task cb) {
+    uint64_t id = next_timer_id++;
+    auto pos = deadlines.emplace(now() + delay_ms, id);
+    timers.emplace(id, std::make_pair(pos, std::move(cb)));
+    return id;
+}
+
+void EventLoop::cancel_timer(uint64_t id) {
+    auto it = timers.find(id);
+    if (it == timers.end())
+        return;
+    deadlines.erase(it->second.first);
+    timers.erase(it);
+}
+
+void EventLoop::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(post_mutex);
+        posted.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    (void)!write(wakefd, &one, sizeof(one));
+}
+
+void EventLoop::defer(Task task) {
+    deferred.push_back(std::move(task));
+}
+
+void EventLoop::stop() {
+    post([this] { stopped = true; });
+}
+
+int EventLoop::next_timeout() const {
+    if (!deferred.empty())
+        return 0;
+    if (deadlines.empty())
+        return -1;
+    uint64_t now = this->now();
+    uint64_t first = deadlines.begin()->first;
+    return first <= now ? 0 : (int)(first - now);
+}
+
+void EventLoop::run_timers() {
+    uint64_t now = this->now();
+    while (!deadlines.empty() && deadlines.begin()->first <= now) {
+        uint64_t id = deadlines.begin()->second;
+        deadlines.erase(deadlines.begin());
+        auto it = timers.find(id);
+        Task cb = std::move(it->second.second);
+        timers.erase(it);
+        cb();
+    }
+}
+
+void EventLoop::run_posted() {
+    std::vector<Task> batch;
+    {
+        std::lock_guard<std::mutex> lock(post_mutex);
+        batch.swap(posted);
+    }
+    for (auto &task : batch)
+        task();
+}
+
+int EventLoop::run_once(int timeout_ms) {
+    int wait = next_timeout();
+    if (timeout_ms >= 0 && (wait < 0 || timeout_ms < wait))
+        wait = timeout_ms;
+
+    struct epoll_event events[64];
+    int n = epoll_wait(epfd, events, 64, wait);
+    uint64_t woke = on_round ? now_ns() : 0;
+    for (int i = 0; i < n; i++) {
+        auto it = handlers.find(events[i].data.fd);
+        if (it != handlers.end())
+            it->second(events[i].events);
+    }
+    run_posted();
+    run_timers();
+    if (!deferred.empty()) {
+        std::vector<Task> batch;
+        batch.swap(deferred);
+        for (auto &task : batch)
+            task();
+    }
+    retired.clear();
+    // an empty poll while spinning is no round worth a sample
+    if (on_round && (n > 0 || timeout_ms != 0))
+        on_round(now_ns() - woke);
+    return n < 0 ? 0 : n;
+}
+
+void EventLoop::busy_poll(uint32_t spin_us) {
+    spin_max_us = spin_us;
+    this->spin_us = spin_us;
+    // best effort: older kernels lack it, and devices without NAPI (loopback) ignore it
+    struct epoll_params params{};
+    params.busy_poll_usecs = spin_us;
+    params.busy_poll_budget = 8;
+    (void)!ioctl(epfd, EPIOCSPARAMS, &params);
+}
+
+void EventLoop::run() {
+    if (spin_max_us) {
+        run_spinning();
+        return;
+    }
+    while (!stopped)
+        run_once();
+}
+
+void EventLoop::run_spinning() {
+    uint64_t idle_since = now_us();
+    while (!stopped) {
+        if (run_once(0) > 0) {
+            idle_since = now_us();
+            continue;
+        }
+        if (now_us() - idle_since < spin_us) {
+            // free on a CPU of its own; elsewhere lets the threads it shares with run
+            sched_yield();
+            continue;
+        }
+        uint64_t slept = now_us();
+        run_once();
+        idle_since = now_us();
+        slept = idle_since - slept;
+        // woken soon after giving up: a longer window would have caught it. Long
+        // sleeps mean the loop is idle, spinning for them only burns the CPU
+        if (slept < spin_max_us)
+            spin_us = std::min(spin_max_us, spin_us * 2);
+        else
+            spin_us = std::max(spin_max_us / 16, spin_us / 2);
+    }
+}
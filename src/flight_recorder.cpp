@@ -0,0 +1,78 @@
+#include "../includes/flight_recorder.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+FlightRecorder::FlightRecorder(size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+    mask = cap - 1;
+    words.reset(new std::atomic<uint64_t>[SLOT_WORDS * cap]);
+    for (size_t i = 0; i < SLOT_WORDS * cap; i++)
+        words[i].store(0, std::memory_order_relaxed);
+    tsc0 = flight_tsc();
+    ns0 = metrics_now_ns();
+}
+
+std::vector<FlightEvent> FlightRecorder::snapshot() const {
+    uint64_t cap = mask + 1;
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t begin = end > cap ? end - cap : 0;
+    std::vector<FlightEvent> events;
+    events.reserve((size_t)(end - begin));
+    for (uint64_t i = begin; i < end; i++) {
+        const std::atomic<uint64_t> *slot = &words[SLOT_WORDS * (i & mask)];
+        uint64_t seq = slot[2].load(std::memory_order_acquire);
+        uint64_t tsc = slot[0].load(std::memory_order_relaxed);
+        uint64_t w = slot[1].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // the worker has moved on to, or is in the middle of, a later event in this slot
+        if (seq != i + 1 || slot[2].load(std::memory_order_relaxed) != seq)
+            continue;
+        FlightEvent e;
+        e.tsc = tsc;
+        e.session = (uint32_t)w;
+        e.block = (uint16_t)(w >> 32);
+        e.type = (uint8_t)(w >> 48);
+        e.arg = (uint8_t)(w >> 56);
+        events.push_back(e);
+    }
+    return events;
+}
+
+bool FlightRecorder::dump(const std::string &path, const std::vector<FlightEvent> &events, uint64_t tsc0, uint64_t ns0) {
+    FlightHeader header{};
+    memcpy(header.magic, "TTFLIGHT", 8);
+    header.version = 1;
+    header.count = (uint32_t)events.size();
+    header.tsc0 = tsc0;
+    header.ns0 = ns0;
+    header.tsc1 = flight_tsc();
+    header.ns1 = metrics_now_ns();
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+    size_t len = events.size() * sizeof(FlightEvent);
+    const char *p = (const char *)events.data();
+    while (ok && len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            ok = false;
+        else {
+            p += n;
+            len -= (size_t)n;
+        }
+    }
+    int saved = errno;
+    if (close(fd) < 0)
+        ok = false;
+    else
+        errno = saved;
+    return ok;
+}
@@ -0,0 +1,271 @@
+#include "../includes/handoff.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+const char MAGIC[8] = {'T', 'T', 'H', 'A', 'N', 'D', 'O', 'F'};
+const uint16_t VERSION = 1;
+const size_t MAX_FDS = 253;         // SCM_MAX_FD
+const size_t MAX_MESSAGE = 4096;
+const int TIMEOUT_S = 10;
+
+// Host byte order: both ends are builds of this code on the same machine
+template <typename T>
+void put(std::string &out, const T &v) {
+    out.append((const char *)&v, sizeof(v));
+}
+
+void put_bytes(std::string &out, const char *p, size_t n) {
+    put(out, (uint32_t)n);
+    out.append(p, n);
+}
+
+struct Reader {
+    const char *p;
+    size_t left;
+
+    template <typename T>
+    bool get(T &v) {
+        if (left < sizeof(v))
+            return false;
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        left -= sizeof(v);
+        return true;
+    }
+    bool get_bytes(std::string &s) {
+        uint32_t n;
+        if (!get(n) || left < n)
+            return false;
+        s.assign(p, n);
+        p += n;
+        left -= n;
+        return true;
+    }
+};
+
+std::string encode(const HandoffSession &s) {
+    std::string out(1, 'S');
+    put(out, s.op);
+    put_bytes(out, s.filename.data(), s.filename.size());
+    put(out, s.peer.sin_addr.s_addr);
+    put(out, s.peer.sin_port);
+    put(out, s.opts.blksize);
+    put(out, s.opts.windowsize);
+    put(out, s.opts.timeout);
+    put(out, (uint8_t)s.opts.has_tsize);
+    put(out, s.opts.tsize);
+    put(out, (uint8_t)s.opts.has_offset);
+    put(out, s.opts.offset);
+    put(out, (uint8_t)s.opts.has_length);
+    put(out, s.opts.length);
+    put(out, s.size);
+    put(out, s.acked);
+    put(out, s.sent);
+    put(out, s.transferred);
+    put(out, s.in_window);
+    put(out, (uint8_t)s.keep_partial);
+    put_bytes(out, s.reply.data(), s.reply.size());
+    return out;
+}
+
+bool decode(const char *buf, size_t len, HandoffSession &s) {
+    Reader r{buf, len};
+    char tag;
+    uint8_t has_tsize, has_offset, has_length, keep_partial;
+    std::string reply;
+    if (!r.get(tag) || tag != 'S' || !r.get(s.op) || !r.get_bytes(s.filename) ||
+        !r.get(s.peer.sin_addr.s_addr) || !r.get(s.peer.sin_port) || !r.get(s.opts.blksize) ||
+        !r.get(s.opts.windowsize) || !r.get(s.opts.timeout) || !r.get(has_tsize) || !r.get(s.opts.tsize) ||
+        !r.get(has_offset) || !r.get(s.opts.offset) || !r.get(has_length) || !r.get(s.opts.length) ||
+        !r.get(s.size) || !r.get(s.acked) || !r.get(s.sent) || !r.get(s.transferred) ||
+        !r.get(s.in_window) || !r.get(keep_partial) || !r.get_bytes(reply) || r.left != 0)
+        return false;
+    if (s.opts.blksize == 0 || s.opts.windowsize == 0)
+        return false;
+    s.peer.sin_family = AF_INET;
+    s.opts.has_tsize = has_tsize;
+    s.opts.has_offset = has_offset;
+    s.opts.has_length = has_length;
+    s.keep_partial = keep_partial;
+    s.reply.assign(reply.begin(), reply.end());
+    return true;
+}
+
+bool send_message(int sock, const std::string &msg, const int *fds, size_t nfds) {
+    struct iovec iov = {(void *)msg.data(), msg.size()};
+    struct msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    std::vector<char> control;
+    if (nfds) {
+        control.assign(CMSG_SPACE(nfds * sizeof(int)), 0);
+        mh.msg_control = control.data();
+        mh.msg_controllen = control.size();
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+    for (;;) {
+        ssize_t n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n == (ssize_t)msg.size();
+    }
+}
+
+// One message; received descriptors are appended to fds (close-on-exec)
+bool recv_message(int sock, std::string &msg, std::vector<int> &fds) {
+    msg.resize(MAX_MESSAGE);
+    struct iovec iov = {&msg[0], msg.size()};
+    std::vector<char> control(CMSG_SPACE(MAX_FDS * sizeof(int)));
+    struct msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.data();
+    mh.msg_controllen = control.size();
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
+    }
+    msg.resize((size_t)n);
+    return !(mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+}
+
+bool unix_address(const std::string &path, struct sockaddr_un &addr) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    path.copy(addr.sun_path, path.size());
+    return true;
+}
+
+}  // namespace
+
+int listen_handoff(const std::string &path) {
+    struct sockaddr_un addr;
+    if (!unix_address(path, addr))
+        return -1;
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+bool receive_handoff(const std::string &path, uint16_t &port, std::vector<int> &listen_socks,
+                     std::vector<HandoffSession> &sessions) {
+    struct sockaddr_un addr;
+    if (!unix_address(path, addr))
+        throw std::runtime_error("upgrade socket path too long");
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        throw std::runtime_error("socket() failed");
+    // nobody there (or a stale socket file): this is a first start
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return false;
+    }
+    struct timeval tv = {TIMEOUT_S, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    std::vector<int> fds;
+    std::vector<HandoffSession> got;
+    auto fail = [&](const char *what) {
+        for (int fd : fds)
+            close(fd);
+        for (auto &s : got)
+            close(s.sock);
+        close(sock);
+        throw std::runtime_error(std::string("handoff from ") + path + " failed: " + what);
+    };
+
+    std::string msg;
+    uint16_t version;
+    if (!recv_message(sock, msg, fds) || msg.size() != sizeof(MAGIC) + 4 ||
+        memcmp(msg.data(), MAGIC, sizeof(MAGIC)) != 0)
+        fail("bad hello");
+    memcpy(&version, msg.data() + sizeof(MAGIC), 2);
+    memcpy(&port, msg.data() + sizeof(MAGIC) + 2, 2);
+    if (version != VERSION)
+        fail("version mismatch");
+    if (fds.empty())
+        fail("no listening sockets");
+    std::vector<int> socks;
+    socks.swap(fds);
+    for (;;) {
+        if (!recv_message(sock, msg, fds)) {
+            fds.insert(fds.end(), socks.begin(), socks.end());
+            fail("connection lost");
+        }
+        if (!msg.empty() && msg[0] == 'E') {
+            uint32_t count = 0;
+            if (msg.size() == 5)
+                memcpy(&count, msg.data() + 1, 4);
+            if (count != got.size() || !fds.empty()) {
+                fds.insert(fds.end(), socks.begin(), socks.end());
+                fail("session count mismatch");
+            }
+            break;
+        }
+        HandoffSession s;
+        if (fds.size() != 1 || !decode(msg.data(), msg.size(), s)) {
+            fds.insert(fds.end(), socks.begin(), socks.end());
+            fail("bad session record");
+        }
+        s.sock = fds[0];
+        fds.clear();
+        got.push_back(std::move(s));
+    }
+    close(sock);
+    listen_socks.insert(listen_socks.end(), socks.begin(), socks.end());
+    for (auto &s : got)
+        sessions.push_back(std::move(s));
+    return true;
+}
+
+bool send_handoff(int conn, uint16_t port, const std::vector<int> &listen_socks,
+                  const std::vector<HandoffSession> &sessions) {
+    if (listen_socks.empty() || listen_socks.size() > MAX_FDS)
+        return false;
+    std::string hello(MAGIC, sizeof(MAGIC));
+    put(hello, VERSION);
+    put(hello, port);
+    if (!send_message(conn, hello, listen_socks.data(), listen_socks.size()))
+        return false;
+    for (const HandoffSession &s : sessions)
+        if (!send_message(conn, encode(s), &s.sock, 1))
+            return false;
+    std::string end(1, 'E');
+    put(end, (uint32_t)sessions.size());
+    return send_message(conn, end, nullptr, 0);
+}
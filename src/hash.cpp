@@ -0,0 +1,238 @@
+#include "../includes/hash.hpp"
+
+#include <cstring>
+#if defined(__SSE2__) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const uint64_t PRIME32_1 = 0x9E3779B1ULL;
+const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+
+const size_t STRIPE = 64;
+const size_t SECRET_SIZE = 192;
+const size_t STRIPES_PER_BLOCK = (SECRET_SIZE - STRIPE) / 8;  // 16 stripes = 1 KiB per scramble
+
+struct Secret {
+    alignas(64) unsigned char bytes[SECRET_SIZE];
+    Secret() {
+        // splitmix64 stream, fixed forever: chunk names depend on it
+        uint64_t x = 0x7475726274667470ULL;  // "turbtftp"
+        for (size_t i = 0; i < SECRET_SIZE; i += 8) {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            memcpy(bytes + i, &z, 8);
+        }
+    }
+};
+const Secret secret;
+
+inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t fold64(uint64_t a, uint64_t b) {
+    __uint128_t p = (__uint128_t)a * b;
+    return (uint64_t)p ^ (uint64_t)(p >> 64);
+}
+
+inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+void accumulate_scalar(uint64_t *acc, const unsigned char *data, const unsigned char *key) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t dv = read64(data + 8 * i);
+        uint64_t dk = dv ^ read64(key + 8 * i);
+        acc[i ^ 1] += dv;
+        acc[i] += (dk & 0xFFFFFFFFULL) * (dk >> 32);
+    }
+}
+
+void scramble_scalar(uint64_t *acc, const unsigned char *key) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= read64(key + 8 * i);
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TFTP_HASH_X86 1
+// Compiled for AVX2 whatever -march says; hash128() only takes this path on CPUs
+// that report it, unless the whole build already targets x86-64-v3
+__attribute__((target("avx2"))) inline void accumulate_avx2(uint64_t *acc, const unsigned char *data,
+                                                            const unsigned char *key) {
+    for (int j = 0; j < 2; j++) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + 4 * j));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(data + 32 * j));
+        __m256i dk = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i *)(key + 32 * j)));
+        __m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+        __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a = _mm256_add_epi64(a, _mm256_add_epi64(prod, swapped));
+        _mm256_storeu_si256((__m256i *)(acc + 4 * j), a);
+    }
+}
+
+__attribute__((target("avx2"))) inline void scramble_avx2(uint64_t *acc, const unsigned char *key) {
+    const __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+    for (int j = 0; j < 2; j++) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + 4 * j));
+        a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(key + 32 * j)));
+        __m256i lo = _mm256_mul_epu32(a, prime);
+        __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+        _mm256_storeu_si256((__m256i *)(acc + 4 * j), _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+    }
+}
+#endif
+
+#if defined(__SSE2__)
+inline void accumulate_sse2(uint64_t *acc, const unsigned char *data, const unsigned char *key) {
+    for (int j = 0; j < 4; j++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + 2 * j));
+        __m128i d = _mm_loadu_si128((const __m128i *)(data + 16 * j));
+        __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(key + 16 * j)));
+        __m128i prod = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+        __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a = _mm_add_epi64(a, _mm_add_epi64(prod, swapped));
+        _mm_storeu_si128((__m128i *)(acc + 2 * j), a);
+    }
+}
+
+inline void scramble_sse2(uint64_t *acc, const unsigned char *key) {
+    const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+    for (int j = 0; j < 4; j++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + 2 * j));
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(key + 16 * j)));
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        _mm_storeu_si128((__m128i *)(acc + 2 * j), _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+    }
+}
+#endif
+
+// always_inline so each wrapper below compiles the loop for its own target
+template <void (*Accumulate)(uint64_t *, const unsigned char *, const unsigned char *),
+          void (*Scramble)(uint64_t *, const unsigned char *)>
+__attribute__((always_inline)) inline Hash128 hash_impl(const void *input, size_t len) {
+    const unsigned char *p = (const unsigned char *)input;
+    const unsigned char *key = secret.bytes;
+    alignas(32) uint64_t acc[8] = {PRIME32_1, PRIME64_1, PRIME64_2, PRIME64_1 ^ PRIME64_2,
+                                   PRIME64_2 >> 1, PRIME64_1 >> 1, PRIME32_1 << 16, ~PRIME64_1};
+    size_t stripes = len / STRIPE;
+    size_t s = 0;
+    for (; s < stripes; s++) {
+        size_t in_block = s % STRIPES_PER_BLOCK;
+        Accumulate(acc, p + s * STRIPE, key + in_block * 8);
+        if (in_block == STRIPES_PER_BLOCK - 1)
+            Scramble(acc, key + SECRET_SIZE - STRIPE);
+    }
+    // zero padded tail stripe; the length is mixed in below so padding cannot collide
+    alignas(32) unsigned char tail[STRIPE] = {0};
+    memcpy(tail, p + s * STRIPE, len - s * STRIPE);
+    Accumulate(acc, tail, key + (s % STRIPES_PER_BLOCK) * 8 + 7);
+
+    uint64_t lo = (uint64_t)len * PRIME64_1;
+    uint64_t hi = ~((uint64_t)len * PRIME64_2);
+    for (int i = 0; i < 4; i++) {
+        lo += fold64(acc[2 * i] ^ read64(key + 11 + 16 * i), acc[2 * i + 1] ^ read64(key + 19 + 16 * i));
+        hi += fold64(acc[2 * i] ^ read64(key + 117 - 16 * i), acc[2 * i + 1] ^ read64(key + 125 - 16 * i));
+    }
+    Hash128 h;
+    h.lo = avalanche(lo);
+    h.hi = avalanche(hi ^ lo);
+    return h;
+}
+
+Hash128 hash_scalar(const void *data, size_t len) {
+    return hash_impl<accumulate_scalar, scramble_scalar>(data, len);
+}
+
+#if defined(__SSE2__) && !defined(__AVX2__)
+Hash128 hash_sse2(const void *data, size_t len) {
+    return hash_impl<accumulate_sse2, scramble_sse2>(data, len);
+}
+#endif
+
+#if defined(TFTP_HASH_X86)
+__attribute__((target("avx2"))) Hash128 hash_avx2(const void *data, size_t len) {
+    return hash_impl<accumulate_avx2, scramble_avx2>(data, len);
+}
+#endif
+
+struct Kernel {
+    Hash128 (*fn)(const void *, size_t);
+    const char *name;
+};
+
+Kernel pick_kernel() {
+#if defined(__AVX2__)
+    return {hash_avx2, "avx2"};
+#else
+#if defined(TFTP_HASH_X86)
+    if (__builtin_cpu_supports("avx2"))
+        return {hash_avx2, "avx2"};
+#endif
+#if defined(__SSE2__)
+    return {hash_sse2, "sse2"};
+#else
+    return {hash_scalar, "scalar"};
+#endif
+#endif
+}
+
+const Kernel &kernel() {
+    static const Kernel k = pick_kernel();
+    return k;
+}
+
+}  // namespace
+
+Hash128 hash128(const void *data, size_t len) {
+    return kernel().fn(data, len);
+}
+
+Hash128 hash128_scalar(const void *data, size_t len) {
+    return hash_scalar(data, len);
+}
+
+const char *hash128_kernel() {
+    return kernel().name;
+}
+
+std::string Hash128::hex() const {
+    static const char digits[] = "0123456789abcdef";
+    std::string s(32, '0');
+    for (int i = 0; i < 16; i++) {
+        s[15 - i] = digits[(hi >> (4 * i)) & 0xF];
+        s[31 - i] = digits[(lo >> (4 * i)) & 0xF];
+    }
+    return s;
+}
+
+bool Hash128::from_hex(const std::string &s, Hash128 &out) {
+    if (s.size() != 32)
+        return false;
+    uint64_t parts[2] = {0, 0};
+    for (int i = 0; i < 32; i++) {
+        char c = s[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (v < 0)
+            return false;
+        parts[i / 16] = (parts[i / 16] << 4) | (uint64_t)v;
+    }
+    out.hi = parts[0];
+    out.lo = parts[1];
+    return true;
+}
@@ -0,0 +1,597 @@
+#include "../includes/image_store.hpp"
+#include "../includes/chunk_store.hpp"
+#include "../includes/hash.hpp"
+#include "../includes/protocal.hpp"
+#include "../includes/storage_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef TURBOTFTP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// ---- sidecar index ----
+
+bool ImageIndex::load(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+    char codec_name[16] = {0};
+    unsigned long long ssize, dsize;
+    long long mtime;
+    bool ok = fscanf(f, "turbotftp-index 1 codec %15s source %llu %lld size %llu",
+                     codec_name, &ssize, &mtime, &dsize) == 4;
+    if (ok) {
+        codec = strcmp(codec_name, "zstd") == 0 ? Codec::ZSTD : Codec::GZIP;
+        source_size = ssize;
+        source_mtime = mtime;
+        size = dsize;
+        frames.clear();
+        unsigned long long a, b, c, d;
+        while (fscanf(f, " frame %llu %llu %llu %llu", &a, &b, &c, &d) == 4)
+            frames.push_back({a, b, c, d});
+        ok = !frames.empty() || size == 0;
+    }
+    fclose(f);
+    return ok;
+}
+
+bool ImageIndex::save(const std::string &path) const {
+    // write then rename so a concurrent reader never sees half an index; the counter
+    // keeps threads saving the same index apart
+    static std::atomic<unsigned> saves{0};
+    std::string tmp = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(saves++);
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f)
+        return false;
+    fprintf(f, "turbotftp-index 1\ncodec %s\nsource %llu %lld\nsize %llu\n",
+            codec == Codec::ZSTD ? "zstd" : "gzip", (unsigned long long)source_size,
+            (long long)source_mtime, (unsigned long long)size);
+    for (const auto &fr : frames)
+        fprintf(f, "frame %llu %llu %llu %llu\n", (unsigned long long)fr.in_offset,
+                (unsigned long long)fr.in_len, (unsigned long long)fr.out_offset,
+                (unsigned long long)fr.out_len);
+    bool ok = fclose(f) == 0;
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// ---- block cache ----
+
+BlockCache::BlockCache(size_t capacity_bytes) : capacity(capacity_bytes) {}
+
+BlockCache::Stats BlockCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats s = counters;
+    s.bytes = bytes;
+    return s;
+}
+
+BlockCache::Block BlockCache::peek(const std::string &key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end() ||
+        it->second.block.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return nullptr;
+    Block block;
+    try {
+        block = it->second.block.get();
+    } catch (...) {
+        return nullptr;  // a loader that threw, on its way out of the cache
+    }
+    if (block) {
+        counters.hits++;
+        lru.splice(lru.begin(), lru, it->second.lru);
+    }
+    return block;
+}
+
+void BlockCache::resize(size_t capacity_bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity = capacity_bytes;
+    evict();
+}
+
+void BlockCache::evict() {
+    // the newest entry always stays, even when it alone exceeds the capacity
+    while (bytes > capacity && entries.size() > 1) {
+        auto it = entries.find(lru.back());
+        bytes -= it->second.bytes;
+        entries.erase(it);
+        lru.pop_back();
+        counters.evictions++;
+    }
+}
+
+// ---- sources ----
+
+FileSource::~FileSource() {
+    close(fd);
+}
+
+ssize_t FileSource::read_at(uint64_t offset, char *buf, size_t len) {
+    return pread(fd, buf, len, (off_t)offset);
+}
+
+FileSink::~FileSink() {
+    if (fd >= 0)
+        close(fd);
+}
+
+bool FileSink::write(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= (size_t)n;
+        pos += (uint64_t)n;
+    }
+    return true;
+}
+
+bool FileSink::commit() {
+    int rc = close(fd);
+    fd = -1;
+    return rc == 0;
+}
+
+bool FileSink::restart() {
+    pos = 0;
+    return ftruncate(fd, 0) == 0;
+}
+
+void FileSink::abort() {
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    if (!path.empty())
+        unlink(path.c_str());
+}
+
+bool MemorySink::write(const char *buf, size_t len) {
+    out.append(buf, len);
+    return true;
+}
+
+ssize_t MemorySource::read_at(uint64_t offset, char *buf, size_t len) {
+    if (offset >= data.size())
+        return 0;
+    len = std::min<size_t>(len, data.size() - (size_t)offset);
+    memcpy(buf, data.data() + offset, len);
+    return (ssize_t)len;
+}
+
+std::string prefix_checksum(ImageSource &source, uint64_t offset) {
+    std::vector<char> buf((size_t)std::min<uint64_t>(offset, RESUME_PIECE_BYTES));
+    // the pieces' digests as hex, so both ends agree whatever their byte order
+    std::string pieces;
+    for (uint64_t start = 0; start < offset; start += buf.size()) {
+        size_t len = (size_t)std::min<uint64_t>(buf.size(), offset - start);
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = source.read_at(start + got, buf.data() + got, len - got);
+            if (n <= 0)
+                return "";
+            got += (size_t)n;
+        }
+        pieces += hash128(buf.data(), len).hex();
+    }
+    return hash128(pieces.data(), pieces.size()).hex();
+}
+
+// Mapped compressed file plus its index, shared by every session reading it
+class CompressedImage {
+public:
+    std::string key;  // cache key prefix, changes when the file does
+    ImageIndex index;
+    const unsigned char *map = nullptr;
+    size_t map_len = 0;
+
+    ~CompressedImage() {
+        if (map)
+            munmap((void *)map, map_len);
+    }
+    BlockCache::Block decode(size_t frame) const;
+};
+
+// Inflates the gzip member at in into out_len bytes of out. With out nullptr it only
+// measures the member, and fails once it is larger than out_len
+static bool inflate_member(const unsigned char *in, size_t in_len, char *out, size_t out_len,
+                           size_t *consumed, size_t *produced) {
+    z_stream zs{};
+    if (inflateInit2(&zs, 15 + 32) != Z_OK)
+        return false;
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = (uInt)in_len;
+    char scratch[16384];
+    size_t total = 0;
+    int rc;
+    do {
+        // with no output buffer we are only measuring the member
+        char *dst = out ? out + total : scratch;
+        size_t room = out ? out_len - total : sizeof(scratch);
+        zs.next_out = (Bytef *)dst;
+        zs.avail_out = (uInt)std::min<size_t>(room, 1u << 30);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        total += (size_t)(zs.next_out - (Bytef *)dst);
+    } while (rc == Z_OK && (out ? total < out_len : total <= out_len));
+    bool ok = out ? rc == Z_STREAM_END || total == out_len : rc == Z_STREAM_END && total <= out_len;
+    if (consumed)
+        *consumed = in_len - zs.avail_in;
+    if (produced)
+        *produced = total;
+    inflateEnd(&zs);
+    return ok;
+}
+
+BlockCache::Block CompressedImage::decode(size_t frame) const {
+    const auto &fr = index.frames[frame];
+    auto out = std::make_shared<std::vector<char>>(fr.out_len);
+    if (index.codec == Codec::GZIP) {
+        size_t produced = 0;
+        if (!inflate_member(map + fr.in_offset, fr.in_len, out->data(), fr.out_len, nullptr, &produced) ||
+            produced != fr.out_len)
+            return nullptr;
+    } else {
+#ifdef TURBOTFTP_HAVE_ZSTD
+        size_t n = ZSTD_decompress(out->data(), fr.out_len, map + fr.in_offset, fr.in_len);
+        if (ZSTD_isError(n) || n != fr.out_len)
+            return nullptr;
+#else
+        return nullptr;
+#endif
+    }
+    return out;
+}
+
+class CompressedSource : public ImageSource {
+public:
+    CompressedSource(std::shared_ptr<CompressedImage> image, BlockCache &cache)
+        : image(std::move(image)), cache(cache) {}
+    uint64_t size() const override { return image->index.size; }
+
+    ssize_t read_at(uint64_t offset, char *buf, size_t len) override {
+        const auto &frames = image->index.frames;
+        size_t copied = 0;
+        while (copied < len && offset < image->index.size) {
+            // frames are sorted by out_offset; find the one holding offset
+            auto it = std::upper_bound(frames.begin(), frames.end(), offset,
+                [](uint64_t off, const ImageIndex::Frame &f) { return off < f.out_offset; });
+            size_t idx = (size_t)(it - frames.begin()) - 1;
+            if (idx != current_idx) {
+                if (storage) {
+                    // a miss is decoded by when_readable() on the pool
+                    current = failed == idx ? nullptr : cache.peek(key_of(idx));
+                    if (!current) {
+                        if (copied)
+                            break;
+                        errno = failed == idx ? EIO : EAGAIN;
+                        missing = idx;
+                        return -1;
+                    }
+                } else {
+                    current = cache.get(key_of(idx), [&] { return image->decode(idx); });
+                    if (!current)
+                        return -1;
+                }
+                current_idx = idx;
+            }
+            uint64_t within = offset - frames[idx].out_offset;
+            size_t n = (size_t)std::min<uint64_t>(len - copied, current->size() - within);
+            memcpy(buf + copied, current->data() + within, n);
+            copied += n;
+            offset += n;
+        }
+        return (ssize_t)copied;
+    }
+
+    void when_readable(EventLoop &loop, std::function<void()> ready) override {
+        // pool threads missing on one frame together decode it once, in the cache
+        size_t idx = missing;
+        storage->run(loop, hint,
+                     [image = image, cache = &cache, key = key_of(idx), idx] {
+                         return cache->get(key, [&] { return image->decode(idx); });
+                     },
+                     [this, token = std::weak_ptr<bool>(alive), idx, ready = std::move(ready)](BlockCache::Block block) {
+                         // the session may be gone by the time the loop runs this
+                         if (token.expired())
+                             return;
+                         if (block) {
+                             current = std::move(block);
+                             current_idx = idx;
+                         } else {
+                             failed = idx;
+                         }
+                         ready();
+                     });
+    }
+
+    void use_storage(StoragePool &pool, size_t queue) override {
+        storage = &pool;
+        hint = queue;
+    }
+
+private:
+    std::shared_ptr<CompressedImage> image;
+    BlockCache &cache;
+    BlockCache::Block current;  // pinned so sequential reads skip the cache lock
+    size_t current_idx = SIZE_MAX;
+    StoragePool *storage = nullptr;
+    size_t hint = 0;
+    size_t missing = SIZE_MAX;  // frame read_at last ran out at
+    size_t failed = SIZE_MAX;   // frame the pool could not decode
+    std::shared_ptr<bool> alive = std::make_shared<bool>(true);
+
+    std::string key_of(size_t idx) const { return image->key + "#" + std::to_string(idx); }
+};
+
+// ---- index building ----
+
+static bool build_index(const unsigned char *map, size_t len, Codec codec, ImageIndex &index) {
+    index.frames.clear();
+    uint64_t in = 0, out = 0;
+    while (in < len) {
+        size_t consumed = 0, produced = 0;
+        if (codec == Codec::GZIP) {
+            if (!inflate_member(map + in, len - in, nullptr, MAX_FRAME_BYTES, &consumed, &produced))
+                return false;
+        } else {
+#ifdef TURBOTFTP_HAVE_ZSTD
+            consumed = ZSTD_findFrameCompressedSize(map + in, len - in);
+            if (ZSTD_isError(consumed))
+                return false;
+            unsigned long long content = ZSTD_getFrameContentSize(map + in, consumed);
+            if (content == ZSTD_CONTENTSIZE_ERROR)
+                return false;
+            if (content != ZSTD_CONTENTSIZE_UNKNOWN) {
+                if (content > MAX_FRAME_BYTES)
+                    return false;
+                produced = (size_t)content;
+            } else {
+                // streamed frames (e.g. from split --filter) carry no size, decode to count
+                ZSTD_DStream *ds = ZSTD_createDStream();
+                ZSTD_inBuffer ib{map + in, consumed, 0};
+                char scratch[1 << 16];
+                size_t rc = 1;
+                while (ib.pos < ib.size && rc != 0 && produced <= MAX_FRAME_BYTES) {
+                    ZSTD_outBuffer ob{scratch, sizeof(scratch), 0};
+                    rc = ZSTD_decompressStream(ds, &ob, &ib);
+                    if (ZSTD_isError(rc))
+                        break;
+                    produced += ob.pos;
+                }
+                ZSTD_freeDStream(ds);
+                if (ZSTD_isError(rc) || produced > MAX_FRAME_BYTES)
+                    return false;
+            }
+#else
+            return false;
+#endif
+        }
+        if (consumed == 0)
+            return false;
+        index.frames.push_back({in, consumed, out, produced});
+        in += consumed;
+        out += produced;
+    }
+    index.size = out;
+    return true;
+}
+
+// A sidecar's frames must tile the file and the image as build_index() lays them
+// out, each within MAX_FRAME_BYTES; anything else is rebuilt
+static bool frames_fit(const ImageIndex &index, size_t map_len) {
+    uint64_t in = 0, out = 0;
+    for (const auto &fr : index.frames) {
+        if (fr.in_offset != in || fr.out_offset != out || fr.in_len == 0 || fr.in_len > map_len - in ||
+            fr.out_len > MAX_FRAME_BYTES)
+            return false;
+        in += fr.in_len;
+        out += fr.out_len;
+    }
+    return in == map_len && out == index.size;
+}
+
+// ---- store ----
+
+ImageStore::ImageStore(const std::string &chunk_root, size_t cache_bytes) : cache_bytes(cache_bytes) {
+    chunk_store = std::make_unique<ChunkStore>(chunk_root.empty() ? "." : chunk_root);
+    caches.push_back(std::make_unique<BlockCache>(cache_bytes));
+}
+
+ImageStore::~ImageStore() = default;
+
+void ImageStore::slice_cache(size_t slices) {
+    slices = std::max<size_t>(slices, 1);
+    caches.clear();
+    for (size_t i = 0; i < slices; i++)
+        caches.push_back(std::make_unique<BlockCache>(cache_bytes / slices));
+}
+
+void ImageStore::resize_cache(size_t bytes) {
+    for (const auto &cache : caches)
+        cache->resize(bytes / caches.size());
+}
+
+BlockCache::Stats ImageStore::cache_stats() const {
+    BlockCache::Stats total{};
+    for (const auto &cache : caches) {
+        BlockCache::Stats s = cache->stats();
+        total.hits += s.hits;
+        total.misses += s.misses;
+        total.evictions += s.evictions;
+        total.bytes += s.bytes;
+    }
+    return total;
+}
+
+std::string ImageStore::path_for(const std::string &root, const std::string &filename) {
+    std::string name = filename;
+    while (!name.empty() && name[0] == '/')
+        name.erase(0, 1);
+    if (name.empty())
+        return "";
+    // reject any ".." component
+    size_t pos = 0;
+    while (pos <= name.size()) {
+        size_t end = name.find('/', pos);
+        if (end == std::string::npos)
+            end = name.size();
+        if (name.compare(pos, end - pos, "..") == 0)
+            return "";
+        pos = end + 1;
+    }
+    return (root.empty() ? "." : root) + "/" + name;
+}
+
+std::shared_ptr<CompressedImage> ImageStore::load_packed(const std::string &path, Codec codec) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+        return nullptr;
+    std::string key = path + "@" + std::to_string(st.st_mtime) + ":" + std::to_string(st.st_size);
+
+    {
+        std::lock_guard<std::mutex> lock(images_mutex);
+        auto it = images.find(path);
+        if (it != images.end() && it->second->key == key)
+            return it->second;
+    }
+
+    // loaded unlocked, so storage threads indexing different images run in parallel;
+    // two racing on one image both build it and the first to finish is kept
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    auto image = std::make_shared<CompressedImage>();
+    image->key = key;
+    image->map_len = (size_t)st.st_size;
+    if (st.st_size > 0) {
+        void *m = mmap(nullptr, image->map_len, PROT_READ, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED) {
+            close(fd);
+            return nullptr;
+        }
+        image->map = (const unsigned char *)m;
+    }
+    close(fd);
+
+    std::string idx_path = path + ".idx";
+    ImageIndex &index = image->index;
+    if (!index.load(idx_path) || index.codec != codec || index.source_size != (uint64_t)st.st_size ||
+        index.source_mtime != (int64_t)st.st_mtime || !frames_fit(index, image->map_len)) {
+        // missing or stale sidecar: one full pass to find the frames, then persist it
+        index = ImageIndex{};
+        index.codec = codec;
+        index.source_size = (uint64_t)st.st_size;
+        index.source_mtime = (int64_t)st.st_mtime;
+        // a member over MAX_FRAME_BYTES fails here too, before anything allocates it
+        if (!build_index(image->map, image->map_len, codec, index)) {
+            errno = EIO;
+            return nullptr;
+        }
+        index.save(idx_path);  // best effort, a read-only root just rebuilds next time
+    }
+    std::lock_guard<std::mutex> lock(images_mutex);
+    auto it = images.find(path);
+    if (it != images.end() && it->second->key == key)
+        return it->second;
+    images[path] = image;
+    return image;
+}
+
+std::unique_ptr<ImageSource> ImageStore::open(const std::string &root, const std::string &filename, size_t slice) {
+    std::string path = path_for(root, filename);
+    if (path.empty()) {
+        errno = EACCES;
+        return nullptr;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            errno = EACCES;
+            return nullptr;
+        }
+        return std::unique_ptr<ImageSource>(new FileSource(fd, (uint64_t)st.st_size));
+    }
+    if (errno != ENOENT)
+        return nullptr;
+
+    // deduplicated uploads
+    if (auto source = chunk_store->open(path + ".chunks"))
+        return source;
+    if (errno != ENOENT)
+        return nullptr;
+
+    static const struct { const char *ext; Codec codec; } packed[] = {
+        {".gz", Codec::GZIP},
+#ifdef TURBOTFTP_HAVE_ZSTD
+        {".zst", Codec::ZSTD},
+#endif
+    };
+    for (const auto &p : packed) {
+        if (auto image = load_packed(path + p.ext, p.codec))
+            return std::unique_ptr<ImageSource>(new CompressedSource(image, *caches[slice % caches.size()]));
+        if (errno != ENOENT)
+            return nullptr;
+    }
+    errno = ENOENT;
+    return nullptr;
+}
+
+std::unique_ptr<ImageSink> ImageStore::create(const std::string &root, const std::string &filename, bool dedup,
+                                              uint64_t *resume_from) {
+    std::string path = path_for(root, filename);
+    if (path.empty()) {
+        errno = EACCES;
+        return nullptr;
+    }
+    if (resume_from)
+        *resume_from = 0;
+    if (dedup)
+        return chunk_store->create(path);  // chunked uploads always start over
+    if (resume_from) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            if (fd >= 0)
+                close(fd);
+            return nullptr;
+        }
+        *resume_from = (uint64_t)st.st_size;
+        return std::unique_ptr<ImageSink>(new FileSink(fd, "", *resume_from));
+    }
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return nullptr;
+    return std::unique_ptr<ImageSink>(new FileSink(fd, path));
+}
+
+std::unique_ptr<ImageSink> ImageStore::resume_upload(const std::string &root, const std::string &filename,
+                                                     uint64_t offset, bool keep_partial) {
+    std::string path = path_for(root, filename);
+    if (path.empty()) {
+        errno = EACCES;
+        return nullptr;
+    }
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    return std::unique_ptr<ImageSink>(new FileSink(fd, keep_partial ? "" : path, offset));
+}
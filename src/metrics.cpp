@@ -0,0 +1,313 @@
+#include "../includes/metrics.hpp"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+size_t Histogram::bucket_of(uint64_t us) {
+    const uint64_t sub = 1u << SUB_BITS;
+    if (us < sub)
+        return (size_t)us;
+    int e = 63 - __builtin_clzll(us);
+    size_t index = ((size_t)(e - SUB_BITS + 1) << SUB_BITS) | (size_t)((us >> (e - SUB_BITS)) & (sub - 1));
+    return index < (size_t)BUCKETS ? index : (size_t)BUCKETS - 1;
+}
+
+uint64_t Histogram::bucket_floor(size_t index) {
+    const uint64_t sub = 1u << SUB_BITS;
+    if (index < sub)
+        return index;
+    int e = (int)(index >> SUB_BITS) + SUB_BITS - 1;
+    return (sub + (index & (sub - 1))) << (e - SUB_BITS);
+}
+
+void Histogram::record(uint64_t us) {
+    std::atomic<uint64_t> &slot = counts[bucket_of(us)];
+    slot.store(slot.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    total.add();
+    sum.add(us);
+}
+
+void Histogram::merge_into(HistogramSnapshot &out) const {
+    if (out.counts.empty())
+        out.counts.assign(BUCKETS, 0);
+    for (int i = 0; i < BUCKETS; i++)
+        out.counts[i] += counts[i].load(std::memory_order_relaxed);
+    out.count += total.get();
+    out.sum += sum.get();
+}
+
+uint64_t HistogramSnapshot::quantile(double q) const {
+    // count and buckets are read at slightly different times, so go by the buckets
+    uint64_t n = 0;
+    for (uint64_t c : counts)
+        n += c;
+    if (n == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * (double)(n - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= rank)
+            return Histogram::bucket_floor(i);
+    }
+    return Histogram::bucket_floor(counts.size() - 1);
+}
+
+void MetricsSnapshot::merge(const WorkerMetrics &w) {
+    rrq += w.rrq.get();
+    wrq += w.wrq.get();
+    bytes_sent += w.bytes_sent.get();
+    bytes_received += w.bytes_received.get();
+    retransmits += w.retransmits.get();
+    timeouts += w.timeouts.get();
+    for (int i = 0; i < METRICS_ERROR_CODES; i++)
+        errors_sent[i] += w.errors_sent[i].get();
+    errors_received += w.errors_received.get();
+    transfers_ok += w.transfers_ok.get();
+    transfers_failed += w.transfers_failed.get();
+    requests_queued += w.requests_queued.get();
+    requests_shed += w.requests_shed.get();
+    requests_expired += w.requests_expired.get();
+    pending += w.pending.get();
+    requests_other_cpu += w.requests_other_cpu.get();
+    requests_other_node += w.requests_other_node.get();
+    storage_jobs += w.storage_jobs.get();
+    log_dropped += w.log_dropped.get();
+    relay_fetches += w.relay_fetches.get();
+    relay_joined += w.relay_joined.get();
+    relay_upstream_bytes += w.relay_upstream_bytes.get();
+    relay_failed += w.relay_failed.get();
+    relay_hits += w.relay_hits.get();
+    if (shard_requests.size() < w.shard_requests.size())
+        shard_requests.resize(w.shard_requests.size());
+    for (size_t i = 0; i < w.shard_requests.size(); i++)
+        shard_requests[i] += w.shard_requests[i].get();
+    shard_unanswered += w.shard_unanswered.get();
+    worker_cpu.push_back(w.cpu);
+    worker_node.push_back(w.node);
+    w.first_data.merge_into(first_data);
+    w.block_rtt.merge_into(block_rtt);
+    w.duration.merge_into(duration);
+    w.queue_wait.merge_into(queue_wait);
+    w.loop_stall.merge_into(loop_stall);
+}
+
+static void append_counter(std::string &out, const char *name, const char *help, uint64_t value) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+             (unsigned long long)value);
+    out += line;
+}
+
+static void append_gauge(std::string &out, const char *name, const char *help, uint64_t value) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n", name, help, name, name,
+             (unsigned long long)value);
+    out += line;
+}
+
+static void append_summary(std::string &out, const char *name, const char *help, const HistogramSnapshot &h) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    out += line;
+    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+        snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.6f\n", name, q, (double)h.quantile(q) / 1e6);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_sum %.6f\n%s_count %llu\n", name, (double)h.sum / 1e6, name,
+             (unsigned long long)h.count);
+    out += line;
+}
+
+std::string prometheus_text(const MetricsSnapshot &s) {
+    std::string out;
+    char line[256];
+    out += "# HELP tftp_requests_total Read and write requests received.\n# TYPE tftp_requests_total counter\n";
+    snprintf(line, sizeof(line), "tftp_requests_total{op=\"rrq\"} %llu\ntftp_requests_total{op=\"wrq\"} %llu\n",
+             (unsigned long long)s.rrq, (unsigned long long)s.wrq);
+    out += line;
+    append_counter(out, "tftp_sent_bytes_total", "Payload bytes acknowledged by clients.", s.bytes_sent);
+    append_counter(out, "tftp_received_bytes_total", "Payload bytes written from clients.", s.bytes_received);
+    append_counter(out, "tftp_retransmits_total", "Packets sent again after a timeout or gap.", s.retransmits);
+    append_counter(out, "tftp_timeouts_total", "Retransmit timer expiries.", s.timeouts);
+    out += "# HELP tftp_errors_sent_total ERROR packets sent, by TFTP error code.\n"
+           "# TYPE tftp_errors_sent_total counter\n";
+    for (int i = 0; i < METRICS_ERROR_CODES; i++) {
+        snprintf(line, sizeof(line), "tftp_errors_sent_total{code=\"%d\"} %llu\n", i,
+                 (unsigned long long)s.errors_sent[i]);
+        out += line;
+    }
+    append_counter(out, "tftp_errors_received_total", "ERROR packets received from clients.", s.errors_received);
+    out += "# HELP tftp_transfers_total Finished transfers.\n# TYPE tftp_transfers_total counter\n";
+    snprintf(line, sizeof(line), "tftp_transfers_total{result=\"ok\"} %llu\ntftp_transfers_total{result=\"failed\"} %llu\n",
+             (unsigned long long)s.transfers_ok, (unsigned long long)s.transfers_failed);
+    out += line;
+    append_counter(out, "tftp_requests_queued_total", "Requests that waited for a session slot.", s.requests_queued);
+    append_counter(out, "tftp_requests_shed_total", "Requests turned away, queue full or waited too long.",
+                   s.requests_shed);
+    append_counter(out, "tftp_requests_expired_total", "Requests turned away after waiting too long.", s.requests_expired);
+    append_gauge(out, "tftp_pending_requests", "Requests waiting for a session slot.", s.pending);
+    append_counter(out, "tftp_requests_other_cpu_total", "Requests the kernel handled on another CPU than their worker's.",
+                   s.requests_other_cpu);
+    append_counter(out, "tftp_requests_other_node_total", "Requests the kernel handled on another NUMA node than their worker's.",
+                   s.requests_other_node);
+    append_counter(out, "tftp_storage_jobs_total", "Blocking storage calls run on the storage pool.", s.storage_jobs);
+    append_counter(out, "tftp_access_log_dropped_total", "Access log records lost because the writer fell behind.",
+                   s.log_dropped);
+    append_counter(out, "tftp_relay_fetches_total", "RRQs for missing files that started an upstream fetch.",
+                   s.relay_fetches);
+    append_counter(out, "tftp_relay_joined_total", "RRQs streamed from an upstream fetch already running.",
+                   s.relay_joined);
+    append_counter(out, "tftp_relay_upstream_bytes_total", "Bytes fetched from the upstream server.",
+                   s.relay_upstream_bytes);
+    append_counter(out, "tftp_relay_failed_total", "Upstream fetches that did not complete.", s.relay_failed);
+    append_counter(out, "tftp_relay_hits_total", "RRQs a relay served from its root.", s.relay_hits);
+    append_counter(out, "tftp_image_cache_hits_total", "Decompressed image blocks found in the cache.",
+                   s.image_cache_hits);
+    append_counter(out, "tftp_image_cache_misses_total", "Decompressed image blocks decoded on demand.",
+                   s.image_cache_misses);
+    append_counter(out, "tftp_config_reloads_total", "Configuration reloads applied.", s.config_reloads);
+    append_counter(out, "tftp_dedup_logical_bytes_total", "Bytes uploaded into the chunk store.",
+                   s.dedup_logical_bytes);
+    append_counter(out, "tftp_dedup_stored_bytes_total", "Bytes of uploaded chunks the chunk store did not have.",
+                   s.dedup_stored_bytes);
+    append_counter(out, "tftp_dedup_chunks_total", "Chunks uploaded into the chunk store.", s.dedup_chunks);
+    append_counter(out, "tftp_dedup_unique_chunks_total", "Uploaded chunks the chunk store did not have.",
+                   s.dedup_unique_chunks);
+    snprintf(line, sizeof(line),
+             "# HELP tftp_dedup_hash_seconds_total Time spent hashing uploaded chunks.\n"
+             "# TYPE tftp_dedup_hash_seconds_total counter\ntftp_dedup_hash_seconds_total %.6f\n",
+             (double)s.dedup_hash_ns / 1e9);
+    out += line;
+    snprintf(line, sizeof(line),
+             "# HELP tftp_dedup_ratio Bytes uploaded per byte stored in the chunk store.\n"
+             "# TYPE tftp_dedup_ratio gauge\ntftp_dedup_ratio %.3f\n",
+             s.dedup_stored_bytes ? (double)s.dedup_logical_bytes / (double)s.dedup_stored_bytes : 1.0);
+    out += line;
+    append_counter(out, "tftp_dedup_swept_chunks_total", "Chunks no upload referred to any more, removed.",
+                   s.dedup_swept_chunks);
+    append_counter(out, "tftp_dedup_swept_bytes_total", "Bytes of the chunks removed.", s.dedup_swept_bytes);
+    if (!s.shard_requests.empty()) {
+        out += "# HELP tftp_shard_requests_total Requests relayed to each shard.\n"
+               "# TYPE tftp_shard_requests_total counter\n";
+        for (size_t i = 0; i < s.shard_requests.size(); i++) {
+            snprintf(line, sizeof(line), "tftp_shard_requests_total{shard=\"%s\"} %llu\n",
+                     i < s.shards.size() ? s.shards[i].c_str() : std::to_string(i).c_str(),
+                     (unsigned long long)s.shard_requests[i]);
+            out += line;
+        }
+        append_counter(out, "tftp_shard_unanswered_total", "Requests whose shard never answered.",
+                       s.shard_unanswered);
+    }
+    out += "# HELP tftp_worker_cpu CPU each worker is pinned to, -1 if it is not.\n# TYPE tftp_worker_cpu gauge\n";
+    for (size_t i = 0; i < s.worker_cpu.size(); i++) {
+        snprintf(line, sizeof(line), "tftp_worker_cpu{worker=\"%zu\"} %d\n", i, s.worker_cpu[i]);
+        out += line;
+    }
+    out += "# HELP tftp_worker_numa_node NUMA node each pinned worker's memory comes from, -1 if not pinned.\n"
+           "# TYPE tftp_worker_numa_node gauge\n";
+    for (size_t i = 0; i < s.worker_node.size(); i++) {
+        snprintf(line, sizeof(line), "tftp_worker_numa_node{worker=\"%zu\"} %d\n", i, s.worker_node[i]);
+        out += line;
+    }
+    append_summary(out, "tftp_first_data_seconds", "Request to first DATA packet.", s.first_data);
+    append_summary(out, "tftp_block_rtt_seconds", "DATA packet to its ACK.", s.block_rtt);
+    append_summary(out, "tftp_transfer_duration_seconds", "Duration of successful transfers.", s.duration);
+    append_summary(out, "tftp_queue_wait_seconds", "Arrival to admission of queued requests.", s.queue_wait);
+    append_summary(out, "tftp_loop_stall_seconds", "Time a worker's loop spent in callbacks per round.", s.loop_stall);
+    return out;
+}
+
+MetricsExporter::MetricsExporter(std::function<std::string()> render, uint16_t port, const std::string &unix_path)
+    : render(std::move(render)), unix_path(unix_path) {
+    if (!unix_path.empty()) {
+        struct sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (unix_path.size() >= sizeof(addr.sun_path))
+            throw std::runtime_error("metrics socket path too long");
+        unix_path.copy(addr.sun_path, unix_path.size());
+        unlink(unix_path.c_str());
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            if (listen_fd >= 0)
+                close(listen_fd);
+            throw std::runtime_error("cannot bind metrics socket " + unix_path);
+        }
+    } else {
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (listen_fd >= 0)
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            if (listen_fd >= 0)
+                close(listen_fd);
+            throw std::runtime_error("cannot bind metrics port " + std::to_string(port));
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(listen_fd, (struct sockaddr *)&addr, &len);
+        bound_port = ntohs(addr.sin_port);
+    }
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (listen(listen_fd, 16) < 0 || wake_fd < 0) {
+        close(listen_fd);
+        if (wake_fd >= 0)
+            close(wake_fd);
+        throw std::runtime_error("metrics listen failed");
+    }
+    thread = std::thread([this] { serve(); });
+}
+
+MetricsExporter::~MetricsExporter() {
+    uint64_t one = 1;
+    (void)!write(wake_fd, &one, sizeof(one));
+    thread.join();
+    close(listen_fd);
+    close(wake_fd);
+    if (!unix_path.empty())
+        unlink(unix_path.c_str());
+}
+
+void MetricsExporter::serve() {
+    for (;;) {
+        struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (fds[1].revents)
+            return;
+        int conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0)
+            continue;
+        // the request itself does not matter, every path gets the metrics; a scraper
+        // that never sends anything only holds us up for the receive timeout
+        struct timeval tv{1, 0};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        char req[1024];
+        (void)!recv(conn, req, sizeof(req), 0);
+        std::string body = render();
+        std::string reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                            std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t off = 0;
+        while (off < reply.size()) {
+            ssize_t n = send(conn, reply.data() + off, reply.size() - off, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            off += (size_t)n;
+        }
+        close(conn);
+    }
+}
@@ -0,0 +1,75 @@
+#include "../includes/net.hpp"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+DatagramNet &DatagramNet::kernel() {
+    static KernelNet net;
+    return net;
+}
+
+int KernelNet::open() {
+    return socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+int KernelNet::bind(int sock, const struct sockaddr_in &addr, bool reuse_port) {
+    if (reuse_port) {
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    }
+    return ::bind(sock, (const struct sockaddr *)&addr, sizeof(addr));
+}
+
+int KernelNet::local_address(int sock, struct sockaddr_in &addr) {
+    socklen_t len = sizeof(addr);
+    return getsockname(sock, (struct sockaddr *)&addr, &len);
+}
+
+int KernelNet::set_receive_buffer(int sock, int bytes) {
+    return setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
+int KernelNet::set_incoming_cpu(int sock, int cpu) {
+    return setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
+
+int KernelNet::incoming_cpu(int sock) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+        return -1;
+    return cpu;
+}
+
+int KernelNet::set_busy_poll(int sock, int usec) {
+    return setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+}
+
+int KernelNet::connect(int sock, const struct sockaddr_in &peer) {
+    return ::connect(sock, (const struct sockaddr *)&peer, sizeof(peer));
+}
+
+ssize_t KernelNet::send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) {
+    if (!to)
+        return send(sock, buf, len, MSG_DONTWAIT);
+    return sendto(sock, buf, len, MSG_DONTWAIT, (const struct sockaddr *)to, sizeof(*to));
+}
+
+ssize_t KernelNet::receive(int sock, char *buf, size_t cap, struct sockaddr_in *from) {
+    socklen_t len = sizeof(*from);
+    return recvfrom(sock, buf, cap, MSG_DONTWAIT, (struct sockaddr *)from, from ? &len : nullptr);
+}
+
+void KernelNet::close(int sock) {
+    ::close(sock);
+}
+
+void KernelNet::watch(EventLoop &loop, int sock, std::function<void()> readable) {
+    loop.add(sock, EPOLLIN, [readable](uint32_t) { readable(); });
+}
+
+void KernelNet::unwatch(EventLoop &loop, int sock) {
+    loop.remove(sock);
+}
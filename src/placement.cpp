@@ -0,0 +1,178 @@
+#include "../includes/placement.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// Node masks are a single word: nodes past 63 keep the default policy
+const int MAX_NODE = 63;
+
+std::string read_line(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return "";
+    char buf[4096];
+    std::string line = fgets(buf, sizeof(buf), f) ? buf : "";
+    fclose(f);
+    while (!line.empty() && (line.back() == '\n' || line.back() == ' '))
+        line.pop_back();
+    return line;
+}
+
+long node_policy(int mode, int node) {
+    unsigned long mask = node >= 0 ? 1ul << node : 0;
+    return syscall(SYS_set_mempolicy, mode, node >= 0 ? &mask : nullptr, node >= 0 ? (unsigned long)MAX_NODE + 2 : 0);
+}
+
+}  // namespace
+
+bool parse_cpu_list(const std::string &text, std::vector<int> &cpus) {
+    cpus.clear();
+    const char *p = text.c_str();
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return false;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                return false;
+            p = end;
+        }
+        for (long c = first; c <= last; c++)
+            cpus.push_back((int)c);
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return false;
+    }
+    return !cpus.empty();
+}
+
+CpuTopology CpuTopology::detect() {
+    CpuTopology t;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &set))
+                t.allowed.push_back(c);
+    }
+    if (t.allowed.empty())
+        t.allowed.push_back(0);
+    t.nodes.assign((size_t)t.allowed.back() + 1, -1);
+    if (DIR *dir = opendir("/sys/devices/system/node")) {
+        while (struct dirent *e = readdir(dir)) {
+            int node;
+            if (sscanf(e->d_name, "node%d", &node) != 1)
+                continue;
+            std::vector<int> cpus;
+            if (!parse_cpu_list(read_line(std::string("/sys/devices/system/node/") + e->d_name + "/cpulist"), cpus))
+                continue;
+            for (int c : cpus) {
+                if ((size_t)c >= t.nodes.size())
+                    t.nodes.resize((size_t)c + 1, -1);
+                t.nodes[(size_t)c] = node;
+            }
+        }
+        closedir(dir);
+    }
+    // no NUMA information: one node
+    if (std::all_of(t.nodes.begin(), t.nodes.end(), [](int n) { return n < 0; }))
+        std::fill(t.nodes.begin(), t.nodes.end(), 0);
+    return t;
+}
+
+int CpuTopology::node_of(int cpu) const {
+    return cpu >= 0 && (size_t)cpu < nodes.size() ? nodes[(size_t)cpu] : -1;
+}
+
+std::vector<WorkerPlacement> CpuTopology::place(size_t count, const std::vector<int> &cpus) const {
+    const std::vector<int> &pool = cpus.empty() ? allowed : cpus;
+    // the CPUs of each node, nodes in order of their first CPU in the list
+    std::vector<int> order;
+    std::vector<std::vector<int>> by_node;
+    for (int c : pool) {
+        int node = std::max(node_of(c), 0);
+        auto it = std::find(order.begin(), order.end(), node);
+        if (it == order.end()) {
+            order.push_back(node);
+            by_node.emplace_back();
+            it = order.end() - 1;
+        }
+        by_node[(size_t)(it - order.begin())].push_back(c);
+    }
+    std::vector<WorkerPlacement> placed;
+    if (order.empty())
+        return placed;
+    std::vector<size_t> next(order.size(), 0);
+    std::vector<int> slices(order.size(), -1);
+    int used = 0;
+    while (placed.size() < count) {
+        // a CPU from each node in turn; once every CPU has a worker, round again
+        bool any = false;
+        for (size_t n = 0; n < order.size() && placed.size() < count; n++) {
+            if (next[n] >= by_node[n].size())
+                continue;
+            any = true;
+            if (slices[n] < 0)
+                slices[n] = used++;
+            WorkerPlacement p;
+            p.cpu = by_node[n][next[n]++];
+            p.node = order[n];
+            p.slice = (size_t)slices[n];
+            placed.push_back(p);
+        }
+        if (!any)
+            std::fill(next.begin(), next.end(), 0);
+    }
+    return placed;
+}
+
+bool pin_thread(const WorkerPlacement &p, cpu_set_t *previous) {
+    if (p.cpu < 0 || p.cpu >= CPU_SETSIZE)
+        return false;
+    if (previous && pthread_getaffinity_np(pthread_self(), sizeof(*previous), previous) != 0)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(p.cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        return false;
+    // preferred rather than bound: a full node still hands out memory from another
+    if (p.node >= 0 && p.node <= MAX_NODE)
+        node_policy(MPOL_PREFERRED, p.node);
+    return true;
+}
+
+void unpin_thread(const cpu_set_t &previous) {
+    pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+    node_policy(MPOL_DEFAULT, -1);
+}
+
+void *alloc_on_node(size_t bytes, int node) {
+    void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+    if (node >= 0 && node <= MAX_NODE) {
+        unsigned long mask = 1ul << node;
+        syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, &mask, (unsigned long)MAX_NODE + 2, 0);
+    }
+    return p;
+}
+
+void free_on_node(void *p, size_t bytes) {
+    if (p)
+        munmap(p, bytes);
+}
@@ -0,0 +1,324 @@
+#include "../includes/relay.hpp"
+#include "../includes/hash.hpp"
+#include "../includes/protocal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+enum FetchState { FETCHING, COMPLETE, FAILED };
+}
+
+// One upstream get, shared by its sink and every source streaming from it
+class RelayFetch {
+public:
+    struct Waiter {
+        EventLoop *loop;
+        std::function<void()> ready;
+    };
+
+    std::string path;               // where the file goes once complete
+    std::string part;               // where it is written meanwhile, in the root's .relay
+    int fd = -1;
+    std::atomic<uint64_t> have{0};  // bytes written, readable by any thread
+    std::atomic<int> state{FETCHING};
+    uint64_t size = UINT64_MAX;     // the upstream's tsize, set before answered
+
+    std::mutex mutex;               // the rest
+    bool answered = false;          // the upstream replied, sessions can start
+    uint16_t code = 0;              // FAILED: what to tell the clients
+    std::string message;
+    std::vector<Waiter> starting;   // RRQs waiting for the answer
+    std::vector<Waiter> readers;    // sessions waiting for more bytes
+
+    ~RelayFetch() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // The upstream replied; size UINT64_MAX if it did not send tsize
+    void negotiated(uint64_t tsize) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size = tsize;
+        answer();
+    }
+    // Bytes up to now were written
+    void grew(uint64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        have.store(now, std::memory_order_release);
+        answer();
+        wake(readers);
+    }
+    void complete() {
+        std::lock_guard<std::mutex> lock(mutex);
+        state.store(COMPLETE, std::memory_order_release);
+        answer();
+        wake(readers);
+    }
+    void fail(uint16_t error_code, const std::string &error) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (state.load(std::memory_order_relaxed) != FETCHING)
+            return;
+        code = error_code;
+        message = error;
+        state.store(FAILED, std::memory_order_release);
+        answer();
+        wake(readers);
+    }
+
+    // Under mutex
+    void answer() {
+        if (answered)
+            return;
+        answered = true;
+        wake(starting);
+    }
+    static void wake(std::vector<Waiter> &waiters) {
+        for (Waiter &w : waiters)
+            w.loop->post(std::move(w.ready));
+        waiters.clear();
+    }
+};
+
+namespace {
+
+std::string parent_of(const std::string &path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+}
+
+void sync_dir(const std::string &dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Creates the directories above path that are missing, durably; false if one of
+// them cannot be made
+bool make_parents(const std::string &path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        std::string dir = path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0755) == 0)
+            sync_dir(parent_of(dir));
+        else if (errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+// Writes the upstream's blocks into the partial file, then moves it into place
+class RelaySink : public ImageSink {
+public:
+    explicit RelaySink(std::shared_ptr<RelayFetch> fetch) : fetch(std::move(fetch)) {}
+
+    bool write(const char *buf, size_t len) override {
+        while (len > 0) {
+            ssize_t n = pwrite(fetch->fd, buf, len, (off_t)pos);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            buf += n;
+            len -= (size_t)n;
+            pos += (uint64_t)n;
+        }
+        fetch->grew(pos);
+        return true;
+    }
+    // On the storage pool when the upstream client has one
+    bool commit() override {
+        // on disk before it is under its name: after a crash a file in the root is
+        // served as complete. Its directories only exist once there is a file for them
+        if (fsync(fetch->fd) < 0 || !make_parents(fetch->path))
+            return false;
+        // a file that has all its bytes but is not under its name yet is still served
+        // from the partial one, so rename before telling anyone
+        if (rename(fetch->part.c_str(), fetch->path.c_str()) < 0)
+            return false;
+        sync_dir(parent_of(fetch->path));
+        return true;
+    }
+    void committed() override { fetch->complete(); }
+    void abort() override {
+        if (fetch->state.load(std::memory_order_acquire) != COMPLETE)
+            unlink(fetch->part.c_str());
+    }
+
+private:
+    std::shared_ptr<RelayFetch> fetch;
+    uint64_t pos = 0;
+};
+
+// A file still arriving: reads what is there, EAGAIN for the rest
+class RelaySource : public ImageSource {
+public:
+    explicit RelaySource(std::shared_ptr<RelayFetch> fetch) : fetch(std::move(fetch)) {}
+
+    uint64_t size() const override { return fetch->size; }
+
+    ssize_t read_at(uint64_t offset, char *buf, size_t len) override {
+        // have is final by the time state says COMPLETE
+        int state = fetch->state.load(std::memory_order_acquire);
+        uint64_t have = fetch->have.load(std::memory_order_acquire);
+        if (state != COMPLETE) {
+            // only the last block may be short, and only once the size is known
+            if (fetch->size != UINT64_MAX)
+                len = offset < fetch->size ? (size_t)std::min<uint64_t>(len, fetch->size - offset) : 0;
+            if (offset + len > have) {
+                errno = state == FAILED ? EIO : EAGAIN;
+                seen = have;
+                return -1;
+            }
+        }
+        return pread(fetch->fd, buf, len, (off_t)offset);
+    }
+
+    void when_readable(EventLoop &loop, std::function<void()> ready) override {
+        // the session may be gone by the time the loop runs this
+        auto guarded = [token = std::weak_ptr<bool>(alive), ready = std::move(ready)] {
+            if (!token.expired())
+                ready();
+        };
+        std::lock_guard<std::mutex> lock(fetch->mutex);
+        if (fetch->have.load(std::memory_order_relaxed) > seen ||
+            fetch->state.load(std::memory_order_relaxed) != FETCHING)
+            loop.post(std::move(guarded));
+        else
+            fetch->readers.push_back({&loop, std::move(guarded)});
+    }
+
+private:
+    std::shared_ptr<RelayFetch> fetch;
+    std::shared_ptr<bool> alive = std::make_shared<bool>(true);
+    uint64_t seen = 0;              // have when read_at last ran out
+};
+
+
+void post_opened(EventLoop &loop, const RelayCache::Ready &ready, RelayCache::Opened opened) {
+    // the source is move-only, the loop's tasks are copyable
+    auto result = std::make_shared<RelayCache::Opened>(std::move(opened));
+    loop.post([ready, result] { ready(std::move(*result)); });
+}
+
+}  // namespace
+
+RelayCache::RelayCache(ImageStore &store, const std::string &root) : store(store) {
+    std::string staging = ImageStore::path_for(root, ".relay");
+    DIR *d = opendir(staging.c_str());
+    if (!d)
+        return;
+    while (struct dirent *e = readdir(d)) {
+        // <hash>.<pid>; one from a process still running belongs to its fetch
+        const char *dot = strrchr(e->d_name, '.');
+        pid_t pid = dot && dot != e->d_name ? (pid_t)atoi(dot + 1) : 0;
+        if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH)
+            unlinkat(dirfd(d), e->d_name, 0);
+    }
+    closedir(d);
+}
+
+void RelayCache::open(const std::string &root, const std::string &filename, EventLoop &loop, AsyncTFTPClient &upstream, size_t slice,
+                      WorkerMetrics &metrics, Ready ready) {
+    std::string path = ImageStore::path_for(root, filename);
+    if (path.empty()) {
+        post_opened(loop, ready, Opened{nullptr, ERR_ACCESS, "Access violation"});
+        return;
+    }
+    // partial files wait in one flat directory under the same root, so a name the
+    // upstream does not have leaves no directories behind
+    std::string staging = ImageStore::path_for(root, ".relay");
+    std::shared_ptr<RelayFetch> fetch;
+    bool start = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = fetches.find(path);
+        if (it != fetches.end()) {
+            fetch = it->second;
+        } else if (access(path.c_str(), F_OK) < 0) {
+            fetch = std::make_shared<RelayFetch>();
+            fetch->path = path;
+            fetch->part = staging + "/" + hash128(path.data(), path.size()).hex() + "." + std::to_string(getpid());
+            mkdir(staging.c_str(), 0755);
+            fetch->fd = ::open(fetch->part.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fetch->fd < 0) {
+                post_opened(loop, ready, Opened{nullptr, ERR_ACCESS, "Access violation"});
+                return;
+            }
+            fetches.emplace(path, fetch);
+            start = true;
+        }
+    }
+    if (!fetch) {
+        // it arrived in full since the caller looked
+        Opened opened;
+        opened.source = store.open(root, filename, slice);
+        if (!opened.source) {
+            opened.code = ERR_NOT_FOUND;
+            opened.message = "File not found";
+        }
+        post_opened(loop, ready, std::move(opened));
+        return;
+    }
+    (start ? metrics.relay_fetches : metrics.relay_joined).add();
+
+    auto deliver = [fetch, ready] {
+        Opened opened;
+        std::unique_lock<std::mutex> lock(fetch->mutex);
+        if (fetch->state.load(std::memory_order_relaxed) == FAILED) {
+            opened.code = fetch->code;
+            opened.message = fetch->message;
+        } else {
+            opened.source = std::make_unique<RelaySource>(fetch);
+        }
+        lock.unlock();
+        ready(std::move(opened));
+    };
+    {
+        std::lock_guard<std::mutex> lock(fetch->mutex);
+        if (fetch->answered)
+            loop.post(deliver);
+        else
+            fetch->starting.push_back({&loop, deliver});
+    }
+    if (!start)
+        return;
+
+    WorkerMetrics *m = &metrics;
+    upstream.get(
+        filename, std::make_unique<RelaySink>(fetch),
+        [this, fetch, m](const TransferResult &r) {
+            m->relay_upstream_bytes.add(r.bytes);
+            if (!r.ok) {
+                m->relay_failed.add();
+                // the upstream's own ERROR goes back as it is; a timeout or local
+                // failure is nothing the client could act on
+                fetch->fail(r.error_code >= 0 ? (uint16_t)r.error_code : (uint16_t)ERR_UNDEFINED, r.error);
+            }
+            finished(fetch);
+        },
+        [fetch](Session &s) {
+            fetch->negotiated(s.options().has_tsize ? s.options().tsize : UINT64_MAX);
+            return true;
+        });
+}
+
+void RelayCache::finished(const std::shared_ptr<RelayFetch> &fetch) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = fetches.find(fetch->path);
+    if (it != fetches.end() && it->second == fetch)
+        fetches.erase(it);
+}
+
+size_t RelayCache::fetching() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return fetches.size();
+}
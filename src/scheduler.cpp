@@ -0,0 +1,213 @@
+#include "../includes/scheduler.hpp"
+#include "../includes/session.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <iterator>
+
+namespace {
+
+// Bytes one run() may send before handing the loop back for ACKs and requests
+const uint64_t RUN_BYTES = 256 << 10;
+
+}  // namespace
+
+TokenBucket::TokenBucket(uint64_t rate, uint64_t burst)
+    : rate((double)rate), burst((double)std::max(burst, (uint64_t)MAX_BLKSIZE + 4)), tokens(this->burst) {}
+
+void TokenBucket::refill(uint64_t now_ms) {
+    if (last_ms == 0 || now_ms < last_ms)
+        last_ms = now_ms;
+    tokens = std::min(burst, tokens + rate * (double)(now_ms - last_ms) / 1000.0);
+    last_ms = now_ms;
+}
+
+uint64_t TokenBucket::available(uint64_t now_ms) {
+    std::lock_guard<std::mutex> lock(mutex);
+    refill(now_ms);
+    return tokens > 0 ? (uint64_t)tokens : 0;
+}
+
+void TokenBucket::take(uint64_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tokens -= (double)n;
+}
+
+uint64_t TokenBucket::wait_ms(uint64_t n, uint64_t now_ms) {
+    std::lock_guard<std::mutex> lock(mutex);
+    refill(now_ms);
+    double missing = (double)n - tokens;
+    if (missing <= 0)
+        return 1;
+    return std::max<uint64_t>(1, (uint64_t)(missing * 1000.0 / rate) + 1);
+}
+
+static uint32_t prefix_mask(int prefix) {
+    return prefix <= 0 ? 0 : prefix >= 32 ? 0xffffffffu : ~(0xffffffffu >> prefix);
+}
+
+ClientLimiter::ClientLimiter(uint64_t rate, uint64_t burst, int prefix)
+    : rate(rate), burst(burst), mask(prefix_mask(prefix)) {}
+
+void ClientLimiter::set_limits(uint64_t new_rate, uint64_t new_burst, int prefix) {
+    std::lock_guard<std::mutex> lock(mutex);
+    rate = new_rate;
+    burst = new_burst;
+    mask = prefix_mask(prefix);
+    // sessions keep theirs alive; new ones get fresh buckets at the new rate
+    buckets.clear();
+}
+
+std::shared_ptr<TokenBucket> ClientLimiter::bucket_for(const struct sockaddr_in &client) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // limits turned off by a reload a worker has not seen yet
+    if (!rate)
+        return nullptr;
+    uint32_t key = ntohl(client.sin_addr.s_addr) & mask;
+    std::weak_ptr<TokenBucket> &slot = buckets[key];
+    std::shared_ptr<TokenBucket> bucket = slot.lock();
+    if (!bucket) {
+        bucket = std::make_shared<TokenBucket>(rate, burst);
+        slot = bucket;
+    }
+    // clients come and go: drop the buckets no session holds any more
+    if (buckets.size() >= sweep_at) {
+        for (auto it = buckets.begin(); it != buckets.end();)
+            it = it->second.expired() ? buckets.erase(it) : std::next(it);
+        sweep_at = std::max<size_t>(1024, buckets.size() * 2);
+    }
+    return bucket;
+}
+
+FairScheduler::FairScheduler(EventLoop &loop, uint32_t quantum, uint64_t rate)
+    : loop(loop), quantum(quantum ? quantum : UINT32_MAX) {
+    if (rate)
+        total = std::make_unique<TokenBucket>(rate, rate / 20);  // 50 ms of burst
+}
+
+void FairScheduler::set_rate(uint64_t rate) {
+    total = rate ? std::make_unique<TokenBucket>(rate, rate / 20) : nullptr;
+}
+
+FairScheduler::~FairScheduler() {
+    if (timer)
+        loop.cancel_timer(timer);
+}
+
+void FairScheduler::wake(SendSession &session) {
+    if (index.count(&session))
+        return;
+    Entry entry{&session, 0, 0};
+    if (active.empty()) {
+        // nobody is waiting: the first quantum goes straight out, which keeps a
+        // lock-step transfer from paying an extra trip through the loop per block
+        uint64_t wait = 0;
+        visit(entry, loop.now(), wait);
+        if (entry.session->next_block_bytes() == 0)
+            return;
+    }
+    active.push_back(entry);
+    index[&session] = std::prev(active.end());
+    schedule();
+}
+
+void FairScheduler::forget(SendSession &session) {
+    auto it = index.find(&session);
+    if (it == index.end())
+        return;
+    active.erase(it->second);
+    index.erase(it);
+}
+
+void FairScheduler::schedule() {
+    if (deferred)
+        return;
+    deferred = true;
+    loop.defer([this] { run(); });
+}
+
+uint64_t FairScheduler::visit(Entry &e, uint64_t now, uint64_t &wait) {
+    size_t next = e.session->next_block_bytes();
+    if (next == 0)
+        return 0;
+    // what is left over is less than a block, the cap only matters without sharing
+    e.deficit = std::min<int64_t>(e.deficit + quantum, (int64_t)quantum + MAX_BLKSIZE + 4);
+    uint64_t budget = (uint64_t)std::max<int64_t>(e.deficit, 0);
+    TokenBucket *client = e.session->client_bucket();
+    if (client)
+        budget = std::min(budget, client->available(now));
+    uint64_t left = total ? total->available(now) : UINT64_MAX;
+    budget = std::min(budget, left);
+    uint64_t used = next <= budget ? e.session->send_burst(budget) : 0;
+    if (used) {
+        e.deficit -= (int64_t)used;
+        if (client)
+            client->take(used);
+        if (total)
+            total->take(used);
+    } else if (next > budget && e.deficit >= (int64_t)next) {
+        // the credit is there but the tokens are not: no more credit until they are.
+        // A session that had both and still sent nothing waits on its source instead,
+        // and wakes the scheduler again itself
+        e.deficit -= quantum;
+        if (total && left < next)
+            wait = total->wait_ms(next, now);
+        else if (client)
+            e.throttled_until = now + client->wait_ms(next, now);
+    }
+    return used;
+}
+
+void FairScheduler::run() {
+    deferred = false;
+    if (timer) {
+        loop.cancel_timer(timer);
+        timer = 0;
+    }
+    uint64_t now = loop.now();
+    uint64_t spent = 0;
+    uint64_t wait = 0;          // the worker's bucket ran dry: wait this long
+    bool runnable = true;
+    while (!active.empty() && runnable && spent < RUN_BYTES && !wait) {
+        runnable = false;
+        for (auto it = active.begin(); it != active.end() && !wait;) {
+            Entry &e = *it;
+            if (e.throttled_until > now) {
+                ++it;
+                continue;
+            }
+            spent += visit(e, now, wait);
+            if (wait) {
+                // the round resumes with e once the bucket refills; starting over at the
+                // head would hand every refill to the same session
+                active.splice(active.end(), active, active.begin(), it);
+                break;
+            }
+            if (e.session->next_block_bytes() == 0) {
+                // DRR: a session with nothing to send keeps no credit
+                index.erase(e.session);
+                it = active.erase(it);
+                continue;
+            }
+            if (e.throttled_until <= now)
+                runnable = true;
+            ++it;
+        }
+    }
+    if (active.empty())
+        return;
+    if (!wait && runnable) {
+        schedule();
+        return;
+    }
+    if (!wait) {
+        uint64_t first = UINT64_MAX;
+        for (const Entry &e : active)
+            first = std::min(first, e.throttled_until);
+        wait = first > now ? first - now : 1;
+    }
+    timer = loop.add_timer((uint32_t)wait, [this] {
+        timer = 0;
+        run();
+    });
+}
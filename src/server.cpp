@@ -0,0 +1,1031 @@
+#include "../includes/server.hpp"
+#include "../includes/chunk_store.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <future>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+TFTPServer::TFTPServer() : TFTPServer(ServerConfig{}) {}
+
+TFTPServer::TFTPServer(const ServerConfig &config)
+    : config(config), net(config.net ? *config.net : DatagramNet::kernel()),
+      store(config.root, config.cache_bytes) {
+    int count = config.workers > 0 ? config.workers : 1;
+    uint16_t port = config.port;
+    // upgrades move kernel sockets, so they only apply to the real network
+    bool upgrade = !config.upgrade_socket.empty() && !config.net;
+    settings = std::make_shared<const ServerConfig>(config);
+    // made either way, so a reload can turn per client limits on
+    client_limits = std::make_unique<ClientLimiter>(config.client_rate_limit, config.client_rate_limit / 20,
+                                                    config.client_prefix);
+    std::vector<int> inherited;
+    std::vector<HandoffSession> incoming;
+    // raw frames only go to and from the real network
+    if (!config.xdp_interface.empty() && !config.net)
+        xdp = std::make_unique<XdpProgram>(config.xdp_interface);
+    if (upgrade && receive_handoff(config.upgrade_socket, port, inherited, incoming))
+        count = std::max(count, (int)inherited.size());  // every inherited socket needs a reader
+    if (!config.access_log.empty())
+        access_log = std::make_unique<AccessLog>(config.access_log);
+    std::vector<WorkerPlacement> places;
+    if (config.pin_workers) {
+        topology = CpuTopology::detect();
+        places = topology.place((size_t)count, config.worker_cpus);
+        size_t slices = 1;
+        for (const WorkerPlacement &p : places)
+            slices = std::max(slices, p.slice + 1);
+        store.slice_cache(slices);
+    }
+    if (config.storage_threads)
+        storage = std::make_unique<StoragePool>(config.storage_threads);
+    std::string upstream_host = config.upstream;
+    ClientOptions upstream;
+    if (!config.upstream.empty()) {
+        relay = std::make_unique<RelayCache>(store, config.root);
+        size_t colon = upstream_host.rfind(':');
+        if (colon != std::string::npos) {
+            upstream.port = (uint16_t)atoi(upstream_host.c_str() + colon + 1);
+            upstream_host.resize(colon);
+        }
+        upstream.blksize = config.upstream_blksize;
+        upstream.windowsize = config.upstream_windowsize;
+        upstream.net = config.net;
+    }
+    std::vector<struct sockaddr_in> shard_addrs;
+    if (!config.shards.empty()) {
+        shard_ring = std::make_unique<ShardRing>(config.shards);
+        for (const std::string &shard : config.shards) {
+            size_t colon = shard.rfind(':');
+            shard_addrs.push_back(colon == std::string::npos
+                                      ? resolve_server(shard, SERVER_PORT)
+                                      : resolve_server(shard.substr(0, colon),
+                                                       (uint16_t)atoi(shard.c_str() + colon + 1)));
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        WorkerPlacement where = (size_t)i < places.size() ? places[(size_t)i] : WorkerPlacement();
+        std::unique_ptr<Worker> worker(new (where.node) Worker());
+        worker->placement = where;
+        worker->metrics.cpu = where.cpu;
+        worker->metrics.node = where.node;
+        // the first bind fixes the port when config.port is 0, the rest join it
+        if ((size_t)i < inherited.size()) {
+            worker->sock = inherited[i];
+        } else {
+            worker->sock = bind_socket(port);
+            if (i == 0) {
+                struct sockaddr_in addr{};
+                net.local_address(worker->sock, addr);
+                port = ntohs(addr.sin_port);
+            }
+        }
+        // the kernel picks this worker's socket for requests it handles on the worker's CPU
+        if (where.cpu >= 0)
+            net.set_incoming_cpu(worker->sock, where.cpu);
+        Worker *w = worker.get();
+        w->index = (uint32_t)i;
+        w->settings = settings;
+        if (config.flight_events)
+            w->recorder = std::make_unique<FlightRecorder>(config.flight_events);
+        if (access_log)
+            w->log = &access_log->ring();
+        if (config.fair_queueing || config.rate_limit || config.client_rate_limit)
+            w->scheduler = std::make_unique<FairScheduler>(w->loop, config.fair_queueing ? config.fair_quantum : 0,
+                                                           config.rate_limit / (uint64_t)count);
+        if (xdp && w->index < xdp->queues())
+            w->demux = std::make_unique<XdpNet>(w->loop, *xdp, w->index, std::max(config.shared_sockets, 1),
+                                                config.request_buffer);
+        else if (config.shared_sockets > 0)
+            w->demux = std::make_unique<DemuxNet>(w->loop, net, config.shared_sockets, config.request_buffer);
+        if (config.busy_poll_us) {
+            w->loop.busy_poll(config.busy_poll_us);
+            net.set_busy_poll(w->sock, (int)config.busy_poll_us);
+            if (w->demux)
+                w->demux->busy_poll((int)config.busy_poll_us);
+        }
+        if (relay) {
+            w->upstream = std::make_unique<AsyncTFTPClient>(w->loop, upstream_host, upstream);
+            if (storage)
+                w->upstream->use_storage(*storage, w->index);
+        }
+        if (shard_ring) {
+            w->metrics.shard_requests = std::vector<Counter>(shard_addrs.size());
+            w->proxy = std::make_unique<ShardProxy>(w->loop, net, shard_addrs, config.limits, w->metrics);
+        }
+        // how long each round of events kept the loop from the next
+        w->loop.observe([w](uint64_t busy_ns) { w->metrics.loop_stall.record(busy_ns / 1000); });
+        net.watch(w->loop, w->sock, [this, w] { handle_request(*w); });
+        workers.push_back(std::move(worker));
+    }
+    sock = workers[0]->sock;
+    bound_port = port;
+    for (size_t i = 0; i < incoming.size(); i++)
+        adopt(*workers[i % workers.size()], incoming[i]);
+    adopted_count = incoming.size();
+    start_metrics();
+    start_sweeper(config);
+    if (upgrade) {
+        upgrade_fd = listen_handoff(config.upgrade_socket);
+        upgrade_wake = eventfd(0, EFD_CLOEXEC);
+        if (upgrade_fd < 0 || upgrade_wake < 0) {
+            if (upgrade_fd >= 0)
+                close(upgrade_fd);
+            if (upgrade_wake >= 0)
+                close(upgrade_wake);
+            throw std::runtime_error("cannot listen on upgrade socket " + config.upgrade_socket);
+        }
+    }
+}
+
+TFTPServer::~TFTPServer() {
+    stop();
+    if (sweeper.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(sweep_mutex);
+            sweep_stop = true;
+        }
+        sweep_wake.notify_all();
+        sweeper.join();
+    }
+    if (upgrade_thread.joinable()) {
+        uint64_t one = 1;
+        (void)!write(upgrade_wake, &one, sizeof(one));
+        upgrade_thread.join();
+    }
+    exporter.reset();
+    for (auto &w : workers)
+        if (w->thread.joinable())
+            w->thread.join();
+    // jobs still queued finish into loops that no longer run
+    storage.reset();
+    for (auto &w : workers) {
+        w->sessions.clear();
+        if (w->sock >= 0) {
+            net.unwatch(w->loop, w->sock);
+            net.close(w->sock);
+        }
+    }
+    if (upgrade_fd >= 0) {
+        close(upgrade_fd);
+        // a successor has bound the path by now, only remove our own
+        if (!handed)
+            unlink(config.upgrade_socket.c_str());
+    }
+    if (upgrade_wake >= 0)
+        close(upgrade_wake);
+}
+
+void TFTPServer::start_metrics() {
+    if (config.metrics_port >= 0 || !config.metrics_socket.empty())
+        exporter = std::make_unique<MetricsExporter>([this] { return prometheus_text(metrics()); },
+                                                     (uint16_t)std::max(config.metrics_port, 0),
+                                                     config.metrics_socket);
+}
+
+void TFTPServer::start_sweeper(const ServerConfig &with) {
+    if (!with.dedup || !with.chunk_sweep_s || sweeper.joinable())
+        return;
+    sweeper = std::thread([this, interval = std::chrono::seconds(with.chunk_sweep_s)] {
+        std::unique_lock<std::mutex> lock(sweep_mutex);
+        while (!sweep_wake.wait_for(lock, interval, [this] { return sweep_stop; })) {
+            lock.unlock();
+            store.chunks().sweep();
+            lock.lock();
+        }
+    });
+}
+
+int TFTPServer::bind_socket(uint16_t port) {
+    int fd = net.open();
+    if (fd < 0)
+        throw std::runtime_error("socket() failed");
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (net.bind(fd, addr, true) < 0) {
+        net.close(fd);
+        throw std::runtime_error("bind() failed on port " + std::to_string(port));
+    }
+    if (config.request_buffer)
+        net.set_receive_buffer(fd, config.request_buffer);
+    return fd;
+}
+
+void TFTPServer::start() {
+    if (upgrade_fd >= 0 && !handed && !upgrade_thread.joinable())
+        upgrade_thread = std::thread([this] { serve_upgrade(); });
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker *w = workers[i].get();
+        w->thread = std::thread([this, w] {
+            pin(*w, nullptr);
+            w->loop.run();
+        });
+    }
+    // worker 0 runs on the caller's thread, which gets its affinity back afterwards
+    cpu_set_t previous;
+    bool pinned = pin(*workers[0], &previous);
+    workers[0]->loop.run();
+    if (pinned)
+        unpin_thread(previous);
+    for (size_t i = 1; i < workers.size(); i++)
+        if (workers[i]->thread.joinable())
+            workers[i]->thread.join();
+}
+
+bool TFTPServer::pin(Worker &worker, cpu_set_t *previous) {
+    if (worker.placement.cpu < 0)
+        return false;
+    if (!pin_thread(worker.placement, previous)) {
+        std::cout << "cannot pin worker " << worker.index << " to CPU " << worker.placement.cpu << "\n";
+        return false;
+    }
+    return true;
+}
+
+MetricsSnapshot TFTPServer::metrics() const {
+    MetricsSnapshot snapshot;
+    for (auto &w : workers)
+        snapshot.merge(w->metrics);
+    snapshot.shards = config.shards;
+    BlockCache::Stats cache = store.cache_stats();
+    snapshot.image_cache_hits = cache.hits;
+    snapshot.image_cache_misses = cache.misses;
+    snapshot.config_reloads = reloads.load(std::memory_order_relaxed);
+    ChunkStore::Stats chunks = store.chunks().stats();
+    snapshot.dedup_logical_bytes = chunks.logical_bytes;
+    snapshot.dedup_stored_bytes = chunks.stored_bytes;
+    snapshot.dedup_chunks = chunks.chunks;
+    snapshot.dedup_unique_chunks = chunks.unique_chunks;
+    snapshot.dedup_hash_ns = chunks.hash_ns;
+    snapshot.dedup_swept_chunks = chunks.swept_chunks;
+    snapshot.dedup_swept_bytes = chunks.swept_bytes;
+    return snapshot;
+}
+
+bool TFTPServer::dump_flight(const std::string &path) const {
+    std::vector<FlightEvent> events;
+    uint64_t tsc0 = 0, ns0 = 0;
+    for (auto &w : workers) {
+        if (!w->recorder)
+            continue;
+        std::vector<FlightEvent> part = w->recorder->snapshot();
+        events.insert(events.end(), part.begin(), part.end());
+        tsc0 = w->recorder->created_tsc();
+        ns0 = w->recorder->created_ns();
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const FlightEvent &a, const FlightEvent &b) { return a.tsc < b.tsc; });
+    return FlightRecorder::dump(path, events, tsc0, ns0);
+}
+
+void TFTPServer::dump_failed(Worker &worker, uint32_t flight_id) {
+    uint64_t now = metrics_now_ns();
+    if (worker.last_dump_ns && now - worker.last_dump_ns < 1000000000ull)
+        return;
+    worker.last_dump_ns = now;
+    std::string path = config.flight_dir + "/flight-" + std::to_string(worker.index) + "-" +
+                       std::to_string(flight_id) + ".bin";
+    if (FlightRecorder::dump(path, worker.recorder->snapshot(), worker.recorder->created_tsc(),
+                             worker.recorder->created_ns()))
+        std::cout << "session " << flight_id << " failed, flight recorder written to " << path << "\n";
+}
+
+void TFTPServer::stop() {
+    for (auto &w : workers)
+        w->loop.stop();
+}
+
+std::vector<std::string> TFTPServer::reload(const ServerConfig &next) {
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    std::vector<std::string> restart;
+    auto check = [&](bool same, const char *name) {
+        if (!same)
+            restart.push_back(name);
+    };
+    check(next.port == config.port || next.port == 0, "port");
+    check(next.workers == config.workers, "workers");
+    check(next.metrics_port == config.metrics_port, "metrics_port");
+    check(next.metrics_socket == config.metrics_socket, "metrics_socket");
+    check(next.flight_events == config.flight_events, "flight_events");
+    check(next.access_log == config.access_log, "access_log");
+    check(next.flight_dir == config.flight_dir, "flight_dir");
+    check(next.upgrade_socket == config.upgrade_socket, "upgrade_socket");
+    check(next.shared_sockets == config.shared_sockets, "shared_sockets");
+    check(next.xdp_interface == config.xdp_interface, "xdp_interface");
+    check(next.fair_queueing == config.fair_queueing, "fair_queueing");
+    check(next.fair_quantum == config.fair_quantum, "fair_quantum");
+    check(next.request_buffer == config.request_buffer, "request_buffer");
+    check(next.pin_workers == config.pin_workers && next.worker_cpus == config.worker_cpus, "worker_cpus");
+    check(next.busy_poll_us == config.busy_poll_us, "busy_poll_us");
+    check(next.storage_threads == config.storage_threads, "storage_threads");
+    check(next.upstream == config.upstream && next.upstream_blksize == config.upstream_blksize &&
+              next.upstream_windowsize == config.upstream_windowsize,
+          "upstream");
+    check(next.shards == config.shards, "shards");
+    check(next.chunk_sweep_s == config.chunk_sweep_s, "chunk_sweep_s");
+    // the chunk store and its sweep stay under the root the server started with, so
+    // with dedup on the root does too: manifests elsewhere would refer to chunks the
+    // sweep cannot see are still in use
+    bool keep_root = next.dedup && next.root != config.root;
+    check(!keep_root, "root (with dedup)");
+
+    // what applies live comes from next, the rest stays as started
+    ServerConfig merged = config;
+    merged.root = keep_root ? config.root : next.root;
+    merged.allow_write = next.allow_write;
+    merged.dedup = next.dedup;
+    merged.max_blksize = next.max_blksize;
+    merged.max_windowsize = next.max_windowsize;
+    merged.cache_bytes = next.cache_bytes;
+    merged.limits = next.limits;
+    merged.rate_limit = next.rate_limit;
+    merged.client_rate_limit = next.client_rate_limit;
+    merged.client_prefix = next.client_prefix;
+    merged.max_sessions = next.max_sessions;
+    merged.max_pending = next.max_pending;
+    merged.small_file = next.small_file;
+    merged.max_queue_ms = next.max_queue_ms;
+    merged.shed_silently = next.shed_silently;
+    merged.log_requests = next.log_requests;
+    auto snapshot = std::make_shared<const ServerConfig>(merged);
+
+    if (snapshot->cache_bytes != settings->cache_bytes)
+        store.resize_cache(snapshot->cache_bytes);
+    client_limits->set_limits(snapshot->client_rate_limit, snapshot->client_rate_limit / 20, snapshot->client_prefix);
+    settings = snapshot;
+    start_sweeper(*snapshot);
+    // each worker switches between two events, so no request sees half of it
+    for (auto &w : workers) {
+        Worker *worker = w.get();
+        worker->loop.post([this, worker, snapshot] { apply_settings(*worker, snapshot); });
+    }
+    reloads.fetch_add(1, std::memory_order_relaxed);
+    return restart;
+}
+
+void TFTPServer::apply_settings(Worker &worker, std::shared_ptr<const ServerConfig> next) {
+    uint64_t rate = next->rate_limit / (uint64_t)workers.size();
+    if (worker.scheduler)
+        worker.scheduler->set_rate(rate);
+    else if (rate || next->client_rate_limit)
+        worker.scheduler = std::make_unique<FairScheduler>(worker.loop, 0, rate);
+    worker.settings = std::move(next);
+    // requests queued under a lower cap may fit now
+    if (!worker.pending_peers.empty())
+        admit(worker);
+}
+
+// Client TID as one integer
+static uint64_t peer_key(const struct sockaddr_in &client) {
+    return (uint64_t)client.sin_addr.s_addr << 16 | client.sin_port;
+}
+
+void TFTPServer::handle_request(Worker &worker) {
+    char buf[2048];
+    for (;;) {
+        struct sockaddr_in client{};
+        socklen_t client_len = sizeof(client);
+        ssize_t n = net.receive(worker.sock, buf, sizeof(buf), &client);
+        if (n < 0)
+            return;
+        worker.request_ns = metrics_now_ns();
+        if (worker.placement.cpu >= 0) {
+            // the CPU the kernel handled the socket's latest datagram on; with a
+            // backlog that is a later request's, which is close enough for a count
+            int cpu = net.incoming_cpu(worker.sock);
+            if (cpu >= 0 && cpu != worker.placement.cpu) {
+                worker.metrics.requests_other_cpu.add();
+                if (topology.node_of(cpu) != worker.placement.node)
+                    worker.metrics.requests_other_node.add();
+            }
+        }
+        Request req;
+        if (!parse_request(buf, (size_t)n, req)) {
+            reject(worker, client, client_len, ERR_ILLEGAL_OP, "Illegal TFTP operation");
+            continue;
+        }
+        if (worker.log)
+            log_access(worker, AR_REQUEST, client, [&](AccessRecord &r) {
+                r.op = (uint8_t)req.op_code;
+                if (req.mode == "netascii")
+                    r.flags = AF_NETASCII;
+                AccessLog::set_name(r, req.filename);
+            });
+        else if (worker.settings->log_requests)
+            std::cout << (req.op_code == RREQ ? "RRQ " : "WRQ ") << req.filename << " (" << req.mode
+                      << ") from " << inet_ntoa(client.sin_addr) << ":" << ntohs(client.sin_port) << "\n";
+        worker.request_op = req.op_code;
+        (req.op_code == RREQ ? worker.metrics.rrq : worker.metrics.wrq).add();
+        if (!worker.admitted_peers.empty() && worker.admitted_peers.count(peer_key(client)))
+            continue;
+        // a resend while its file is still being opened, or while it waits
+        if ((!worker.opening.empty() && worker.opening.count(peer_key(client))) ||
+            (!worker.pending_peers.empty() && worker.pending_peers.count(peer_key(client))))
+            continue;
+        if (worker.proxy) {
+            if (!worker.proxy->forward(client, buf, (size_t)n, shard_ring->owner(req.filename)))
+                reject(worker, client, client_len, ERR_UNDEFINED, "Out of sockets");
+            continue;
+        }
+        // once anything waits, newcomers queue behind it; RRQs open their file first
+        if (req.op_code == RREQ)
+            open_rrq(worker, client, req);
+        else if (must_wait(worker))
+            enqueue(worker, client, req, OpenedFile());
+        else
+            handle_wrq(worker, client, client_len, req);
+    }
+}
+
+template <class Fill>
+void TFTPServer::log_access(Worker &worker, uint8_t type, const struct sockaddr_in &client, Fill fill) {
+    bool logged = worker.log->log([&](AccessRecord &r) {
+        r.type = type;
+        r.worker = (uint8_t)worker.index;
+        r.addr = client.sin_addr.s_addr;
+        r.port = ntohs(client.sin_port);
+        fill(r);
+    });
+    if (!logged)
+        worker.metrics.log_dropped.add();
+}
+
+template <class Work, class Done>
+void TFTPServer::storage_call(Worker &worker, const struct sockaddr_in &client, Work work, Done done) {
+    if (!storage) {
+        done(work());
+        return;
+    }
+    uint64_t key = peer_key(client);
+    worker.opening.insert(key);
+    worker.metrics.storage_jobs.add();
+    storage->run(worker.loop, worker.index, std::move(work),
+                 [this, &worker, key, done = std::move(done)](auto result) mutable {
+                     worker.opening.erase(key);
+                     done(std::move(result));
+                     if (worker.settings->max_sessions)
+                         admit(worker);
+                 });
+}
+
+TFTPServer::OpenedFile TFTPServer::open_file(const std::string &root, const Request &req, const TransferOptions &opts,
+                                             size_t slice) {
+    OpenedFile file;
+    file.source = store.open(root, req.filename, slice);
+    if (!file.source) {
+        file.error = errno;
+        return file;
+    }
+    // a resume reads everything before the offset, which is the slow part of the open
+    if (req.mode != "netascii" && opts.has_offset && !opts.prefixsum.empty() &&
+        opts.offset <= file.source->size())
+        file.prefixsum = prefix_checksum(*file.source, opts.offset);
+    return file;
+}
+
+TFTPServer::CreatedFile TFTPServer::create_file(const std::string &root, const Request &req, bool dedup, bool resume,
+                                                size_t slice) {
+    CreatedFile file;
+    file.sink = store.create(root, req.filename, dedup, resume ? &file.have : nullptr);
+    file.dedup = dedup;
+    if (!file.sink) {
+        file.error = errno;
+        return file;
+    }
+    if (resume && file.have > 0) {
+        std::unique_ptr<ImageSource> partial = store.open(root, req.filename, slice);
+        if (partial)
+            file.prefixsum = prefix_checksum(*partial, file.have);
+    }
+    return file;
+}
+
+void TFTPServer::open_rrq(Worker &worker, const struct sockaddr_in &client, const Request &req) {
+    TransferOptions opts;
+    parse_options(req, opts, worker.settings->max_blksize, worker.settings->max_windowsize);
+    uint64_t arrived = worker.request_ns;
+    size_t slice = worker.placement.slice;
+    // the storage thread reads the root from the snapshot the request arrived under
+    storage_call(worker, client,
+                 [this, settings = worker.settings, req, opts, slice] {
+                     return open_file(settings->root, req, opts, slice);
+                 },
+                 [this, &worker, client = client, req, arrived](OpenedFile file) mutable {
+                     opened_rrq(worker, client, req, arrived, std::move(file));
+                 });
+}
+
+void TFTPServer::opened_rrq(Worker &worker, const struct sockaddr_in &client, const Request &req, uint64_t arrived,
+                            OpenedFile file) {
+    worker.request_ns = arrived;
+    worker.request_op = RREQ;
+    if (relay && !file.relayed) {
+        if (!file.source && file.error == ENOENT) {
+            relay_rrq(worker, client, req, arrived);
+            return;
+        }
+        if (file.source)
+            worker.metrics.relay_hits.add();
+    }
+    // a missing file costs nothing to answer, do it now rather than after any wait
+    if (!file.source) {
+        errno = file.error;
+        reject_open(worker, client, sizeof(client));
+        return;
+    }
+    struct sockaddr_in peer = client;
+    if (must_wait(worker))
+        enqueue(worker, peer, req, std::move(file));
+    else
+        handle_rrq(worker, peer, sizeof(peer), req, std::move(file));
+}
+
+void TFTPServer::relay_rrq(Worker &worker, const struct sockaddr_in &client, const Request &req, uint64_t arrived) {
+    // resends are ignored until the upstream answers, and the wait holds a session slot
+    uint64_t key = peer_key(client);
+    worker.opening.insert(key);
+    relay->open(worker.settings->root, req.filename, worker.loop, *worker.upstream, worker.placement.slice, worker.metrics,
+                [this, &worker, client, req, arrived, key](RelayCache::Opened opened) {
+                    worker.opening.erase(key);
+                    worker.request_ns = arrived;
+                    worker.request_op = RREQ;
+                    if (!opened.source) {
+                        reject(worker, client, sizeof(client), opened.code, opened.message.c_str());
+                    } else {
+                        OpenedFile file;
+                        file.source = std::move(opened.source);
+                        file.relayed = true;
+                        opened_rrq(worker, client, req, arrived, std::move(file));
+                    }
+                    if (worker.settings->max_sessions)
+                        admit(worker);
+                });
+}
+
+void TFTPServer::reject(Worker &worker, const struct sockaddr_in &client, socklen_t,
+                        uint16_t code, const char *msg) {
+    char buf[128];
+    size_t len = build_error(buf, sizeof(buf), code, msg);
+    net.send_to(worker.sock, buf, len, &client);
+    if (code < METRICS_ERROR_CODES)
+        worker.metrics.errors_sent[code].add();
+    if (worker.log)
+        log_access(worker, AR_REJECTED, client, [&](AccessRecord &r) {
+            r.op = (uint8_t)worker.request_op;
+            r.code = code;
+        });
+}
+
+void TFTPServer::reject_open(Worker &worker, const struct sockaddr_in &client, socklen_t client_len) {
+    if (errno == ENOENT)
+        reject(worker, client, client_len, ERR_NOT_FOUND, "File not found");
+    else
+        reject(worker, client, client_len, ERR_ACCESS, "Access violation");
+}
+
+// ---- admission control ----
+
+void TFTPServer::enqueue(Worker &worker, const struct sockaddr_in &client, const Request &req, OpenedFile file) {
+    expire(worker);
+    uint64_t key = peer_key(client);
+    if (worker.pending_peers.count(key))
+        return;  // the client resent its request while it waited
+    // RRQs arrive opened, for their size
+    bool small = req.op_code == RREQ && file.source->size() <= worker.settings->small_file;
+    Pending p{client, req, std::move(file), worker.request_ns};
+    if (worker.pending_peers.size() >= worker.settings->max_pending) {
+        // full: a small file pushes out the newest large request, anything else is shed
+        if (!small || worker.pending_large.empty()) {
+            shed(worker, client);
+            return;
+        }
+        Pending &last = worker.pending_large.back();
+        worker.pending_peers.erase(peer_key(last.client));
+        shed(worker, last.client);
+        worker.pending_large.pop_back();
+    }
+    worker.pending_peers.insert(key);
+    (small ? worker.pending_small : worker.pending_large).push_back(std::move(p));
+    worker.metrics.requests_queued.add();
+    worker.metrics.pending.set(worker.pending_peers.size());
+}
+
+void TFTPServer::shed(Worker &worker, const struct sockaddr_in &client) {
+    worker.metrics.requests_shed.add();
+    if (!worker.settings->shed_silently)
+        reject(worker, client, sizeof(client), ERR_UNDEFINED, "Server busy");
+}
+
+void TFTPServer::expire(Worker &worker) {
+    if (!worker.settings->max_queue_ms)
+        return;
+    uint64_t oldest = metrics_now_ns() - (uint64_t)worker.settings->max_queue_ms * 1000000;
+    // both queues are in arrival order, so only their fronts can be too old
+    for (std::deque<Pending> *queue : {&worker.pending_small, &worker.pending_large}) {
+        while (!queue->empty() && queue->front().arrived_ns < oldest) {
+            worker.pending_peers.erase(peer_key(queue->front().client));
+            worker.metrics.requests_expired.add();
+            shed(worker, queue->front().client);
+            queue->pop_front();
+        }
+    }
+    worker.metrics.pending.set(worker.pending_peers.size());
+}
+
+void TFTPServer::admit(Worker &worker) {
+    expire(worker);
+    // a reload may have lifted the cap (0) with requests still queued
+    while ((!worker.settings->max_sessions || busy_slots(worker) < worker.settings->max_sessions) &&
+           !worker.pending_peers.empty()) {
+        std::deque<Pending> &queue = worker.pending_small.empty() ? worker.pending_large : worker.pending_small;
+        Pending p = std::move(queue.front());
+        queue.pop_front();
+        worker.pending_peers.erase(peer_key(p.client));
+        worker.metrics.queue_wait.record_since(p.arrived_ns);
+        // time to first DATA counts from arrival, wait included
+        worker.request_ns = p.arrived_ns;
+        worker.request_op = p.req.op_code;
+        size_t before = busy_slots(worker);
+        if (p.req.op_code == RREQ)
+            handle_rrq(worker, p.client, sizeof(p.client), p.req, std::move(p.file));
+        else
+            handle_wrq(worker, p.client, sizeof(p.client), p.req);
+        // a WRQ whose create went to the storage pool is still on its way
+        if (busy_slots(worker) > before)
+            worker.admitted_peers.insert(peer_key(p.client));
+    }
+    worker.metrics.pending.set(worker.pending_peers.size());
+}
+
+int TFTPServer::open_session_socket(Worker &worker, const struct sockaddr_in &client, socklen_t) {
+    DatagramNet &net = session_net(worker);
+    int fd = net.open();
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = 0;
+    // connected, so the kernel drops datagrams from any other TID for us
+    if (net.bind(fd, local) < 0 || net.connect(fd, client) < 0) {
+        net.close(fd);
+        return -1;
+    }
+    if (config.busy_poll_us && !worker.demux)
+        net.set_busy_poll(fd, (int)config.busy_poll_us);
+    return fd;
+}
+
+Session &TFTPServer::add_session(Worker &worker, std::unique_ptr<Session> session, const std::string &filename,
+                                 std::function<void(bool ok)> done) {
+    Session *raw = session.get();
+    raw->use_net(session_net(worker));
+    raw->use_frames(worker.frames);
+    raw->use_dally(worker.dally);
+    if (storage)
+        raw->use_storage(*storage, worker.index);
+    raw->set_metrics(worker.metrics, worker.request_ns);
+    uint32_t flight_id = 0;
+    if (worker.recorder) {
+        // worker index in the top bits keeps ids unique across a merged dump
+        flight_id = worker.index << 24 | (++worker.flight_ids & 0xffffff);
+        raw->set_recorder(*worker.recorder, flight_id);
+        worker.recorder->record(FE_STATE, flight_id, worker.request_op, FS_START);
+    }
+    std::string logged_name = worker.log ? filename : std::string();
+    raw->on_done = [this, &worker, done, flight_id, name = std::move(logged_name), op = worker.request_op,
+                    arrived = worker.request_ns](Session &s) {
+        if (done)
+            done(s.ok());
+        if (worker.log)
+            log_access(worker, s.ok() ? AR_DONE_OK : AR_DONE_FAILED, s.peer_address(), [&](AccessRecord &r) {
+                r.op = (uint8_t)op;
+                r.bytes = s.bytes();
+                r.duration_us = (uint32_t)std::min<uint64_t>((metrics_now_ns() - arrived) / 1000, UINT32_MAX);
+                r.blksize = s.options().blksize;
+                r.windowsize = s.options().windowsize;
+                AccessLog::set_name(r, name);
+            });
+        if (!s.ok() && worker.recorder && !config.flight_dir.empty())
+            dump_failed(worker, flight_id);
+        if (!worker.admitted_peers.empty())
+            worker.admitted_peers.erase(peer_key(s.peer_address()));
+        // the session is still on the stack, free it once the loop unwinds
+        Session *key = &s;
+        worker.loop.post([this, &worker, key] {
+            worker.sessions.erase(key);
+            worker.movable.erase(key);
+            if (worker.settings->max_sessions)
+                admit(worker);
+            if (worker.draining && worker.sessions.empty())
+                worker.loop.stop();
+        });
+    };
+    worker.sessions.emplace(raw, std::move(session));
+    return *raw;
+}
+
+void TFTPServer::pace(Worker &worker, SendSession &rrq, const struct sockaddr_in &client) {
+    if (worker.scheduler)
+        rrq.use_scheduler(*worker.scheduler,
+                          worker.settings->client_rate_limit ? client_limits->bucket_for(client) : nullptr);
+}
+
+static std::vector<char> make_oack(const Request &req, const TransferOptions &opts) {
+    std::vector<char> oack;
+    if (req.options.empty())
+        return oack;
+    char buf[512];
+    size_t len = build_oack(buf, sizeof(buf), req, opts);
+    if (len > 2)
+        oack.assign(buf, buf + len);
+    return oack;
+}
+
+void TFTPServer::handle_rrq(Worker &worker, struct sockaddr_in &client, socklen_t client_len, const Request &req,
+                            OpenedFile file) {
+    std::unique_ptr<ImageSource> &source = file.source;
+    TransferOptions opts;
+    parse_options(req, opts, worker.settings->max_blksize, worker.settings->max_windowsize);
+    // decompressed size for packed images; left out while a relayed file's is not known
+    opts.has_tsize = opts.has_tsize && source->size() != UINT64_MAX;
+    if (opts.has_tsize)
+        opts.tsize = source->size();
+    if (req.mode == "netascii") {
+        // byte ranges are only meaningful on the untranslated stream
+        opts.has_offset = false;
+        opts.has_length = false;
+        opts.prefixsum.clear();
+    } else if (opts.has_offset && !opts.prefixsum.empty()) {
+        // resume: only continue if the client's partial copy ends with our bytes,
+        // otherwise leave offset out of the OACK so it starts over from 0
+        if (opts.offset > source->size() || file.prefixsum != opts.prefixsum) {
+            opts.has_offset = false;
+            opts.has_length = false;
+            opts.prefixsum.clear();
+        }
+    } else if (opts.has_offset && opts.offset > source->size()) {
+        reject(worker, client, client_len, ERR_OPTION, "Offset beyond end of file");
+        return;
+    }
+
+    int fd = open_session_socket(worker, client, client_len);
+    if (fd < 0) {
+        reject(worker, client, client_len, ERR_UNDEFINED, "Out of sockets");
+        return;
+    }
+    auto session = std::make_unique<SendSession>(worker.loop, fd, client, opts, worker.settings->limits,
+                                                std::move(source), req.mode == "netascii");
+    SendSession *rrq = session.get();
+    add_session(worker, std::move(session), req.filename);
+    pace(worker, *rrq, client);
+    // a shared socket cannot go to another process with the transfer, nor can an
+    // upstream fetch
+    if (req.mode != "netascii" && !worker.demux && !file.relayed)
+        worker.movable[rrq] = Movable{RREQ, req.filename, false};
+    rrq->begin(make_oack(req, opts));
+}
+
+void TFTPServer::handle_wrq(Worker &worker, struct sockaddr_in &client, socklen_t client_len, const Request &req) {
+    if (!worker.settings->allow_write) {
+        reject(worker, client, client_len, ERR_ACCESS, "Access violation");
+        return;
+    }
+    TransferOptions opts;
+    parse_options(req, opts, worker.settings->max_blksize, worker.settings->max_windowsize);
+    // resume: the client asks with offset (any value) and we answer with how much we have
+    bool resume = opts.has_offset && req.mode != "netascii" && !worker.settings->dedup;
+    uint64_t arrived = worker.request_ns;
+    size_t slice = worker.placement.slice;
+    bool dedup = worker.settings->dedup;
+    storage_call(worker, client,
+                 [this, settings = worker.settings, req, dedup, resume, slice] {
+                     return create_file(settings->root, req, dedup, resume, slice);
+                 },
+                 [this, &worker, client, req, arrived](CreatedFile file) mutable {
+                     worker.request_ns = arrived;
+                     worker.request_op = WREQ;
+                     start_wrq(worker, client, req, std::move(file));
+                 });
+}
+
+void TFTPServer::start_wrq(Worker &worker, struct sockaddr_in &client, const Request &req, CreatedFile file) {
+    socklen_t client_len = sizeof(client);
+    if (!file.sink) {
+        reject(worker, client, client_len, file.error == ENOENT ? ERR_NOT_FOUND : ERR_ACCESS,
+               file.error == ENOENT ? "Directory not found" : "Access violation");
+        return;
+    }
+    TransferOptions opts;
+    parse_options(req, opts, worker.settings->max_blksize, worker.settings->max_windowsize);
+    opts.has_offset = opts.has_offset && req.mode != "netascii" && !file.dedup;
+    opts.offset = file.have;
+    opts.has_length = false;
+    opts.prefixsum = file.prefixsum;
+    std::unique_ptr<ImageSink> &sink = file.sink;
+
+    int fd = open_session_socket(worker, client, client_len);
+    if (fd < 0) {
+        reject(worker, client, client_len, ERR_UNDEFINED, "Out of sockets");
+        return;
+    }
+    auto session = std::make_unique<ReceiveSession>(worker.loop, fd, client, opts, worker.settings->limits,
+                                                std::move(sink), req.mode == "netascii");
+    ReceiveSession *wrq = session.get();
+    add_session(worker, std::move(session), req.filename);
+    // chunked uploads live in the chunk store's memory until commit, they finish here
+    if (req.mode != "netascii" && !file.dedup && !worker.demux)
+        worker.movable[wrq] = Movable{WREQ, req.filename, opts.has_offset};
+    wrq->begin(make_oack(req, opts));
+}
+
+// ---- upgrade handoff ----
+
+void TFTPServer::serve_upgrade() {
+    for (;;) {
+        struct pollfd fds[2] = {{upgrade_fd, POLLIN, 0}, {upgrade_wake, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (fds[1].revents)
+            return;
+        int conn = accept4(upgrade_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0)
+            continue;
+        // only a process running as our user gets the port and the transfers, whoever
+        // else can reach the socket's path
+        struct ucred cred{};
+        socklen_t len = sizeof(cred);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid()) {
+            std::cout << "upgrade from uid " << cred.uid << " refused\n";
+            close(conn);
+            continue;
+        }
+        // the successor binds the path for its own successor once it has everything
+        unlink(config.upgrade_socket.c_str());
+        bool ok = hand_off(conn);
+        close(conn);
+        if (ok)
+            return;
+        std::cout << "upgrade handoff failed, carrying on\n";
+        close(upgrade_fd);
+        upgrade_fd = listen_handoff(config.upgrade_socket);
+        if (upgrade_fd < 0)
+            return;
+    }
+}
+
+bool TFTPServer::hand_off(int conn) {
+    // a worker suspends only while the handoff still wants its part: one that answers
+    // after the deadline keeps its socket and sessions instead of leaving them in a
+    // promise nobody reads
+    struct Pending {
+        std::mutex mutex;
+        bool abandoned = false;
+        std::promise<HandoffPart> promise;
+    };
+    std::vector<std::shared_ptr<Pending>> pending;
+    std::vector<std::future<HandoffPart>> futures;
+    for (auto &w : workers) {
+        Worker *worker = w.get();
+        auto p = std::make_shared<Pending>();
+        futures.push_back(p->promise.get_future());
+        pending.push_back(p);
+        worker->loop.post([this, worker, p] {
+            std::lock_guard<std::mutex> lock(p->mutex);
+            if (!p->abandoned)
+                p->promise.set_value(suspend_worker(*worker));
+        });
+    }
+    // a worker that does not answer is busy or shutting down; the handoff fails then
+    // and the parts that did arrive go back to their workers
+    std::vector<HandoffPart> parts(workers.size());
+    bool ok = true;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    for (size_t i = 0; i < futures.size(); i++) {
+        if (futures[i].wait_until(deadline) != std::future_status::ready) {
+            std::lock_guard<std::mutex> lock(pending[i]->mutex);
+            // it may have answered while we took the lock
+            if (futures[i].wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                pending[i]->abandoned = true;
+                ok = false;
+                continue;
+            }
+        }
+        parts[i] = futures[i].get();
+    }
+    std::vector<int> socks;
+    std::vector<HandoffSession> sessions;
+    for (auto &part : parts) {
+        if (part.sock >= 0)
+            socks.push_back(part.sock);
+        sessions.insert(sessions.end(), part.sessions.begin(), part.sessions.end());
+    }
+    // the successor binds the metrics port or socket as soon as it has everything
+    exporter.reset();
+    if (!ok || !send_handoff(conn, bound_port, socks, sessions)) {
+        // take everything back; the successor closes whatever it got so far
+        start_metrics();
+        for (size_t i = 0; i < parts.size(); i++) {
+            if (parts[i].sock < 0)
+                continue;
+            Worker *worker = workers[i].get();
+            auto part = std::make_shared<HandoffPart>(std::move(parts[i]));
+            worker->loop.post([this, worker, part] {
+                worker->sock = part->sock;
+                net.watch(worker->loop, worker->sock, [this, worker] { handle_request(*worker); });
+                for (auto &state : part->sessions)
+                    adopt(*worker, state);
+            });
+        }
+        return false;
+    }
+    for (int fd : socks)
+        close(fd);
+    for (auto &state : sessions)
+        close(state.sock);
+    handed = true;
+    size_t staying = 0;
+    for (auto &part : parts)
+        staying += part.staying;
+    std::cout << "handed " << sessions.size() << " transfers to the new process, finishing "
+              << staying << " here\n";
+    for (auto &w : workers) {
+        Worker *worker = w.get();
+        worker->loop.post([worker] {
+            worker->draining = true;
+            if (worker->sessions.empty())
+                worker->loop.stop();
+        });
+    }
+    return true;
+}
+
+TFTPServer::HandoffPart TFTPServer::suspend_worker(Worker &worker) {
+    HandoffPart part;
+    part.sock = worker.sock;
+    net.unwatch(worker.loop, worker.sock);
+    worker.sock = -1;
+    for (auto it = worker.movable.begin(); it != worker.movable.end();) {
+        HandoffSession state;
+        state.op = it->second.op;
+        state.filename = it->second.filename;
+        state.keep_partial = it->second.keep_partial;
+        state.sock = it->first->suspend(state);
+        if (state.sock < 0) {
+            ++it;
+            continue;
+        }
+        worker.sessions.erase(it->first);
+        it = worker.movable.erase(it);
+        part.sessions.push_back(std::move(state));
+    }
+    part.staying = worker.sessions.size();
+    return part;
+}
+
+void TFTPServer::adopt(Worker &worker, const HandoffSession &state) {
+    worker.request_ns = metrics_now_ns();
+    worker.request_op = state.op;
+    std::unique_ptr<Session> session;
+    if (state.op == RREQ) {
+        std::unique_ptr<ImageSource> source = store.open(worker.settings->root, state.filename, worker.placement.slice);
+        if (source)
+            session = std::make_unique<SendSession>(worker.loop, state.sock, state.peer, state.opts,
+                                                    worker.settings->limits, std::move(source), false);
+    } else {
+        uint64_t at = (state.opts.has_offset ? state.opts.offset : 0) + state.transferred;
+        std::unique_ptr<ImageSink> sink =
+            store.resume_upload(worker.settings->root, state.filename, at, state.keep_partial);
+        if (sink)
+            session = std::make_unique<ReceiveSession>(worker.loop, state.sock, state.peer, state.opts,
+                                                       worker.settings->limits, std::move(sink), false);
+    }
+    if (!session) {
+        char buf[128];
+        net.send_to(state.sock, buf, build_error(buf, sizeof(buf), ERR_UNDEFINED, "File went away"), nullptr);
+        net.close(state.sock);
+        worker.metrics.transfers_failed.add();
+        return;
+    }
+    Session *raw = session.get();
+    add_session(worker, std::move(session), state.filename);
+    raw->use_net(net);  // it arrived with a socket of its own
+    if (state.op == RREQ)
+        pace(worker, *static_cast<SendSession *>(raw), state.peer);
+    worker.movable[raw] = Movable{state.op, state.filename, state.keep_partial};
+    if (state.op == RREQ)
+        static_cast<SendSession *>(raw)->resume(state);
+    else
+        static_cast<ReceiveSession *>(raw)->resume(state);
+}
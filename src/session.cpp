@@ -0,0 +1,809 @@
+#include "../includes/session.hpp"
+#include "../includes/storage_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <utility>
+
+std::vector<char> BufferPool::take(size_t n) {
+    std::vector<char> buf;
+    if (!spare.empty()) {
+        buf = std::move(spare.back());
+        spare.pop_back();
+    }
+    buf.resize(n);  // keeps the capacity of a recycled buffer
+    return buf;
+}
+
+void BufferPool::give(std::vector<char> &&buf) {
+    if (spare.size() < max_buffers && buf.capacity() > 0)
+        spare.push_back(std::move(buf));
+}
+
+DallyList::~DallyList() {
+    for (auto &t : tids) {
+        loop.cancel_timer(t.second.timer);
+        t.second.net->unwatch(loop, t.first);
+        t.second.net->close(t.first);
+    }
+}
+
+void DallyList::add(DatagramNet &net, int sock, const std::vector<char> &final_ack, uint32_t ms) {
+    // entries whose TID a timer already dropped are skipped, and trimmed with the rest
+    auto held = [this](const std::pair<int, uint64_t> &e) {
+        auto it = tids.find(e.first);
+        return it != tids.end() && it->second.added == e.second;
+    };
+    while (!order.empty() && (!held(order.front()) || tids.size() >= max_tids)) {
+        if (held(order.front())) {
+            loop.cancel_timer(tids[order.front().first].timer);
+            drop(order.front().first);
+        }
+        order.pop_front();
+    }
+    Tid &t = tids[sock];
+    t.net = &net;
+    t.ack = final_ack;
+    t.added = ++adds;
+    order.emplace_back(sock, t.added);
+    t.timer = loop.add_timer(ms, [this, sock] { drop(sock); });
+    net.watch(loop, sock, [this, sock] { on_readable(sock); });
+}
+
+void DallyList::on_readable(int sock) {
+    auto it = tids.find(sock);
+    if (it == tids.end())
+        return;
+    Tid &t = it->second;
+    char buf[4];  // the header is all that matters, the rest is cut off
+    ssize_t n;
+    while ((n = t.net->receive(sock, buf, sizeof(buf), nullptr)) >= 0 || errno == EINTR) {
+        if (n == 4 && get_u16(buf) == DATA && get_u16(buf + 2) == get_u16(t.ack.data() + 2))
+            (void)!t.net->send_to(sock, t.ack.data(), t.ack.size(), nullptr);
+    }
+}
+
+void DallyList::drop(int sock) {
+    auto it = tids.find(sock);
+    if (it == tids.end())
+        return;
+    it->second.net->unwatch(loop, sock);
+    it->second.net->close(sock);
+    tids.erase(it);
+}
+
+Session::Session(EventLoop &loop, int sock, const struct sockaddr_in &peer,
+                 const TransferOptions &opts, const SessionLimits &limits)
+    : loop(loop), sock(sock), peer(peer), opts(opts), limits(limits), net(&DatagramNet::kernel()),
+      packet(4 + (size_t)opts.blksize + 1) {}
+
+Session::~Session() {
+    if (timer)
+        loop.cancel_timer(timer);
+    if (!done)
+        net->unwatch(loop, sock);
+    if (sock >= 0)
+        net->close(sock);
+    if (pool)
+        pool->give(std::move(packet));
+}
+
+void Session::use_pool(BufferPool &buffers) {
+    pool = &buffers;
+    std::vector<char> buf = pool->take(packet.size());
+    packet.swap(buf);
+}
+
+void Session::use_storage(StoragePool &storage_pool, size_t hint) {
+    storage = &storage_pool;
+    storage_hint = hint;
+}
+
+void Session::set_metrics(WorkerMetrics &worker_metrics, uint64_t request_ns) {
+    metrics = &worker_metrics;
+    started_ns = request_ns;
+}
+
+void Session::set_recorder(FlightRecorder &flight, uint32_t id) {
+    recorder = &flight;
+    flight_id = id;
+}
+
+void Session::note_retransmit(uint64_t block) {
+    if (metrics)
+        metrics->retransmits.add();
+    if (recorder)
+        recorder->record(FE_RETRANSMIT, flight_id, block);
+}
+
+void Session::attach() {
+    net->watch(loop, sock, [this] { on_readable(); });
+}
+
+uint32_t Session::timeout_ms() const {
+    return opts.timeout ? opts.timeout * 1000u : limits.timeout_ms;
+}
+
+void Session::send_request(const std::vector<char> &req) {
+    connected = false;
+    pending = req;
+    send_packet(pending.data(), pending.size());
+    arm_timer();
+}
+
+void Session::send_packet(const char *buf, size_t len) {
+    if (recorder && len >= 4)
+        recorder->record(FE_TX, flight_id, buf[1] == OACK ? 0 : get_u16(buf + 2), (uint8_t)buf[1]);
+    // a lost send is handled by the retransmit timer
+    (void)!net->send_to(sock, buf, len, connected ? nullptr : &peer);
+}
+
+void Session::send_error(uint16_t code, const char *msg) {
+    char buf[128];
+    send_packet(buf, build_error(buf, sizeof(buf), code, msg));
+    if (metrics && code < METRICS_ERROR_CODES)
+        metrics->errors_sent[code].add();
+}
+
+void Session::arm_timer() {
+    if (timer)
+        loop.cancel_timer(timer);
+    timer = loop.add_timer(timeout_ms(), [this] { timer_fired(); });
+}
+
+void Session::timer_fired() {
+    timer = 0;
+    if (metrics)
+        metrics->timeouts.add();
+    if (recorder)
+        recorder->record(FE_TIMER, flight_id, 0, (uint8_t)std::min(retries, 255));
+    if (++retries > limits.max_retries) {
+        if (connected)
+            send_error(ERR_UNDEFINED, "Transfer timed out");
+        finish(false, "Transfer timed out");
+        return;
+    }
+    if (!pending.empty()) {
+        send_packet(pending.data(), pending.size());
+        note_retransmit(0);
+        arm_timer();
+        return;
+    }
+    events.deliver(SessionEvent{});
+}
+
+void Session::finish(bool success, const char *reason) {
+    if (done)
+        return;
+    done = true;
+    succeeded = success;
+    if (reason)
+        error_msg = reason;
+    if (timer) {
+        loop.cancel_timer(timer);
+        timer = 0;
+    }
+    net->unwatch(loop, sock);
+    if (recorder)
+        recorder->record(FE_STATE, flight_id, 0, success ? FS_DONE_OK : FS_DONE_FAILED);
+    if (metrics) {
+        if (success) {
+            metrics->transfers_ok.add();
+            metrics->duration.record_since(started_ns);
+        } else {
+            metrics->transfers_failed.add();
+        }
+    }
+    if (on_done)
+        on_done(*this);
+}
+
+int Session::suspend(HandoffSession &) {
+    return -1;
+}
+
+int Session::detach() {
+    if (timer) {
+        loop.cancel_timer(timer);
+        timer = 0;
+    }
+    net->unwatch(loop, sock);
+    done = true;
+    if (recorder)
+        recorder->record(FE_STATE, flight_id, 0, FS_HANDED_OFF);
+    int fd = sock;
+    sock = -1;
+    return fd;
+}
+
+void Session::cancel(const char *reason) {
+    if (done)
+        return;
+    if (connected)
+        send_error(ERR_UNDEFINED, reason);
+    finish(false, reason);
+}
+
+void Session::negotiated(const TransferOptions &granted) {
+    opts = granted;
+    packet.resize(4 + (size_t)opts.blksize + 1);
+    if (recorder)
+        recorder->record(FE_STATE, flight_id, 0, FS_NEGOTIATED);
+}
+
+bool Session::accept_options() {
+    if (!on_negotiated || on_negotiated(*this))
+        return true;
+    send_error(ERR_OPTION, "Transfer cancelled");
+    finish(false, "Resume prefix mismatch");
+    return false;
+}
+
+void Session::on_readable() {
+    while (!done) {
+        struct sockaddr_in from{};
+        ssize_t n = net->receive(sock, packet.data(), packet.size(), &from);
+        if (n < 0) {
+            // ICMP port unreachable: the peer has closed its TID, nobody will ACK
+            if (errno == ECONNREFUSED && connected)
+                finish(false, "Peer went away");
+            break;
+        }
+        if (!connected) {
+            // first reply: the server answers from a fresh port, which becomes its TID
+            if (from.sin_addr.s_addr != peer.sin_addr.s_addr)
+                continue;
+            peer = from;
+            net->connect(sock, peer);
+            connected = true;
+        }
+        if (n < 4)
+            continue;
+        if (recorder)
+            recorder->record(FE_RX, flight_id, packet[1] == OACK ? 0 : get_u16(packet.data() + 2),
+                             (uint8_t)packet[1]);
+        if (get_u16(packet.data()) == ERROR) {
+            if (metrics)
+                metrics->errors_received.add();
+            packet[(size_t)n - 1] = '\0';
+            peer_code = get_u16(packet.data() + 2);
+            finish(false, n > 4 ? packet.data() + 4 : "Error from peer");
+            break;
+        }
+        events.deliver(SessionEvent{packet.data(), (size_t)n});
+    }
+}
+
+// ---- sending ----
+
+SendSession::SendSession(EventLoop &loop, int sock, const struct sockaddr_in &peer,
+                         const TransferOptions &opts, const SessionLimits &limits,
+                         std::unique_ptr<ImageSource> source, bool netascii)
+    : Session(loop, sock, peer, opts, limits), source(std::move(source)), netascii(netascii) {
+    size_ring();
+}
+
+SendSession::~SendSession() {
+    if (scheduler)
+        scheduler->forget(*this);
+    if (pool)
+        for (auto &slot : ring)
+            pool->give(std::move(slot));
+}
+
+void SendSession::size_ring() {
+    if (pool) {
+        for (auto &slot : ring)
+            pool->give(std::move(slot));
+        ring.resize(opts.windowsize);
+        for (auto &slot : ring)
+            slot = pool->take(4 + (size_t)opts.blksize);
+    } else {
+        ring.assign(opts.windowsize, std::vector<char>(4 + (size_t)opts.blksize));
+    }
+    ring_len.assign(opts.windowsize, 0);
+    ring_sent_ns.assign(opts.windowsize, 0);
+    offset = opts.has_offset ? opts.offset : 0;
+    end = opts.has_length ? offset + opts.length : UINT64_MAX;
+}
+
+void SendSession::negotiated(const TransferOptions &granted) {
+    Session::negotiated(granted);
+    size_ring();
+}
+
+void SendSession::use_storage(StoragePool &storage_pool, size_t hint) {
+    Session::use_storage(storage_pool, hint);
+    source->use_storage(storage_pool, hint);
+}
+
+void SendSession::begin(const std::vector<char> &oack_packet) {
+    attach();
+    oack = oack_packet;
+    flow = run();
+}
+
+void SendSession::request(const std::vector<char> &wrq) {
+    attach();
+    send_request(wrq);
+    flow = run();
+}
+
+int SendSession::suspend(HandoffSession &state) {
+    if (done || netascii || !pending.empty() || !oack.empty())
+        return -1;
+    state.peer = peer;
+    state.opts = opts;
+    state.size = source->size();
+    state.acked = acked;
+    state.sent = sent;
+    state.transferred = transferred;
+    return detach();
+}
+
+void SendSession::resume(const HandoffSession &state) {
+    attach();
+    acked = state.acked;
+    sent = state.sent;
+    highest_sent = state.sent;
+    transferred = state.transferred;
+    offset = (opts.has_offset ? opts.offset : 0) + acked * opts.blksize;
+    generated = acked;
+    if (source->size() != state.size) {
+        send_error(ERR_UNDEFINED, "Read error");
+        finish(false, "Read error");
+        return;
+    }
+    for (uint64_t b = acked + 1; b <= sent; b++) {
+        if (fill(b))
+            continue;
+        if (errno != EAGAIN) {
+            send_error(ERR_UNDEFINED, "Read error");
+            finish(false, "Read error");
+            return;
+        }
+        // still being decoded: the rest goes out again once it is there
+        sent = b - 1;
+        break;
+    }
+    if (last_block && acked == last_block) {
+        finish(true);
+        return;
+    }
+    // blocks the old process had not got round to sending go out now, not on a timeout
+    arm_timer();
+    flow = run();
+}
+
+bool SendSession::fill(uint64_t block) {
+    std::vector<char> &slot = ring[block % opts.windowsize];
+    char *data = slot.data() + 4;
+    size_t len = 0;
+    // where the block starts in the source, staged bytes not yet encoded included
+    uint64_t from = offset - (staged.size() - staged_pos);
+    int from_carry = carry;
+    auto unavailable = [&] {
+        offset = from;
+        carry = from_carry;
+        staged.clear();
+        staged_pos = 0;
+        errno = EAGAIN;
+        return false;
+    };
+    if (!netascii) {
+        ssize_t n = 0;
+        while (len < opts.blksize && offset < end) {
+            size_t want = (size_t)std::min<uint64_t>(opts.blksize - len, end - offset);
+            n = source->read_at(offset, data + len, want);
+            if (n <= 0)
+                break;
+            len += (size_t)n;
+            offset += (uint64_t)n;
+        }
+        if (n < 0)
+            return errno == EAGAIN ? unavailable() : false;
+    } else {
+        while (len < opts.blksize) {
+            if (staged_pos == staged.size()) {
+                staged.resize(opts.blksize);
+                ssize_t n = source->read_at(offset, staged.data(), staged.size());
+                if (n < 0)
+                    return errno == EAGAIN ? unavailable() : false;
+                staged.resize((size_t)n);
+                staged_pos = 0;
+                offset += (uint64_t)n;
+                if (n == 0 && carry < 0)
+                    break;
+            }
+            size_t used = 0;
+            len += netascii_encode(staged.data() + staged_pos, staged.size() - staged_pos, used,
+                                   data + len, opts.blksize - len, carry);
+            staged_pos += used;
+        }
+    }
+    build_data_header(slot.data(), (uint16_t)block);
+    ring_len[block % opts.windowsize] = 4 + len;
+    generated = block;
+    if (len < opts.blksize)
+        last_block = block;
+    return true;
+}
+
+bool SendSession::window_open() const {
+    // blocks already in the ring can go again while the source catches up
+    return sent < acked + opts.windowsize && (last_block == 0 || sent < last_block) &&
+           (!starved || sent < generated);
+}
+
+void SendSession::starve() {
+    // with nothing in flight the client just waits; that is no timeout of ours
+    if (sent > acked) {
+        arm_timer();
+    } else if (timer) {
+        loop.cancel_timer(timer);
+        timer = 0;
+    }
+    if (starved)
+        return;
+    starved = true;
+    source->when_readable(loop, [this] {
+        starved = false;
+        if (!done)
+            send_window();
+    });
+}
+
+bool SendSession::send_block() {
+    uint64_t block = sent + 1;
+    if (block > generated && !fill(block)) {
+        if (errno == EAGAIN) {
+            starve();
+            return false;
+        }
+        send_error(ERR_UNDEFINED, "Read error");
+        finish(false, "Read error");
+        return false;
+    }
+    size_t slot = block % opts.windowsize;
+    send_packet(ring[slot].data(), ring_len[slot]);
+    sent = block;
+    if (block <= highest_sent)
+        note_retransmit(block);
+    if (metrics) {
+        if (block > highest_sent) {
+            ring_sent_ns[slot] = metrics_now_ns();
+            if (block == 1)
+                metrics->first_data.record((ring_sent_ns[slot] - started_ns) / 1000);
+        } else {
+            ring_sent_ns[slot] = 0;  // Karn: an ACK for a resent block says nothing about RTT
+        }
+    }
+    highest_sent = std::max(highest_sent, block);
+    return true;
+}
+
+void SendSession::send_window() {
+    if (scheduler) {
+        // the blocks go out on this session's turn; with nothing in flight there is
+        // nothing for the peer to lose, so waiting for that turn is not a timeout
+        if (sent == acked && timer) {
+            loop.cancel_timer(timer);
+            timer = 0;
+        }
+        if (window_open())
+            scheduler->wake(*this);
+        return;
+    }
+    while (window_open())
+        if (!send_block())
+            return;
+    if (starved)
+        starve();  // only what is in flight is timed
+    else
+        arm_timer();
+}
+
+void SendSession::use_scheduler(FairScheduler &worker_scheduler, std::shared_ptr<TokenBucket> limit) {
+    scheduler = &worker_scheduler;
+    client_limit = std::move(limit);
+}
+
+size_t SendSession::next_block_bytes() const {
+    if (done || !oack.empty() || !pending.empty() || !window_open())
+        return 0;
+    uint64_t block = sent + 1;
+    return block <= generated ? ring_len[block % opts.windowsize] : 4 + (size_t)opts.blksize;
+}
+
+uint64_t SendSession::send_burst(uint64_t budget) {
+    uint64_t used = 0;
+    size_t next;
+    while ((next = next_block_bytes()) != 0 && used + next <= budget) {
+        if (!send_block())
+            return used;
+        used += ring_len[sent % opts.windowsize];
+    }
+    if (used)
+        arm_timer();
+    return used;
+}
+
+Flow SendSession::run() {
+    if (!pending.empty()) {
+        // client put: the WRQ is answered by an OACK or by ACK 0 without options
+        TransferOptions granted;
+        for (;;) {
+            SessionEvent e = co_await events.next();
+            granted = TransferOptions();
+            if (e.timeout())
+                continue;  // the request is resent by the session
+            uint16_t op = get_u16(e.buf);
+            if (op == OACK ? parse_oack(e.buf, e.len, granted) : op == ACK && get_u16(e.buf + 2) == 0)
+                break;
+        }
+        negotiated(granted);
+        pending.clear();
+        retries = 0;
+        if (!accept_options())
+            co_return;
+    } else if (!oack.empty()) {
+        // server: the OACK goes out until the client's ACK 0 for it
+        send_packet(oack.data(), oack.size());
+        arm_timer();
+        for (;;) {
+            SessionEvent e = co_await events.next();
+            if (!e.timeout()) {
+                if (get_u16(e.buf) == ACK && get_u16(e.buf + 2) == 0)
+                    break;
+                continue;
+            }
+            send_packet(oack.data(), oack.size());
+            note_retransmit(0);
+            arm_timer();
+        }
+        oack.clear();
+        if (recorder)
+            recorder->record(FE_STATE, flight_id, 0, FS_NEGOTIATED);
+        retries = 0;
+    }
+
+    send_window();
+    while (!done) {
+        SessionEvent e = co_await events.next();
+        if (e.timeout()) {
+            // go back to the last block the peer has
+            sent = acked;
+            send_window();
+            continue;
+        }
+        if (get_u16(e.buf) != ACK)
+            continue;
+        uint16_t n = get_u16(e.buf + 2);
+        // widen the 16 bit block number around what is in flight (it wraps past 65535)
+        uint64_t block = acked + (uint16_t)(n - (uint16_t)acked);
+        if (block <= acked || block > sent)
+            continue;  // duplicate or stale, never retransmit on these (Sorcerer's Apprentice)
+        uint64_t before = transferred;
+        for (uint64_t b = acked + 1; b <= block; b++)
+            transferred += ring_len[b % opts.windowsize] - 4;
+        if (metrics) {
+            metrics->bytes_sent.add(transferred - before);
+            uint64_t sent_ns = ring_sent_ns[block % opts.windowsize];
+            if (sent_ns)
+                metrics->block_rtt.record_since(sent_ns);
+        }
+        acked = block;
+        retries = 0;
+        if (last_block && acked == last_block) {
+            finish(true);
+            co_return;
+        }
+        // an ACK short of the window edge means the peer saw a hole: go back
+        if (acked < sent)
+            sent = acked;
+        send_window();
+    }
+}
+
+// ---- receiving ----
+
+ReceiveSession::ReceiveSession(EventLoop &loop, int sock, const struct sockaddr_in &peer,
+                               const TransferOptions &opts, const SessionLimits &limits,
+                               std::unique_ptr<ImageSink> sink, bool netascii)
+    : Session(loop, sock, peer, opts, limits), sink(std::move(sink)), netascii(netascii) {}
+
+ReceiveSession::~ReceiveSession() {
+    if (!succeeded && sink)
+        sink->abort();
+}
+
+void ReceiveSession::begin(const std::vector<char> &oack) {
+    attach();
+    if (oack.empty()) {
+        char ack[4];
+        send_reply(ack, build_ack(ack, 0));
+    } else {
+        send_reply(oack.data(), oack.size());
+    }
+    flow = run();
+}
+
+void ReceiveSession::request(const std::vector<char> &rrq, bool probe_only) {
+    probe = probe_only;
+    attach();
+    send_request(rrq);
+    flow = run();
+}
+
+int ReceiveSession::suspend(HandoffSession &state) {
+    if (done || committing || netascii || !pending.empty())
+        return -1;
+    state.peer = peer;
+    state.opts = opts;
+    state.acked = received;
+    state.transferred = transferred;
+    state.in_window = in_window;
+    state.reply = reply;
+    sink.reset();
+    return detach();
+}
+
+void ReceiveSession::resume(const HandoffSession &state) {
+    attach();
+    received = state.acked;
+    transferred = state.transferred;
+    in_window = state.in_window;
+    reply = state.reply;
+    arm_timer();
+    flow = run();
+}
+
+void ReceiveSession::send_reply(const char *buf, size_t len) {
+    reply.assign(buf, buf + len);
+    send_packet(buf, len);
+    arm_timer();
+}
+
+void ReceiveSession::commit_on_pool() {
+    // the sender waits for the final ACK meanwhile, resending the last DATA; that
+    // is no timeout of ours
+    if (timer) {
+        loop.cancel_timer(timer);
+        timer = 0;
+    }
+    committing = true;
+    if (metrics)
+        metrics->storage_jobs.add();
+    // the job owns the sink while it runs; it comes back, and is freed, on the loop
+    auto held = std::make_shared<std::unique_ptr<ImageSink>>(std::move(sink));
+    storage->run(loop, storage_hint, [held] { return (*held)->commit(); },
+                 [this, held, token = std::weak_ptr<bool>(alive)](bool ok) {
+                     std::unique_ptr<ImageSink> back = std::move(*held);
+                     if (token.expired())
+                         return;
+                     sink = std::move(back);
+                     committing = false;
+                     committed.deliver(ok);
+                 });
+}
+
+void ReceiveSession::fail_write() {
+    send_error(ERR_DISK_FULL, "Disk full or write error");
+    finish(false, "Disk full or write error");
+}
+
+Flow ReceiveSession::run() {
+    SessionEvent e;
+    bool held = false;  // e is DATA 1, which answered the RRQ
+    if (!pending.empty()) {
+        // client get: the RRQ is answered by an OACK or straight away by DATA 1
+        TransferOptions granted;
+        uint16_t op = 0;
+        for (;;) {
+            e = co_await events.next();
+            granted = TransferOptions();
+            if (e.timeout())
+                continue;  // the request is resent by the session
+            op = get_u16(e.buf);
+            if (op == OACK ? parse_oack(e.buf, e.len, granted) : op == DATA)
+                break;
+        }
+        negotiated(granted);
+        pending.clear();
+        retries = 0;
+        if (!accept_options())
+            co_return;
+        if (probe) {
+            send_error(ERR_UNDEFINED, "Transfer cancelled");
+            finish(true);
+            co_return;
+        }
+        if (op == OACK) {
+            char ack[4];
+            send_reply(ack, build_ack(ack, 0));
+        } else {
+            held = true;
+        }
+    }
+
+    for (;;) {
+        if (!held)
+            e = co_await events.next();
+        held = false;
+        if (e.timeout()) {
+            // the sender goes back to whatever the last ACK says
+            in_window = 0;
+            send_packet(reply.data(), reply.size());
+            note_retransmit(received);
+            arm_timer();
+            continue;
+        }
+        if (get_u16(e.buf) != DATA)
+            continue;
+        size_t payload = e.len - 4;
+        if (payload > opts.blksize)
+            continue;
+        uint16_t n = get_u16(e.buf + 2);
+        if (n != (uint16_t)(received + 1)) {
+            // out of order: one ACK of the last good block makes the sender go back
+            if (!gap_acked) {
+                char ack[4];
+                send_reply(ack, build_ack(ack, (uint16_t)received));
+                gap_acked = true;
+                in_window = 0;
+            }
+            continue;
+        }
+        const char *data = e.buf + 4;
+        size_t data_len = payload;
+        if (netascii) {
+            decoded.resize(payload + 1);
+            data_len = netascii_decode(data, payload, decoded.data(), cr_pending);
+            data = decoded.data();
+        }
+        if (!sink->write(data, data_len)) {
+            fail_write();
+            co_return;
+        }
+        received++;
+        transferred += data_len;
+        if (metrics) {
+            metrics->bytes_received.add(data_len);
+            if (received == 1)
+                metrics->first_data.record_since(started_ns);
+        }
+        retries = 0;
+        gap_acked = false;
+        bool last = payload < opts.blksize;
+        // commit before the final ACK so the sender only sees success once it is durable
+        if (last) {
+            bool ok = !netascii || !cr_pending || sink->write("\r", 1);
+            if (ok && storage) {
+                commit_on_pool();
+                ok = co_await committed.next();
+                if (done)
+                    co_return;  // cancelled meanwhile
+            } else if (ok) {
+                ok = sink->commit();
+            }
+            if (!ok) {
+                fail_write();
+                co_return;
+            }
+            sink->committed();
+        }
+        if (last || ++in_window >= opts.windowsize) {
+            char ack[4];
+            send_reply(ack, build_ack(ack, (uint16_t)received));
+            in_window = 0;
+        }
+        if (last) {
+            finish(true);
+            if (dally) {
+                dally->add(*net, sock, reply, 2 * timeout_ms());
+                sock = -1;
+            }
+            co_return;
+        }
+    }
+}
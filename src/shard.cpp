@@ -0,0 +1,196 @@
+#include "../includes/shard.hpp"
+#include "../includes/hash.hpp"
+#include "../includes/protocal.hpp"
+
+#include <algorithm>
+
+ShardRing::ShardRing(const std::vector<std::string> &shards, int points) : count(shards.size()) {
+    for (size_t i = 0; i < shards.size(); i++) {
+        for (int p = 0; p < points; p++) {
+            std::string point = shards[i] + "#" + std::to_string(p);
+            ring.emplace_back(hash128(point.data(), point.size()).lo, (uint32_t)i);
+        }
+    }
+    std::sort(ring.begin(), ring.end());
+}
+
+size_t ShardRing::owner(const std::string &filename) const {
+    if (ring.empty())
+        return 0;
+    // "/pxelinux.0" and "pxelinux.0" are one file to the backends, see ImageStore::path_for
+    size_t skip = filename.find_first_not_of('/');
+    const char *name = filename.data() + (skip == std::string::npos ? filename.size() : skip);
+    uint64_t h = hash128(name, (size_t)(filename.data() + filename.size() - name)).lo;
+    auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(h, (uint32_t)0));
+    return (it == ring.end() ? ring.front() : *it).second;
+}
+
+struct ShardProxy::Relay {
+    uint64_t key;
+    struct sockaddr_in shard;       // the backend's port until its TID is known
+    int front = -1;                 // connected to the client
+    int back = -1;                  // to the backend, connected once it has answered
+    std::vector<char> request;      // resent until the backend answers
+    bool answered = false;
+    int retries = 0;
+    uint64_t timer = 0;
+    uint64_t last_ms = 0;           // when a datagram last passed
+    uint32_t timeout_ms = 0;        // the peers', from the OACK when they negotiated one
+    uint16_t blksize = SIZE;
+    int32_t last_block = -1;        // the short DATA's block, -1 until one has passed
+    bool ended = false;
+};
+
+ShardProxy::ShardProxy(EventLoop &loop, DatagramNet &net, std::vector<struct sockaddr_in> shards,
+                       const SessionLimits &limits, WorkerMetrics &metrics)
+    : loop(loop), net(net), shards(std::move(shards)), limits(limits), metrics(metrics), buf(MAX_BLKSIZE + 4) {}
+
+ShardProxy::~ShardProxy() {
+    for (auto &it : relays) {
+        Relay &r = *it.second;
+        loop.cancel_timer(r.timer);
+        net.unwatch(loop, r.front);
+        net.unwatch(loop, r.back);
+        net.close(r.front);
+        net.close(r.back);
+    }
+}
+
+int ShardProxy::open_socket(const struct sockaddr_in *peer) {
+    int fd = net.open();
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = 0;
+    if (net.bind(fd, local) < 0 || (peer && net.connect(fd, *peer) < 0)) {
+        net.close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool ShardProxy::forward(const struct sockaddr_in &client, const char *data, size_t len, size_t shard) {
+    uint64_t key = (uint64_t)client.sin_addr.s_addr << 16 | client.sin_port;
+    if (relays.count(key))
+        return true;
+    int front = open_socket(&client);
+    int back = front < 0 ? -1 : open_socket(nullptr);
+    if (back < 0) {
+        if (front >= 0)
+            net.close(front);
+        return false;
+    }
+    auto relay = std::make_unique<Relay>();
+    Relay &r = *relay;
+    r.key = key;
+    r.shard = shards[shard];
+    r.front = front;
+    r.back = back;
+    r.request.assign(data, data + len);
+    r.last_ms = loop.now();
+    r.timeout_ms = limits.timeout_ms;
+    relays.emplace(key, std::move(relay));
+    net.watch(loop, front, [this, &r] { from_client(r); });
+    net.watch(loop, back, [this, &r] { from_shard(r); });
+    net.send_to(back, data, len, &r.shard);
+    metrics.shard_requests[shard].add();
+    r.timer = loop.add_timer(r.timeout_ms, [this, &r] { check(r); });
+    return true;
+}
+
+void ShardProxy::from_client(Relay &r) {
+    for (;;) {
+        ssize_t n = net.receive(r.front, buf.data(), buf.size(), nullptr);
+        if (n < 0)
+            return;
+        // the client cannot know this TID before the backend's first reply reaches it
+        if (!r.answered)
+            continue;
+        watch_for_end(r, (size_t)n);
+        net.send_to(r.back, buf.data(), (size_t)n, nullptr);
+        r.last_ms = loop.now();
+    }
+}
+
+void ShardProxy::from_shard(Relay &r) {
+    for (;;) {
+        struct sockaddr_in from{};
+        ssize_t n = net.receive(r.back, buf.data(), buf.size(), &from);
+        if (n < 0)
+            return;
+        if (!r.answered) {
+            // the backend answers from a port of its own, that is its TID from now on
+            if (from.sin_addr.s_addr != r.shard.sin_addr.s_addr)
+                continue;
+            r.answered = true;
+            r.shard = from;
+            net.connect(r.back, from);
+            std::vector<char>().swap(r.request);
+        }
+        watch_for_end(r, (size_t)n);
+        net.send_to(r.front, buf.data(), (size_t)n, nullptr);
+        r.last_ms = loop.now();
+    }
+}
+
+void ShardProxy::watch_for_end(Relay &r, size_t len) {
+    if (len < 4)
+        return;
+    switch (get_u16(buf.data())) {
+    case OACK: {
+        TransferOptions opts;
+        if (parse_oack(buf.data(), len, opts)) {
+            r.blksize = opts.blksize;
+            if (opts.timeout)
+                r.timeout_ms = opts.timeout * 1000u;
+        }
+        break;
+    }
+    case DATA:
+        if (len - 4 < r.blksize)
+            r.last_block = get_u16(buf.data() + 2);
+        break;
+    case ACK:
+        if (r.last_block >= 0 && get_u16(buf.data() + 2) == (uint16_t)r.last_block)
+            r.ended = true;
+        break;
+    case ERROR:
+        r.ended = true;
+        break;
+    }
+}
+
+void ShardProxy::check(Relay &r) {
+    if (!r.answered) {
+        // give up at half the retries, so the ERROR reaches a client still waiting for it
+        if (++r.retries > limits.max_retries / 2) {
+            char out[64];
+            net.send_to(r.front, out, build_error(out, sizeof(out), ERR_UNDEFINED, "Shard not responding"), nullptr);
+            metrics.shard_unanswered.add();
+            close(r);
+            return;
+        }
+        net.send_to(r.back, r.request.data(), r.request.size(), &r.shard);
+    } else {
+        // past the end, stay a while for the last DATA or ACK being sent again; otherwise
+        // both ends have given up by the time they have been silent for all their retries
+        uint64_t idle = loop.now() - r.last_ms;
+        if ((r.ended && idle >= 2ull * r.timeout_ms) ||
+            idle >= (uint64_t)r.timeout_ms * (uint64_t)(limits.max_retries + 1)) {
+            close(r);
+            return;
+        }
+    }
+    r.timer = loop.add_timer(r.timeout_ms, [this, &r] { check(r); });
+}
+
+void ShardProxy::close(Relay &r) {
+    loop.cancel_timer(r.timer);
+    net.unwatch(loop, r.front);
+    net.unwatch(loop, r.back);
+    net.close(r.front);
+    net.close(r.back);
+    relays.erase(r.key);
+}
@@ -0,0 +1,339 @@
+#include "../includes/sim_net.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+SimNet::SimNet(const LinkParams &link, uint64_t seed) : default_link(link), rng(seed) {}
+
+SimNet::~SimNet() {
+    // loops outlive us in some tests; make sure none keeps calling into a dead clock
+    for (auto &l : loops)
+        l.first->use_clock(nullptr);
+}
+
+SimNet::Host &SimNet::host(const std::string &ip) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip.c_str(), &addr) != 1)
+        throw std::runtime_error("bad simulated host address " + ip);
+    auto &h = hosts[addr.s_addr];
+    if (!h)
+        h.reset(new Host(*this, addr.s_addr));
+    return *h;
+}
+
+void SimNet::set_link(const std::string &from, const std::string &to, const LinkParams &params) {
+    links[{host(from).ip, host(to).ip}].params = params;
+}
+
+double SimNet::uniform() {
+    // top 53 bits, the same on every platform unlike std::uniform_real_distribution
+    return (double)(rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+SimNet::Link &SimNet::link(uint32_t from, uint32_t to) {
+    auto it = links.find({from, to});
+    if (it == links.end())
+        it = links.emplace(std::make_pair(from, to), Link{default_link, 0}).first;
+    return it->second;
+}
+
+bool SimNet::port_in_use(uint32_t host, uint16_t port) const {
+    for (auto &s : sockets)
+        if (s.second.host == host && s.second.port == port)
+            return true;
+    return false;
+}
+
+ssize_t SimNet::send(int sock, const char *buf, size_t len, const struct sockaddr_in *to) {
+    auto it = sockets.find(sock);
+    if (it == sockets.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    Socket &s = it->second;
+    if (!to) {
+        if (!s.connected) {
+            errno = EDESTADDRREQ;
+            return -1;
+        }
+        to = &s.peer;
+    }
+    if (s.port == 0) {
+        // implicit bind, as the kernel does on the first send
+        while (port_in_use(s.host, next_port))
+            next_port = next_port == 65535 ? 49152 : next_port + 1;
+        s.port = next_port++;
+    }
+    counters.sent++;
+    Packet p;
+    p.from.sin_family = AF_INET;
+    p.from.sin_addr.s_addr = s.ip ? s.ip : s.host;
+    p.from.sin_port = htons(s.port);
+    p.to = *to;
+    p.data.assign(buf, len);
+
+    uint32_t dest = to->sin_addr.s_addr;
+    if (dest == htonl(INADDR_LOOPBACK))
+        dest = s.host;
+    Link &l = link(s.host, dest);
+    const LinkParams &lp = l.params;
+    if (lp.loss > 0 && uniform() < lp.loss) {
+        counters.lost++;
+        return (ssize_t)len;
+    }
+    // serialisation on the bottleneck, queueing behind what is already on the wire
+    uint64_t start = std::max(clock_us, l.busy_until_us);
+    if (lp.bandwidth_bps) {
+        uint64_t backlog = (start - clock_us) * lp.bandwidth_bps / 8000000;
+        if (lp.queue_bytes && backlog + len > lp.queue_bytes) {
+            counters.queue_drops++;
+            return (ssize_t)len;
+        }
+        l.busy_until_us = start + ((uint64_t)len + 28) * 8000000 / lp.bandwidth_bps;  // + IP/UDP headers
+        start = l.busy_until_us;
+    }
+    p.at_us = start + lp.latency_us;
+    if (lp.jitter_us)
+        p.at_us += (uint64_t)(uniform() * lp.jitter_us);
+    if (lp.reorder > 0 && uniform() < lp.reorder) {
+        counters.reordered++;
+        p.at_us += lp.reorder_us;
+    }
+    if (lp.duplicate > 0 && uniform() < lp.duplicate) {
+        counters.duplicated++;
+        Packet copy = p;
+        copy.seq = next_seq++;
+        copy.at_us += 1 + (lp.jitter_us ? (uint64_t)(uniform() * lp.jitter_us) : 0);
+        in_flight.push(std::move(copy));
+    }
+    p.seq = next_seq++;
+    in_flight.push(std::move(p));
+    return (ssize_t)len;
+}
+
+void SimNet::deliver(Packet &p) {
+    uint32_t dest = p.to.sin_addr.s_addr;
+    uint16_t port = ntohs(p.to.sin_port);
+    uint32_t src_host = p.from.sin_addr.s_addr;
+    if (dest == htonl(INADDR_LOOPBACK))
+        dest = src_host;
+    // connected sockets win over wildcard ones, as in the kernel
+    int target = -1;
+    std::vector<int> group;
+    for (auto &entry : sockets) {
+        const Socket &s = entry.second;
+        if (s.host != dest || s.port != port || (s.ip && s.ip != dest))
+            continue;
+        if (s.connected) {
+            if (s.peer.sin_addr.s_addr == p.from.sin_addr.s_addr && s.peer.sin_port == p.from.sin_port) {
+                target = entry.first;
+                break;
+            }
+            continue;
+        }
+        group.push_back(entry.first);
+    }
+    if (target < 0 && !group.empty()) {
+        // SO_REUSEPORT: spread by source, with a fixed order so the choice is reproducible
+        std::sort(group.begin(), group.end());
+        uint32_t h = p.from.sin_addr.s_addr * 2654435761u ^ (uint32_t)p.from.sin_port * 40503u;
+        target = group[h % group.size()];
+    }
+    if (target < 0) {
+        counters.unreachable++;
+        return;
+    }
+    Socket &s = sockets[target];
+    if (s.queue.size() >= 512) {
+        counters.queue_drops++;
+        return;
+    }
+    counters.delivered++;
+    s.queue.emplace_back(p.from, std::move(p.data));
+    if (s.readable) {
+        std::function<void()> cb = s.readable;  // the callback may unwatch or close
+        cb();
+    }
+}
+
+void SimNet::watch(EventLoop &loop, int sock, std::function<void()> readable) {
+    auto it = sockets.find(sock);
+    if (it == sockets.end())
+        return;
+    it->second.loop = &loop;
+    it->second.readable = std::move(readable);
+    auto l = std::find_if(loops.begin(), loops.end(), [&](const std::pair<EventLoop *, int> &e) { return e.first == &loop; });
+    if (l == loops.end()) {
+        loop.use_clock([this] { return clock_us / 1000; });
+        loops.emplace_back(&loop, 1);
+    } else {
+        l->second++;
+    }
+}
+
+void SimNet::unwatch(EventLoop &loop, int sock) {
+    auto it = sockets.find(sock);
+    if (it == sockets.end() || it->second.loop != &loop)
+        return;
+    it->second.loop = nullptr;
+    it->second.readable = nullptr;
+    auto l = std::find_if(loops.begin(), loops.end(), [&](const std::pair<EventLoop *, int> &e) { return e.first == &loop; });
+    if (l != loops.end() && --l->second == 0)
+        loops.erase(l);
+}
+
+void SimNet::close(int sock) {
+    auto it = sockets.find(sock);
+    if (it == sockets.end())
+        return;
+    if (it->second.loop)
+        unwatch(*it->second.loop, sock);
+    sockets.erase(sock);
+}
+
+bool SimNet::run_once(EventLoop *driver) {
+    std::vector<EventLoop *> active;
+    for (auto &l : loops)
+        active.push_back(l.first);
+    if (driver && std::find(active.begin(), active.end(), driver) == active.end()) {
+        driver->use_clock([this] { return clock_us / 1000; });
+        active.push_back(driver);
+    }
+    for (EventLoop *loop : active)
+        loop->run_once(0);
+    // anything runnable right now goes first; only advance the clock once all are idle
+    uint64_t next = in_flight.empty() ? UINT64_MAX : in_flight.top().at_us;
+    for (EventLoop *loop : active) {
+        if (loop->has_posted())
+            return true;
+        uint64_t deadline = loop->next_deadline();
+        if (deadline != UINT64_MAX) {
+            if (deadline * 1000 <= clock_us)
+                return true;
+            next = std::min(next, deadline * 1000);
+        }
+    }
+    if (next == UINT64_MAX)
+        return false;
+    clock_us = std::max(clock_us, next);
+    while (!in_flight.empty() && in_flight.top().at_us <= clock_us) {
+        Packet p = in_flight.top();
+        in_flight.pop();
+        deliver(p);
+    }
+    return true;
+}
+
+void SimNet::run_until(const std::function<bool()> &done, EventLoop *driver) {
+    while (!done() && run_once(driver)) {}
+}
+
+// ---- Host ----
+
+int SimNet::Host::open() {
+    int sock = net.next_socket++;
+    Socket s;
+    s.host = ip;
+    net.sockets.emplace(sock, std::move(s));
+    return sock;
+}
+
+int SimNet::Host::bind(int sock, const struct sockaddr_in &addr, bool reuse_port) {
+    auto it = net.sockets.find(sock);
+    if (it == net.sockets.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    uint32_t want = addr.sin_addr.s_addr;
+    if (want != htonl(INADDR_ANY) && want != ip && want != htonl(INADDR_LOOPBACK)) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+    uint16_t port = ntohs(addr.sin_port);
+    if (port == 0) {
+        while (net.port_in_use(ip, net.next_port))
+            net.next_port = net.next_port == 65535 ? 49152 : net.next_port + 1;
+        port = net.next_port++;
+    } else {
+        for (auto &s : net.sockets) {
+            if (s.first != sock && s.second.host == ip && s.second.port == port &&
+                !(reuse_port && s.second.reuse_port)) {
+                errno = EADDRINUSE;
+                return -1;
+            }
+        }
+    }
+    it->second.ip = want == htonl(INADDR_ANY) ? 0 : ip;
+    it->second.port = port;
+    it->second.reuse_port = reuse_port;
+    return 0;
+}
+
+int SimNet::Host::local_address(int sock, struct sockaddr_in &addr) {
+    auto it = net.sockets.find(sock);
+    if (it == net.sockets.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = it->second.ip;
+    addr.sin_port = htons(it->second.port);
+    return 0;
+}
+
+int SimNet::Host::connect(int sock, const struct sockaddr_in &peer) {
+    auto it = net.sockets.find(sock);
+    if (it == net.sockets.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    it->second.connected = true;
+    it->second.peer = peer;
+    if (peer.sin_addr.s_addr == htonl(INADDR_LOOPBACK))
+        it->second.peer.sin_addr.s_addr = ip;
+    return 0;
+}
+
+ssize_t SimNet::Host::send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) {
+    return net.send(sock, buf, len, to);
+}
+
+ssize_t SimNet::Host::receive(int sock, char *buf, size_t cap, struct sockaddr_in *from) {
+    auto it = net.sockets.find(sock);
+    if (it == net.sockets.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    auto &queue = it->second.queue;
+    if (queue.empty()) {
+        errno = EAGAIN;
+        return -1;
+    }
+    // datagram semantics: whatever does not fit in cap is lost
+    size_t n = std::min(cap, queue.front().second.size());
+    memcpy(buf, queue.front().second.data(), n);
+    if (from)
+        *from = queue.front().first;
+    queue.pop_front();
+    return (ssize_t)n;
+}
+
+void SimNet::Host::close(int sock) {
+    net.close(sock);
+}
+
+void SimNet::Host::watch(EventLoop &loop, int sock, std::function<void()> readable) {
+    net.watch(loop, sock, std::move(readable));
+}
+
+void SimNet::Host::unwatch(EventLoop &loop, int sock) {
+    net.unwatch(loop, sock);
+}
+
+void SimNet::Host::run_once(EventLoop &loop) {
+    net.run_once(&loop);
+}
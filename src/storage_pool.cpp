@@ -0,0 +1,83 @@
+#include "../includes/storage_pool.hpp"
+
+#include <algorithm>
+
+StoragePool::StoragePool(size_t threads) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads; i++)
+        deques.push_back(std::make_unique<Deque>());
+    for (size_t i = 0; i < threads; i++)
+        workers.emplace_back([this, i] { work(i); });
+}
+
+StoragePool::~StoragePool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &t : workers)
+        t.join();
+}
+
+void StoragePool::submit(size_t hint, Job job) {
+    Deque &d = *deques[hint % deques.size()];
+    {
+        std::lock_guard<std::mutex> lock(d.mutex);
+        d.jobs.push_back(std::move(job));
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+StoragePool::Stats StoragePool::stats() const {
+    Stats s;
+    s.jobs = jobs_run.load(std::memory_order_relaxed);
+    s.stolen = jobs_stolen.load(std::memory_order_relaxed);
+    return s;
+}
+
+bool StoragePool::take(size_t self, Job &job) {
+    {
+        Deque &own = *deques[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.jobs.empty()) {
+            job = std::move(own.jobs.front());
+            own.jobs.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < deques.size(); i++) {
+        Deque &other = *deques[(self + i) % deques.size()];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (!other.jobs.empty()) {
+            job = std::move(other.jobs.back());
+            other.jobs.pop_back();
+            jobs_stolen.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void StoragePool::work(size_t self) {
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this] { return queued > 0 || stopping; });
+            if (queued == 0)
+                return;  // stopping, and nothing left to run
+            queued--;
+        }
+        // queued counted this job in, so some deque holds it until a thread takes it
+        Job job;
+        while (!take(self, job))
+            std::this_thread::yield();
+        job();
+        jobs_run.fetch_add(1, std::memory_order_relaxed);
+    }
+}
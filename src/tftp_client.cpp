@@ -0,0 +1,201 @@
+/*
+ * tftp_client [options] <server> get <remote> [local]
+ * tftp_client [options] <server> put <remote> [local]
+ * tftp_client [options] <server> mget <manifest>
+ * tftp_client [options] <server> mput <manifest>
+ *
+ * A manifest has one "<remote> [local]" per line; blank lines and # comments are
+ * skipped. mget/mput run up to -j transfers at a time over one event loop and finish
+ * with the aggregate throughput and per-file latency percentiles.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/client.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [-p port] [-m octet|netascii] [-b blksize] [-w windowsize]"
+              << " [-j jobs] [-s stripes] [-r] <server> get|put <remote> [local]\n"
+              << "       " << prog << " [options] <server> mget|mput <manifest>\n";
+}
+
+// A flag's value in [min, max]; false for anything else, atoi's 0 included
+static bool parse_flag(const char *arg, uint64_t min, uint64_t max, uint16_t &out) {
+    uint64_t v;
+    if (!parse_number(arg, v) || v < min || v > max)
+        return false;
+    out = (uint16_t)v;
+    return true;
+}
+
+struct Job {
+    std::string remote;
+    std::string local;
+};
+
+static bool read_manifest(const std::string &path, bool get, std::vector<Job> &jobs) {
+    std::ifstream in(path);
+    if (!in)
+        return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        Job job;
+        if (!(fields >> job.remote) || job.remote[0] == '#')
+            continue;
+        fields >> job.local;
+        if (job.local.empty())
+            job.local = get ? job.remote.substr(job.remote.rfind('/') + 1) : job.remote;
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+static double percentile(std::vector<double> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = (size_t)(p / 100.0 * (double)(sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+// Runs every job with at most `jobs` in flight, returns the number that failed
+static int run_batch(const std::string &server, const ClientOptions &options, bool get,
+                     const std::vector<Job> &manifest, int jobs) {
+    using clock = std::chrono::steady_clock;
+    EventLoop loop;
+    AsyncTFTPClient tftp(loop, server, options);
+    std::deque<size_t> queue;
+    for (size_t i = 0; i < manifest.size(); i++)
+        queue.push_back(i);
+    std::vector<double> latency_ms;
+    uint64_t total_bytes = 0;
+    int failed = 0;
+    size_t finished = 0;
+    clock::time_point begin = clock::now();
+
+    std::function<void()> launch = [&] {
+        while (!queue.empty() && tftp.active() < (size_t)jobs) {
+            const Job &job = manifest[queue.front()];
+            queue.pop_front();
+            clock::time_point started = clock::now();
+            auto done = [&, job, started](const TransferResult &r) {
+                finished++;
+                latency_ms.push_back(std::chrono::duration<double, std::milli>(clock::now() - started).count());
+                total_bytes += r.bytes;
+                if (!r.ok) {
+                    failed++;
+                    std::cerr << job.remote << ": " << r.error << "\n";
+                }
+                launch();
+            };
+            if (get) {
+                int fd = open(job.local.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fd < 0) {
+                    finished++;
+                    failed++;
+                    std::cerr << job.local << ": " << strerror(errno) << "\n";
+                    continue;
+                }
+                tftp.get(job.remote, std::unique_ptr<ImageSink>(new FileSink(fd, job.local)), done);
+            } else {
+                int fd = open(job.local.c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat st;
+                if (fd < 0 || fstat(fd, &st) < 0) {
+                    finished++;
+                    failed++;
+                    std::cerr << job.local << ": " << strerror(errno) << "\n";
+                    if (fd >= 0)
+                        close(fd);
+                    continue;
+                }
+                tftp.put(job.remote, std::unique_ptr<ImageSource>(new FileSource(fd, (uint64_t)st.st_size)), done);
+            }
+        }
+    };
+    launch();
+    while (finished < manifest.size())
+        loop.run_once();
+
+    double secs = std::chrono::duration<double>(clock::now() - begin).count();
+    std::sort(latency_ms.begin(), latency_ms.end());
+    std::printf("%zu files, %d failed, %llu bytes in %.2f s (%.1f MB/s)\n", manifest.size(), failed,
+                (unsigned long long)total_bytes, secs, secs > 0 ? (double)total_bytes / secs / 1e6 : 0.0);
+    std::printf("latency ms: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", percentile(latency_ms, 50),
+                percentile(latency_ms, 90), percentile(latency_ms, 99),
+                latency_ms.empty() ? 0.0 : latency_ms.back());
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    ClientOptions options;
+    int jobs = 32;
+    int stripes = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:b:w:j:s:r")) != -1) {
+        bool ok = true;
+        switch (opt) {
+        case 'p': ok = parse_flag(optarg, 1, 65535, options.port); break;
+        case 'm': options.mode = optarg; break;
+        case 'b': ok = parse_flag(optarg, 8, MAX_BLKSIZE, options.blksize); break;
+        case 'w': ok = parse_flag(optarg, 1, MAX_WINDOWSIZE, options.windowsize); break;
+        case 'j': jobs = std::max(1, atoi(optarg)); break;
+        case 's': stripes = std::max(1, atoi(optarg)); break;
+        case 'r': options.resume = true; break;
+        default: ok = false; break;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (argc - optind < 3) {
+        usage(argv[0]);
+        return 2;
+    }
+    std::string server = argv[optind];
+    std::string cmd = argv[optind + 1];
+    std::string remote = argv[optind + 2];
+    std::string local = argc - optind > 3 ? argv[optind + 3] : "";
+
+    try {
+        if (cmd == "mget" || cmd == "mput") {
+            std::vector<Job> manifest;
+            if (!read_manifest(remote, cmd == "mget", manifest)) {
+                std::cerr << remote << ": " << strerror(errno) << "\n";
+                return 1;
+            }
+            return run_batch(server, options, cmd == "mget", manifest, jobs) ? 1 : 0;
+        }
+        TFTPClient client(server, options);
+        bool ok;
+        if (cmd == "get")
+            ok = stripes > 1 ? client.striped_rrq(remote, local, stripes) : client.send_rrq(remote, local);
+        else if (cmd == "put")
+            ok = client.send_wrq(remote, local);
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+        if (!ok) {
+            std::cerr << remote << ": " << client.error() << "\n";
+            return 1;
+        }
+        std::printf("%llu bytes\n", (unsigned long long)client.bytes_transferred());
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
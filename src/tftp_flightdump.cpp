@@ -0,0 +1,94 @@
+/*
+ * tftp_flightdump <dump> [worker.session]
+ *
+ * Prints a flight recorder dump (TFTPServer::dump_flight or a flight-*.bin written
+ * on a failed session) one event per line, microseconds from the first event.
+*/
+
+#include "../includes/flight_recorder.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static const char *opcode_name(uint8_t op) {
+    static const char *names[] = {"?", "RRQ", "WRQ", "DATA", "ACK", "ERROR", "OACK"};
+    return op < sizeof(names) / sizeof(names[0]) ? names[op] : "?";
+}
+
+static const char *state_name(uint8_t state) {
+    switch (state) {
+    case FS_START: return "start";
+    case FS_NEGOTIATED: return "negotiated";
+    case FS_DONE_OK: return "done ok";
+    case FS_DONE_FAILED: return "done FAILED";
+    case FS_HANDED_OFF: return "handed off";
+    default: return "?";
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <dump> [worker.session]\n", argv[0]);
+        return 2;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    FlightHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, "TTFLIGHT", 8) != 0 || h.version != 1) {
+        fprintf(stderr, "%s: not a flight recorder dump\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+    // block is the ERROR code for ERROR packets and 0 for OACKs
+    std::vector<FlightEvent> events(h.count);
+    size_t got = fread(events.data(), sizeof(FlightEvent), events.size(), f);
+    fclose(f);
+    events.resize(got);
+    bool filter = argc > 2;
+    uint32_t only = 0;
+    if (filter) {
+        // "worker.n" as printed below, or the raw id
+        char *end;
+        only = (uint32_t)strtoul(argv[2], &end, 0);
+        if (*end == '.')
+            only = only << 24 | (uint32_t)strtoul(end + 1, nullptr, 0);
+    }
+
+    // TSC ticks to nanoseconds from the two calibration points in the header
+    double ns_per_tick = h.tsc1 > h.tsc0 ? (double)(h.ns1 - h.ns0) / (double)(h.tsc1 - h.tsc0) : 1.0;
+    uint64_t first = 0;
+    for (const FlightEvent &e : events) {
+        if (filter && e.session != only)
+            continue;
+        if (!first)
+            first = e.tsc;
+        printf("%12.3f  %u.%-8u ", (double)(e.tsc - first) * ns_per_tick / 1000.0, e.session >> 24,
+               e.session & 0xffffff);
+        switch (e.type) {
+        case FE_RX:
+        case FE_TX:
+            printf("%s %-5s %u\n", e.type == FE_RX ? "rx" : "tx", opcode_name(e.arg), e.block);
+            break;
+        case FE_RETRANSMIT:
+            printf("retransmit %u\n", e.block);
+            break;
+        case FE_TIMER:
+            printf("timer (retry %u)\n", e.arg);
+            break;
+        case FE_STATE:
+            if (e.arg == FS_START)
+                printf("start %s\n", opcode_name((uint8_t)e.block));
+            else
+                printf("%s\n", state_name(e.arg));
+            break;
+        default:
+            printf("unknown event %u\n", e.type);
+        }
+    }
+    return 0;
+}
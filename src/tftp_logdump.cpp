@@ -0,0 +1,136 @@
+/*
+ * tftp_logdump <access log> [client address]
+ *
+ * Prints a binary access log (tftp_server -L) one record per line, wall clock time
+ * first. With an address, only the records about that client.
+*/
+
+#include "../includes/access_log.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct ClockPoint {
+    uint64_t tsc;
+    uint64_t ns;
+};
+
+const char *opcode_name(uint8_t op) {
+    return op == 1 ? "RRQ" : op == 2 ? "WRQ" : "?";
+}
+
+// Wall clock ns for tsc, from the clock points of its process: interpolated between
+// the two around it, or extended from the nearest two at either end
+uint64_t wall_ns(const std::vector<ClockPoint> &clock, uint64_t tsc) {
+    if (clock.empty())
+        return 0;
+    if (clock.size() == 1)
+        return clock[0].ns;
+    auto it = std::upper_bound(clock.begin(), clock.end(), tsc,
+                               [](uint64_t t, const ClockPoint &p) { return t < p.tsc; });
+    size_t hi = std::min<size_t>(std::max<size_t>((size_t)(it - clock.begin()), 1), clock.size() - 1);
+    const ClockPoint &a = clock[hi - 1];
+    const ClockPoint &b = clock[hi];
+    double ns_per_tick = b.tsc > a.tsc ? (double)(b.ns - a.ns) / (double)(b.tsc - a.tsc) : 1.0;
+    return (uint64_t)((double)a.ns + ((double)tsc - (double)a.tsc) * ns_per_tick);
+}
+
+void print_time(uint64_t ns) {
+    time_t s = (time_t)(ns / 1000000000);
+    struct tm tm;
+    gmtime_r(&s, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    printf("%s.%06uZ ", buf, (unsigned)(ns % 1000000000 / 1000));
+}
+
+void print_record(const AccessRecord &r, uint64_t ns) {
+    print_time(ns);
+    if (r.type == AR_OPEN) {
+        printf("process %u opened the log\n", r.duration_us);
+        return;
+    }
+    struct in_addr addr;
+    addr.s_addr = r.addr;
+    printf("w%u %s:%u %s ", r.worker, inet_ntoa(addr), r.port, opcode_name(r.op));
+    std::string name(r.name, r.name_len);
+    if (r.flags & AF_TRUNCATED)
+        name += "...";
+    switch (r.type) {
+    case AR_REQUEST:
+        printf("%s (%s)\n", name.c_str(), r.flags & AF_NETASCII ? "netascii" : "octet");
+        break;
+    case AR_REJECTED:
+        printf("rejected with ERROR %u\n", r.code);
+        break;
+    case AR_DONE_OK:
+    case AR_DONE_FAILED:
+        printf("%s %s %llu bytes in %.3f ms, blksize %u windowsize %u\n", name.c_str(),
+               r.type == AR_DONE_OK ? "ok" : "FAILED", (unsigned long long)r.bytes, r.duration_us / 1000.0,
+               r.blksize, r.windowsize);
+        break;
+    default:
+        printf("unknown record %u\n", r.type);
+    }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <access log> [client address]\n", argv[0]);
+        return 2;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    AccessLogHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, "TTACCESS", 8) != 0 || h.version != 1 ||
+        h.record_size != sizeof(AccessRecord)) {
+        fprintf(stderr, "%s: not an access log\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+    std::vector<AccessRecord> records;
+    AccessRecord r;
+    while (fread(&r, sizeof(r), 1, f) == 1)
+        records.push_back(r);
+    fclose(f);
+    bool filter = argc > 2;
+    struct in_addr only{};
+    if (filter && inet_aton(argv[2], &only) == 0) {
+        fprintf(stderr, "%s: not an IPv4 address\n", argv[2]);
+        return 2;
+    }
+
+    // each process appending to the log starts with AR_OPEN and has its own TSC
+    // base; convert its records with its own clock points only
+    size_t begin = 0;
+    while (begin < records.size()) {
+        size_t end = begin + 1;
+        while (end < records.size() && records[end].type != AR_OPEN)
+            end++;
+        std::vector<ClockPoint> clock;
+        for (size_t i = begin; i < end; i++)
+            if (records[i].type == AR_OPEN || records[i].type == AR_CLOCK)
+                clock.push_back({records[i].tsc, records[i].bytes});
+        std::sort(clock.begin(), clock.end(), [](const ClockPoint &a, const ClockPoint &b) { return a.tsc < b.tsc; });
+        for (size_t i = begin; i < end; i++) {
+            const AccessRecord &rec = records[i];
+            if (rec.type == AR_CLOCK || (filter && (rec.type == AR_OPEN || rec.addr != only.s_addr)))
+                continue;
+            print_record(rec, rec.type == AR_OPEN ? rec.bytes : wall_ns(clock, rec.tsc));
+        }
+        begin = end;
+    }
+    return 0;
+}
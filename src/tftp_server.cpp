@@ -0,0 +1,188 @@
+/*
+ * tftp_server [-p port] [-d root] [-t workers] [-R] [-D] [-b max_blksize]
+ *             [-w max_windowsize] [-M metrics_port] [-F flight_dir] [-U upgrade_socket]
+ *             [-r rate] [-c client_rate] [-P client_prefix] [-S max_sessions]
+ *             [-s shared_sockets] [-X xdp_interface] [-C cpus] [-B busy_poll_us]
+ *             [-O storage_threads] [-L access_log] [-v] [-u upstream[:port]]
+ *             [-H shard[:port],shard[:port],...] [-f config_file]
+ *
+ * Serves root (default .) until SIGINT/SIGTERM. -R refuses WRQs, -D stores uploads
+ * in the deduplicating chunk store, -F keeps a flight recorder per worker and dumps
+ * it into flight_dir when a session fails.
+ *
+ * -r caps the server's sending at rate bytes/s, -c each client address (or
+ * /client_prefix block of addresses) at client_rate bytes/s. -S queues requests past
+ * max_sessions transfers per worker, small files first. -s serves each worker's
+ * transfers from shared_sockets sockets instead of one per transfer. -X moves their
+ * DATA and ACKs over AF_XDP on xdp_interface (needs CAP_NET_ADMIN and CAP_BPF).
+ * -C pins each worker to a CPU of cpus ("0-7,16-23", or "all" for every CPU the
+ * process may use), spread over the NUMA nodes, with its memory on its node.
+ * -B has the workers spin on their sockets for up to busy_poll_us microseconds
+ * before sleeping, for lower request latency at the cost of CPU. -O opens files,
+ * checks resumes, inflates packed images and commits uploads on storage_threads
+ * threads, so a slow disk or file server does not stall the transfers already
+ * running. -L appends a binary record of every request
+ * and transfer to access_log; read it with tftp_logdump. Without it, -v prints each
+ * request instead. -u relays: a file root does not have is fetched from the upstream
+ * server while it streams to the client, and kept in root for the next RRQ. -H makes
+ * this a front end for the listed servers: each request is relayed to the one its
+ * filename hashes to, so their caches hold disjoint shares of the images.
+ *
+ * -f reads settings from config_file (see config_file.hpp) before the other flags,
+ * which override it. SIGHUP reads it again and applies what can change live, see
+ * TFTPServer::reload(): transfers in flight keep what they negotiated, new requests
+ * get the new settings. A file that does not parse leaves the server as it was.
+ *
+ * -U upgrades without downtime: a server already running with the same path hands
+ * over its port and transfers in flight, finishes the rest and exits.
+*/
+
+#include "../includes/config_file.hpp"
+#include "../includes/server.hpp"
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <pthread.h>
+#include <thread>
+#include <unistd.h>
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [-p port] [-d root] [-t workers] [-R] [-D] [-b max_blksize]"
+              << " [-w max_windowsize] [-M metrics_port] [-F flight_dir] [-U upgrade_socket]"
+              << " [-r rate] [-c client_rate] [-P client_prefix] [-S max_sessions] [-s shared_sockets]"
+              << " [-X xdp_interface] [-C cpus] [-B busy_poll_us] [-O storage_threads] [-L access_log]"
+              << " [-v] [-u upstream[:port]] [-H shard[:port],...] [-f config_file]\n";
+}
+
+// The defaults, then config_file when there is one, then the other flags. False after
+// printing why when something does not parse
+static bool build_config(int argc, char *argv[], ServerConfig &config, std::string &config_file) {
+    config = ServerConfig();
+    config.workers = (int)std::thread::hardware_concurrency();
+    config_file.clear();
+    int opt;
+    optind = 0;  // glibc: start over, this runs again on SIGHUP
+    opterr = 0;  // the second pass reports bad flags
+    while ((opt = getopt(argc, argv, "p:d:t:RDb:w:M:F:U:r:c:P:S:s:X:C:B:O:L:vu:H:f:")) != -1)
+        if (opt == 'f')
+            config_file = optarg;
+    std::string error;
+    if (!config_file.empty() && !load_config_file(config_file, config, error)) {
+        std::cerr << error << "\n";
+        return false;
+    }
+    optind = 0;
+    opterr = 1;
+
+    while ((opt = getopt(argc, argv, "p:d:t:RDb:w:M:F:U:r:c:P:S:s:X:C:B:O:L:vu:H:f:")) != -1) {
+        switch (opt) {
+        case 'p': config.port = (uint16_t)atoi(optarg); break;
+        case 'd': config.root = optarg; break;
+        case 't': config.workers = atoi(optarg); break;
+        case 'R': config.allow_write = false; break;
+        case 'D': config.dedup = true; break;
+        case 'b': config.max_blksize = (uint16_t)atoi(optarg); break;
+        case 'w': config.max_windowsize = (uint16_t)atoi(optarg); break;
+        case 'M': config.metrics_port = atoi(optarg); break;
+        case 'F':
+            config.flight_dir = optarg;
+            config.flight_events = 1 << 16;
+            break;
+        case 'U': config.upgrade_socket = optarg; break;
+        case 'r': config.rate_limit = strtoull(optarg, nullptr, 10); break;
+        case 'c': config.client_rate_limit = strtoull(optarg, nullptr, 10); break;
+        case 'P': config.client_prefix = atoi(optarg); break;
+        case 'S': config.max_sessions = (size_t)atoi(optarg); break;
+        case 's': config.shared_sockets = atoi(optarg); break;
+        case 'X': config.xdp_interface = optarg; break;
+        case 'B': config.busy_poll_us = (uint32_t)atoi(optarg); break;
+        case 'O': config.storage_threads = (size_t)atol(optarg); break;
+        case 'L': config.access_log = optarg; break;
+        case 'v': config.log_requests = true; break;
+        case 'u': config.upstream = optarg; break;
+        case 'f': break;
+        case 'H':
+            for (std::string list = optarg; !list.empty();) {
+                size_t comma = list.find(',');
+                if (comma != 0)
+                    config.shards.push_back(list.substr(0, comma));
+                list.erase(0, comma == std::string::npos ? list.size() : comma + 1);
+            }
+            break;
+        case 'C':
+            config.pin_workers = true;
+            if (std::string(optarg) != "all" && !parse_cpu_list(optarg, config.worker_cpus)) {
+                usage(argv[0]);
+                return false;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return false;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    ServerConfig config;
+    std::string config_file;
+    if (!build_config(argc, argv, config, config_file))
+        return 2;
+
+    // the workers inherit this mask, so only the waiter below sees the signals
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try {
+        TFTPServer server(config);
+        std::cout << "serving " << config.root << " on port " << server.port() << " with "
+                  << (config.workers > 0 ? config.workers : 1) << " workers\n";
+        if (server.adopted())
+            std::cout << "took over " << server.adopted() << " transfers from the previous process\n";
+        if (!config.upstream.empty())
+            std::cout << "relaying files missing from " << config.root << " from " << config.upstream << "\n";
+        if (!config.shards.empty())
+            std::cout << "sharding requests over " << config.shards.size() << " servers\n";
+        if (server.metrics_port())
+            std::cout << "metrics on http://127.0.0.1:" << server.metrics_port() << "/metrics\n";
+        std::thread waiter([&] {
+            int sig;
+            while (sigwait(&signals, &sig) == 0 && sig == SIGHUP) {
+                ServerConfig next;
+                std::string file;
+                if (config_file.empty()) {
+                    std::cerr << "SIGHUP ignored, no -f config_file to reload\n";
+                    continue;
+                }
+                if (!build_config(argc, argv, next, file)) {
+                    std::cerr << "reload failed, keeping the running configuration\n";
+                    continue;
+                }
+                for (const std::string &key : server.reload(next))
+                    std::cerr << key << " changed, takes a restart\n";
+                std::cout << "reloaded " << config_file << "\n";
+            }
+            server.stop();
+        });
+        server.start();
+        // start() returns through stop(), which the waiter has called, or after a
+        // handoff once the last transfer left here has finished
+        if (server.handed_off())
+            pthread_kill(waiter.native_handle(), SIGTERM);
+        waiter.join();
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
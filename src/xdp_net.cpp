@@ -0,0 +1,519 @@
+#include "../includes/xdp_net.hpp"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <dirent.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+namespace {
+
+const uint32_t FRAME_SIZE = 2048;       // a UMEM chunk holds one frame
+const uint32_t FRAMES = 4096;           // half wait in the fill ring, half are for sending
+const uint32_t RING_SIZE = FRAMES / 2;
+const size_t ETH_LEN = 14;
+const size_t IP_LEN = 20;               // IPv4 without options, the only kind redirected
+const size_t HEADERS = ETH_LEN + IP_LEN + 8;
+const uint32_t MAX_QUEUES = 64;
+// the kernel sends 32 frames per sendto(); enough calls to empty the ring
+const int KICKS = RING_SIZE / 32 + 1;
+
+int bpf(int cmd, union bpf_attr &attr) { return (int)syscall(__NR_bpf, cmd, &attr, sizeof(attr)); }
+
+int create_map(uint32_t type, uint32_t entries) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = 4;
+    attr.value_size = 4;
+    attr.max_entries = entries;
+    return bpf(BPF_MAP_CREATE, attr);
+}
+
+int update_map(int map, uint32_t key, uint32_t value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)map;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    attr.flags = BPF_ANY;
+    return bpf(BPF_MAP_UPDATE_ELEM, attr);
+}
+
+struct bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    struct bpf_insn i;
+    memset(&i, 0, sizeof(i));
+    i.code = code;
+    i.dst_reg = dst & 0xf;
+    i.src_reg = src & 0xf;
+    i.off = off;
+    i.imm = imm;
+    return i;
+}
+
+// The XDP program. Multi-byte packet fields are loaded in host order, so they are
+// compared against htons() of the value and the port map is keyed the same way
+std::vector<struct bpf_insn> assemble(int ports, int sockets) {
+    std::vector<struct bpf_insn> p;
+    std::vector<size_t> to_pass;
+    auto pass_if = [&](uint8_t op, uint8_t dst, uint8_t src, int32_t imm) {
+        to_pass.push_back(p.size());
+        p.push_back(insn(BPF_JMP | op | (src ? BPF_X : BPF_K), dst, src, 0, imm));
+    };
+    auto load_map = [&](uint8_t dst, int map) {
+        p.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, map));
+        p.push_back(insn(0, 0, 0, 0, 0));
+    };
+    // r6 = ctx, r2 = data, r3 = data_end; room for Ethernet, IPv4 and UDP headers
+    p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0));
+    p.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, 2, 1, offsetof(struct xdp_md, data), 0));
+    p.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, 3, 1, offsetof(struct xdp_md, data_end), 0));
+    p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0));
+    p.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, (int32_t)HEADERS));
+    pass_if(BPF_JGT, 4, 3, 0);
+    // IPv4, no options, UDP, not a fragment
+    p.push_back(insn(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 12, 0));
+    pass_if(BPF_JNE, 5, 0, htons(0x0800));
+    p.push_back(insn(BPF_LDX | BPF_MEM | BPF_B, 5, 2, ETH_LEN, 0));
+    pass_if(BPF_JNE, 5, 0, 0x45);
+    p.push_back(insn(BPF_LDX | BPF_MEM | BPF_B, 5, 2, ETH_LEN + 9, 0));
+    pass_if(BPF_JNE, 5, 0, IPPROTO_UDP);
+    p.push_back(insn(BPF_LDX | BPF_MEM | BPF_H, 5, 2, ETH_LEN + 6, 0));
+    p.push_back(insn(BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, htons(0x3fff)));
+    pass_if(BPF_JNE, 5, 0, 0);
+    // ports[destination port] is the queue + 1 whose socket serves it
+    p.push_back(insn(BPF_LDX | BPF_MEM | BPF_H, 5, 2, ETH_LEN + IP_LEN + 2, 0));
+    p.push_back(insn(BPF_STX | BPF_MEM | BPF_W, 10, 5, -4, 0));
+    p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0));
+    p.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4));
+    load_map(1, ports);
+    p.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+    pass_if(BPF_JEQ, 0, 0, 0);
+    p.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, 5, 0, 0, 0));
+    pass_if(BPF_JEQ, 5, 0, 0);
+    p.push_back(insn(BPF_ALU64 | BPF_SUB | BPF_K, 5, 0, 0, 1));
+    // a frame on another queue than the port's socket goes up the stack to the
+    // shared socket, which the same worker reads
+    p.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, 4, 6, offsetof(struct xdp_md, rx_queue_index), 0));
+    pass_if(BPF_JNE, 5, 4, 0);
+    load_map(1, sockets);
+    p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, 2, 4, 0, 0));
+    p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS));
+    p.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    p.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    size_t pass = p.size();
+    p.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS));
+    p.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    for (size_t j : to_pass)
+        p[j].off = (int16_t)(pass - j - 1);
+    return p;
+}
+
+uint32_t count_rx_queues(const std::string &ifname) {
+    DIR *dir = opendir(("/sys/class/net/" + ifname + "/queues").c_str());
+    if (!dir)
+        return 1;
+    uint32_t n = 0;
+    while (struct dirent *e = readdir(dir))
+        if (strncmp(e->d_name, "rx-", 3) == 0)
+            n++;
+    closedir(dir);
+    return n ? n : 1;
+}
+
+// Ones' complement sum of 16 bit words, in the byte order they are stored in
+uint64_t sum_words(const uint8_t *p, size_t len, uint64_t sum) {
+    for (; len >= 4; p += 4, len -= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        sum += w;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        sum += w;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        uint16_t w = 0;
+        memcpy(&w, p, 1);
+        sum += w;
+    }
+    return sum;
+}
+
+uint16_t fold(uint64_t sum) {
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+void put16(uint8_t *p, uint16_t v) { memcpy(p, &v, 2); }
+
+uint16_t get16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return v;
+}
+
+}  // namespace
+
+XdpProgram::XdpProgram(const std::string &ifname) {
+    index = (int)if_nametoindex(ifname.c_str());
+    if (index == 0)
+        throw std::runtime_error("no interface " + ifname);
+    rx_queues = std::min(count_rx_queues(ifname), MAX_QUEUES);
+    virtual_device = access(("/sys/class/net/" + ifname + "/device").c_str(), F_OK) != 0;
+    ports = create_map(BPF_MAP_TYPE_ARRAY, 1 << 16);
+    sockets = create_map(BPF_MAP_TYPE_XSKMAP, MAX_QUEUES);
+    if (ports < 0 || sockets < 0) {
+        int err = errno;
+        release();
+        throw std::runtime_error(std::string("cannot create XDP maps: ") + strerror(err));
+    }
+
+    std::vector<struct bpf_insn> code = assemble(ports, sockets);
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)code.data();
+    attr.insn_cnt = (uint32_t)code.size();
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    prog = bpf(BPF_PROG_LOAD, attr);
+    if (prog < 0) {
+        int err = errno;
+        // again with the verifier's log, for the error
+        char log[8192] = "";
+        attr.log_buf = (uint64_t)(uintptr_t)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+        int again = bpf(BPF_PROG_LOAD, attr);
+        if (again >= 0)
+            ::close(again);
+        release();
+        throw std::runtime_error(std::string("cannot load XDP program: ") + strerror(err) + "\n" + log);
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = (uint32_t)prog;
+    attr.link_create.target_ifindex = (uint32_t)index;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    link = bpf(BPF_LINK_CREATE, attr);
+    if (link < 0) {
+        int err = errno;
+        release();
+        throw std::runtime_error("cannot attach XDP program to " + ifname + ": " + strerror(err));
+    }
+}
+
+XdpProgram::~XdpProgram() { release(); }
+
+void XdpProgram::release() {
+    for (int *fd : {&link, &prog, &sockets, &ports})
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+}
+
+int XdpProgram::add_socket(uint32_t queue, int xsk) {
+    if (queue >= MAX_QUEUES) {
+        errno = EINVAL;
+        return -1;
+    }
+    return update_map(sockets, queue, (uint32_t)xsk);
+}
+
+void XdpProgram::remove_socket(uint32_t queue) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)sockets;
+    attr.key = (uint64_t)(uintptr_t)&queue;
+    bpf(BPF_MAP_DELETE_ELEM, attr);
+}
+
+int XdpProgram::add_port(uint16_t port, uint32_t queue) { return update_map(ports, htons(port), queue + 1); }
+
+void XdpProgram::remove_port(uint16_t port) { update_map(ports, htons(port), 0); }
+
+XdpNet::XdpNet(EventLoop &loop, XdpProgram &program, uint32_t queue, int count, int receive_buffer)
+    : DemuxNet(loop, DatagramNet::kernel(), count, receive_buffer), program(program), queue(queue) {
+    if (!open_socket()) {
+        int err = errno;
+        release();
+        throw std::runtime_error("cannot open AF_XDP socket on queue " + std::to_string(queue) + ": " +
+                                 strerror(err));
+    }
+    for (int s : shared) {
+        struct sockaddr_in addr{};
+        base.local_address(s, addr);
+        ports.push_back(addr.sin_port);
+        if (program.add_port(ntohs(addr.sin_port), queue) < 0) {
+            int err = errno;
+            release();
+            throw std::runtime_error(std::string("cannot redirect shared socket port: ") + strerror(err));
+        }
+    }
+    loop.add(xsk, EPOLLIN, [this](uint32_t) { receive_frames(); });
+    watching = true;
+}
+
+XdpNet::~XdpNet() { release(); }
+
+bool XdpNet::map_ring(Ring &ring, const struct xdp_ring_offset &offsets, off_t pgoff, size_t desc_size) {
+    ring.map_len = offsets.desc + RING_SIZE * desc_size;
+    void *map = mmap(nullptr, ring.map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk, pgoff);
+    if (map == MAP_FAILED)
+        return false;
+    ring.map = map;
+    char *base = (char *)map;
+    ring.producer = (uint32_t *)(base + offsets.producer);
+    ring.consumer = (uint32_t *)(base + offsets.consumer);
+    ring.desc = base + offsets.desc;
+    ring.mask = RING_SIZE - 1;
+    return true;
+}
+
+bool XdpNet::open_socket() {
+    xsk = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xsk < 0)
+        return false;
+    void *area = mmap(nullptr, (size_t)FRAMES * FRAME_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (area == MAP_FAILED)
+        return false;
+    umem = (uint8_t *)area;
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(uintptr_t)umem;
+    reg.len = (uint64_t)FRAMES * FRAME_SIZE;
+    reg.chunk_size = FRAME_SIZE;
+    if (setsockopt(xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+        return false;
+    int size = (int)RING_SIZE;
+    for (int opt : {XDP_UMEM_FILL_RING, XDP_UMEM_COMPLETION_RING, XDP_RX_RING, XDP_TX_RING})
+        if (setsockopt(xsk, SOL_XDP, opt, &size, sizeof(size)) < 0)
+            return false;
+    struct xdp_mmap_offsets off;
+    socklen_t len = sizeof(off);
+    if (getsockopt(xsk, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+        return false;
+    if (!map_ring(fill, off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t)) ||
+        !map_ring(completion, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t)) ||
+        !map_ring(rx, off.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc)) ||
+        !map_ring(tx, off.tx, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc)))
+        return false;
+
+    // the first half of the frames is for the kernel to receive into, the rest for sending
+    uint64_t *slots = (uint64_t *)fill.desc;
+    for (uint32_t i = 0; i < RING_SIZE; i++)
+        slots[i] = (uint64_t)i * FRAME_SIZE;
+    __atomic_store_n(fill.producer, RING_SIZE, __ATOMIC_RELEASE);
+    for (uint32_t i = FRAMES; i > RING_SIZE; i--)
+        free_frames.push_back((uint64_t)(i - 1) * FRAME_SIZE);
+
+    struct sockaddr_xdp addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = (uint32_t)program.ifindex();
+    addr.sxdp_queue_id = queue;
+    addr.sxdp_flags = XDP_COPY;
+    if (::bind(xsk, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return false;
+    return program.add_socket(queue, xsk) == 0;
+}
+
+void XdpNet::release() {
+    if (xsk >= 0) {
+        if (watching)
+            loop.remove(xsk);
+        watching = false;
+        program.remove_socket(queue);
+        for (uint16_t port : ports)
+            program.remove_port(ntohs(port));
+        ports.clear();
+        ::close(xsk);
+        xsk = -1;
+    }
+    for (Ring *ring : {&fill, &completion, &rx, &tx})
+        if (ring->map) {
+            munmap(ring->map, ring->map_len);
+            *ring = Ring();
+        }
+    if (umem) {
+        munmap(umem, (size_t)FRAMES * FRAME_SIZE);
+        umem = nullptr;
+    }
+}
+
+void XdpNet::receive_frames() {
+    uint32_t end = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE);
+    uint32_t next = *rx.consumer;
+    uint32_t filled = *fill.producer;
+    const struct xdp_desc *descs = (const struct xdp_desc *)rx.desc;
+    uint64_t *slots = (uint64_t *)fill.desc;
+    for (; next != end; next++, filled++) {
+        const struct xdp_desc &d = descs[next & rx.mask];
+        handle_frame(umem + d.addr, d.len);
+        // the frame starts after the kernel's headroom; the fill ring wants the chunk
+        slots[filled & fill.mask] = d.addr & ~(uint64_t)(FRAME_SIZE - 1);
+    }
+    __atomic_store_n(rx.consumer, next, __ATOMIC_RELEASE);
+    __atomic_store_n(fill.producer, filled, __ATOMIC_RELEASE);
+}
+
+void XdpNet::handle_frame(const uint8_t *frame, uint32_t len) {
+    // the program only redirects IPv4 UDP without options or fragments
+    const uint8_t *ip = frame + ETH_LEN;
+    const uint8_t *udp = ip + IP_LEN;
+    size_t ip_len = ntohs(get16(ip + 2));
+    size_t udp_len = ntohs(get16(udp + 4));
+    if (len < HEADERS || ip_len < IP_LEN + 8 || ETH_LEN + ip_len > len || udp_len < 8 || udp_len > ip_len - IP_LEN) {
+        xdp_counters.rx_dropped++;
+        return;
+    }
+    // 0 is no checksum; otherwise the whole datagram and pseudo header sum to all ones,
+    // or, from a local peer, the field still holds the bare pseudo-header sum
+    uint16_t check = get16(udp + 6);
+    if (check != 0) {
+        uint64_t pseudo = sum_words(ip + 12, 8, 0) + htons(IPPROTO_UDP) + get16(udp + 4);
+        if (fold(sum_words(udp, udp_len, pseudo)) != 0 &&
+            !(program.is_virtual() && check == (uint16_t)~fold(pseudo))) {
+            xdp_counters.rx_bad_checksum++;
+            return;
+        }
+    }
+    uint16_t port = get16(udp + 2);
+    size_t i = 0;
+    while (i < ports.size() && ports[i] != port)
+        i++;
+    if (i == ports.size()) {
+        xdp_counters.rx_dropped++;
+        return;
+    }
+    struct sockaddr_in from{};
+    from.sin_family = AF_INET;
+    memcpy(&from.sin_addr.s_addr, ip + 12, 4);
+    memcpy(&from.sin_port, udp, 2);
+    // replies go back the way this frame came
+    Neighbour &n = neighbours[from.sin_addr.s_addr];
+    memcpy(n.peer_mac, frame + 6, 6);
+    memcpy(n.local_mac, frame, 6);
+    memcpy(&n.local_addr, ip + 16, 4);
+    xdp_counters.rx_frames++;
+    deliver(i, from, (const char *)udp + 8, udp_len - 8);
+}
+
+ssize_t XdpNet::send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) {
+    size_t i;
+    if (route(sock, to, i) < 0)
+        return -1;
+    if (transmit(i, *to, buf, len))
+        return (ssize_t)len;
+    xdp_counters.tx_kernel++;
+    return base.send_to(shared[i], buf, len, to);
+}
+
+bool XdpNet::transmit(size_t i, const struct sockaddr_in &to, const char *buf, size_t len) {
+    if (HEADERS + len > FRAME_SIZE)
+        return false;
+    auto it = neighbours.find(to.sin_addr.s_addr);
+    if (it == neighbours.end())
+        return false;
+    if (free_frames.empty())
+        reclaim();
+    uint32_t slot = *tx.producer;
+    if (free_frames.empty() || slot - __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE) >= RING_SIZE)
+        return false;
+    uint64_t addr = free_frames.back();
+    free_frames.pop_back();
+
+    const Neighbour &n = it->second;
+    uint8_t *frame = umem + addr;
+    memcpy(frame, n.peer_mac, 6);
+    memcpy(frame + 6, n.local_mac, 6);
+    put16(frame + 12, htons(0x0800));
+    uint8_t *ip = frame + ETH_LEN;
+    ip[0] = 0x45;
+    ip[1] = 0;
+    put16(ip + 2, htons((uint16_t)(IP_LEN + 8 + len)));
+    put16(ip + 4, htons(ip_id++));
+    put16(ip + 6, htons(0x4000));  // don't fragment
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    put16(ip + 10, 0);
+    memcpy(ip + 12, &n.local_addr, 4);
+    memcpy(ip + 16, &to.sin_addr.s_addr, 4);
+    put16(ip + 10, fold(sum_words(ip, IP_LEN, 0)));
+    uint8_t *udp = ip + IP_LEN;
+    put16(udp, ports[i]);
+    memcpy(udp + 2, &to.sin_port, 2);
+    put16(udp + 4, htons((uint16_t)(8 + len)));
+    put16(udp + 6, 0);
+    memcpy(udp + 8, buf, len);
+    // pseudo header: addresses, protocol, UDP length
+    uint64_t sum = sum_words(ip + 12, 8, 0) + htons(IPPROTO_UDP) + htons((uint16_t)(8 + len));
+    uint16_t check = fold(sum_words(udp, 8 + len, sum));
+    put16(udp + 6, check ? check : 0xffff);
+
+    struct xdp_desc &d = ((struct xdp_desc *)tx.desc)[slot & tx.mask];
+    d.addr = addr;
+    d.len = (uint32_t)(HEADERS + len);
+    d.options = 0;
+    __atomic_store_n(tx.producer, slot + 1, __ATOMIC_RELEASE);
+    xdp_counters.tx_frames++;
+    if (!kick_pending) {
+        kick_pending = true;
+        loop.defer([this] { kick(); });
+    }
+    return true;
+}
+
+void XdpNet::kick() {
+    kick_pending = false;
+    bool busy = false;
+    for (int k = 0; k < KICKS; k++) {
+        if (__atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE) == *tx.producer)
+            break;
+        // copy mode sends from sendto(); EAGAIN means it stopped after a batch
+        if (sendto(xsk, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0 && errno != EAGAIN && errno != EINTR) {
+            busy = errno == EBUSY || errno == ENOBUFS;
+            break;
+        }
+    }
+    reclaim();
+    if (busy && !kick_pending) {
+        // the device queue is full: try again after the next poll
+        kick_pending = true;
+        loop.defer([this] { kick(); });
+    }
+}
+
+void XdpNet::reclaim() {
+    uint32_t end = __atomic_load_n(completion.producer, __ATOMIC_ACQUIRE);
+    uint32_t next = *completion.consumer;
+    const uint64_t *slots = (const uint64_t *)completion.desc;
+    for (; next != end; next++)
+        free_frames.push_back(slots[next & completion.mask]);
+    __atomic_store_n(completion.consumer, next, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,98 @@
+/*
+ * What the tests under tests/ share. Each test file is a plain executable that ctest
+ * runs: CHECK reports a failed condition and carries on, and run_tests() returns the
+ * exit status, non-zero if any check failed.
+ *
+ *   static void peer_table_grows() { ... CHECK(table.find(7) == 1); ... }
+ *   int main() { return run_tests({{"peer_table_grows", peer_table_grows}}); }
+*/
+
+#ifndef TFTP_TESTS_CHECK_HPP
+#define TFTP_TESTS_CHECK_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <string>
+#include <unistd.h>
+#include <utility>
+
+inline int check_failures = 0;
+
+#define CHECK(cond)                                                                       \
+    do {                                                                                  \
+        if (!(cond)) {                                                                    \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);      \
+            check_failures++;                                                             \
+        }                                                                                 \
+    } while (0)
+
+inline int run_tests(std::initializer_list<std::pair<const char *, void (*)()>> tests) {
+    int failed = 0;
+    for (const auto &t : tests) {
+        int before = check_failures;
+        t.second();
+        bool ok = check_failures == before;
+        printf("%s %s\n", ok ? "ok  " : "FAIL", t.first);
+        failed += ok ? 0 : 1;
+    }
+    fflush(stdout);
+    return failed ? 1 : 0;
+}
+
+// A directory under /tmp that goes away with the object, files and all
+struct TempDir {
+    std::string path;
+    TempDir() {
+        char tmpl[] = "/tmp/turbotftp-test-XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            perror("mkdtemp");
+            exit(1);
+        }
+        path = tmpl;
+    }
+    ~TempDir() {
+        std::string cmd = "rm -rf '" + path + "'";
+        if (system(cmd.c_str()) != 0)
+            fprintf(stderr, "could not remove %s\n", path.c_str());
+    }
+    std::string operator/(const std::string &name) const { return path + "/" + name; }
+};
+
+inline bool write_file(const std::string &path, const std::string &data) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+inline std::string read_file(const std::string &path) {
+    std::string data;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return data;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.append(buf, n);
+    fclose(f);
+    return data;
+}
+
+// Deterministic bytes; with text, lines of printable characters
+inline std::string make_data(size_t size, uint64_t seed = 1, bool text = false) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 \n";
+    std::string data(size, '\0');
+    uint64_t x = 0x9e3779b97f4a7c15ull ^ seed;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = text ? alphabet[x & 63] : (char)x;
+    }
+    return data;
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * ChunkStore: uploads are stored once per distinct chunk and read back whole, and a
+ * chunk is only shared with stored bytes that are the same.
+*/
+
+#include "../includes/chunk_store.hpp"
+#include "check.hpp"
+
+#include <cerrno>
+#include <string>
+#include <sys/stat.h>
+
+namespace {
+
+// Writes data through a sink of store under path, then reads it back
+std::string round_trip(ChunkStore &store, const std::string &path, const std::string &data) {
+    std::unique_ptr<ImageSink> sink = store.create(path);
+    CHECK(sink->write(data.data(), data.size()));
+    CHECK(sink->commit());
+    std::unique_ptr<ImageSource> source = store.open(path + ".chunks");
+    CHECK(source && source->size() == data.size());
+    std::string back(data.size(), '\0');
+    CHECK(source && source->read_at(0, &back[0], back.size()) == (ssize_t)back.size());
+    return back;
+}
+
+void dedup() {
+    TempDir dir;
+    ChunkStore store(dir.path, 4096);
+    std::string data = make_data(4096 * 8, 1);
+    CHECK(round_trip(store, dir / "a.bin", data) == data);
+    CHECK(round_trip(store, dir / "b.bin", data) == data);
+    CHECK(store.sync());
+    ChunkStore::Stats s = store.stats();
+    CHECK(s.chunks == 16 && s.unique_chunks == 8);
+    CHECK(s.logical_bytes == data.size() * 2 && s.stored_bytes == data.size());
+}
+
+void planted_chunk() {
+    TempDir dir;
+    ChunkStore store(dir.path, 4096);
+    std::string data = make_data(4096, 2);
+    Hash128 hash = hash128(data.data(), data.size());
+
+    // other bytes under the chunk's name, as a collision would leave them: the
+    // upload fails rather than sharing them, and they are left as they were
+    std::string other = make_data(4096, 3);
+    std::string path = store.chunk_path(hash);
+    CHECK(mkdir((dir / ".chunks").c_str(), 0755) == 0);
+    CHECK(mkdir(path.substr(0, path.rfind('/')).c_str(), 0755) == 0);
+    CHECK(write_file(path, other));
+    Hash128 got;
+    errno = 0;
+    CHECK(!store.put(data.data(), data.size(), got) && errno == EEXIST);
+    CHECK(read_file(path) == other);
+    store.unpin(got);
+
+    // likewise for bytes of another length
+    CHECK(write_file(path, data.substr(0, 100)));
+    CHECK(!store.put(data.data(), data.size(), got));
+    CHECK(read_file(path) == data.substr(0, 100));
+    store.unpin(got);
+
+    // the same bytes are shared
+    CHECK(write_file(path, data));
+    CHECK(store.put(data.data(), data.size(), got) && got == hash);
+    store.unpin(got);
+    CHECK(store.stats().unique_chunks == 0);
+}
+
+}  // namespace
+
+int main() {
+    return run_tests({
+        {"dedup", dedup},
+        {"planted_chunk", planted_chunk},
+    });
+}
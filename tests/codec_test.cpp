@@ -0,0 +1,182 @@
+/*
+ * Packet codec (protocal.hpp) and netascii translation (tftp_common.hpp).
+*/
+
+#include "../includes/protocal.hpp"
+#include "check.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Options = std::vector<std::pair<std::string, std::string>>;
+
+Request parsed(uint16_t op, const std::string &filename, const std::string &mode, const Options &options) {
+    char buf[1024];
+    size_t len = build_request(buf, sizeof(buf), op, filename, mode, options);
+    Request req{};
+    CHECK(len > 0);
+    CHECK(parse_request(buf, len, req));
+    return req;
+}
+
+void request_round_trip() {
+    Request req = parsed(RREQ, "pxelinux/boot.img", "OCTET", {{"BLKSIZE", "1428"}, {"tsize", "0"}});
+    CHECK(req.op_code == RREQ);
+    CHECK(req.filename == "pxelinux/boot.img");
+    CHECK(req.mode == "octet");    // modes and option names are case insensitive
+    CHECK(req.options.size() == 2);
+    CHECK(req.options[0].first == "blksize" && req.options[0].second == "1428");
+    CHECK(req.options[1].first == "tsize" && req.options[1].second == "0");
+
+    req = parsed(WREQ, "notes.txt", "netascii", {});
+    CHECK(req.op_code == WREQ && req.mode == "netascii" && req.options.empty());
+
+    char small[8];
+    CHECK(build_request(small, sizeof(small), RREQ, "long-name.bin", "octet", {}) == 0);
+}
+
+void malformed_requests() {
+    Request req;
+    const char unterminated[] = "\0\1file\0octet";
+    CHECK(!parse_request(unterminated, sizeof(unterminated) - 1, req));
+    const char bad_mode[] = "\0\1file\0mail\0";
+    CHECK(!parse_request(bad_mode, sizeof(bad_mode) - 1, req));
+    const char no_mode[] = "\0\1file\0";
+    CHECK(!parse_request(no_mode, sizeof(no_mode) - 1, req));
+    const char odd_options[] = "\0\1file\0octet\0blksize\0";
+    CHECK(!parse_request(odd_options, sizeof(odd_options) - 1, req));
+    const char empty_name[] = "\0\1\0octet\0";
+    CHECK(!parse_request(empty_name, sizeof(empty_name) - 1, req));
+    const char data[] = "\0\3file\0octet\0";
+    CHECK(!parse_request(data, sizeof(data) - 1, req));
+    CHECK(!parse_request("\0\1", 2, req));
+}
+
+void options_clamped() {
+    Request req = parsed(RREQ, "f", "octet",
+                         {{"blksize", "65000"}, {"windowsize", "500"}, {"timeout", "3"}, {"tsize", "0"},
+                          {"offset", "4096"}, {"length", "512"}, {"prefixsum", std::string(32, 'A')}});
+    TransferOptions opts;
+    parse_options(req, opts, 1428, 64);
+    CHECK(opts.blksize == 1428);
+    CHECK(opts.windowsize == 64);
+    CHECK(opts.timeout == 3);
+    CHECK(opts.has_tsize && opts.tsize == 0);
+    CHECK(opts.has_offset && opts.offset == 4096);
+    CHECK(opts.has_length && opts.length == 512);
+    CHECK(opts.prefixsum == std::string(32, 'a'));
+
+    // out of range or malformed values are left out, as RFC 2347 allows
+    req = parsed(RREQ, "f", "octet",
+                 {{"blksize", "7"}, {"windowsize", "0"}, {"timeout", "256"}, {"tsize", "-1"},
+                  {"prefixsum", "abc"}, {"colour", "blue"}});
+    opts = TransferOptions{};
+    parse_options(req, opts);
+    CHECK(opts.blksize == SIZE);
+    CHECK(opts.windowsize == 1);
+    CHECK(opts.timeout == 0);
+    CHECK(!opts.has_tsize);
+    CHECK(opts.prefixsum.empty());
+
+    // only plain digits that fit in 64 bits are numbers
+    uint64_t v = 0;
+    CHECK(parse_number("18446744073709551615", v) && v == UINT64_MAX);
+    CHECK(!parse_number("18446744073709551616", v));
+    CHECK(!parse_number("99999999999999999999", v));
+    CHECK(!parse_number(" 512", v) && !parse_number("+512", v) && !parse_number("512 ", v));
+    CHECK(parse_number("00000000000000000000512", v) && v == 512);
+}
+
+void oack_echoes_what_was_asked() {
+    Request req = parsed(RREQ, "f", "octet", {{"windowsize", "16"}, {"tsize", "0"}});
+    TransferOptions opts;
+    parse_options(req, opts);
+    opts.tsize = 123456;
+    opts.blksize = 1024;    // not asked for, so not in the OACK
+    char buf[512];
+    size_t len = build_oack(buf, sizeof(buf), req, opts);
+    std::string body(buf + 2, len - 2);
+    CHECK(get_u16(buf) == OACK);
+    CHECK(body.find("blksize") == std::string::npos);
+
+    TransferOptions granted;
+    CHECK(parse_oack(buf, len, granted));
+    CHECK(granted.windowsize == 16);
+    CHECK(granted.has_tsize && granted.tsize == 123456);
+    CHECK(granted.blksize == SIZE);
+}
+
+void small_packets() {
+    char buf[64];
+    CHECK(build_ack(buf, 0xbeef) == 4 && get_u16(buf) == ACK && get_u16(buf + 2) == 0xbeef);
+    CHECK(build_data_header(buf, 7) == 4 && get_u16(buf) == DATA && get_u16(buf + 2) == 7);
+
+    size_t len = build_error(buf, sizeof(buf), ERR_NOT_FOUND, "File not found");
+    CHECK(len == 5 + strlen("File not found"));
+    CHECK(get_u16(buf) == ERROR && get_u16(buf + 2) == ERR_NOT_FOUND);
+    CHECK(strcmp(buf + 4, "File not found") == 0);
+    // a message that does not fit is cut short and still terminated
+    len = build_error(buf, 10, ERR_UNDEFINED, "a rather long explanation");
+    CHECK(len == 10 && buf[9] == '\0' && strcmp(buf + 4, "a rat") == 0);
+    // and one with no room for the header is not built at all
+    CHECK(build_error(buf, 4, ERR_UNDEFINED, "x") == 0);
+
+    put_u16(buf, 0x0102);
+    CHECK((unsigned char)buf[0] == 1 && (unsigned char)buf[1] == 2);
+}
+
+// Encodes src in blocks of block bytes, then decodes the blocks one at a time
+std::string netascii_round_trip(const std::string &src, size_t block, std::string *wire = nullptr) {
+    std::string encoded;
+    std::vector<char> out(block);
+    int carry = -1;
+    size_t pos = 0;
+    for (;;) {
+        size_t consumed;
+        size_t n = netascii_encode(src.data() + pos, src.size() - pos, consumed, out.data(), block, carry);
+        pos += consumed;
+        encoded.append(out.data(), n);
+        if (n < block && carry < 0)
+            break;
+    }
+    if (wire)
+        *wire = encoded;
+    std::string decoded;
+    std::vector<char> dst(block + 1);
+    bool cr_pending = false;
+    for (size_t off = 0; off < encoded.size(); off += block) {
+        size_t len = std::min(block, encoded.size() - off);
+        decoded.append(dst.data(), netascii_decode(encoded.data() + off, len, dst.data(), cr_pending));
+    }
+    if (cr_pending)
+        decoded += '\r';
+    return decoded;
+}
+
+void netascii() {
+    std::string wire;
+    CHECK(netascii_round_trip("a\nb\rc\r\n", 512, &wire) == "a\nb\rc\r\n");
+    CHECK(wire == std::string("a\r\nb\r\0c\r\0\r\n", 11));
+
+    // pairs split across blocks, for every block size small enough to split them
+    std::string text = make_data(4096, 3, true) + "\r\r\n\n\r";
+    for (size_t block = 1; block <= 9; block++)
+        CHECK(netascii_round_trip(text, block) == text);
+    CHECK(netascii_round_trip("", 512).empty());
+}
+
+}  // namespace
+
+int main() {
+    return run_tests({
+        {"request_round_trip", request_round_trip},
+        {"malformed_requests", malformed_requests},
+        {"options_clamped", options_clamped},
+        {"oack_echoes_what_was_asked", oack_echoes_what_was_asked},
+        {"small_packets", small_packets},
+        {"netascii", netascii},
+    });
+}
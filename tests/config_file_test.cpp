@@ -0,0 +1,107 @@
+/*
+ * The configuration file reader: amounts with suffixes, and what a bad file does to
+ * the configuration it was applied to (nothing).
+*/
+
+#include "../includes/config_file.hpp"
+#include "check.hpp"
+
+#include <string>
+
+namespace {
+
+bool amount(const std::string &s, uint64_t expect) {
+    uint64_t v = 0;
+    return parse_amount(s, v) && v == expect;
+}
+
+bool rejected(const std::string &s) {
+    uint64_t v = 12345;
+    return !parse_amount(s, v) && v == 12345;
+}
+
+void amounts() {
+    CHECK(amount("0", 0));
+    CHECK(amount("1428", 1428));
+    CHECK(amount("64K", 65536));
+    CHECK(amount("64k", 65536));
+    CHECK(amount("512M", 512ull << 20));
+    CHECK(amount("16G", 16ull << 30));
+    CHECK(amount("18446744073709551615", UINT64_MAX));
+    CHECK(amount("17179869183G", 17179869183ull << 30));
+
+    CHECK(rejected(""));
+    CHECK(rejected("K"));
+    CHECK(rejected("-1"));
+    CHECK(rejected(" 1"));
+    CHECK(rejected("12X"));
+    CHECK(rejected("12KB"));
+    // past 64 bits, before and after the suffix
+    CHECK(rejected("18446744073709551616"));
+    CHECK(rejected("99999999999999999999999"));
+    CHECK(rejected("17179869184G"));
+    CHECK(rejected("17592186044416M"));
+}
+
+void loads_a_file() {
+    TempDir dir;
+    std::string path = dir / "tftp.conf";
+    CHECK(write_file(path, "# a comment\n"
+                           "root = /srv/tftp   # trailing comment\n"
+                           "\n"
+                           "  workers=8\n"
+                           "max_blksize = 1468\n"
+                           "cache_bytes = 512M\n"
+                           "allow_write = yes\n"
+                           "rate_limit = 1G\n"));
+    ServerConfig config;
+    std::string error;
+    CHECK(load_config_file(path, config, error));
+    CHECK(error.empty());
+    CHECK(config.root == "/srv/tftp");
+    CHECK(config.workers == 8);
+    CHECK(config.max_blksize == 1468);
+    CHECK(config.cache_bytes == 512ull << 20);
+    CHECK(config.allow_write);
+    CHECK(config.rate_limit == 1ull << 30);
+}
+
+void bad_files_change_nothing() {
+    TempDir dir;
+    std::string path = dir / "tftp.conf";
+    ServerConfig defaults;
+    std::string error;
+
+    CHECK(write_file(path, "workers = 8\ncolour = blue\n"));
+    ServerConfig config;
+    CHECK(!load_config_file(path, config, error));
+    CHECK(error == path + ":2: unknown key colour");
+    CHECK(config.workers == defaults.workers);
+
+    CHECK(write_file(path, "workers = 8\n\nrate_limit = 99999999999999999999999\n"));
+    CHECK(!load_config_file(path, config, error));
+    CHECK(error == path + ":3: bad value for rate_limit");
+    CHECK(config.workers == defaults.workers && config.rate_limit == defaults.rate_limit);
+
+    CHECK(write_file(path, "max_blksize = 4\n"));
+    CHECK(!load_config_file(path, config, error));
+    CHECK(error == path + ":1: bad value for max_blksize");
+
+    CHECK(write_file(path, "workers 8\n"));
+    CHECK(!load_config_file(path, config, error));
+    CHECK(error == path + ":1: expected key = value");
+
+    std::string missing = dir / "missing.conf";
+    CHECK(!load_config_file(missing, config, error));
+    CHECK(error == missing + ": cannot read");
+}
+
+}  // namespace
+
+int main() {
+    return run_tests({
+        {"amounts", amounts},
+        {"loads_a_file", loads_a_file},
+        {"bad_files_change_nothing", bad_files_change_nothing},
+    });
+}
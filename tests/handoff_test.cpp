@@ -0,0 +1,117 @@
+/*
+ * Upgrade handoff over the kernel's loopback, as handoff_bench runs it but small: a
+ * successor constructed on the same upgrade socket while gets, netascii gets and puts
+ * are running takes some of them over, and every one of them still ends intact.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+#include "check.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Servers run start() on a thread of their own
+struct Running {
+    TFTPServer server;
+    std::thread thread;
+    explicit Running(const ServerConfig &config) : server(config), thread([this] { server.start(); }) {}
+    ~Running() {
+        server.stop();
+        thread.join();
+    }
+};
+
+void handoff() {
+    TempDir dir;
+    std::string content = make_data(256 << 10, 1, true);
+    CHECK(write_file(dir / "handoff.bin", content));
+
+    ServerConfig config;
+    config.root = dir.path;
+    config.port = 0;
+    config.workers = 2;
+    // slow enough that everything is still running when the successor starts
+    config.rate_limit = 4 << 20;
+    config.upgrade_socket = dir / ".upgrade";
+    auto old_server = std::make_unique<Running>(config);
+
+    EventLoop loop;
+    ClientOptions options;
+    options.port = old_server->server.port();
+    options.blksize = 1428;
+    options.windowsize = 8;
+    AsyncTFTPClient client(loop, "127.0.0.1", options);
+    ClientOptions text_options = options;
+    text_options.mode = "netascii";
+    AsyncTFTPClient text_client(loop, "127.0.0.1", text_options);
+
+    const int gets = 12, texts = 2, puts = 4;
+    std::vector<std::string> got(gets + texts);
+    int running = 0, failures = 0, corrupt = 0;
+    for (int i = 0; i < gets + texts; i++) {
+        running++;
+        std::string &out = got[(size_t)i];
+        (i < gets ? client : text_client)
+            .get("handoff.bin", std::make_unique<MemorySink>(out), [&](const TransferResult &r) {
+                running--;
+                if (!r.ok)
+                    failures++;
+                else if (out != content)
+                    corrupt++;
+            });
+    }
+    for (int i = 0; i < puts; i++) {
+        running++;
+        client.put("put" + std::to_string(i) + ".bin", std::make_unique<MemorySource>(content),
+                   [&](const TransferResult &r) {
+                       running--;
+                       if (!r.ok)
+                           failures++;
+                   });
+    }
+
+    std::unique_ptr<Running> new_server;
+    std::thread upgrade([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        new_server = std::make_unique<Running>(config);
+    });
+    while (running > 0)
+        loop.run_once(100);
+    upgrade.join();
+
+    CHECK(failures == 0);
+    CHECK(corrupt == 0);
+    for (int i = 0; i < puts; i++)
+        CHECK(read_file(dir / ("put" + std::to_string(i) + ".bin")) == content);
+    CHECK(new_server && new_server->server.adopted() > 0);
+    // the successor serves new requests on the same port
+    std::string out;
+    bool done = false;
+    client.get("handoff.bin", std::make_unique<MemorySink>(out), [&](const TransferResult &r) {
+        done = true;
+        CHECK(r.ok);
+    });
+    while (!done)
+        loop.run_once(100);
+    CHECK(out == content);
+    CHECK(new_server && new_server->server.metrics().rrq > 0);
+    old_server.reset();
+    new_server.reset();
+}
+
+}  // namespace
+
+int main() {
+    // the old server reports each handoff on std::cout
+    std::streambuf *saved = std::cout.rdbuf(nullptr);
+    int status = run_tests({{"handoff", handoff}});
+    std::cout.rdbuf(saved);
+    return status;
+}
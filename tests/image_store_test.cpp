@@ -0,0 +1,100 @@
+/*
+ * ImageStore's packed images: gzip members served decompressed through the cache,
+ * a sidecar that does not match the image rebuilt, and an image with a member too
+ * large to inflate into one cache entry refused.
+*/
+
+#include "../includes/image_store.hpp"
+#include "check.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <zlib.h>
+
+namespace {
+
+// Independent gzip members of member bytes each, like `split -b 1M --filter=gzip`
+std::string gzip_members(const std::string &data, size_t member) {
+    std::string out;
+    for (size_t off = 0; off < data.size(); off += member) {
+        size_t len = std::min(member, data.size() - off);
+        z_stream z{};
+        deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        std::string packed(deflateBound(&z, len), '\0');
+        z.next_in = (Bytef *)data.data() + off;
+        z.avail_in = (uInt)len;
+        z.next_out = (Bytef *)&packed[0];
+        z.avail_out = (uInt)packed.size();
+        deflate(&z, Z_FINISH);
+        packed.resize(z.total_out);
+        deflateEnd(&z);
+        out += packed;
+    }
+    return out;
+}
+
+std::string read_all(ImageSource &source) {
+    std::string out(source.size(), '\0');
+    size_t got = 0;
+    while (got < out.size()) {
+        ssize_t n = source.read_at(got, &out[got], std::min<size_t>(out.size() - got, 1428));
+        if (n <= 0)
+            break;
+        got += (size_t)n;
+    }
+    out.resize(got);
+    return out;
+}
+
+void packed_image() {
+    TempDir dir;
+    std::string content = make_data(300000, 1, true);
+    CHECK(write_file(dir / "image.bin.gz", gzip_members(content, 64 << 10)));
+    ImageStore store(dir.path);
+    std::unique_ptr<ImageSource> source = store.open(dir.path, "image.bin");
+    CHECK(source && source->size() == content.size());
+    CHECK(source && read_all(*source) == content);
+    ImageIndex index;
+    CHECK(index.load(dir / "image.bin.gz.idx") && index.frames.size() == 5);
+
+    // a sidecar whose frames point past the image is rebuilt, not trusted
+    index.frames[4].in_len += 1 << 20;
+    CHECK(index.save(dir / "image.bin.gz.idx"));
+    ImageStore fresh(dir.path);
+    source = fresh.open(dir.path, "image.bin");
+    CHECK(source && read_all(*source) == content);
+    CHECK(index.load(dir / "image.bin.gz.idx") && index.frames[4].in_len < (1 << 20));
+}
+
+void oversized_member() {
+    TempDir dir;
+    // one member over the cap, as a plain `gzip image.bin` of a large image would be
+    std::string content(MAX_FRAME_BYTES + 1, 'x');
+    CHECK(write_file(dir / "big.bin.gz", gzip_members(content, content.size())));
+    ImageStore store(dir.path);
+    errno = 0;
+    CHECK(!store.open(dir.path, "big.bin") && errno == EIO);
+
+    // and so is a sidecar that lists one, even though it matches the image
+    std::string small = make_data(1000, 2);
+    CHECK(write_file(dir / "small.bin.gz", gzip_members(small, small.size())));
+    CHECK(store.open(dir.path, "small.bin"));
+    ImageIndex index;
+    CHECK(index.load(dir / "small.bin.gz.idx"));
+    index.frames[0].out_len = index.size = MAX_FRAME_BYTES + 1;
+    CHECK(index.save(dir / "small.bin.gz.idx"));
+    ImageStore fresh(dir.path);
+    std::unique_ptr<ImageSource> source = fresh.open(dir.path, "small.bin");
+    CHECK(source && source->size() == small.size() && read_all(*source) == small);
+}
+
+}  // namespace
+
+int main() {
+    return run_tests({
+        {"packed_image", packed_image},
+        {"oversized_member", oversized_member},
+    });
+}
@@ -0,0 +1,139 @@
+/*
+ * PeerTable, the open addressing table DemuxNet files its virtual sockets in.
+ * Backward shift deletion is what can go wrong, so most of this builds runs of keys
+ * sharing a home slot, wrapping past the end of the table, and deletes from them.
+*/
+
+#include "../includes/demux_net.hpp"
+#include "check.hpp"
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// The slot key starts probing from in a table of 64, as PeerTable::home computes it
+size_t home64(uint64_t key) {
+    return (size_t)((key * 0x9e3779b97f4a7c15ull) >> 58);
+}
+
+// count keys whose home slot in a fresh table is slot, smallest first
+std::vector<uint64_t> keys_homed_at(size_t slot, size_t count, uint64_t from = 1) {
+    std::vector<uint64_t> keys;
+    for (uint64_t key = from; keys.size() < count; key++)
+        if (home64(key) == slot)
+            keys.push_back(key);
+    return keys;
+}
+
+void insert_find_erase() {
+    PeerTable table;
+    CHECK(table.size() == 0 && table.capacity() == 64);
+    CHECK(table.find(42) == -1);
+    CHECK(table.insert(42, 7));
+    CHECK(!table.insert(42, 8));    // already there, and keeps its value
+    CHECK(table.find(42) == 7);
+    CHECK(table.size() == 1);
+    table.erase(43);
+    CHECK(table.size() == 1);
+    table.erase(42);
+    CHECK(table.find(42) == -1 && table.size() == 0);
+    table.erase(42);
+    CHECK(table.size() == 0);
+}
+
+void grows_at_half_full() {
+    PeerTable table;
+    for (int i = 1; i <= 32; i++)
+        table.insert((uint64_t)i, i);
+    CHECK(table.capacity() == 64);
+    table.insert(33, 33);
+    CHECK(table.capacity() == 128);
+    for (int i = 1; i <= 1000; i++)
+        table.insert((uint64_t)i, i);
+    CHECK(table.size() == 1000 && table.capacity() == 2048);
+    bool all = true;
+    for (int i = 1; i <= 1000; i++)
+        all = all && table.find((uint64_t)i) == i;
+    CHECK(all);
+}
+
+// Fills a run of keys homed at one slot and deletes them in every order of a few
+// patterns; whatever is left must still be found
+void erase_from_a_run(size_t slot) {
+    std::vector<uint64_t> run = keys_homed_at(slot, 5);
+    // one key homed just after the run's start, which lands behind it and may only
+    // move back as far as its own home
+    std::vector<uint64_t> next = keys_homed_at((slot + 1) & 63, 2);
+    std::vector<uint64_t> keys = run;
+    keys.insert(keys.end(), next.begin(), next.end());
+
+    std::vector<std::vector<size_t>> orders = {
+        {0, 1, 2, 3, 4, 5, 6}, {6, 5, 4, 3, 2, 1, 0}, {0, 5, 2, 6, 1, 3, 4}, {5, 0, 6, 1, 4, 2, 3}, {2, 3, 5, 0, 6, 4, 1},
+    };
+    for (const auto &order : orders) {
+        PeerTable table;
+        for (size_t i = 0; i < keys.size(); i++)
+            CHECK(table.insert(keys[i], (int)i));
+        CHECK(table.capacity() == 64);
+        std::vector<bool> gone(keys.size());
+        for (size_t victim : order) {
+            table.erase(keys[victim]);
+            gone[victim] = true;
+            for (size_t i = 0; i < keys.size(); i++)
+                CHECK(table.find(keys[i]) == (gone[i] ? -1 : (int)i));
+        }
+        CHECK(table.size() == 0);
+    }
+}
+
+void backward_shift() {
+    erase_from_a_run(10);
+    // runs that wrap from slot 63 round to slot 0
+    erase_from_a_run(61);
+    erase_from_a_run(63);
+}
+
+void against_unordered_map() {
+    std::mt19937_64 rng(7);
+    PeerTable table;
+    std::unordered_map<uint64_t, int> model;
+    // a small key space, so inserts hit existing keys and erases hit present ones
+    std::uniform_int_distribution<uint64_t> pick(1, 300);
+    bool agrees = true;
+    for (int step = 0; step < 200000; step++) {
+        uint64_t key = pick(rng);
+        switch (rng() % 3) {
+        case 0: {
+            bool fresh = model.emplace(key, step).second;
+            agrees = agrees && table.insert(key, step) == fresh;
+            break;
+        }
+        case 1:
+            model.erase(key);
+            table.erase(key);
+            break;
+        default: {
+            auto it = model.find(key);
+            agrees = agrees && table.find(key) == (it == model.end() ? -1 : it->second);
+        }
+        }
+        agrees = agrees && table.size() == model.size();
+    }
+    CHECK(agrees);
+    for (const auto &kv : model)
+        CHECK(table.find(kv.first) == kv.second);
+}
+
+}  // namespace
+
+int main() {
+    return run_tests({
+        {"insert_find_erase", insert_find_erase},
+        {"grows_at_half_full", grows_at_half_full},
+        {"backward_shift", backward_shift},
+        {"against_unordered_map", against_unordered_map},
+    });
+}
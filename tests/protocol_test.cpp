@@ -0,0 +1,295 @@
+/*
+ * Whole transfers between a TFTPServer and the clients over SimNet, so lossy links
+ * and slow rate limits cost no wall time and every run is the same: option
+ * negotiation, loss, netascii both ways, resumed downloads, a lost final ACK and
+ * the deficit round robin scheduler's shares.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/client.hpp"
+#include "../includes/server.hpp"
+#include "../includes/sim_net.hpp"
+#include "check.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace {
+
+const char *SERVER = "10.0.0.1";
+
+struct Fixture {
+    TempDir dir;
+    SimNet net;
+    ServerConfig config;
+
+    explicit Fixture(const LinkParams &link = LinkParams{}, uint64_t seed = 1) : net(link, seed) {
+        config.root = dir.path;
+        config.net = &net.host(SERVER);
+    }
+    ClientOptions client(const std::string &ip = "10.0.0.2") {
+        ClientOptions options;
+        options.net = &net.host(ip);
+        return options;
+    }
+};
+
+// Runs one get on the simulation and returns its result
+TransferResult get(Fixture &f, const ClientOptions &options, const std::string &filename, std::string &out) {
+    EventLoop loop;
+    AsyncTFTPClient client(loop, SERVER, options);
+    TransferResult result;
+    bool done = false;
+    client.get(filename, std::make_unique<MemorySink>(out), [&](const TransferResult &r) {
+        result = r;
+        done = true;
+    });
+    f.net.run_until([&] { return done; }, &loop);
+    CHECK(done);
+    return result;
+}
+
+void negotiation() {
+    Fixture f;
+    f.config.max_blksize = 1468;
+    f.config.max_windowsize = 16;
+    TFTPServer server(f.config);
+    std::string content = make_data(100000);
+    CHECK(write_file(f.dir / "image.bin", content));
+
+    // asking for more than the server allows gets its limits, and tsize is answered
+    ClientOptions options = f.client();
+    options.blksize = 9000;
+    options.windowsize = 500;
+    std::string out;
+    TransferResult r = get(f, options, "image.bin", out);
+    CHECK(r.ok && out == content && r.bytes == content.size());
+    CHECK(r.options.blksize == 1468);
+    CHECK(r.options.windowsize == 16);
+    CHECK(r.options.has_tsize && r.options.tsize == content.size());
+
+    // nothing asked for but tsize: plain RFC 1350 blocks, lock-step
+    out.clear();
+    r = get(f, f.client(), "image.bin", out);
+    CHECK(r.ok && out == content);
+    CHECK(r.options.blksize == SIZE && r.options.windowsize == 1);
+
+    // a size that is a whole number of blocks ends with an empty one
+    std::string even = make_data(SIZE * 4, 2);
+    CHECK(write_file(f.dir / "even.bin", even));
+    out.clear();
+    r = get(f, f.client(), "even.bin", out);
+    CHECK(r.ok && out == even);
+
+    out.clear();
+    r = get(f, f.client(), "missing.bin", out);
+    CHECK(!r.ok && r.error_code == ERR_NOT_FOUND && r.error == "File not found");
+}
+
+void lossy_link() {
+    LinkParams link;
+    link.latency_us = 20000;
+    link.jitter_us = 5000;
+    link.loss = 0.05;
+    link.reorder = 0.02;
+    link.duplicate = 0.01;
+    Fixture f(link, 7);
+    TFTPServer server(f.config);
+    std::string content = make_data(1 << 20, 3);
+    CHECK(write_file(f.dir / "image.bin", content));
+
+    ClientOptions options = f.client();
+    options.blksize = 1428;
+    options.windowsize = 8;
+    std::string out;
+    TransferResult r = get(f, options, "image.bin", out);
+    CHECK(r.ok && out == content);
+    CHECK(f.net.stats().lost > 0);
+    CHECK(server.metrics().retransmits > 0);
+
+    // and uploads, with the blocking client
+    CHECK(write_file(f.dir / "local.bin", content));
+    TFTPClient client(SERVER, options);
+    CHECK(client.send_wrq("upload.bin", f.dir / "local.bin"));
+    CHECK(read_file(f.dir / "upload.bin") == content);
+}
+
+void netascii() {
+    Fixture f;
+    TFTPServer server(f.config);
+    // line ends and bare CRs, with blocks small enough that CR LF and CR NUL pairs
+    // straddle block boundaries
+    std::string text = make_data(20000, 4, true) + "\r\nend\r";
+    CHECK(write_file(f.dir / "notes.txt", text));
+
+    ClientOptions options = f.client();
+    options.mode = "netascii";
+    options.blksize = 9;
+    std::string out;
+    TransferResult r = get(f, options, "notes.txt", out);
+    CHECK(r.ok && out == text);
+
+    EventLoop loop;
+    AsyncTFTPClient client(loop, SERVER, options);
+    bool done = false, ok = false;
+    client.put("uploaded.txt", std::make_unique<MemorySource>(text), [&](const TransferResult &t) {
+        done = true;
+        ok = t.ok;
+    });
+    f.net.run_until([&] { return done; }, &loop);
+    CHECK(ok);
+    CHECK(read_file(f.dir / "uploaded.txt") == text);
+}
+
+void resume() {
+    Fixture f;
+    TFTPServer server(f.config);
+    std::string content = make_data(300000, 5);
+    CHECK(write_file(f.dir / "image.bin", content));
+
+    ClientOptions options = f.client();
+    options.blksize = 1428;
+    options.resume = true;
+    TFTPClient client(SERVER, options);
+    std::string local = f.dir / "fetched.bin";
+
+    // a partial copy of this file is continued where it ends
+    CHECK(write_file(local, content.substr(0, 123457)));
+    CHECK(client.send_rrq("image.bin", local));
+    CHECK(client.bytes_transferred() == content.size() - 123457);
+    CHECK(read_file(local) == content);
+
+    // a finished one costs nothing more
+    CHECK(client.send_rrq("image.bin", local));
+    CHECK(client.bytes_transferred() == 0);
+    CHECK(read_file(local) == content);
+
+    // a partial copy of some other file is thrown away and fetched whole
+    std::string other = content.substr(0, 100000);
+    other[5000] ^= 1;
+    CHECK(write_file(local, other));
+    CHECK(client.send_rrq("image.bin", local));
+    CHECK(client.bytes_transferred() == content.size());
+    CHECK(read_file(local) == content);
+
+    // and one longer than the server's copy likewise
+    CHECK(write_file(local, content + "trailing"));
+    CHECK(client.send_rrq("image.bin", local));
+    CHECK(read_file(local) == content);
+
+    // the whole prefix is compared, not just the piece before the offset
+    std::string large = make_data(3 << 20, 8);
+    CHECK(write_file(f.dir / "large.bin", large));
+    std::string early = large.substr(0, (2 << 20) + 1000);
+    early[100] ^= 1;
+    CHECK(write_file(local, early));
+    CHECK(client.send_rrq("large.bin", local));
+    CHECK(client.bytes_transferred() == large.size());
+    CHECK(read_file(local) == large);
+}
+
+// The server's side of a SimNet host that loses the first ACK of one block
+class LoseAck : public DatagramNet {
+public:
+    LoseAck(DatagramNet &inner, uint16_t block) : inner(inner), block(block) {}
+    int open() override { return inner.open(); }
+    int bind(int sock, const struct sockaddr_in &addr, bool reuse_port) override {
+        return inner.bind(sock, addr, reuse_port);
+    }
+    int local_address(int sock, struct sockaddr_in &addr) override { return inner.local_address(sock, addr); }
+    int connect(int sock, const struct sockaddr_in &peer) override { return inner.connect(sock, peer); }
+    ssize_t send_to(int sock, const char *buf, size_t len, const struct sockaddr_in *to) override {
+        if (!lost && len == 4 && get_u16(buf) == ACK && get_u16(buf + 2) == block) {
+            lost = true;
+            return (ssize_t)len;
+        }
+        return inner.send_to(sock, buf, len, to);
+    }
+    ssize_t receive(int sock, char *buf, size_t cap, struct sockaddr_in *from) override {
+        return inner.receive(sock, buf, cap, from);
+    }
+    void close(int sock) override { inner.close(sock); }
+    void watch(EventLoop &loop, int sock, std::function<void()> readable) override {
+        inner.watch(loop, sock, std::move(readable));
+    }
+    void unwatch(EventLoop &loop, int sock) override { inner.unwatch(loop, sock); }
+    void run_once(EventLoop &loop) override { inner.run_once(loop); }
+
+    bool lost = false;
+
+private:
+    DatagramNet &inner;
+    uint16_t block;
+};
+
+void final_ack_lost() {
+    Fixture f;
+    // 3 blocks of 512: the server's ACK 3 goes missing, and the client's resent
+    // DATA 3 has to find the server's TID still open to get it
+    LoseAck lossy(f.net.host(SERVER), 3);
+    f.config.net = &lossy;
+    TFTPServer server(f.config);
+    std::string content = make_data(1500, 7);
+    CHECK(write_file(f.dir / "local.bin", content));
+    TFTPClient client(SERVER, f.client());
+    CHECK(client.send_wrq("upload.bin", f.dir / "local.bin"));
+    CHECK(lossy.lost);
+    CHECK(read_file(f.dir / "upload.bin") == content);
+    CHECK(server.metrics().transfers_ok == 1);
+}
+
+void fair_shares() {
+    LinkParams link;
+    link.latency_us = 5000;
+    Fixture f(link);
+    f.config.fair_queueing = true;
+    f.config.rate_limit = 256 << 10;
+    f.config.workers = 1;
+    TFTPServer server(f.config);
+    std::string content = make_data(512 << 10, 6);
+    CHECK(write_file(f.dir / "image.bin", content));
+
+    // the worker's bucket, not the windows, limits both: a window of 64 would take
+    // nearly all of it from a window of 4 if each refill went to whoever came first.
+    // Round robin splits it evenly, so both finish at about the same time
+    ClientOptions greedy = f.client("10.0.0.2"), polite = f.client("10.0.0.3");
+    greedy.blksize = polite.blksize = 1428;
+    greedy.windowsize = 64;
+    polite.windowsize = 4;
+    EventLoop loop;
+    AsyncTFTPClient greedy_client(loop, SERVER, greedy), polite_client(loop, SERVER, polite);
+    std::string greedy_out, polite_out;
+    uint64_t greedy_us = 0, polite_us = 0;
+    int running = 2;
+    greedy_client.get("image.bin", std::make_unique<MemorySink>(greedy_out), [&](const TransferResult &r) {
+        CHECK(r.ok);
+        greedy_us = f.net.now_us();
+        running--;
+    });
+    polite_client.get("image.bin", std::make_unique<MemorySink>(polite_out), [&](const TransferResult &r) {
+        CHECK(r.ok);
+        polite_us = f.net.now_us();
+        running--;
+    });
+    f.net.run_until([&] { return running == 0; }, &loop);
+    CHECK(running == 0);
+    CHECK(greedy_out == content && polite_out == content);
+    // two files of 512 KiB at 256 KiB/s take about four seconds
+    CHECK(std::max(greedy_us, polite_us) > 3600000);
+    CHECK(greedy_us * 10 >= polite_us * 7 && polite_us * 10 >= greedy_us * 7);
+}
+
+}  // namespace
+
+int main() {
+    return run_tests({
+        {"negotiation", negotiation},
+        {"lossy_link", lossy_link},
+        {"netascii", netascii},
+        {"resume", resume},
+        {"final_ack_lost", final_ack_lost},
+        {"fair_shares", fair_shares},
+    });
+}
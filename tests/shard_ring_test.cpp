@@ -0,0 +1,102 @@
+/*
+ * ShardRing: placement is stable, roughly even, and changing the set of shards moves
+ * only the names that have to move.
+*/
+
+#include "../includes/shard.hpp"
+#include "check.hpp"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+const int NAMES = 20000;
+
+std::string name(int i) {
+    return "images/node" + std::to_string(i) + "/vmlinuz";
+}
+
+// The shard each name lands on, by shard name rather than index
+std::vector<std::string> place(const std::vector<std::string> &shards) {
+    ShardRing ring(shards);
+    std::vector<std::string> owners;
+    for (int i = 0; i < NAMES; i++)
+        owners.push_back(shards[ring.owner(name(i))]);
+    return owners;
+}
+
+void placement() {
+    std::vector<std::string> shards = {"10.0.0.1:69", "10.0.0.2:69", "10.0.0.3:69", "10.0.0.4:69"};
+    ShardRing ring(shards);
+    CHECK(ring.size() == 4);
+    CHECK(ring.owner("pxelinux.0") == ring.owner("pxelinux.0"));
+    CHECK(ring.owner("/pxelinux.0") == ring.owner("pxelinux.0"));
+    CHECK(ring.owner("//pxelinux.0") == ring.owner("pxelinux.0"));
+    CHECK(ring.owner("") < 4 && ring.owner("/") < 4);
+
+    // the same shards in the same order place the same way in another ring
+    ShardRing again(shards);
+    bool same = true;
+    for (int i = 0; i < 1000; i++)
+        same = same && ring.owner(name(i)) == again.owner(name(i));
+    CHECK(same);
+
+    ShardRing empty({});
+    CHECK(empty.size() == 0 && empty.owner("pxelinux.0") == 0);
+    ShardRing one({"10.0.0.1:69"});
+    CHECK(one.owner("pxelinux.0") == 0);
+}
+
+void balance() {
+    std::vector<std::string> shards = {"10.0.0.1:69", "10.0.0.2:69", "10.0.0.3:69", "10.0.0.4:69"};
+    ShardRing ring(shards);
+    std::vector<int> counts(shards.size());
+    for (int i = 0; i < NAMES; i++)
+        counts[ring.owner(name(i))]++;
+    // 160 points each keeps every shard well within 15-35% of a fair 25%
+    for (int c : counts)
+        CHECK(c > NAMES * 15 / 100 && c < NAMES * 35 / 100);
+}
+
+void adding_a_shard() {
+    std::vector<std::string> shards = {"10.0.0.1:69", "10.0.0.2:69", "10.0.0.3:69", "10.0.0.4:69"};
+    std::vector<std::string> before = place(shards);
+    shards.push_back("10.0.0.5:69");
+    std::vector<std::string> after = place(shards);
+    int moved = 0;
+    bool only_to_new = true;
+    for (int i = 0; i < NAMES; i++) {
+        if (before[(size_t)i] != after[(size_t)i]) {
+            moved++;
+            only_to_new = only_to_new && after[(size_t)i] == "10.0.0.5:69";
+        }
+    }
+    CHECK(only_to_new);
+    // about a fifth
+    CHECK(moved > NAMES / 10 && moved < NAMES * 3 / 10);
+}
+
+void removing_a_shard() {
+    std::vector<std::string> shards = {"10.0.0.1:69", "10.0.0.2:69", "10.0.0.3:69", "10.0.0.4:69"};
+    std::vector<std::string> before = place(shards);
+    // indices shift when a shard goes, names do not
+    shards.erase(shards.begin() + 1);
+    std::vector<std::string> after = place(shards);
+    bool kept = true;
+    for (int i = 0; i < NAMES; i++)
+        if (before[(size_t)i] != "10.0.0.2:69")
+            kept = kept && after[(size_t)i] == before[(size_t)i];
+    CHECK(kept);
+}
+
+}  // namespace
+
+int main() {
+    return run_tests({
+        {"placement", placement},
+        {"balance", balance},
+        {"adding_a_shard", adding_a_shard},
+        {"removing_a_shard", removing_a_shard},
+    });
+}
@@ -0,0 +1,187 @@
+/*
+ * The storage pool over the kernel's loopback: a packed image whose members are
+ * inflated on the pool rather than in read_at, a server with storage threads
+ * serving such an image and committing uploads there, and a relay committing what
+ * it fetched there.
+*/
+
+#include "../includes/async_client.hpp"
+#include "../includes/server.hpp"
+#include "../includes/storage_pool.hpp"
+#include "check.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <zlib.h>
+
+namespace {
+
+// Independent gzip members of member bytes each, like `split -b 1M --filter=gzip`
+std::string gzip_members(const std::string &data, size_t member) {
+    std::string out;
+    for (size_t off = 0; off < data.size(); off += member) {
+        size_t len = std::min(member, data.size() - off);
+        z_stream z{};
+        deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        std::string packed(deflateBound(&z, len), '\0');
+        z.next_in = (Bytef *)data.data() + off;
+        z.avail_in = (uInt)len;
+        z.next_out = (Bytef *)&packed[0];
+        z.avail_out = (uInt)packed.size();
+        deflate(&z, Z_FINISH);
+        packed.resize(z.total_out);
+        deflateEnd(&z);
+        out += packed;
+    }
+    return out;
+}
+
+// Servers run start() on a thread of their own
+struct Running {
+    TFTPServer server;
+    std::thread thread;
+    explicit Running(const ServerConfig &config) : server(config), thread([this] { server.start(); }) {}
+    ~Running() {
+        server.stop();
+        thread.join();
+    }
+};
+
+void decode_on_pool() {
+    TempDir dir;
+    std::string content = make_data(300000, 1, true);
+    CHECK(write_file(dir / "image.bin.gz", gzip_members(content, 64 << 10)));
+    ImageStore store(dir.path);
+    StoragePool pool(1);
+    EventLoop loop;
+    std::unique_ptr<ImageSource> source = store.open(dir.path, "image.bin");
+    CHECK(source && source->size() == content.size());
+    if (!source)
+        return;
+    source->use_storage(pool, 0);
+
+    // a member the cache does not have is not inflated by read_at, the pool does it
+    std::string out(content.size(), '\0');
+    size_t got = 0;
+    int waits = 0;
+    while (got < out.size()) {
+        ssize_t n = source->read_at(got, &out[got], out.size() - got);
+        if (n > 0) {
+            got += (size_t)n;
+            continue;
+        }
+        CHECK(n < 0 && errno == EAGAIN);
+        if (n == 0 || errno != EAGAIN)
+            break;
+        bool ready = false;
+        source->when_readable(loop, [&] { ready = true; });
+        while (!ready)
+            loop.run_once(100);
+        waits++;
+    }
+    CHECK(out == content);
+    CHECK(waits == 5);
+    // read again, it is all in the cache
+    std::unique_ptr<ImageSource> again = store.open(dir.path, "image.bin");
+    again->use_storage(pool, 0);
+    CHECK(again->read_at(200000, &out[0], 1000) == 1000);
+    CHECK(out.compare(0, 1000, content, 200000, 1000) == 0);
+}
+
+void server_storage() {
+    TempDir dir;
+    std::string content = make_data(1 << 20, 2);
+    CHECK(write_file(dir / "image.bin.gz", gzip_members(content, 128 << 10)));
+
+    ServerConfig config;
+    config.root = dir.path;
+    config.port = 0;
+    config.workers = 1;
+    config.storage_threads = 2;
+    config.allow_write = true;
+    Running running(config);
+
+    EventLoop loop;
+    ClientOptions options;
+    options.port = running.server.port();
+    options.blksize = 1428;
+    options.windowsize = 8;
+    AsyncTFTPClient client(loop, "127.0.0.1", options);
+    std::string out;
+    bool got = false, put = false;
+    client.get("image.bin", std::make_unique<MemorySink>(out), [&](const TransferResult &r) {
+        CHECK(r.ok);
+        got = true;
+    });
+    client.put("upload.bin", std::make_unique<MemorySource>(content), [&](const TransferResult &r) {
+        CHECK(r.ok);
+        put = true;
+    });
+    while (!got || !put)
+        loop.run_once(100);
+    CHECK(out == content);
+    CHECK(read_file(dir / "upload.bin") == content);
+    // the RRQ's open, the WRQ's create and its commit
+    MetricsSnapshot m = running.server.metrics();
+    CHECK(m.storage_jobs == 3);
+}
+
+void relay_storage() {
+    TempDir origin_dir, relay_dir;
+    std::string content = make_data(200000, 3);
+    CHECK(mkdir((origin_dir / "boot").c_str(), 0755) == 0);
+    CHECK(write_file(origin_dir / "boot/image.bin", content));
+
+    ServerConfig origin_config;
+    origin_config.root = origin_dir.path;
+    origin_config.port = 0;
+    origin_config.workers = 1;
+    Running origin(origin_config);
+    ServerConfig relay_config;
+    relay_config.root = relay_dir.path;
+    relay_config.port = 0;
+    relay_config.workers = 1;
+    relay_config.storage_threads = 2;
+    relay_config.upstream = "127.0.0.1:" + std::to_string(origin.server.port());
+    Running relay(relay_config);
+
+    EventLoop loop;
+    ClientOptions options;
+    options.port = relay.server.port();
+    options.blksize = 1428;
+    AsyncTFTPClient client(loop, "127.0.0.1", options);
+    // the first get streams from the fetch; the second joins it or, once the fetch
+    // is done, finds the file in the root, but never fetches again
+    for (int i = 0; i < 2; i++) {
+        std::string out;
+        bool done = false;
+        client.get("boot/image.bin", std::make_unique<MemorySink>(out), [&](const TransferResult &r) {
+            CHECK(r.ok);
+            done = true;
+        });
+        while (!done)
+            loop.run_once(100);
+        CHECK(out == content);
+    }
+    // renamed into place on the pool once the fetch is done, which the gets need not wait for
+    for (int i = 0; i < 50 && read_file(relay_dir / "boot/image.bin") != content; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(read_file(relay_dir / "boot/image.bin") == content);
+    MetricsSnapshot m = relay.server.metrics();
+    CHECK(m.relay_fetches == 1 && m.relay_failed == 0);
+}
+
+}  // namespace
+
+int main() {
+    return run_tests({
+        {"decode_on_pool", decode_on_pool},
+        {"server_storage", server_storage},
+        {"relay_storage", relay_storage},
+    });
+}